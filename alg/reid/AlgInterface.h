@@ -23,7 +23,9 @@ extern "C" std::shared_ptr<std::vector<std::shared_ptr<TsJsonObject>>>
 extern "C" bool  algCtrl  (void*, const std::string&                 );
 extern "C" void  algStop  (void*                                     );
 extern "C" void  algFina  (void*                                     );
+// one result per frame, unless algSetCb2 registered a callback as well
 extern "C" bool  algSetCb (void*, TsPutResult,  void*                );
+// one result per camera of a frame in one call, replaces the algSetCb one
 extern "C" bool  algSetCb2(void*, TsPutResults, void*                );
 
 #endif //__TS_ALG_INTERFACE_H__
\ No newline at end of file
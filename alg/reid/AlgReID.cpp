@@ -7,7 +7,10 @@
  * @LastEditTime: 2021-11-17 17:47:11
  */
 
+#include <stdlib.h>
 #include <time.h>
+#include <algorithm>
+#include <chrono>
 #include <map>
 #include <mutex>
 
@@ -16,21 +19,15 @@
 #include <nvbufsurface.h>
 
 #include "AlgInterface.h"
+#include "FeatureCodec.h"
+#include "FeaturePolicy.h"
+#include "GalleryInterface.h"
+#include "GalleryJournal.h"
+#include "TrackAggregator.h"
+#include "TrackState.h"
+#include "Trajectory.h"
 #include "TSObjectReIDPlus.h"
 
-/*
- * camera_id------->object_id
- * object_id-------->trace point vector
- */
-// typedef struct {
-//     typedef std::pair<int, int> point;
-//     std::tuple<uint8_t, uint8_t, uint8_t> color;
-//     std::vector<point> points;
-//     bool lost;
-// }trace;
-// std::map<int64_t, std::map<int64_t, trace > > a->trace_map;
-// std::map<int64_t, std::map<int64_t, std::vector<std::pair<int, int> > > > a->trace_map;
-
 typedef struct _AlgConfig {
     std::string config_path_ { "/opt/thundersoft/algs/models/TSReID.fig" };
     ts::TSDevice device_     { ts::TSDevice::DEVICE_GPU };
@@ -40,36 +37,31 @@ typedef struct _AlgConfig {
     float low_dist_          { 0.135 };
     float high_dist_         { 0.16 };
     int max_elem_num_        { 10000 };
+    FeatureEncoding feature_encoding_ { FEATURE_ENCODING_TEXT };
+    FeaturePayload  feature_payload_  { FEATURE_PAYLOAD_ALWAYS };
+    bool binary_result_       { false };
+    int track_state_capacity_ { 4096 };
+    int track_state_ttl_sec_  { 60 };
+    int trail_points_         { 0 };
+    int trail_lost_ms_        { 2000 };
+    GalleryConfig gallery_   {       };
 } AlgConfig;
 
 typedef struct _AlgCore {
     AlgConfig             cfg_            ;
     ts::TSObjectReIDPlus* alg_    { NULL };
     ts::TSObjectReIDDB*   alg_db_ { NULL };
+    GalleryInterface*     gallery_{ NULL };
+    GalleryJournal*       journal_{ NULL };
+    TrackAggregator*      tracks_ { NULL };
+    FeaturePolicy*        payload_{ NULL };
+    TrackStateStore*      states_ { NULL };
+    TrajectoryStore*      trails_ { NULL };
     TsPutResult cb_put_result_    { NULL };
     TsPutResults cb_put_results_  { NULL };
     void* cb_user_data_           { NULL };
-    std::map<int64_t, std::tuple<uint8_t, uint8_t, uint8_t> > color_map;
-    std::map<int64_t, std::vector<std::pair<int, int> > > trace_map;
-    std::mutex mutex_;
 } AlgCore;
 
-static std::string vector2str (const std::vector<float>& vec)
-{
-    std::stringstream ss;
-    std::string str ("");
-
-    for(size_t i = 0; i < vec.size(); ++i)
-    {
-        if(i != 0)
-            ss << " ";
-        ss << vec[i];
-    }
-
-    str = ss.str();
-    return str;
-}
-
 static ts::TSDevice string_to_device (std::string& device) 
 {
     std::transform(device.begin(), device.end(), device.begin(),
@@ -161,6 +153,314 @@ static bool parse_args (AlgConfig& config, const std::string& data)
                 int r = json_object_get_int_member (object, "max-elem-num");
                 TS_INFO_MSG_V ("\tmax-elem-num:%d", r);
                 config.max_elem_num_ = r;
+                config.gallery_.max_elem_num_ = r;
+            }
+
+            if (json_object_has_member (object, "feature-encoding")) {
+                std::string e ((const char*)json_object_get_string_member (
+                    object, "feature-encoding"));
+                TS_INFO_MSG_V ("\tfeature-encoding:%s", e.c_str());
+                config.feature_encoding_ = StringToFeatureEncoding(e);
+            }
+
+            if (json_object_has_member (object, "feature-payload")) {
+                std::string p ((const char*)json_object_get_string_member (
+                    object, "feature-payload"));
+                TS_INFO_MSG_V ("\tfeature-payload:%s", p.c_str());
+                config.feature_payload_ = StringToFeaturePayload(p);
+            }
+
+            if (json_object_has_member (object, "result-format")) {
+                std::string f ((const char*)json_object_get_string_member (
+                    object, "result-format"));
+                TS_INFO_MSG_V ("\tresult-format:%s", f.c_str());
+                config.binary_result_ = 0 == f.compare("binary");
+            }
+
+            if (json_object_has_member (object, "track-state-capacity")) {
+                int c = json_object_get_int_member (object,
+                    "track-state-capacity");
+                TS_INFO_MSG_V ("\ttrack-state-capacity:%d", c);
+                config.track_state_capacity_ = c;
+            }
+
+            if (json_object_has_member (object, "track-state-ttl-sec")) {
+                int t = json_object_get_int_member (object,
+                    "track-state-ttl-sec");
+                TS_INFO_MSG_V ("\ttrack-state-ttl-sec:%d", t);
+                config.track_state_ttl_sec_ = t;
+            }
+
+            if (json_object_has_member (object, "trail-points")) {
+                int n = json_object_get_int_member (object, "trail-points");
+                TS_INFO_MSG_V ("\ttrail-points:%d", n);
+                config.trail_points_ = n;
+            }
+
+            if (json_object_has_member (object, "trail-lost-ms")) {
+                int l = json_object_get_int_member (object, "trail-lost-ms");
+                TS_INFO_MSG_V ("\ttrail-lost-ms:%d", l);
+                config.trail_lost_ms_ = l;
+            }
+
+            if (json_object_has_member (object, "gallery")) {
+                JsonObject* g = json_object_get_object_member (object, "gallery");
+
+                if (json_object_has_member (g, "mode")) {
+                    std::string m ((const char*)json_object_get_string_member (
+                        g, "mode"));
+                    TS_INFO_MSG_V ("\tgallery-mode:%s", m.c_str());
+                    config.gallery_.mode_ = StringToGalleryMode(m);
+                }
+
+                if (json_object_has_member (g, "isa")) {
+                    std::string i ((const char*)json_object_get_string_member (
+                        g, "isa"));
+                    TS_INFO_MSG_V ("\tgallery-isa:%s", i.c_str());
+                    config.gallery_.isa_ = i;
+                }
+
+                if (json_object_has_member (g, "storage")) {
+                    std::string t ((const char*)json_object_get_string_member (
+                        g, "storage"));
+                    TS_INFO_MSG_V ("\tgallery-storage:%s", t.c_str());
+                    config.gallery_.storage_ = StringToGalleryStorage(t);
+                }
+
+                // in-process galleries may hold far more than the vendor db
+                if (json_object_has_member (g, "max-elem-num")) {
+                    int r = json_object_get_int_member (g, "max-elem-num");
+                    TS_INFO_MSG_V ("\tgallery-max-elem-num:%d", r);
+                    config.gallery_.max_elem_num_ = r;
+                }
+
+                if (json_object_has_member (g, "nlist")) {
+                    int n = json_object_get_int_member (g, "nlist");
+                    TS_INFO_MSG_V ("\tgallery-nlist:%d", n);
+                    config.gallery_.nlist_ = n;
+                }
+
+                if (json_object_has_member (g, "nprobe")) {
+                    int n = json_object_get_int_member (g, "nprobe");
+                    TS_INFO_MSG_V ("\tgallery-nprobe:%d", n);
+                    config.gallery_.nprobe_ = n;
+                }
+
+                if (json_object_has_member (g, "pq-m")) {
+                    int m = json_object_get_int_member (g, "pq-m");
+                    TS_INFO_MSG_V ("\tgallery-pq-m:%d", m);
+                    config.gallery_.pq_m_ = m;
+                }
+
+                if (json_object_has_member (g, "train-size")) {
+                    int t = json_object_get_int_member (g, "train-size");
+                    TS_INFO_MSG_V ("\tgallery-train-size:%d", t);
+                    config.gallery_.train_size_ = t;
+                }
+
+                if (json_object_has_member (g, "m")) {
+                    int m = json_object_get_int_member (g, "m");
+                    TS_INFO_MSG_V ("\tgallery-m:%d", m);
+                    config.gallery_.hnsw_m_ = m;
+                }
+
+                if (json_object_has_member (g, "ef-construction")) {
+                    int e = json_object_get_int_member (g, "ef-construction");
+                    TS_INFO_MSG_V ("\tgallery-ef-construction:%d", e);
+                    config.gallery_.ef_construction_ = e;
+                }
+
+                if (json_object_has_member (g, "ef-search")) {
+                    int e = json_object_get_int_member (g, "ef-search");
+                    TS_INFO_MSG_V ("\tgallery-ef-search:%d", e);
+                    config.gallery_.ef_search_ = e;
+                }
+
+                if (json_object_has_member (g, "recall-every")) {
+                    int r = json_object_get_int_member (g, "recall-every");
+                    TS_INFO_MSG_V ("\tgallery-recall-every:%d", r);
+                    config.gallery_.recall_every_ = r;
+                }
+
+                if (json_object_has_member (g, "snapshot")) {
+                    std::string p ((const char*)json_object_get_string_member (
+                        g, "snapshot"));
+                    TS_INFO_MSG_V ("\tgallery-snapshot:%s", p.c_str());
+                    config.gallery_.snapshot_ = p;
+                }
+
+                if (json_object_has_member (g, "wal-flush-ms")) {
+                    int w = json_object_get_int_member (g, "wal-flush-ms");
+                    TS_INFO_MSG_V ("\tgallery-wal-flush-ms:%d", w);
+                    config.gallery_.wal_flush_ms_ = w;
+                }
+
+                if (json_object_has_member (g, "checkpoint-sec")) {
+                    int c = json_object_get_int_member (g, "checkpoint-sec");
+                    TS_INFO_MSG_V ("\tgallery-checkpoint-sec:%d", c);
+                    config.gallery_.checkpoint_sec_ = c;
+                }
+
+                if (json_object_has_member (g, "checkpoint-mb")) {
+                    int c = json_object_get_int_member (g, "checkpoint-mb");
+                    TS_INFO_MSG_V ("\tgallery-checkpoint-mb:%d", c);
+                    config.gallery_.checkpoint_mb_ = c;
+                }
+
+                // the shards share max-elem-num whatever the camera mix and
+                // allocate rows as they fill, keep shards at the number of
+                // camera groups that search in parallel
+                if (json_object_has_member (g, "shards")) {
+                    int n = json_object_get_int_member (g, "shards");
+                    TS_INFO_MSG_V ("\tgallery-shards:%d", n);
+                    config.gallery_.shards_ = n;
+                }
+
+                if (json_object_has_member (g, "fanout-threads")) {
+                    int t = json_object_get_int_member (g, "fanout-threads");
+                    TS_INFO_MSG_V ("\tgallery-fanout-threads:%d", t);
+                    config.gallery_.fanout_threads_ = t;
+                }
+
+                if (json_object_has_member (g, "eviction")) {
+                    std::string e ((const char*)json_object_get_string_member (
+                        g, "eviction"));
+                    TS_INFO_MSG_V ("\tgallery-eviction:%s", e.c_str());
+                    config.gallery_.eviction_ = StringToEvictionPolicy(e);
+                }
+
+                if (json_object_has_member (g, "ttl-sec")) {
+                    int t = json_object_get_int_member (g, "ttl-sec");
+                    TS_INFO_MSG_V ("\tgallery-ttl-sec:%d", t);
+                    config.gallery_.ttl_sec_ = t;
+                }
+
+                if (json_object_has_member (g, "min-hits")) {
+                    int h = json_object_get_int_member (g, "min-hits");
+                    TS_INFO_MSG_V ("\tgallery-min-hits:%d", h);
+                    config.gallery_.min_hits_ = h;
+                }
+
+                if (json_object_has_member (g, "recent-sec")) {
+                    int r = json_object_get_int_member (g, "recent-sec");
+                    TS_INFO_MSG_V ("\tgallery-recent-sec:%d", r);
+                    config.gallery_.recent_sec_ = r;
+                }
+
+                if (json_object_has_member (g, "segment-sec")) {
+                    int t = json_object_get_int_member (g, "segment-sec");
+                    TS_INFO_MSG_V ("\tgallery-segment-sec:%d", t);
+                    config.gallery_.segment_sec_ = t;
+                }
+
+                if (json_object_has_member (g, "rerank-k")) {
+                    int k = json_object_get_int_member (g, "rerank-k");
+                    TS_INFO_MSG_V ("\tgallery-rerank-k:%d", k);
+                    config.gallery_.rerank_k_ = k;
+                }
+
+                if (json_object_has_member (g, "rerank-lambda")) {
+                    gdouble l = json_object_get_double_member (g,
+                        "rerank-lambda");
+                    TS_INFO_MSG_V ("\tgallery-rerank-lambda:%f", l);
+                    config.gallery_.rerank_lambda_ = (float)l;
+                }
+
+                if (json_object_has_member (g, "rerank-budget-us")) {
+                    int b = json_object_get_int_member (g, "rerank-budget-us");
+                    TS_INFO_MSG_V ("\tgallery-rerank-budget-us:%d", b);
+                    config.gallery_.rerank_budget_us_ = b;
+                }
+
+                // ["unix:<path>", "<host>:<port>"], the remote mode's nodes
+                if (json_object_has_member (g, "nodes")) {
+                    JsonArray* nodes = json_object_get_array_member (g,
+                        "nodes");
+                    for (guint i = 0; i < json_array_get_length (nodes); i++) {
+                        std::string n = json_array_get_string_element (nodes,
+                            i);
+                        TS_INFO_MSG_V ("\tgallery-node:%s", n.c_str());
+                        config.gallery_.nodes_.push_back (n);
+                    }
+                }
+
+                if (json_object_has_member (g, "node-timeout-ms")) {
+                    int t = json_object_get_int_member (g, "node-timeout-ms");
+                    TS_INFO_MSG_V ("\tgallery-node-timeout-ms:%d", t);
+                    config.gallery_.node_timeout_ms_ = t;
+                }
+
+                if (json_object_has_member (g, "node-retry-ms")) {
+                    int r = json_object_get_int_member (g, "node-retry-ms");
+                    TS_INFO_MSG_V ("\tgallery-node-retry-ms:%d", r);
+                    config.gallery_.node_retry_ms_ = r;
+                }
+
+                if (json_object_has_member (g, "track-aggregate")) {
+                    gboolean t = json_object_get_boolean_member (g,
+                        "track-aggregate");
+                    TS_INFO_MSG_V ("\tgallery-track-aggregate:%d", t);
+                    config.gallery_.track_aggregate_ = t;
+                }
+
+                if (json_object_has_member (g, "track-refresh")) {
+                    int r = json_object_get_int_member (g, "track-refresh");
+                    TS_INFO_MSG_V ("\tgallery-track-refresh:%d", r);
+                    config.gallery_.track_refresh_ = r;
+                }
+
+                if (json_object_has_member (g, "track-ttl-sec")) {
+                    int t = json_object_get_int_member (g, "track-ttl-sec");
+                    TS_INFO_MSG_V ("\tgallery-track-ttl-sec:%d", t);
+                    config.gallery_.track_ttl_sec_ = t;
+                }
+
+                // {"<camera id>": shard}, cameras of one group share a shard
+                if (json_object_has_member (g, "camera-shards")) {
+                    JsonObject* cs = json_object_get_object_member (g,
+                        "camera-shards");
+                    GList* members = json_object_get_members (cs);
+                    for (GList* m = members; m; m = m->next) {
+                        const char* camera = (const char*) m->data;
+                        int shard = json_object_get_int_member (cs, camera);
+                        TS_INFO_MSG_V ("\tgallery-camera-shard:%s->%d",
+                            camera, shard);
+                        config.gallery_.camera_shards_[atoll (camera)] = shard;
+                    }
+                    g_list_free (members);
+                }
+
+                // {"<camera id>": [{"camera":id, "min-sec":s, "max-sec":s}]},
+                // where a person leaving a camera shows up and when
+                if (json_object_has_member (g, "topology")) {
+                    JsonObject* tp = json_object_get_object_member (g,
+                        "topology");
+                    GList* members = json_object_get_members (tp);
+                    for (GList* m = members; m; m = m->next) {
+                        const char* camera = (const char*) m->data;
+                        JsonArray* links = json_object_get_array_member (tp,
+                            camera);
+                        std::vector<CameraLink>& out =
+                            config.gallery_.topology_[atoll (camera)];
+                        for (guint i = 0; i < json_array_get_length (links);
+                            i++) {
+                            JsonObject* l = json_array_get_object_element (
+                                links, i);
+                            CameraLink link;
+                            link.camera_  = json_object_get_int_member (l,
+                                "camera");
+                            link.min_sec_ = json_object_get_int_member (l,
+                                "min-sec");
+                            link.max_sec_ = json_object_get_int_member (l,
+                                "max-sec");
+                            TS_INFO_MSG_V ("\tgallery-topology:%s->%ld "
+                                "[%d, %d]s", camera, link.camera_,
+                                link.min_sec_, link.max_sec_);
+                            out.push_back (link);
+                        }
+                    }
+                    g_list_free (members);
+                }
             }
         }
     } else {
@@ -178,168 +478,310 @@ done:
     return ret;
 }
 
-static JsonObject* results_to_json_object (const std::vector<ts::ReIDData>& results)
+/*
+ * Encodes feature into writer, or into blob with its offset in writer, the
+ * bytes it takes. Without a writer it is only encoded, to be priced.
+ */
+static size_t feature_to_json (const std::vector<float>& feature,
+    FeatureEncoding encoding, std::vector<unsigned char>& blob,
+    TsJsonWriter* writer)
+{
+    // grow to the largest feature once, then every detection reuses them
+    static thread_local std::vector<char>          text;
+    static thread_local std::vector<unsigned char> scratch;
+    size_t n;
+
+    switch (encoding) {
+    case FEATURE_ENCODING_BASE64_FP32:
+    case FEATURE_ENCODING_BASE64_FP16:
+        text.resize (std::max (text.size (),
+            Base64Size (FeatureBytes (encoding, feature.size ())) + 1));
+        n = FeatureToBase64 (encoding, feature.data (), feature.size (),
+            text.data ());
+        if (writer) writer->String ("feature", text.data (), n);
+        return n;
+    case FEATURE_ENCODING_BLOB_FP32:
+    case FEATURE_ENCODING_BLOB_FP16: {
+        std::vector<unsigned char>& out = writer ? blob : scratch;
+        size_t offset = writer ? blob.size () : 0;
+        n = FeatureBytes (encoding, feature.size ());
+        out.resize (std::max (out.size (), offset + n));
+        FeatureToBytes (encoding, feature.data (), feature.size (),
+            out.data () + offset);
+        if (writer) writer->Int ("feature-offset", offset);
+        return n;
+    }
+    default:
+        text.resize (std::max (text.size (),
+            FeatureTextSize (feature.size ())));
+        n = FeatureToText (feature.data (), feature.size (), text.data ());
+        if (writer) writer->String ("feature", text.data (), n);
+        return n;
+    }
+}
+
+/*
+ * Streams the count results at index of a frame into writer, their ids
+ * the searched ones in ids, numbers as json numbers.
+ * Features are published as configured in feature-encoding, the blob
+ * encodings append them to blob, the others leave it alone. A detection
+ * the payload policy skips has no "feature" or "feature-offset" at all.
+ */
+static void results_to_json (const std::vector<ts::ReIDData>& results,
+    const std::vector<int64_t>& ids, const uint32_t* index, size_t count,
+    FeatureEncoding encoding, FeaturePolicy* payload,
+    std::vector<unsigned char>& blob, TsJsonWriter& writer)
 {
-    TS_INFO_MSG_V ("results_to_json_object called.");
+    TS_DEBUG_MSG_V ("results_to_json called.");
 
-    JsonObject* result = json_object_new ();
-    JsonArray*  jarray = json_array_new ();
-    JsonObject* jobject = NULL;
+    writer.BeginObject ();
+    writer.String ("alg-name", "reid", 4);
+    if (encoding != FEATURE_ENCODING_TEXT) {
+        const char* name = FeatureEncodingName (encoding);
+        writer.String ("feature-encoding", name, strlen (name));
+    }
+    writer.BeginArray ("alg-result");
+
+    for (size_t k = 0; k < count; k ++) {
+        size_t i = index[k];
+        writer.BeginObject ();
+        writer.Int ("object-id", ids[i]);
+        writer.Int ("trace-id",  results[i].trace_id);
+
+        if (!payload) {
+            feature_to_json (results[i].feature, encoding, blob, &writer);
+        } else {
+            bool publish = payload->Publish (results[i].camera_id,
+                results[i].trace_id, ids[i]);
+            if (publish || payload->Sample ()) {
+                auto start = std::chrono::steady_clock::now ();
+                size_t n = feature_to_json (results[i].feature, encoding,
+                    blob, publish ? &writer : NULL);
+                payload->Account (publish, n,
+                    std::chrono::duration<double, std::micro> (
+                    std::chrono::steady_clock::now () - start).count ());
+            }
+        }
 
-    if (!result || !jarray) {
-        TS_ERR_MSG_V ("Failed to new a object with type JsonXyz");
-        if (result) json_object_unref (result);
-        if (jarray) json_array_unref  (jarray);
-        return NULL;
+        writer.Float ("confidence", results[i].confidence);
+        writer.Float ("x",          results[i].x);
+        writer.Float ("y",          results[i].y);
+        writer.Float ("width",      results[i].width);
+        writer.Float ("height",     results[i].height);
+        writer.EndObject ();
     }
 
-    for (int i = 0; i < (int)results.size(); i ++) {
+    writer.EndArray ();
+    writer.EndObject ();
+}
 
-        if (!(jobject = json_object_new ())) {
-            TS_ERR_MSG_V ("Failed to new a object with type JsonObject");
-            json_object_unref (result);
-            json_array_unref (jarray);
-            return NULL;
+/*
+ * The count results at index of a frame as a binary record, see
+ * TsResultHeader, features
+ * as the raw values of feature-encoding, fp32 for text. The payload policy
+ * applies as it does to the json.
+ */
+static void results_to_record (const std::vector<ts::ReIDData>& results,
+    const std::vector<int64_t>& ids, const uint32_t* index, size_t count,
+    FeatureEncoding encoding, FeaturePolicy* payload,
+    std::vector<unsigned char>& record)
+{
+    static thread_local std::vector<unsigned char> scratch;
+    bool fp16 = encoding == FEATURE_ENCODING_BASE64_FP16 ||
+        encoding == FEATURE_ENCODING_BLOB_FP16;
+    FeatureEncoding raw = fp16 ? FEATURE_ENCODING_BLOB_FP16 :
+        FEATURE_ENCODING_BLOB_FP32;
+    size_t dims = count ? results[index[0]].feature.size () : 0;
+    size_t bytes = FeatureBytes (raw, dims);
+
+    TsResultWriter writer (record);
+    writer.Begin ("reid", count, fp16 ? TS_RESULT_FEATURE_FP16 :
+        TS_RESULT_FEATURE_FP32, dims);
+    scratch.resize (bytes);
+
+    for (size_t k = 0; k < count; k++) {
+        size_t i = index[k];
+        TsResultDetection& d = writer.Detection (k);
+        d.object_id_  = ids[i];
+        d.trace_id_   = results[i].trace_id;
+        d.confidence_ = results[i].confidence;
+        d.x_          = results[i].x;
+        d.y_          = results[i].y;
+        d.width_      = results[i].width;
+        d.height_     = results[i].height;
+
+        if (results[i].feature.size () != dims) continue;
+
+        if (!payload) {
+            FeatureToBytes (raw, results[i].feature.data (), dims,
+                writer.AddFeature (k));
+            continue;
         }
-        
-        json_object_set_string_member (jobject, "object-id",
-            std::to_string(results[i].object_id).c_str());
-        json_object_set_string_member (jobject, "trace-id",
-            std::to_string(results[i].trace_id).c_str());
-        json_object_set_string_member (jobject, "feature",
-            vector2str(results[i].feature).c_str());
-        json_object_set_string_member (jobject, "confidence",
-            std::to_string(results[i].confidence).c_str());
-        json_object_set_string_member (jobject, "x",
-            std::to_string(results[i].x).c_str());
-        json_object_set_string_member (jobject, "y",
-            std::to_string(results[i].y).c_str());
-        json_object_set_string_member (jobject, "width",
-            std::to_string(results[i].width).c_str());
-        json_object_set_string_member (jobject, "height",
-            std::to_string(results[i].height).c_str());
-        json_array_add_object_element(jarray, jobject);
-    }
-
-    json_object_set_string_member (result, "alg-name", "reid");
-    json_object_set_array_member  (result, "alg-result", jarray);
-    
-    return result;
+
+        bool publish = payload->Publish (results[i].camera_id,
+            results[i].trace_id, ids[i]);
+        if (publish || payload->Sample ()) {
+            auto start = std::chrono::steady_clock::now ();
+            FeatureToBytes (raw, results[i].feature.data (), dims,
+                publish ? writer.AddFeature (k) : scratch.data ());
+            payload->Account (publish, bytes,
+                std::chrono::duration<double, std::micro> (
+                std::chrono::steady_clock::now () - start).count ());
+        }
+    }
+}
+
+static void gallery_insert_and_search (AlgCore* a,
+    const std::vector<ts::ReIDData>& results, std::vector<int64_t>& ids)
+{
+    // grown to the largest frame once, then reused by every frame
+    static thread_local std::vector<GalleryQuery> queries;
+    queries.assign (results.size(), GalleryQuery ());
+
+    for (size_t i = 0; i < results.size(); i++) {
+        if ((int)results[i].feature.size() != a->cfg_.gallery_.dims_) {
+            TS_WARN_MSG_V ("Skip feature with %ld dims (expect %d)",
+                results[i].feature.size(), a->cfg_.gallery_.dims_);
+            continue;
+        }
+        queries[i].feature_    = results[i].feature.data();
+        queries[i].camera_id_  = results[i].camera_id;
+        queries[i].trace_id_   = results[i].trace_id;
+        queries[i].confidence_ = results[i].confidence;
+    }
+
+    // with tracks only their first detection reaches the gallery
+    if (a->tracks_) {
+        a->tracks_->InsertAndSearch (queries);
+    } else {
+        a->gallery_->InsertAndSearch (queries);
+    }
+
+    for (size_t i = 0; i < results.size(); i++) {
+        ids[i] = queries[i].feature_ ? queries[i].object_id_ :
+            results[i].object_id;
+    }
+}
+
+/*
+ * The object id of every result after the search, into ids. The gallery
+ * reads the features where they are. The vendor db only searches a vector
+ * it may write, and may leave out what it could not search, while the
+ * listener gets the frame as the const vector the vendor callback type
+ * declares, which the message and osd index by position afterwards. So the
+ * vendor path searches a per-thread copy assigned from results; its
+ * elements keep their feature storage from frame to frame, the copy is a
+ * memcpy per feature and allocates nothing once the largest frame was seen.
+ */
+static void search_results (AlgCore* a,
+    const std::vector<ts::ReIDData>& results, std::vector<int64_t>& ids)
+{
+    ids.resize (results.size());
+
+    if (a->gallery_) {
+        gallery_insert_and_search (a, results, ids);
+        return;
+    }
+
+    static thread_local std::vector<ts::ReIDData> scratch;
+    scratch = results;
+    a->alg_db_->insertandSearchID(scratch);
+
+    for (size_t i = 0; i < results.size(); i++) {
+        ids[i] = i < scratch.size() ? scratch[i].object_id :
+            results[i].object_id;
+    }
 }
 
 static void results_to_osd_object (
     const std::vector<ts::ReIDData>& results,
+    const std::vector<int64_t>& ids, const uint32_t* index, size_t count,
     std::vector<TsOsdObject>& osd_object,
     void* user_data)
 {
-    TS_INFO_MSG_V("results_to_osd_object called.");
+    TS_DEBUG_MSG_V ("results_to_osd_object called.");
 
     AlgCore* a = (AlgCore*) user_data;
+    int64_t now = TrackStateStore::Now ();
+
+    osd_object.reserve (osd_object.size() + count *
+        (1 + (a->trails_ ? a->cfg_.trail_points_ : 0)));
+
+    for (size_t k = 0; k < count; k++) {
+        size_t i = index[k];
+        const ts::ReIDData& bbox = results[i];
+        uint8_t r, g, b;
+
+        // a detection the gallery refused has no identity to color or trail
+        if (ids[i] < 0) {
+            osd_object.emplace_back ((int)bbox.x,
+                (int)bbox.y, (int)bbox.width,
+                (int)bbox.height, 255, 255, 255,
+                0, "unknown", TsObjectType::OBJECT);
+            continue;
+        }
 
-    // to-do reid db insert and search
-    auto tmp = std::make_shared<std::vector<ts::ReIDData>>();
-    *tmp = results;
-    a->alg_db_->insertandSearchID(*tmp);
+        // the color follows from the id, the store only keeps it alive
+        a->states_->Touch (ids[i], now);
+        TrackColor (ids[i], r, g, b);
 
-    // int64_t min_object_id = 0x3fffffff;
+        osd_object.emplace_back ((int)bbox.x,
+            (int)bbox.y, (int)bbox.width,
+            (int)bbox.height, r, g, b,
+            0, "person_" + std::to_string(ids[i]), TsObjectType::OBJECT);
+
+        // the trail follows the bottom center of the box, where it stands
+        if (a->trails_) {
+            a->trails_->Append (bbox.camera_id, ids[i],
+                (int)(bbox.x + bbox.width / 2), (int)(bbox.y + bbox.height),
+                now, r, g, b, osd_object);
+        }
+    }
 
-    for (auto&& bbox : *tmp) {
-        std::string text = "person_" + std::to_string(bbox.object_id);
-        std::tuple<uint8_t, uint8_t, uint8_t> color;
+    a->states_->Sweep (now);
+    if (a->trails_) a->trails_->Sweep (now);
 
-        {
-            std::lock_guard<std::mutex> lock(a->mutex_);
-            if (a->color_map.find(bbox.object_id) != a->color_map.end()) {
-                color = a->color_map[bbox.object_id];
-            } else {
-                uint8_t r = rand() % 256;
-                uint8_t g = rand() % 256;
-                uint8_t b = rand() % 256;
-                color = std::make_tuple(r, g, b);
-                a->color_map[bbox.object_id] = color;
-            }
-        }
+    TS_DEBUG_MSG_V ("track state size: %ld", a->states_->Size());
+}
 
-        osd_object.push_back (TsOsdObject ((int)bbox.x,
-            (int)bbox.y, (int)bbox.width,
-            (int)bbox.height, std::get<0>(color), std::get<1>(color), std::get<2>(color),
-            0, text, TsObjectType::OBJECT));
-    }
-
-    // for (size_t i = 0; i < results.size(); i++) {
-    //     std::string text = "person_" + std::to_string(results[i].object_id);
-    //     std::tuple<uint8_t, uint8_t, uint8_t> color;
-
-    //     if (min_object_id > results[i].object_id) min_object_id = results[i].object_id;
-
-    //     {
-    //         std::lock_guard<std::mutex> lock(a->mutex_);
-    //         if (a->color_map.find(results[i].object_id) != a->color_map.end()) {
-    //             color = a->color_map[results[i].object_id];
-    //         } else {
-    //             uint8_t r = rand() % 256;
-    //             uint8_t g = rand() % 256;
-    //             uint8_t b = rand() % 256;
-    //             color = std::make_tuple(r, g, b);
-    //             a->color_map[results[i].object_id] = color;
-    //         }
-    //     }
-
-    //     osd_object.push_back (TsOsdObject ((int)results[i].x,
-    //         (int)results[i].y, (int)results[i].width,
-    //         (int)results[i].height, std::get<0>(color), std::get<1>(color), std::get<2>(color),
-    //         0, text, TsObjectType::OBJECT));
-
-    //     {
-    //         std::lock_guard<std::mutex> lock(a->mutex_);
-    //         int tmp_x, tmp_y;
-    //         std::pair<int, int> pos;
-
-    //         if (a->trace_map.find(results[i].object_id) != a->trace_map.end()) {
-    //             std::vector<std::pair<int, int> > trace = a->trace_map[results[i].object_id];
-
-    //             for (size_t i = 0; i < trace.size(); i++) {
-    //                 pos = trace.at(i);
-    //                 tmp_x = pos.first;
-    //                 tmp_y = pos.second;
-    //                 osd_object.push_back (TsOsdObject (tmp_x, tmp_x, 8, 8,
-    //                     std::get<0>(color), std::get<1>(color), std::get<2>(color),
-    //                     0, text, TsObjectType::OBJECT));
-    //             }
-    //         } else {
-    //             a->trace_map[results[i].object_id] = std::vector<std::pair<int, int> >();
-    //         }
-
-    //         tmp_x = results[i].x + results[i].width / 2;
-    //         tmp_y = results[i].y + results[i].height;
-    //         pos = std::make_pair(tmp_x, tmp_y);
-    //         a->trace_map[results[i].object_id].push_back(pos);
-    //         // osd_object.push_back(TsOsdObject (tmp_x, tmp_y, 8, 8, std::get<0>(color),
-    //         //             std::get<1>(color), std::get<2>(color),
-    //         //             0, text, TsObjectType::OBJECT));
-    //     }
-    // }
-
-    // TS_INFO_MSG_V("----------------------current minmum trace id %ld, trace size: %ld", min_object_id, a->trace_map.size());
-
-    // {
-    //     std::lock_guard<std::mutex> lock(a->mutex_);
-    //     auto c_iter = a->color_map.begin();
-    //     auto t_iter = a->trace_map.begin();
-    //     for (;c_iter != a->color_map.end() && t_iter != a->trace_map.end();) {
-    //         if (c_iter->first < min_object_id) {
-    //             TS_INFO_MSG_V("----------------------delete minmum trace id0 %ld", min_object_id);
-    //             a->color_map.erase(c_iter++);
-    //             a->trace_map.erase(t_iter++);
-    //             TS_INFO_MSG_V("----------------------delete minmum trace id1 %ld", min_object_id);
-    //         } else {
-    //             c_iter++;
-    //             t_iter++;
-    //         }
-    //     }
-    // }
-
-    TS_INFO_MSG_V("color map size: %ld", a->color_map.size());
+/*
+ * The result of the count results at index, as json or a binary record
+ * as configured, with its osd objects. NULL on failure.
+ */
+static std::shared_ptr<TsJsonObject> make_result (AlgCore* a,
+    const std::vector<ts::ReIDData>& results, const std::vector<int64_t>& ids,
+    const uint32_t* index, size_t count)
+{
+    std::shared_ptr<TsJsonObject> jo;
+
+    if (a->cfg_.binary_result_) {
+        // the json is only made if someone asks for the message
+        std::vector<unsigned char> record;
+        results_to_record (results, ids, index, count,
+            a->cfg_.feature_encoding_, a->payload_, record);
+        jo = std::make_shared<TsJsonObject> (std::move (record));
+    } else {
+        std::vector<unsigned char> blob;
+        size_t dims = count ? results[index[0]].feature.size () : 0;
+        blob.reserve (count * FeatureBytes (a->cfg_.feature_encoding_, dims));
+
+        // the text is copied out once, the writer keeps its capacity
+        static thread_local TsJsonWriter writer;
+        writer.Clear ();
+        results_to_json (results, ids, index, count,
+            a->cfg_.feature_encoding_, a->payload_, blob, writer);
+
+        jo = std::make_shared<TsJsonObject> (writer.GetString ());
+        if (jo) jo->GetFeatureBuffer ().swap (blob);
+    }
+
+    if (!jo || !jo->HasResult()) {
+        TS_ERR_MSG_V ("Failed to new an object with type TsJsonObject"); 
+        return NULL;
+    }
+
+    results_to_osd_object (results, ids, index, count, jo->GetOsdObject(), a);
+    return jo;
 }
 
 RDC_STATE algListener (const std::vector<ts::ReIDData>& reid_vec, void* user_data)
@@ -348,54 +790,55 @@ RDC_STATE algListener (const std::vector<ts::ReIDData>& reid_vec, void* user_dat
 
     AlgCore* a = (AlgCore*) user_data;
 
-    // std::shared_ptr<std::vector<std::shared_ptr<TsJsonObject>>> jos;
-    // if (!(jos = std::make_shared<std::vector<std::shared_ptr<TsJsonObject>>>())) {
-    //     TS_ERR_MSG_V ("Failed to create a new TsJsonObject with type std::vector");
-    //     return STATE_INVALID_VALUE;
-    // }
-
-    // std::map<int64_t, std::shared_ptr<std::vector<ts::ReIDData> > > data_map;
-
-    // for (auto&& data : reid_vec) {
-    //     if (data_map.end() == data_map.find(data.camera_id)) {
-    //         data_map[data.camera_id] = std::make_shared<std::vector<ts::ReIDData>>();
-    //     }
-    //     data_map[data.camera_id]->push_back(data);
-    // }
-
-    // for (auto it : data_map) {
-    //     std::shared_ptr<TsJsonObject> jo = std::make_shared<TsJsonObject> 
-    //         (results_to_json_object (*(it.second)));
-    //     if (!jo || !jo->GetResult()) {
-    //         TS_ERR_MSG_V ("Failed to new an object with type TsJsonObject"); 
-    //         return false;
-    //     }
-
-    //     results_to_osd_object (*(it.second), jo->GetOsdObject(),
-    //         jo->GetOsdPoint(), it.first);
-
-    //     jos->push_back (jo);
-
-    // }
-
-    // if (jos->size() > 0) {
-    //     if (!a->cb_put_results_ (jos, NULL/*sample*/, a->cb_user_data_)) {
-    //         TS_ERR_MSG_V ("Failed to put the result corresponding to sample");
-    //         return STATE_INVALID_VALUE;
-    //     } else if (a->cb_put_result_) {
-    //         a->cb_put_result_ ((*jos)[0], NULL, a->cb_user_data_);
-    //     }
-    // }
-
-    std::shared_ptr<TsJsonObject> jo = std::make_shared<TsJsonObject> 
-            (results_to_json_object (reid_vec));
-    if (!jo || !jo->GetResult()) {
-        TS_ERR_MSG_V ("Failed to new an object with type TsJsonObject"); 
-        return false;
+    // the ids are searched first, so the message and osd carry the new ones
+    static thread_local std::vector<int64_t> ids;
+    search_results (a, reid_vec, ids);
+
+    // the results by camera, in frame order within one, reused per frame
+    static thread_local std::vector<uint32_t> order;
+    order.resize (reid_vec.size ());
+    for (size_t i = 0; i < order.size (); i++) order[i] = i;
+
+    if (!a->cb_put_results_) {
+        std::shared_ptr<TsJsonObject> jo = make_result (a, reid_vec, ids,
+            order.data (), order.size ());
+        if (!jo) return false;
+        if (a->cb_put_result_ && !a->cb_put_result_ (jo, NULL, a->cb_user_data_)) {
+            TS_ERR_MSG_V ("Failed to put the result corresponding to sample");
+            return -1;
+        }
+        return STATE_SUCCESS;
+    }
+
+    std::sort (order.begin (), order.end (),
+        [&reid_vec] (uint32_t l, uint32_t r) {
+            return reid_vec[l].camera_id != reid_vec[r].camera_id ?
+                reid_vec[l].camera_id < reid_vec[r].camera_id : l < r;
+        });
+
+    size_t cameras = order.empty () ? 0 : 1;
+    for (size_t i = 1; i < order.size (); i++) {
+        cameras += reid_vec[order[i]].camera_id != reid_vec[order[i - 1]].camera_id;
     }
-    results_to_osd_object (reid_vec, jo->GetOsdObject(), a);
-    if (!a->cb_put_result_ (jo, NULL, a->cb_user_data_)) {
-        TS_ERR_MSG_V ("Failed to put the result corresponding to sample");
+
+    std::shared_ptr<std::vector<std::shared_ptr<TsJsonObject>>> jos =
+        std::make_shared<std::vector<std::shared_ptr<TsJsonObject>>> ();
+    jos->reserve (cameras);
+    for (size_t begin = 0, end; begin < order.size (); begin = end) {
+        int64_t camera_id = reid_vec[order[begin]].camera_id;
+        for (end = begin + 1; end < order.size () &&
+            reid_vec[order[end]].camera_id == camera_id; end++);
+
+        std::shared_ptr<TsJsonObject> jo = make_result (a, reid_vec, ids,
+            order.data () + begin, end - begin);
+        if (!jo) return false;
+        jo->SetCameraId (std::to_string (camera_id));
+        jos->push_back (std::move (jo));
+    }
+
+    // one hand-off per frame, one result per camera in it
+    if (!a->cb_put_results_ (jos, NULL, a->cb_user_data_)) {
+        TS_ERR_MSG_V ("Failed to put the results corresponding to sample");
         return -1;
     }
 
@@ -418,11 +861,6 @@ void* algInit (const std::string& args)
         goto done;
     }
 
-    if (!(a->alg_db_ = new ts::TSObjectReIDDB())) {
-        TS_ERR_MSG_V ("Failed to new a object with type TSObjectReIDDB");
-        goto done;
-    }
-
     TS_INFO_MSG_V ("Algorithm Information: ");
     TS_INFO_MSG_V ("----------------------------------------------------");
     TS_INFO_MSG_V ("%s", a->alg_->getAlgoInfo().c_str());
@@ -439,6 +877,62 @@ void* algInit (const std::string& args)
     a->alg_->setScoreThresh (a->cfg_.conf_thresh_, a->cfg_.nms_thresh_);
     a->alg_->registeronCallBackListener(algListener, a);
 
+    a->cfg_.gallery_.dims_         = a->alg_->getFeatureDims();
+    a->cfg_.gallery_.low_dist_     = a->cfg_.low_dist_;
+    a->cfg_.gallery_.high_dist_    = a->cfg_.high_dist_;
+
+    a->states_ = new TrackStateStore (a->cfg_.track_state_capacity_,
+        a->cfg_.track_state_ttl_sec_);
+    if (a->cfg_.trail_points_ > 0) {
+        a->trails_ = new TrajectoryStore (a->cfg_.track_state_capacity_,
+            a->cfg_.trail_points_, a->cfg_.trail_lost_ms_);
+    }
+
+    // always needs neither state nor accounting
+    if (a->cfg_.feature_payload_ != FEATURE_PAYLOAD_ALWAYS) {
+        a->payload_ = new FeaturePolicy (a->cfg_.feature_payload_,
+            a->cfg_.gallery_.max_elem_num_);
+    }
+
+    // CreateGallery refuses a sharded vendor gallery and says why
+    if (a->cfg_.gallery_.mode_ != GalleryMode::GALLERY_VENDOR ||
+        a->cfg_.gallery_.shards_ > 1) {
+        if (!(a->gallery_ = CreateGallery (a->cfg_.gallery_))) {
+            TS_ERR_MSG_V ("Failed to create the in-process gallery");
+            goto done;
+        }
+        TS_INFO_MSG_V ("Using in-process gallery %s with %s kernels",
+            a->gallery_->Name(), KernelIsaName (GetKernelIsa()));
+        // a missing snapshot is a cold start, not an error
+        if (!a->cfg_.gallery_.snapshot_.empty()) {
+            a->gallery_->LoadSnapshot (a->cfg_.gallery_.snapshot_);
+        }
+        // inserts after the last snapshot are replayed from the wal
+        if (!a->cfg_.gallery_.snapshot_.empty() &&
+            a->cfg_.gallery_.wal_flush_ms_ > 0) {
+            a->journal_ = new GalleryJournal ();
+            if (a->journal_->Start (a->gallery_, a->cfg_.gallery_.snapshot_,
+                a->cfg_.gallery_.wal_flush_ms_,
+                a->cfg_.gallery_.checkpoint_sec_,
+                (uint64_t) a->cfg_.gallery_.checkpoint_mb_ << 20)) {
+                a->gallery_->SetJournal (a->journal_);
+            } else {
+                TS_WARN_MSG_V ("Gallery wal disabled, failed to start it");
+                delete a->journal_;
+                a->journal_ = NULL;
+            }
+        }
+        if (a->cfg_.gallery_.track_aggregate_) {
+            a->tracks_ = new TrackAggregator (a->gallery_, a->cfg_.gallery_);
+        }
+        return (void*) a;
+    }
+
+    if (!(a->alg_db_ = new ts::TSObjectReIDDB())) {
+        TS_ERR_MSG_V ("Failed to new a object with type TSObjectReIDDB");
+        goto done;
+    }
+
     if (!a->alg_db_->initialize (a->alg_->getFeatureDims(),
         a->cfg_.max_elem_num_)) {
         TS_ERR_MSG_V ("Failed to init the algorithm TSObjectReIDDB");
@@ -453,8 +947,12 @@ done:
     if (a->alg_) {
         delete a->alg_;
         delete a->alg_db_;
+        delete a->gallery_;
     }
 
+    delete a->payload_;
+    delete a->states_;
+    delete a->trails_;
     delete a;
 
     return NULL;
@@ -635,10 +1133,33 @@ void algFina(void* alg)
     a->alg_->stop();
     a->alg_->deinitialize();
 
-    a->alg_db_->deinitialize();
+    if (a->alg_db_) a->alg_db_->deinitialize();
+
+    if (a->payload_) a->payload_->PrintStats();
+    a->states_->PrintStats();
+    if (a->trails_) a->trails_->PrintStats();
+
+    if (a->gallery_) {
+        a->gallery_->PrintStats();
+        if (a->tracks_) a->tracks_->PrintStats();
+        if (a->journal_) {
+            // the final checkpoint, it also drops the wal segments
+            a->gallery_->SetJournal (NULL);
+            a->journal_->Stop();
+        } else if (!a->cfg_.gallery_.snapshot_.empty()) {
+            a->gallery_->SaveSnapshot (a->cfg_.gallery_.snapshot_);
+        }
+        a->gallery_->Deinitialize();
+    }
     
     delete a->alg_;
     delete a->alg_db_;
+    delete a->tracks_;
+    delete a->payload_;
+    delete a->states_;
+    delete a->trails_;
+    delete a->journal_;
+    delete a->gallery_;
     delete a;
 }
 
@@ -653,6 +1174,10 @@ bool algSetCb (void* alg, TsPutResult cb, void* args)
         a->cb_put_result_ = cb;
         a->cb_user_data_ = args;
     }
+    if (cb && a->cb_put_results_) {
+        TS_WARN_MSG_V ("Results go to the algSetCb2 callback, the algSetCb "
+            "one is not called");
+    }
 
     return true;
 }
@@ -666,6 +1191,10 @@ bool algSetCb2 (void* alg, TsPutResults cb, void* args)
         a->cb_put_results_ = cb;
         a->cb_user_data_ = args;
     }
+    if (cb && a->cb_put_result_) {
+        TS_WARN_MSG_V ("Results go to the algSetCb2 callback, the algSetCb "
+            "one is not called any more");
+    }
 
     return TRUE;
 }
@@ -0,0 +1,148 @@
+/*
+ * @Description: Implement of the camera adjacency graph and sighting index.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-26 15:42:09
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-26 15:42:09
+ */
+
+#include "CameraTopology.h"
+
+CameraTopology::CameraTopology (
+    const std::map<int64_t, std::vector<CameraLink> >& links)
+{
+    for (auto&& from : links) {
+        // a person may come back to the camera that lost them at any time
+        std::vector<Window>& own = inbound_[from.first];
+        if (own.empty ()) own.push_back (Window { from.first, 0, INT64_MAX });
+        for (auto&& l : from.second) {
+            if (l.camera_ == from.first) continue;
+            std::vector<Window>& in = inbound_[l.camera_];
+            if (in.empty ()) in.push_back (Window { l.camera_, 0, INT64_MAX });
+            in.push_back (Window { from.first, (int64_t) l.min_sec_ * 1000,
+                (int64_t) l.max_sec_ * 1000 });
+        }
+    }
+
+    Bucket (TOPOLOGY_ANY_CAMERA);
+}
+
+uint32_t CameraTopology::Bucket (int64_t camera_id)
+{
+    // entries of cameras outside the graph go with those of no camera
+    if (camera_id != TOPOLOGY_ANY_CAMERA && !inbound_.count (camera_id)) {
+        camera_id = TOPOLOGY_ANY_CAMERA;
+    }
+
+    auto it = buckets_.find (camera_id);
+    if (it != buckets_.end ()) return it->second;
+
+    uint32_t b = nodes_.size ();
+    nodes_.push_back (Node ());
+    nodes_[b].prev_ = nodes_[b].next_ = nodes_[b].bucket_ = b;
+    buckets_[camera_id] = b;
+
+    return b;
+}
+
+void CameraTopology::Link (uint32_t n, uint32_t bucket)
+{
+    Node& head = nodes_[bucket];
+
+    nodes_[n].bucket_ = bucket;
+    nodes_[n].prev_   = bucket;
+    nodes_[n].next_   = head.next_;
+    nodes_[head.next_].prev_ = n;
+    head.next_ = n;
+}
+
+void CameraTopology::Unlink (uint32_t n)
+{
+    nodes_[nodes_[n].prev_].next_ = nodes_[n].next_;
+    nodes_[nodes_[n].next_].prev_ = nodes_[n].prev_;
+}
+
+void CameraTopology::Sighted (int64_t id, int64_t camera_id, int64_t now)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    uint32_t n;
+
+    auto it = index_.find (id);
+    if (it != index_.end ()) {
+        n = it->second;
+        Unlink (n);
+    } else if (!free_.empty ()) {
+        n = free_.back ();
+        free_.pop_back ();
+        index_[id] = n;
+    } else {
+        n = nodes_.size ();
+        nodes_.push_back (Node ());
+        index_[id] = n;
+    }
+
+    nodes_[n].id_        = id;
+    nodes_[n].last_seen_ = now;
+    Link (n, Bucket (camera_id));
+}
+
+void CameraTopology::Erase (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    auto it = index_.find (id);
+    if (it == index_.end ()) return;
+
+    Unlink (it->second);
+    nodes_[it->second].id_ = -1;
+    free_.push_back (it->second);
+    index_.erase (it);
+}
+
+bool CameraTopology::Candidates (int64_t camera_id, int64_t now,
+    std::vector<int64_t>& out)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    out.clear ();
+
+    auto in = inbound_.find (camera_id);
+    if (in == inbound_.end ()) return false;
+
+    for (auto&& l : in->second) {
+        auto b = buckets_.find (l.camera_);
+        if (b == buckets_.end ()) continue;
+
+        // newest first, stop once the window is behind us
+        for (uint32_t n = nodes_[b->second].next_; n != b->second;
+            n = nodes_[n].next_) {
+            int64_t age = now - nodes_[n].last_seen_;
+            if (age > l.max_ms_) break;
+            if (age >= l.min_ms_) out.push_back (nodes_[n].id_);
+        }
+    }
+
+    uint32_t any = buckets_[TOPOLOGY_ANY_CAMERA];
+    for (uint32_t n = nodes_[any].next_; n != any; n = nodes_[n].next_) {
+        out.push_back (nodes_[n].id_);
+    }
+
+    return true;
+}
+
+bool CameraTopology::Reachable (int64_t from, int64_t to, int64_t age)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    auto in = inbound_.find (to);
+    if (in == inbound_.end () || !inbound_.count (from)) return true;
+
+    for (auto&& l : in->second) {
+        if (l.camera_ == from && age >= l.min_ms_ && age <= l.max_ms_) {
+            return true;
+        }
+    }
+
+    return false;
+}
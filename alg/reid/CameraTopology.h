@@ -0,0 +1,88 @@
+/*
+ * @Description: Camera adjacency graph and sighting index of the ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-26 15:42:09
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-26 15:42:09
+ */
+
+#ifndef __TS_CAMERA_TOPOLOGY_H__
+#define __TS_CAMERA_TOPOLOGY_H__
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// the camera of entries seen nowhere in the graph, they stay candidates
+#define TOPOLOGY_ANY_CAMERA INT64_MIN
+
+// a person leaving one camera appears on camera_ within [min_sec_, max_sec_]
+typedef struct _CameraLink {
+    int64_t camera_  { 0 };
+    int     min_sec_ { 0 };
+    int     max_sec_ { 0 };
+} CameraLink;
+
+/*
+ * The links of every camera and, per camera, the entries last seen there
+ * ordered by recency. The candidates of a query are the entries last seen
+ * on its own camera, on a camera linked to it within the transit window
+ * and on cameras outside the graph, a camera outside the graph searches
+ * everything. Each window is walked from its newest entry and stops at the
+ * first one older than max_sec_, so only candidates are ever visited.
+ * Entries restored without a camera stay candidates of every query until
+ * they are seen again. The class locks itself.
+ */
+class CameraTopology
+{
+public:
+    // source camera -> links leaving it
+    CameraTopology (const std::map<int64_t, std::vector<CameraLink> >& links);
+
+    // id was inserted or matched on camera at now (ms)
+    void Sighted (int64_t id, int64_t camera_id, int64_t now);
+    void Erase   (int64_t id);
+
+    /*
+     * Writes the ids a query on camera at now may match to out, false
+     * when the camera is outside the graph and every entry qualifies.
+     */
+    bool Candidates (int64_t camera_id, int64_t now, std::vector<int64_t>& out);
+
+    // whether an entry seen on from age ms ago is a candidate on to
+    bool Reachable  (int64_t from, int64_t to, int64_t age);
+
+private:
+    typedef struct _Window {
+        int64_t camera_ ;
+        int64_t min_ms_ ;
+        int64_t max_ms_ ;
+    } Window;
+
+    typedef struct _Node {
+        int64_t  id_        { -1 };
+        int64_t  last_seen_ { 0  };
+        uint32_t bucket_    { 0  };
+        uint32_t prev_      { 0  };
+        uint32_t next_      { 0  };
+    } Node;
+
+    // a sentinel node per camera heads its list, newest first
+    uint32_t Bucket (int64_t camera_id);
+    void     Link   (uint32_t n, uint32_t bucket);
+    void     Unlink (uint32_t n);
+
+private:
+    std::mutex                                    mutex_   ;
+    // destination camera -> the links arriving there, its own included
+    std::unordered_map<int64_t, std::vector<Window> > inbound_;
+    std::unordered_map<int64_t, uint32_t>         buckets_ ;
+    std::vector<Node>                             nodes_   ;
+    std::vector<uint32_t>                         free_    ;
+    std::unordered_map<int64_t, uint32_t>         index_   ;
+};
+
+#endif //__TS_CAMERA_TOPOLOGY_H__
@@ -0,0 +1,74 @@
+/*
+ * @Description: Implement of the epoch-based reclamation.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-01 10:21:44
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-01 10:21:44
+ */
+
+#include <functional>
+#include <thread>
+
+#include "EpochReclaimer.h"
+
+EpochReclaimer::~EpochReclaimer (void)
+{
+    // no reader outlives the structure it reads
+    for (auto&& r : retired_) r.second ();
+    retired_.clear ();
+}
+
+EpochReclaimer::Guard::Guard (EpochReclaimer& reclaimer)
+    : reclaimer_ (reclaimer)
+{
+    // threads start apart, so a slot is usually free at the first try
+    size_t start = std::hash<std::thread::id> () (std::this_thread::get_id ());
+
+    for (size_t i = 0; ; i++) {
+        slot_ = (start + i) % EPOCH_READER_SLOTS;
+        Slot& s = reclaimer_.slots_[slot_];
+        if (!s.busy_.load (std::memory_order_relaxed) &&
+            !s.busy_.exchange (true)) break;
+        if (i % EPOCH_READER_SLOTS == EPOCH_READER_SLOTS - 1) {
+            std::this_thread::yield ();
+        }
+    }
+
+    // a stale epoch left in the slot is older still, so the writer only
+    // ever waits longer than it has to, never shorter
+    reclaimer_.slots_[slot_].epoch_.store (reclaimer_.epoch_.load ());
+}
+
+EpochReclaimer::Guard::~Guard (void)
+{
+    reclaimer_.slots_[slot_].busy_.store (false, std::memory_order_release);
+}
+
+void EpochReclaimer::Retire (std::function<void (void)> deleter)
+{
+    // the object is unlinked, readers announcing a later epoch missed it
+    retired_.push_back (std::make_pair (epoch_.fetch_add (1), deleter));
+    Reclaim ();
+}
+
+void EpochReclaimer::Reclaim (void)
+{
+    uint64_t oldest = epoch_.load ();
+
+    for (size_t i = 0; i < EPOCH_READER_SLOTS; i++) {
+        if (!slots_[i].busy_.load ()) continue;
+        uint64_t e = slots_[i].epoch_.load ();
+        if (e < oldest) oldest = e;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size (); i++) {
+        if (retired_[i].first < oldest) {
+            retired_[i].second ();
+        } else {
+            retired_[kept++] = std::move (retired_[i]);
+        }
+    }
+    retired_.resize (kept);
+}
@@ -0,0 +1,69 @@
+/*
+ * @Description: Epoch-based reclamation of memory shared with lock-free readers.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-01 10:21:44
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-01 10:21:44
+ */
+
+#ifndef __TS_EPOCH_RECLAIMER_H__
+#define __TS_EPOCH_RECLAIMER_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// readers inside at the same time, more wait for a free slot
+#define EPOCH_READER_SLOTS 64
+
+/*
+ * A reader announces the current epoch in a slot of its own for as long as
+ * it holds pointers it loaded from the shared structure. The writer unlinks
+ * an object first and retires it with the epoch it advanced from, it is
+ * freed once no slot still announces that epoch or an older one: a reader
+ * that announced a newer epoch started after the unlink and cannot see it.
+ * Readers never block the writer and the writer never blocks readers, an
+ * unlucky slow reader only delays the frees.
+ * Retire and Reclaim belong to a single writer at a time.
+ */
+class EpochReclaimer
+{
+public:
+    EpochReclaimer (void) {}
+    ~EpochReclaimer (void);
+
+    // the scope of a reader
+    class Guard
+    {
+    public:
+        explicit Guard (EpochReclaimer& reclaimer);
+        ~Guard (void);
+
+    private:
+        EpochReclaimer& reclaimer_;
+        size_t          slot_     ;
+    };
+
+    // frees what no reader can see any longer
+    void   Retire  (std::function<void (void)> deleter);
+    void   Reclaim (void);
+    size_t Pending (void) { return retired_.size (); }
+
+private:
+    // padded to a cache line of its own, readers never share one
+    typedef struct _Slot {
+        std::atomic<bool>     busy_  { false };
+        std::atomic<uint64_t> epoch_ { 0     };
+        char                  pad_[64 - 2 * sizeof (uint64_t)];
+    } Slot;
+
+private:
+    std::atomic<uint64_t> epoch_ { 1 };
+    Slot                  slots_[EPOCH_READER_SLOTS];
+    std::vector<std::pair<uint64_t, std::function<void (void)> > > retired_;
+};
+
+#endif //__TS_EPOCH_RECLAIMER_H__
@@ -0,0 +1,307 @@
+/*
+ * @Description: Implement of the feature encodings with a SIMD base64.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-08 10:26:14
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-08 10:26:14
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_CODEC_X86 1
+#endif
+
+#include "FeatureCodec.h"
+#include "FeatureKernels.h"
+
+static const char kBase64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+FeatureEncoding StringToFeatureEncoding (const std::string& encoding)
+{
+    std::string e (encoding);
+    std::transform(e.begin(), e.end(), e.begin(),
+        [](unsigned char ch){ return tolower(ch); }
+    );
+
+    if (0 == e.compare("base64-fp32")) {
+        return FEATURE_ENCODING_BASE64_FP32;
+    } else if (0 == e.compare("base64-fp16")) {
+        return FEATURE_ENCODING_BASE64_FP16;
+    } else if (0 == e.compare("blob-fp32")) {
+        return FEATURE_ENCODING_BLOB_FP32;
+    } else if (0 == e.compare("blob-fp16")) {
+        return FEATURE_ENCODING_BLOB_FP16;
+    } else {
+        return FEATURE_ENCODING_TEXT;
+    }
+}
+
+const char* FeatureEncodingName (FeatureEncoding encoding)
+{
+    switch (encoding) {
+    case FEATURE_ENCODING_BASE64_FP32: return "base64-fp32";
+    case FEATURE_ENCODING_BASE64_FP16: return "base64-fp16";
+    case FEATURE_ENCODING_BLOB_FP32:   return "blob-fp32";
+    case FEATURE_ENCODING_BLOB_FP16:   return "blob-fp16";
+    default:                           return "text";
+    }
+}
+
+static bool is_fp16 (FeatureEncoding encoding)
+{
+    return encoding == FEATURE_ENCODING_BASE64_FP16 ||
+        encoding == FEATURE_ENCODING_BLOB_FP16;
+}
+
+size_t FeatureBytes (FeatureEncoding encoding, size_t dims)
+{
+    if (encoding == FEATURE_ENCODING_TEXT) return 0;
+
+    return dims * (is_fp16 (encoding) ? sizeof (uint16_t) : sizeof (float));
+}
+
+void FeatureToBytes (FeatureEncoding encoding, const float* feature,
+    size_t dims, void* dst)
+{
+    if (is_fp16 (encoding)) {
+        EncodeF16 (feature, (uint16_t*) dst, dims);
+    } else {
+        memcpy (dst, feature, dims * sizeof (float));
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // the published layout is little-endian whatever the host
+    if (is_fp16 (encoding)) {
+        uint16_t* p = (uint16_t*) dst;
+        for (size_t i = 0; i < dims; i++) p[i] = __builtin_bswap16 (p[i]);
+    } else {
+        uint32_t* p = (uint32_t*) dst;
+        for (size_t i = 0; i < dims; i++) p[i] = __builtin_bswap32 (p[i]);
+    }
+#endif
+}
+
+/*----------------------------------text-------------------------------------*/
+// "-1.23457e-05" and a space
+#define FEATURE_TEXT_MAX 16
+
+static const double kPow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+/*
+ * printf "%g": six significant digits, fixed notation for exponents -4 to
+ * 5, trailing zeros dropped. A float times 10^k for k <= 9 is exact in a
+ * double, so rounding it half to even once is what printf makes of the
+ * exact decimal value. Anything else goes to snprintf.
+ */
+static size_t format_g (float value, char* dst)
+{
+    double a = fabs ((double) value);
+    char*  p = dst;
+
+    if (a == 0.0) {
+        if (signbit (value)) *p++ = '-';
+        *p++ = '0';
+        return p - dst;
+    }
+    if (!(a >= 1e-4 && a < 1e6)) {
+        return snprintf (dst, FEATURE_TEXT_MAX, "%g", value);
+    }
+
+    int e = 5;
+    while (e > -4 && a < kPow10[e + 4] * 1e-4) e--;
+
+    int64_t m = llrint (a * kPow10[5 - e]);
+    while (m >= 1000000 || m < 100000) {
+        e += m >= 1000000 ? 1 : -1;
+        if (e > 5 || e < -4) {
+            return snprintf (dst, FEATURE_TEXT_MAX, "%g", value);
+        }
+        m = llrint (a * kPow10[5 - e]);
+        // rounded up to the next power of ten
+        if (m == 1000000) {
+            m = 100000;
+            e++;
+            if (e > 5) return snprintf (dst, FEATURE_TEXT_MAX, "%g", value);
+            break;
+        }
+    }
+
+    char digits[6];
+    for (int i = 5; i >= 0; i--, m /= 10) digits[i] = (char) ('0' + m % 10);
+    int last = 5;
+    while (last > 0 && digits[last] == '0' && last > e) last--;
+
+    if (value < 0) *p++ = '-';
+    if (e < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > e; i--) *p++ = '0';
+        for (int i = 0; i <= last; i++) *p++ = digits[i];
+    } else {
+        for (int i = 0; i <= e; i++) *p++ = digits[i];
+        if (last > e) {
+            *p++ = '.';
+            for (int i = e + 1; i <= last; i++) *p++ = digits[i];
+        }
+    }
+
+    return p - dst;
+}
+
+size_t FeatureTextSize (size_t dims)
+{
+    return dims * FEATURE_TEXT_MAX + 1;
+}
+
+size_t FeatureToText (const float* feature, size_t dims, char* dst)
+{
+    char* p = dst;
+
+    for (size_t i = 0; i < dims; i++) {
+        if (i) *p++ = ' ';
+        p += format_g (feature[i], p);
+    }
+    *p = '\0';
+
+    return p - dst;
+}
+
+size_t Base64Size (size_t bytes)
+{
+    return (bytes + 2) / 3 * 4;
+}
+
+/*----------------------------------scalar-----------------------------------*/
+static size_t base64_scalar (const uint8_t* src, size_t bytes, char* dst)
+{
+    char*  out = dst;
+    size_t i   = 0;
+
+    for (; i + 3 <= bytes; i += 3) {
+        uint32_t v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+        out[0] = kBase64[(v >> 18) & 0x3f];
+        out[1] = kBase64[(v >> 12) & 0x3f];
+        out[2] = kBase64[(v >>  6) & 0x3f];
+        out[3] = kBase64[v & 0x3f];
+        out += 4;
+    }
+
+    if (i < bytes) {
+        uint32_t v = src[i] << 16;
+        if (i + 1 < bytes) v |= src[i + 1] << 8;
+        out[0] = kBase64[(v >> 18) & 0x3f];
+        out[1] = kBase64[(v >> 12) & 0x3f];
+        out[2] = i + 1 < bytes ? kBase64[(v >> 6) & 0x3f] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+
+    return out - dst;
+}
+
+/*-----------------------------------avx2------------------------------------*/
+#ifdef TS_CODEC_X86
+/*
+ * 24 input bytes become 32 characters per round: each 128-bit lane gathers
+ * 12 bytes into four 3-byte groups, multiplies split them into 6-bit
+ * indices, one byte each, and a 16-entry table of offsets per index range
+ * turns the indices into ascii (W. Mula, D. Lemire, "Faster Base64 Encoding
+ * and Decoding Using AVX2 Instructions"). Each lane loads 16 bytes, so 28
+ * must remain, the rest goes through base64_scalar.
+ */
+__attribute__((target("avx2")))
+static size_t base64_avx2 (const uint8_t* src, size_t bytes, char* dst)
+{
+    const __m256i shuffle = _mm256_setr_epi8 (
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8 (
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    char*  out = dst;
+    size_t i   = 0;
+
+    for (; i + 28 <= bytes; i += 24) {
+        __m256i in = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+            _mm_loadu_si128 ((const __m128i*) (src + i))),
+            _mm_loadu_si128 ((const __m128i*) (src + i + 12)), 1);
+        in = _mm256_shuffle_epi8 (in, shuffle);
+
+        // indices a and c to the low 6 bits of their 16-bit halves ...
+        __m256i ac = _mm256_mulhi_epu16 (
+            _mm256_and_si256 (in, _mm256_set1_epi32 (0x0fc0fc00)),
+            _mm256_set1_epi32 (0x04000040));
+        // ... b and d to the high byte of theirs
+        __m256i bd = _mm256_mullo_epi16 (
+            _mm256_and_si256 (in, _mm256_set1_epi32 (0x003f03f0)),
+            _mm256_set1_epi32 (0x01000010));
+        __m256i idx = _mm256_or_si256 (ac, bd);
+
+        // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+        __m256i range = _mm256_subs_epu8 (idx, _mm256_set1_epi8 (51));
+        __m256i upper = _mm256_cmpgt_epi8 (_mm256_set1_epi8 (26), idx);
+        range = _mm256_or_si256 (range,
+            _mm256_and_si256 (upper, _mm256_set1_epi8 (13)));
+
+        _mm256_storeu_si256 ((__m256i*) out, _mm256_add_epi8 (idx,
+            _mm256_shuffle_epi8 (offsets, range)));
+        out += 32;
+    }
+
+    out += base64_scalar (src + i, bytes - i, out);
+    return out - dst;
+}
+#endif //TS_CODEC_X86
+
+size_t Base64Encode (const void* src, size_t bytes, char* dst)
+{
+    size_t n;
+
+#ifdef TS_CODEC_X86
+    // every kernel isa above scalar implies avx2
+    if (GetKernelIsa () != KERNEL_ISA_SCALAR) {
+        n = base64_avx2 ((const uint8_t*) src, bytes, dst);
+        dst[n] = '\0';
+        return n;
+    }
+#endif
+    n = base64_scalar ((const uint8_t*) src, bytes, dst);
+    dst[n] = '\0';
+    return n;
+}
+
+size_t FeatureToBase64 (FeatureEncoding encoding, const float* feature,
+    size_t dims, char* dst)
+{
+    static thread_local std::vector<uint16_t> half;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // fp32 is already in the published layout
+    if (!is_fp16 (encoding)) {
+        return Base64Encode (feature, dims * sizeof (float), dst);
+    }
+#endif
+
+    size_t bytes = FeatureBytes (is_fp16 (encoding) ?
+        FEATURE_ENCODING_BLOB_FP16 : FEATURE_ENCODING_BLOB_FP32, dims);
+    if (half.size () * sizeof (uint16_t) < bytes) {
+        half.resize ((bytes + 1) / sizeof (uint16_t));
+    }
+    FeatureToBytes (encoding, feature, dims, half.data ());
+
+    return Base64Encode (half.data (), bytes, dst);
+}
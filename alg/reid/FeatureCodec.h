@@ -0,0 +1,64 @@
+/*
+ * @Description: Encodings of the ReID features published with the results.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-08 10:26:14
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-08 10:26:14
+ */
+
+#ifndef __TS_FEATURE_CODEC_H__
+#define __TS_FEATURE_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * How "feature" of a detection is published. Text is the decimal floats
+ * separated by spaces, as always. The base64 encodings carry the raw
+ * little-endian fp32 or IEEE fp16 values as a string in the json, the blob
+ * encodings append them to TsJsonObject::GetFeatureData and the json only
+ * holds "feature-offset", the byte offset of the detection's feature.
+ */
+typedef enum _FeatureEncoding {
+    FEATURE_ENCODING_TEXT,
+    FEATURE_ENCODING_BASE64_FP32,
+    FEATURE_ENCODING_BASE64_FP16,
+    FEATURE_ENCODING_BLOB_FP32,
+    FEATURE_ENCODING_BLOB_FP16
+} FeatureEncoding;
+
+// "text", "base64-fp32", "base64-fp16", "blob-fp32" or "blob-fp16"
+FeatureEncoding StringToFeatureEncoding (const std::string& encoding);
+const char*     FeatureEncodingName     (FeatureEncoding encoding);
+
+// raw bytes of one feature of dims in encoding, 0 for text
+size_t FeatureBytes  (FeatureEncoding encoding, size_t dims);
+// little-endian fp32 or fp16 values of feature into dst of FeatureBytes
+void   FeatureToBytes (FeatureEncoding encoding, const float* feature,
+                       size_t dims, void* dst);
+
+// characters FeatureToText may write for a feature of dims, with the nul
+size_t FeatureTextSize (size_t dims);
+/*
+ * The features as the text encoding publishes them, "%g" of every value
+ * separated by spaces, into dst of FeatureTextSize, nul terminated, its
+ * length. Values from 1e-4 to 1e6 skip printf.
+ */
+size_t FeatureToText (const float* feature, size_t dims, char* dst);
+
+// characters of the padded base64 text of bytes, without the terminator
+size_t Base64Size    (size_t bytes);
+// base64 of src into dst of Base64Size + 1, nul terminated, its length
+size_t Base64Encode  (const void* src, size_t bytes, char* dst);
+
+/*
+ * The base64 text of feature in dst of Base64Size (FeatureBytes) + 1, its
+ * length. Nothing is allocated once the calling thread's fp16 scratch has
+ * grown to dims.
+ */
+size_t FeatureToBase64 (FeatureEncoding encoding, const float* feature,
+                        size_t dims, char* dst);
+
+#endif //__TS_FEATURE_CODEC_H__
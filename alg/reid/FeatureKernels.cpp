@@ -0,0 +1,811 @@
+/*
+ * @Description: Implement of SIMD feature kernels with runtime dispatch.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-18 10:12:05
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-18 10:12:05
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_KERNEL_X86 1
+#endif
+
+#include "FeatureKernels.h"
+
+/*----------------------------------scalar-----------------------------------*/
+static float dot_scalar (const float* a, const float* b, size_t dims)
+{
+    float s0 = 0.f, s1 = 0.f, s2 = 0.f, s3 = 0.f;
+    size_t i = 0;
+
+    for (; i + 4 <= dims; i += 4) {
+        s0 += a[i + 0] * b[i + 0];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < dims; i++) s0 += a[i] * b[i];
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+static void dot_rows_scalar (const float* q, const float* base, size_t rows,
+    size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        out[r] = dot_scalar (q, base + r * stride, dims);
+    }
+}
+
+static inline float half_to_float (uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t man  = h & 0x3ff;
+    uint32_t bits;
+
+    if (exp == 0) {
+        if (man == 0) {
+            bits = sign;
+        } else {
+            // subnormal, renormalize
+            exp = 127 - 15 + 1;
+            while (!(man & 0x400)) {
+                man <<= 1;
+                exp--;
+            }
+            bits = sign | (exp << 23) | ((man & 0x3ff) << 13);
+        }
+    } else if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (man << 13);
+    } else {
+        bits = sign | ((exp + 127 - 15) << 23) | (man << 13);
+    }
+
+    float f;
+    memcpy (&f, &bits, sizeof (f));
+    return f;
+}
+
+static inline uint16_t float_to_half (float f)
+{
+    uint32_t bits;
+    memcpy (&bits, &f, sizeof (bits));
+
+    uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000);
+    int32_t  exp  = (int32_t) ((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t man  = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (man ? 0x200 : 0);
+    }
+    if (exp >= 0x1f) return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        man |= 0x800000;
+        uint32_t shift = (uint32_t) (14 - exp);
+        uint32_t half  = man >> shift;
+        uint32_t rem   = man & ((1u << shift) - 1);
+        uint32_t mid   = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half++;
+        return sign | (uint16_t) half;
+    }
+
+    uint32_t half = ((uint32_t) exp << 10) | (man >> 13);
+    uint32_t rem  = man & 0x1fff;
+    // round to nearest even, a carry into the exponent is still correct
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++;
+    return sign | (uint16_t) half;
+}
+
+static void dot_rows_f16_scalar (const float* q, const uint16_t* base,
+    size_t rows, size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        const uint16_t* b = base + r * stride;
+        float s = 0.f;
+        for (size_t i = 0; i < dims; i++) s += q[i] * half_to_float (b[i]);
+        out[r] = s;
+    }
+}
+
+static void dot_rows_i8_scalar (const float* q, const int8_t* base,
+    const float* scales, size_t rows, size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        const int8_t* b = base + r * stride;
+        float s = 0.f;
+        for (size_t i = 0; i < dims; i++) s += q[i] * (float) b[i];
+        out[r] = s * scales[r];
+    }
+}
+
+/*
+ * The batched kernels walk the rows in blocks of about this many bytes, a
+ * block stays in L2 while every query of the batch passes over it.
+ */
+#define BATCH_BLOCK_BYTES (128 << 10)
+// rows of one register tile, every query load of the tile is reused as often
+#define BATCH_TILE_ROWS   4
+
+static size_t batch_row_block (size_t stride)
+{
+    size_t n = BATCH_BLOCK_BYTES / (stride * sizeof (float));
+
+    return std::max<size_t> (BATCH_TILE_ROWS, n / BATCH_TILE_ROWS *
+        BATCH_TILE_ROWS);
+}
+
+static void dot_batch_scalar (const float* const* q, size_t nq,
+    const float* base, size_t rows, size_t dims, size_t stride, float* out,
+    size_t ldo)
+{
+    size_t block = batch_row_block (stride);
+
+    for (size_t r0 = 0; r0 < rows; r0 += block) {
+        size_t nr = std::min (block, rows - r0);
+        for (size_t j = 0; j < nq; j++) {
+            dot_rows_scalar (q[j], base + r0 * stride, nr, dims, stride,
+                out + j * ldo + r0);
+        }
+    }
+}
+
+#ifdef TS_KERNEL_X86
+/*-----------------------------------avx2------------------------------------*/
+__attribute__((target("avx2,fma")))
+static inline float hsum256 (__m256 v)
+{
+    __m128 lo = _mm256_castps256_ps128 (v);
+    __m128 hi = _mm256_extractf128_ps (v, 1);
+    lo = _mm_add_ps (lo, hi);
+    lo = _mm_add_ps (lo, _mm_movehl_ps (lo, lo));
+    lo = _mm_add_ss (lo, _mm_shuffle_ps (lo, lo, 0x1));
+    return _mm_cvtss_f32 (lo);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2 (const float* a, const float* b, size_t dims)
+{
+    __m256 acc0 = _mm256_setzero_ps ();
+    __m256 acc1 = _mm256_setzero_ps ();
+    size_t i = 0;
+
+    for (; i + 16 <= dims; i += 16) {
+        acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i),
+            _mm256_loadu_ps (b + i), acc0);
+        acc1 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i + 8),
+            _mm256_loadu_ps (b + i + 8), acc1);
+    }
+    for (; i + 8 <= dims; i += 8) {
+        acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i),
+            _mm256_loadu_ps (b + i), acc0);
+    }
+
+    float s = hsum256 (_mm256_add_ps (acc0, acc1));
+    for (; i < dims; i++) s += a[i] * b[i];
+
+    return s;
+}
+
+// four rows per pass so every query load is reused four times
+__attribute__((target("avx2,fma")))
+static void dot_rows_avx2 (const float* q, const float* base, size_t rows,
+    size_t dims, size_t stride, float* out)
+{
+    size_t r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        const float* b0 = base + (r + 0) * stride;
+        const float* b1 = base + (r + 1) * stride;
+        const float* b2 = base + (r + 2) * stride;
+        const float* b3 = base + (r + 3) * stride;
+        __m256 a0 = _mm256_setzero_ps (), a1 = _mm256_setzero_ps ();
+        __m256 a2 = _mm256_setzero_ps (), a3 = _mm256_setzero_ps ();
+        size_t i = 0;
+
+        for (; i + 8 <= dims; i += 8) {
+            __m256 v = _mm256_loadu_ps (q + i);
+            a0 = _mm256_fmadd_ps (v, _mm256_loadu_ps (b0 + i), a0);
+            a1 = _mm256_fmadd_ps (v, _mm256_loadu_ps (b1 + i), a1);
+            a2 = _mm256_fmadd_ps (v, _mm256_loadu_ps (b2 + i), a2);
+            a3 = _mm256_fmadd_ps (v, _mm256_loadu_ps (b3 + i), a3);
+        }
+
+        float s0 = hsum256 (a0), s1 = hsum256 (a1);
+        float s2 = hsum256 (a2), s3 = hsum256 (a3);
+        for (; i < dims; i++) {
+            s0 += q[i] * b0[i];
+            s1 += q[i] * b1[i];
+            s2 += q[i] * b2[i];
+            s3 += q[i] * b3[i];
+        }
+
+        out[r + 0] = s0;
+        out[r + 1] = s1;
+        out[r + 2] = s2;
+        out[r + 3] = s3;
+    }
+
+    for (; r < rows; r++) {
+        out[r] = dot_avx2 (q, base + r * stride, dims);
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void dot_rows_f16_avx2 (const float* q, const uint16_t* base,
+    size_t rows, size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        const uint16_t* b = base + r * stride;
+        __m256 acc0 = _mm256_setzero_ps ();
+        __m256 acc1 = _mm256_setzero_ps ();
+        size_t i = 0;
+
+        for (; i + 16 <= dims; i += 16) {
+            __m256 h0 = _mm256_cvtph_ps (
+                _mm_loadu_si128 ((const __m128i*) (b + i)));
+            __m256 h1 = _mm256_cvtph_ps (
+                _mm_loadu_si128 ((const __m128i*) (b + i + 8)));
+            acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (q + i), h0, acc0);
+            acc1 = _mm256_fmadd_ps (_mm256_loadu_ps (q + i + 8), h1, acc1);
+        }
+        for (; i + 8 <= dims; i += 8) {
+            __m256 h0 = _mm256_cvtph_ps (
+                _mm_loadu_si128 ((const __m128i*) (b + i)));
+            acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (q + i), h0, acc0);
+        }
+
+        float s = hsum256 (_mm256_add_ps (acc0, acc1));
+        for (; i < dims; i++) s += q[i] * half_to_float (b[i]);
+        out[r] = s;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void dot_rows_i8_avx2 (const float* q, const int8_t* base,
+    const float* scales, size_t rows, size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        const int8_t* b = base + r * stride;
+        __m256 acc0 = _mm256_setzero_ps ();
+        __m256 acc1 = _mm256_setzero_ps ();
+        size_t i = 0;
+
+        for (; i + 16 <= dims; i += 16) {
+            __m128i c  = _mm_loadu_si128 ((const __m128i*) (b + i));
+            __m256  c0 = _mm256_cvtepi32_ps (_mm256_cvtepi8_epi32 (c));
+            __m256  c1 = _mm256_cvtepi32_ps (_mm256_cvtepi8_epi32 (
+                _mm_srli_si128 (c, 8)));
+            acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (q + i), c0, acc0);
+            acc1 = _mm256_fmadd_ps (_mm256_loadu_ps (q + i + 8), c1, acc1);
+        }
+
+        float s = hsum256 (_mm256_add_ps (acc0, acc1));
+        for (; i < dims; i++) s += q[i] * (float) b[i];
+        out[r] = s * scales[r];
+    }
+}
+
+__attribute__((target("avx2,f16c")))
+static void encode_f16_avx2 (const float* src, uint16_t* dst, size_t n)
+{
+    size_t i = 0;
+
+    // round to nearest even, as float_to_half
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128 ((__m128i*) (dst + i), _mm256_cvtps_ph (
+            _mm256_loadu_ps (src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; i++) dst[i] = float_to_half (src[i]);
+}
+
+__attribute__((target("avx2,f16c")))
+static void decode_f16_avx2 (const uint16_t* src, float* dst, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps (dst + i, _mm256_cvtph_ps (
+            _mm_loadu_si128 ((const __m128i*) (src + i))));
+    }
+    for (; i < n; i++) dst[i] = half_to_float (src[i]);
+}
+
+// queries of one avx2 tile: 12 accumulators and 3 query loads in 16 ymm
+#define AVX2_TILE_QUERIES 3
+
+__attribute__((target("avx2,fma")))
+static void dot_tile_avx2 (const float* const* q, const float* b,
+    size_t dims, size_t stride, float* out, size_t ldo)
+{
+    __m256 acc[AVX2_TILE_QUERIES][BATCH_TILE_ROWS];
+    size_t i = 0;
+
+    for (size_t j = 0; j < AVX2_TILE_QUERIES; j++) {
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            acc[j][r] = _mm256_setzero_ps ();
+        }
+    }
+
+    for (; i + 8 <= dims; i += 8) {
+        __m256 v[AVX2_TILE_QUERIES];
+        for (size_t j = 0; j < AVX2_TILE_QUERIES; j++) {
+            v[j] = _mm256_loadu_ps (q[j] + i);
+        }
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            __m256 x = _mm256_loadu_ps (b + r * stride + i);
+            for (size_t j = 0; j < AVX2_TILE_QUERIES; j++) {
+                acc[j][r] = _mm256_fmadd_ps (v[j], x, acc[j][r]);
+            }
+        }
+    }
+
+    for (size_t j = 0; j < AVX2_TILE_QUERIES; j++) {
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            float s = hsum256 (acc[j][r]);
+            for (size_t t = i; t < dims; t++) s += q[j][t] * b[r * stride + t];
+            out[j * ldo + r] = s;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void dot_batch_avx2 (const float* const* q, size_t nq,
+    const float* base, size_t rows, size_t dims, size_t stride, float* out,
+    size_t ldo)
+{
+    size_t block = batch_row_block (stride);
+
+    for (size_t r0 = 0; r0 < rows; r0 += block) {
+        size_t nr = std::min (block, rows - r0);
+        const float* rb = base + r0 * stride;
+        size_t j = 0;
+
+        for (; j + AVX2_TILE_QUERIES <= nq; j += AVX2_TILE_QUERIES) {
+            size_t r = 0;
+            for (; r + BATCH_TILE_ROWS <= nr; r += BATCH_TILE_ROWS) {
+                dot_tile_avx2 (q + j, rb + r * stride, dims, stride,
+                    out + j * ldo + r0 + r, ldo);
+            }
+            for (; r < nr; r++) {
+                for (size_t t = 0; t < AVX2_TILE_QUERIES; t++) {
+                    out[(j + t) * ldo + r0 + r] =
+                        dot_avx2 (q[j + t], rb + r * stride, dims);
+                }
+            }
+        }
+
+        for (; j < nq; j++) {
+            dot_rows_avx2 (q[j], rb, nr, dims, stride, out + j * ldo + r0);
+        }
+    }
+}
+
+/*----------------------------------avx512-----------------------------------*/
+// gcc flags the undefined upper lanes inside its own avx512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static float dot_avx512 (const float* a, const float* b, size_t dims)
+{
+    __m512 acc0 = _mm512_setzero_ps ();
+    __m512 acc1 = _mm512_setzero_ps ();
+    size_t i = 0;
+
+    for (; i + 32 <= dims; i += 32) {
+        acc0 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i),
+            _mm512_loadu_ps (b + i), acc0);
+        acc1 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i + 16),
+            _mm512_loadu_ps (b + i + 16), acc1);
+    }
+    for (; i + 16 <= dims; i += 16) {
+        acc0 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i),
+            _mm512_loadu_ps (b + i), acc0);
+    }
+    if (i < dims) {
+        __mmask16 m = (__mmask16)((1u << (dims - i)) - 1);
+        acc1 = _mm512_fmadd_ps (_mm512_maskz_loadu_ps (m, a + i),
+            _mm512_maskz_loadu_ps (m, b + i), acc1);
+    }
+
+    return _mm512_reduce_add_ps (_mm512_add_ps (acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static void dot_rows_avx512 (const float* q, const float* base, size_t rows,
+    size_t dims, size_t stride, float* out)
+{
+    size_t r = 0;
+    size_t tail = dims % 16;
+    __mmask16 m = (__mmask16)((1u << tail) - 1);
+
+    for (; r + 4 <= rows; r += 4) {
+        const float* b0 = base + (r + 0) * stride;
+        const float* b1 = base + (r + 1) * stride;
+        const float* b2 = base + (r + 2) * stride;
+        const float* b3 = base + (r + 3) * stride;
+        __m512 a0 = _mm512_setzero_ps (), a1 = _mm512_setzero_ps ();
+        __m512 a2 = _mm512_setzero_ps (), a3 = _mm512_setzero_ps ();
+        size_t i = 0;
+
+        for (; i + 16 <= dims; i += 16) {
+            __m512 v = _mm512_loadu_ps (q + i);
+            a0 = _mm512_fmadd_ps (v, _mm512_loadu_ps (b0 + i), a0);
+            a1 = _mm512_fmadd_ps (v, _mm512_loadu_ps (b1 + i), a1);
+            a2 = _mm512_fmadd_ps (v, _mm512_loadu_ps (b2 + i), a2);
+            a3 = _mm512_fmadd_ps (v, _mm512_loadu_ps (b3 + i), a3);
+        }
+        if (tail) {
+            __m512 v = _mm512_maskz_loadu_ps (m, q + i);
+            a0 = _mm512_fmadd_ps (v, _mm512_maskz_loadu_ps (m, b0 + i), a0);
+            a1 = _mm512_fmadd_ps (v, _mm512_maskz_loadu_ps (m, b1 + i), a1);
+            a2 = _mm512_fmadd_ps (v, _mm512_maskz_loadu_ps (m, b2 + i), a2);
+            a3 = _mm512_fmadd_ps (v, _mm512_maskz_loadu_ps (m, b3 + i), a3);
+        }
+
+        out[r + 0] = _mm512_reduce_add_ps (a0);
+        out[r + 1] = _mm512_reduce_add_ps (a1);
+        out[r + 2] = _mm512_reduce_add_ps (a2);
+        out[r + 3] = _mm512_reduce_add_ps (a3);
+    }
+
+    for (; r < rows; r++) {
+        out[r] = dot_avx512 (q, base + r * stride, dims);
+    }
+}
+__attribute__((target("avx512f")))
+static void dot_rows_f16_avx512 (const float* q, const uint16_t* base,
+    size_t rows, size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        const uint16_t* b = base + r * stride;
+        __m512 acc = _mm512_setzero_ps ();
+        size_t i = 0;
+
+        for (; i + 16 <= dims; i += 16) {
+            __m512 h = _mm512_cvtph_ps (
+                _mm256_loadu_si256 ((const __m256i*) (b + i)));
+            acc = _mm512_fmadd_ps (_mm512_loadu_ps (q + i), h, acc);
+        }
+
+        float s = _mm512_reduce_add_ps (acc);
+        for (; i < dims; i++) s += q[i] * half_to_float (b[i]);
+        out[r] = s;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void dot_rows_i8_avx512 (const float* q, const int8_t* base,
+    const float* scales, size_t rows, size_t dims, size_t stride, float* out)
+{
+    for (size_t r = 0; r < rows; r++) {
+        const int8_t* b = base + r * stride;
+        __m512 acc = _mm512_setzero_ps ();
+        size_t i = 0;
+
+        for (; i + 16 <= dims; i += 16) {
+            __m512 c = _mm512_cvtepi32_ps (_mm512_cvtepi8_epi32 (
+                _mm_loadu_si128 ((const __m128i*) (b + i))));
+            acc = _mm512_fmadd_ps (_mm512_loadu_ps (q + i), c, acc);
+        }
+
+        float s = _mm512_reduce_add_ps (acc);
+        for (; i < dims; i++) s += q[i] * (float) b[i];
+        out[r] = s * scales[r];
+    }
+}
+
+// queries of one avx512 tile: 16 accumulators and 4 query loads in 32 zmm
+#define AVX512_TILE_QUERIES 4
+
+__attribute__((target("avx512f")))
+static void dot_tile_avx512 (const float* const* q, const float* b,
+    size_t dims, size_t stride, float* out, size_t ldo)
+{
+    __m512 acc[AVX512_TILE_QUERIES][BATCH_TILE_ROWS];
+    size_t tail = dims % 16;
+    __mmask16 m = (__mmask16)((1u << tail) - 1);
+    size_t i = 0;
+
+    for (size_t j = 0; j < AVX512_TILE_QUERIES; j++) {
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            acc[j][r] = _mm512_setzero_ps ();
+        }
+    }
+
+    for (; i + 16 <= dims; i += 16) {
+        __m512 v[AVX512_TILE_QUERIES];
+        for (size_t j = 0; j < AVX512_TILE_QUERIES; j++) {
+            v[j] = _mm512_loadu_ps (q[j] + i);
+        }
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            __m512 x = _mm512_loadu_ps (b + r * stride + i);
+            for (size_t j = 0; j < AVX512_TILE_QUERIES; j++) {
+                acc[j][r] = _mm512_fmadd_ps (v[j], x, acc[j][r]);
+            }
+        }
+    }
+    if (tail) {
+        __m512 v[AVX512_TILE_QUERIES];
+        for (size_t j = 0; j < AVX512_TILE_QUERIES; j++) {
+            v[j] = _mm512_maskz_loadu_ps (m, q[j] + i);
+        }
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            __m512 x = _mm512_maskz_loadu_ps (m, b + r * stride + i);
+            for (size_t j = 0; j < AVX512_TILE_QUERIES; j++) {
+                acc[j][r] = _mm512_fmadd_ps (v[j], x, acc[j][r]);
+            }
+        }
+    }
+
+    for (size_t j = 0; j < AVX512_TILE_QUERIES; j++) {
+        for (size_t r = 0; r < BATCH_TILE_ROWS; r++) {
+            out[j * ldo + r] = _mm512_reduce_add_ps (acc[j][r]);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void dot_batch_avx512 (const float* const* q, size_t nq,
+    const float* base, size_t rows, size_t dims, size_t stride, float* out,
+    size_t ldo)
+{
+    size_t block = batch_row_block (stride);
+
+    for (size_t r0 = 0; r0 < rows; r0 += block) {
+        size_t nr = std::min (block, rows - r0);
+        const float* rb = base + r0 * stride;
+        size_t j = 0;
+
+        for (; j + AVX512_TILE_QUERIES <= nq; j += AVX512_TILE_QUERIES) {
+            size_t r = 0;
+            for (; r + BATCH_TILE_ROWS <= nr; r += BATCH_TILE_ROWS) {
+                dot_tile_avx512 (q + j, rb + r * stride, dims, stride,
+                    out + j * ldo + r0 + r, ldo);
+            }
+            for (; r < nr; r++) {
+                for (size_t t = 0; t < AVX512_TILE_QUERIES; t++) {
+                    out[(j + t) * ldo + r0 + r] =
+                        dot_avx512 (q[j + t], rb + r * stride, dims);
+                }
+            }
+        }
+
+        for (; j < nq; j++) {
+            dot_rows_avx512 (q[j], rb, nr, dims, stride, out + j * ldo + r0);
+        }
+    }
+}
+
+#pragma GCC diagnostic pop
+#endif //TS_KERNEL_X86
+
+/*---------------------------------dispatch----------------------------------*/
+static KernelIsa detect_isa (void)
+{
+#ifdef TS_KERNEL_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx512f")) return KERNEL_ISA_AVX512;
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma") &&
+        __builtin_cpu_supports ("f16c"))
+        return KERNEL_ISA_AVX2;
+#endif
+    return KERNEL_ISA_SCALAR;
+}
+
+static KernelIsa supported_isa (void)
+{
+    static const KernelIsa isa = detect_isa ();
+    return isa;
+}
+
+static std::atomic<int> g_isa { -1 };
+
+static KernelIsa current_isa (void)
+{
+    int isa = g_isa.load (std::memory_order_relaxed);
+    if (isa < 0) {
+        isa = (int) supported_isa ();
+        g_isa.store (isa, std::memory_order_relaxed);
+    }
+    return (KernelIsa) isa;
+}
+
+size_t FeatureStride (size_t dims)
+{
+    return (dims + TS_FEATURE_ALIGN_FLOATS - 1) /
+        TS_FEATURE_ALIGN_FLOATS * TS_FEATURE_ALIGN_FLOATS;
+}
+
+float* FeatureAlloc (size_t floats)
+{
+    void* ptr = NULL;
+    size_t bytes = floats * sizeof (float);
+
+    if (bytes == 0) bytes = TS_FEATURE_ALIGN_BYTES;
+    if (posix_memalign (&ptr, TS_FEATURE_ALIGN_BYTES, bytes)) {
+        return NULL;
+    }
+
+    return (float*) ptr;
+}
+
+void FeatureFree (void* ptr)
+{
+    free (ptr);
+}
+
+float L2Normalize (float* v, size_t dims)
+{
+    float norm = sqrtf (DotProduct (v, v, dims));
+
+    if (norm > 1e-12f) {
+        float inv = 1.f / norm;
+        for (size_t i = 0; i < dims; i++) v[i] *= inv;
+    }
+
+    return norm;
+}
+
+float DotProduct (const float* a, const float* b, size_t dims)
+{
+    switch (current_isa ()) {
+#ifdef TS_KERNEL_X86
+    case KERNEL_ISA_AVX512: return dot_avx512 (a, b, dims);
+    case KERNEL_ISA_AVX2:   return dot_avx2   (a, b, dims);
+#endif
+    default:                return dot_scalar (a, b, dims);
+    }
+}
+
+void DotProductRows (const float* q, const float* base, size_t rows,
+    size_t dims, size_t stride, float* out)
+{
+    switch (current_isa ()) {
+#ifdef TS_KERNEL_X86
+    case KERNEL_ISA_AVX512:
+        dot_rows_avx512 (q, base, rows, dims, stride, out);
+        break;
+    case KERNEL_ISA_AVX2:
+        dot_rows_avx2   (q, base, rows, dims, stride, out);
+        break;
+#endif
+    default:
+        dot_rows_scalar (q, base, rows, dims, stride, out);
+        break;
+    }
+}
+
+void DotProductBatch (const float* const* q, size_t nq, const float* base,
+    size_t rows, size_t dims, size_t stride, float* out, size_t ldo)
+{
+    switch (current_isa ()) {
+#ifdef TS_KERNEL_X86
+    case KERNEL_ISA_AVX512:
+        dot_batch_avx512 (q, nq, base, rows, dims, stride, out, ldo);
+        break;
+    case KERNEL_ISA_AVX2:
+        dot_batch_avx2   (q, nq, base, rows, dims, stride, out, ldo);
+        break;
+#endif
+    default:
+        dot_batch_scalar (q, nq, base, rows, dims, stride, out, ldo);
+        break;
+    }
+}
+
+void DotProductRowsF16 (const float* q, const uint16_t* base, size_t rows,
+    size_t dims, size_t stride, float* out)
+{
+    switch (current_isa ()) {
+#ifdef TS_KERNEL_X86
+    case KERNEL_ISA_AVX512:
+        dot_rows_f16_avx512 (q, base, rows, dims, stride, out);
+        break;
+    case KERNEL_ISA_AVX2:
+        dot_rows_f16_avx2   (q, base, rows, dims, stride, out);
+        break;
+#endif
+    default:
+        dot_rows_f16_scalar (q, base, rows, dims, stride, out);
+        break;
+    }
+}
+
+void DotProductRowsI8 (const float* q, const int8_t* base,
+    const float* scales, size_t rows, size_t dims, size_t stride, float* out)
+{
+    switch (current_isa ()) {
+#ifdef TS_KERNEL_X86
+    case KERNEL_ISA_AVX512:
+        dot_rows_i8_avx512 (q, base, scales, rows, dims, stride, out);
+        break;
+    case KERNEL_ISA_AVX2:
+        dot_rows_i8_avx2   (q, base, scales, rows, dims, stride, out);
+        break;
+#endif
+    default:
+        dot_rows_i8_scalar (q, base, scales, rows, dims, stride, out);
+        break;
+    }
+}
+
+void EncodeF16 (const float* src, uint16_t* dst, size_t n)
+{
+#ifdef TS_KERNEL_X86
+    // every published feature passes through here in the fp16 encodings
+    if (current_isa () != KERNEL_ISA_SCALAR) {
+        encode_f16_avx2 (src, dst, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) dst[i] = float_to_half (src[i]);
+}
+
+void DecodeF16 (const uint16_t* src, float* dst, size_t n)
+{
+#ifdef TS_KERNEL_X86
+    // batched searches widen whole blocks of rows through here
+    if (current_isa () != KERNEL_ISA_SCALAR) {
+        decode_f16_avx2 (src, dst, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) dst[i] = half_to_float (src[i]);
+}
+
+float EncodeI8 (const float* src, int8_t* dst, size_t n)
+{
+    float amax = 0.f;
+
+    for (size_t i = 0; i < n; i++) amax = std::max (amax, fabsf (src[i]));
+    if (amax == 0.f) {
+        memset (dst, 0, n);
+        return 0.f;
+    }
+
+    float scale = amax / 127.f;
+    float inv   = 127.f / amax;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (int8_t) lrintf (src[i] * inv);
+    }
+
+    return scale;
+}
+
+void DecodeI8 (const int8_t* src, float scale, float* dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dst[i] = src[i] * scale;
+}
+
+KernelIsa GetKernelIsa (void)
+{
+    return current_isa ();
+}
+
+void SetKernelIsa (KernelIsa isa)
+{
+    // never select an instruction set the cpu does not have
+    if ((int) isa > (int) supported_isa ()) isa = supported_isa ();
+    g_isa.store ((int) isa, std::memory_order_relaxed);
+}
+
+const char* KernelIsaName (KernelIsa isa)
+{
+    switch (isa) {
+    case KERNEL_ISA_AVX512: return "avx512";
+    case KERNEL_ISA_AVX2:   return "avx2";
+    default:                return "scalar";
+    }
+}
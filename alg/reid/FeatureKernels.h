@@ -0,0 +1,98 @@
+/*
+ * @Description: SIMD feature kernels used by the in-process ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-18 10:12:05
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-18 10:12:05
+ */
+
+#ifndef __TS_FEATURE_KERNELS_H__
+#define __TS_FEATURE_KERNELS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every row of a gallery matrix is padded to a multiple of this many floats,
+ * so a row always starts on a 64-byte (one cache line, one zmm) boundary.
+ */
+#define TS_FEATURE_ALIGN_FLOATS 16
+#define TS_FEATURE_ALIGN_BYTES  64
+
+typedef enum _KernelIsa {
+    KERNEL_ISA_SCALAR,
+    KERNEL_ISA_AVX2,
+    KERNEL_ISA_AVX512
+} KernelIsa;
+
+// rows padded up to TS_FEATURE_ALIGN_FLOATS
+size_t FeatureStride (size_t dims);
+
+// 64-byte aligned allocation, release with FeatureFree
+float* FeatureAlloc (size_t floats);
+void   FeatureFree  (void* ptr);
+
+// scales v in place to unit length, returns the original norm
+float  L2Normalize  (float* v, size_t dims);
+
+// <a, b> using the best kernel the running cpu supports
+float  DotProduct   (const float* a, const float* b, size_t dims);
+
+// out[i] = <q, base + i * stride> for i in [0, rows)
+void   DotProductRows (
+    const float* q,
+    const float* base,
+    size_t       rows,
+    size_t       dims,
+    size_t       stride,
+    float*       out);
+
+/*
+ * out[j * ldo + i] = <q[j], base + i * stride> for nq queries, a small
+ * GEMM: blocks of rows stay in cache while every query passes over them
+ * and each loaded row element feeds a tile of queries.
+ */
+void   DotProductBatch (
+    const float* const* q,
+    size_t       nq,
+    const float* base,
+    size_t       rows,
+    size_t       dims,
+    size_t       stride,
+    float*       out,
+    size_t       ldo);
+
+/*
+ * Compressed rows. fp16 rows hold IEEE half floats, int8 rows hold
+ * round(x / scale) with one scale per row chosen so max|x| maps to 127.
+ * Both are widened to fp32 in registers and scored against a fp32 query.
+ */
+void   DotProductRowsF16 (
+    const float*    q,
+    const uint16_t* base,
+    size_t          rows,
+    size_t          dims,
+    size_t          stride,
+    float*          out);
+
+void   DotProductRowsI8 (
+    const float*    q,
+    const int8_t*   base,
+    const float*    scales,
+    size_t          rows,
+    size_t          dims,
+    size_t          stride,
+    float*          out);
+
+void   EncodeF16 (const float* src, uint16_t* dst, size_t n);
+void   DecodeF16 (const uint16_t* src, float* dst, size_t n);
+float  EncodeI8  (const float* src, int8_t* dst, size_t n);
+void   DecodeI8  (const int8_t* src, float scale, float* dst, size_t n);
+
+// selected once on first use from cpuid; "gallery-isa" may cap it
+KernelIsa   GetKernelIsa (void);
+void        SetKernelIsa (KernelIsa isa);
+const char* KernelIsaName (KernelIsa isa);
+
+#endif //__TS_FEATURE_KERNELS_H__
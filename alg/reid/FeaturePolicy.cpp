@@ -0,0 +1,162 @@
+/*
+ * @Description: Implement of the feature payload policy.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-10 09:41:36
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-10 09:41:36
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include "Common.h"
+#include "FeaturePolicy.h"
+
+FeaturePayload StringToFeaturePayload (const std::string& payload)
+{
+    std::string p (payload);
+    std::transform(p.begin(), p.end(), p.begin(),
+        [](unsigned char ch){ return tolower(ch); }
+    );
+
+    if (0 == p.compare("never")) {
+        return FEATURE_PAYLOAD_NEVER;
+    } else if (0 == p.compare("first-seen-per-identity")) {
+        return FEATURE_PAYLOAD_FIRST_SEEN;
+    } else if (0 == p.compare("on-identity-change")) {
+        return FEATURE_PAYLOAD_ON_CHANGE;
+    } else {
+        return FEATURE_PAYLOAD_ALWAYS;
+    }
+}
+
+const char* FeaturePayloadName (FeaturePayload payload)
+{
+    switch (payload) {
+    case FEATURE_PAYLOAD_NEVER:      return "never";
+    case FEATURE_PAYLOAD_FIRST_SEEN: return "first-seen-per-identity";
+    case FEATURE_PAYLOAD_ON_CHANGE:  return "on-identity-change";
+    default:                         return "always";
+    }
+}
+
+FeaturePolicy::FeaturePolicy (FeaturePayload payload, size_t capacity)
+    : payload_ (payload), capacity_ (std::max<size_t> (capacity, 1))
+{
+    last_report_ = Now ();
+}
+
+int64_t FeaturePolicy::Now (void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+bool FeaturePolicy::Publish (int64_t camera_id, int64_t trace_id,
+    int64_t object_id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    bool publish = false;
+
+    // no identity to remember, every detection the gallery refused is new
+    if (object_id < 0) {
+        publish = payload_ != FEATURE_PAYLOAD_NEVER;
+        if (!publish) stats_.skipped_ ++;
+        return publish;
+    }
+
+    switch (payload_) {
+    case FEATURE_PAYLOAD_NEVER:
+        break;
+    case FEATURE_PAYLOAD_FIRST_SEEN:
+        if (!(publish = seen_.insert (object_id).second)) break;
+        seen_order_.push_back (object_id);
+        if (seen_order_.size () > capacity_) {
+            seen_.erase (seen_order_.front ());
+            seen_order_.pop_front ();
+        }
+        break;
+    case FEATURE_PAYLOAD_ON_CHANGE: {
+        TrackKey key (camera_id, trace_id);
+        auto it = traces_.find (key);
+        if (it != traces_.end ()) {
+            publish = it->second != object_id;
+            it->second = object_id;
+            break;
+        }
+
+        publish = true;
+        traces_.emplace (key, object_id);
+        trace_order_.push_back (key);
+        if (trace_order_.size () > capacity_) {
+            traces_.erase (trace_order_.front ());
+            trace_order_.pop_front ();
+        }
+        break;
+    }
+    default:
+        publish = true;
+        break;
+    }
+
+    if (!publish) stats_.skipped_ ++;
+    return publish;
+}
+
+bool FeaturePolicy::Sample (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return stats_.skipped_ % FEATURE_PAYLOAD_SAMPLE == 1;
+}
+
+void FeaturePolicy::Account (bool published, size_t bytes, double us)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (published) {
+        stats_.published_ ++;
+        stats_.bytes_     += bytes;
+        stats_.encode_us_ += us;
+    } else {
+        stats_.sampled_ ++;
+        stats_.sample_bytes_ += bytes;
+        stats_.sample_us_    += us;
+    }
+
+    int64_t now = Now ();
+    if (now - last_report_ >= FEATURE_PAYLOAD_REPORT_SEC * 1000) {
+        last_report_ = now;
+        Print ();
+    }
+}
+
+FeaturePayloadStats FeaturePolicy::Stats (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return stats_;
+}
+
+void FeaturePolicy::PrintStats (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    Print ();
+}
+
+void FeaturePolicy::Print (void)
+{
+    const FeaturePayloadStats& s = stats_;
+    uint64_t encoded = s.published_ + s.sampled_;
+    double   bytes   = encoded ? (double) (s.bytes_ + s.sample_bytes_) /
+        encoded : 0.0;
+    double   us      = encoded ? (s.encode_us_ + s.sample_us_) / encoded : 0.0;
+
+    TS_INFO_MSG_V ("feature payload %s: published:%lu (%lu bytes, %.1f ms), "
+        "skipped:%lu, saved ~%.0f bytes and ~%.1f ms of encoding",
+        FeaturePayloadName (payload_), s.published_, s.bytes_,
+        s.encode_us_ / 1000.0, s.skipped_, bytes * s.skipped_,
+        us * s.skipped_ / 1000.0);
+}
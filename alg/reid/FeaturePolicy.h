@@ -0,0 +1,98 @@
+/*
+ * @Description: Which published detections carry their ReID feature.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-10 09:41:36
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-10 09:41:36
+ */
+
+#ifndef __TS_FEATURE_POLICY_H__
+#define __TS_FEATURE_POLICY_H__
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// one skipped feature in this many is encoded anyway to price the rest
+#define FEATURE_PAYLOAD_SAMPLE     1024
+// seconds between two reports of what the policy saved
+#define FEATURE_PAYLOAD_REPORT_SEC 60
+
+typedef enum _FeaturePayload {
+    FEATURE_PAYLOAD_ALWAYS,
+    FEATURE_PAYLOAD_NEVER,
+    FEATURE_PAYLOAD_FIRST_SEEN,  // the first detection of every identity
+    FEATURE_PAYLOAD_ON_CHANGE    // a trace's first detection and id changes
+} FeaturePayload;
+
+// "always", "never", "first-seen-per-identity" or "on-identity-change"
+FeaturePayload StringToFeaturePayload (const std::string& payload);
+const char*    FeaturePayloadName     (FeaturePayload payload);
+
+typedef struct _FeaturePayloadStats {
+    uint64_t published_    { 0   };
+    uint64_t skipped_      { 0   };
+    uint64_t bytes_        { 0   };  // of the published features
+    double   encode_us_    { 0.0 };
+    uint64_t sampled_      { 0   };  // skipped ones encoded to price them
+    uint64_t sample_bytes_ { 0   };
+    double   sample_us_    { 0.0 };
+} FeaturePayloadStats;
+
+/*
+ * Decides per detection whether its feature goes out with the result, so
+ * the features nobody reads are never encoded. first-seen-per-identity
+ * remembers the object ids it published, on-identity-change the last id
+ * published for every (camera, trace id). Both forget the oldest entries
+ * past capacity, an identity or trace forgotten that way is published
+ * once more when it comes back. A detection without an object id is
+ * published unless the payload is never, and not remembered.
+ *
+ * The bytes and encoding time saved are estimated from the average of the
+ * features that were encoded, published or sampled.
+ */
+class FeaturePolicy
+{
+public:
+    FeaturePolicy (FeaturePayload payload, size_t capacity);
+
+    // true if the detection publishes its feature, remembered as published
+    bool   Publish  (int64_t camera_id, int64_t trace_id, int64_t object_id);
+    // true for one skipped feature in FEATURE_PAYLOAD_SAMPLE
+    bool   Sample   (void);
+    // an encoded feature of bytes that took us, published or sampled
+    void   Account  (bool published, size_t bytes, double us);
+
+    FeaturePayloadStats Stats (void);
+    void   PrintStats (void);
+
+private:
+    typedef std::pair<int64_t, int64_t> TrackKey;
+
+    struct TrackKeyHash {
+        size_t operator() (const TrackKey& k) const {
+            return std::hash<int64_t> () (k.first * 0x9e3779b97f4a7c15ULL ^
+                k.second);
+        }
+    };
+
+    void    Print (void);
+    int64_t Now   (void);
+
+private:
+    FeaturePayload      payload_     ;
+    size_t              capacity_    ;
+    std::mutex          mutex_       ;
+    FeaturePayloadStats stats_       {   };
+    int64_t             last_report_ { 0 };
+    std::unordered_set<int64_t>                          seen_   ;
+    std::deque<int64_t>                                  seen_order_  ;
+    std::unordered_map<TrackKey, int64_t, TrackKeyHash>  traces_ ;
+    std::deque<TrackKey>                                 trace_order_ ;
+};
+
+#endif //__TS_FEATURE_POLICY_H__
@@ -0,0 +1,440 @@
+/*
+ * @Description: Implement of the exact brute-force ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-18 11:02:46
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-18 11:02:46
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "FlatGallery.h"
+#include "GallerySnapshot.h"
+
+FlatGallery::~FlatGallery (void)
+{
+    Deinitialize ();
+}
+
+bool FlatGallery::Initialize (const GalleryConfig& config)
+{
+    if (config.dims_ <= 0 || config.max_elem_num_ <= 0) {
+        TS_ERR_MSG_V ("Invalid gallery shape (%d x %d)", config.max_elem_num_,
+            config.dims_);
+        return false;
+    }
+
+    Deinitialize ();
+
+    cfg_      = config;
+    dims_     = config.dims_;
+    stride_   = FeatureStride (dims_);
+    capacity_ = config.max_elem_num_;
+
+    switch (cfg_.storage_) {
+    case GalleryStorage::GALLERY_STORAGE_FP16: elem_ = sizeof (uint16_t); break;
+    case GalleryStorage::GALLERY_STORAGE_INT8: elem_ = sizeof (int8_t);   break;
+    default:                                   elem_ = sizeof (float);    break;
+    }
+
+    if (!Grow (std::min<size_t> (capacity_, FLAT_INITIAL_ROWS))) return false;
+
+    ids_.assign (capacity_, -1);
+    seqs_.assign (capacity_, 0);
+    scores_.assign (capacity_, 0.f);
+    if (cfg_.storage_ == GalleryStorage::GALLERY_STORAGE_INT8) {
+        scales_.assign (capacity_, 0.f);
+    }
+
+    return true;
+}
+
+void FlatGallery::Deinitialize (void)
+{
+    if (mapping_) {
+        munmap (mapping_, mapping_bytes_);
+        mapping_       = NULL;
+        mapping_bytes_ = 0;
+    } else if (matrix_) {
+        FeatureFree (matrix_);
+    }
+    matrix_ = NULL;
+
+    capacity_  = 0;
+    allocated_ = 0;
+    count_    = 0;
+    seq_      = 0;
+    ids_.clear ();
+    seqs_.clear ();
+    age_.clear ();
+    scales_.clear ();
+    scores_.clear ();
+    rows_.clear ();
+}
+
+size_t FlatGallery::Search (const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    if (!count_) return 0;
+
+    switch (cfg_.storage_) {
+    case GalleryStorage::GALLERY_STORAGE_FP16:
+        DotProductRowsF16 (feature, (const uint16_t*) matrix_, count_, dims_,
+            stride_, scores_.data ());
+        break;
+    case GalleryStorage::GALLERY_STORAGE_INT8:
+        DotProductRowsI8 (feature, (const int8_t*) matrix_, scales_.data (),
+            count_, dims_, stride_, scores_.data ());
+        break;
+    default:
+        DotProductRows (feature, (const float*) matrix_, count_, dims_,
+            stride_, scores_.data ());
+        break;
+    }
+
+    return SelectNearest (scores_.data (), ids_.data (), count_, k, matches);
+}
+
+void FlatGallery::SearchBatch (const float* const* features, size_t n,
+    size_t k, GalleryMatch* matches, size_t* found)
+{
+    if (n < 2 || !count_) {
+        GalleryInterface::SearchBatch (features, n, k, matches, found);
+        return;
+    }
+
+    size_t block = std::min<size_t> (count_, FLAT_BATCH_ROWS);
+    scores_.resize (std::max (capacity_, n * block));
+    std::fill (found, found + n, 0);
+
+    for (size_t r0 = 0; r0 < count_; r0 += block) {
+        size_t nr = std::min (block, count_ - r0);
+        const float* rows = (const float*) matrix_ + r0 * stride_;
+
+        // compressed rows are widened once per block, not once per query
+        if (cfg_.storage_ != GalleryStorage::GALLERY_STORAGE_FP32) {
+            batch_.resize (block * stride_);
+            for (size_t r = 0; r < nr; r++) {
+                GetRow (r0 + r, &batch_[r * stride_]);
+            }
+            rows = batch_.data ();
+        }
+
+        DotProductBatch (features, n, rows, nr, dims_, stride_,
+            scores_.data (), block);
+        for (size_t i = 0; i < n; i++) {
+            found[i] = MergeNearest (&scores_[i * block], &ids_[r0], nr, k,
+                matches + i * k, found[i]);
+        }
+    }
+}
+
+void FlatGallery::SearchBatchIds (const float* const* features, size_t n,
+    const int64_t* ids, size_t nids, size_t k, GalleryMatch* matches,
+    size_t* found)
+{
+    size_t block = FLAT_BATCH_ROWS;
+
+    batch_.resize (block * stride_);
+    batch_ids_.resize (block);
+    scores_.resize (std::max (capacity_, n * block));
+    std::fill (found, found + n, 0);
+
+    // candidates are scattered over the matrix, only they are gathered
+    for (size_t c = 0; c < nids; ) {
+        size_t nr = 0;
+        for (; c < nids && nr < block; c++) {
+            auto it = rows_.find (ids[c]);
+            if (it == rows_.end ()) continue;
+            GetRow (it->second, &batch_[nr * stride_]);
+            batch_ids_[nr++] = ids[c];
+        }
+        if (!nr) break;
+
+        DotProductBatch (features, n, batch_.data (), nr, dims_, stride_,
+            scores_.data (), block);
+        for (size_t i = 0; i < n; i++) {
+            found[i] = MergeNearest (&scores_[i * block], batch_ids_.data (),
+                nr, k, matches + i * k, found[i]);
+        }
+    }
+}
+
+bool FlatGallery::Add (int64_t id, const float* feature)
+{
+    size_t row;
+
+    if (!matrix_) return false;
+
+    if (count_ < capacity_) {
+        if (count_ == allocated_ && !Grow (count_ + 1)) return false;
+        row = count_++;
+    } else {
+        row = OldestRow ();
+        age_.pop_front ();
+        rows_.erase (ids_[row]);
+    }
+
+    char* dst = matrix_ + row * stride_ * elem_;
+    switch (cfg_.storage_) {
+    case GalleryStorage::GALLERY_STORAGE_FP16:
+        EncodeF16 (feature, (uint16_t*) dst, dims_);
+        break;
+    case GalleryStorage::GALLERY_STORAGE_INT8:
+        scales_[row] = EncodeI8 (feature, (int8_t*) dst, dims_);
+        break;
+    default:
+        memcpy (dst, feature, dims_ * sizeof (float));
+        break;
+    }
+    ids_[row]  = id;
+    rows_[id]  = row;
+    seqs_[row] = ++seq_;
+    age_.push_back (std::make_pair (seq_, id));
+
+    // removals leave entries behind, never more than the rows themselves
+    if (age_.size () > 2 * capacity_) {
+        std::vector<size_t> order;
+        AgeOrder (order);
+        age_.clear ();
+        for (auto&& r : order) age_.push_back (std::make_pair (seqs_[r], ids_[r]));
+    }
+
+    return true;
+}
+
+bool FlatGallery::Grow (size_t rows)
+{
+    if (rows <= allocated_) return true;
+
+    // an adopted snapshot mapping always spans the capacity
+    size_t n         = std::min (capacity_, std::max (rows, 2 * allocated_));
+    size_t row_bytes = stride_ * elem_;
+    size_t bytes     = n * row_bytes;
+    char*  matrix    = (char*) FeatureAlloc ((bytes + 3) / sizeof (float));
+    if (!matrix) {
+        TS_ERR_MSG_V ("Failed to allocate %ld bytes for the gallery", bytes);
+        return false;
+    }
+
+    // padding columns must stay zero, the kernels may read them
+    memset (matrix + count_ * row_bytes, 0, (n - count_) * row_bytes);
+    if (matrix_) {
+        memcpy (matrix, matrix_, count_ * row_bytes);
+        FeatureFree (matrix_);
+    }
+    matrix_    = matrix;
+    allocated_ = n;
+
+    return true;
+}
+
+size_t FlatGallery::OldestRow (void)
+{
+    for (;; age_.pop_front ()) {
+        auto it = rows_.find (age_.front ().second);
+        if (it != rows_.end () && seqs_[it->second] == age_.front ().first) {
+            return it->second;
+        }
+    }
+}
+
+void FlatGallery::AgeOrder (std::vector<size_t>& order)
+{
+    order.clear ();
+    order.reserve (count_);
+    for (auto&& a : age_) {
+        auto it = rows_.find (a.second);
+        if (it != rows_.end () && seqs_[it->second] == a.first) {
+            order.push_back (it->second);
+        }
+    }
+}
+
+void FlatGallery::ResetAge (size_t head)
+{
+    age_.clear ();
+    for (size_t i = 0; i < count_; i++) {
+        size_t row = (head + i) % count_;
+        seqs_[row] = ++seq_;
+        age_.push_back (std::make_pair (seq_, ids_[row]));
+    }
+}
+
+bool FlatGallery::Remove (int64_t id)
+{
+    auto it = rows_.find (id);
+    if (it == rows_.end ()) return false;
+
+    size_t row  = it->second;
+    size_t last = --count_;
+    size_t row_bytes = stride_ * elem_;
+    rows_.erase (it);
+
+    // keep rows dense, the scan covers [0, count_)
+    if (row != last) {
+        memcpy (matrix_ + row * row_bytes, matrix_ + last * row_bytes,
+            row_bytes);
+        ids_[row]  = ids_[last];
+        seqs_[row] = seqs_[last];
+        if (!scales_.empty ()) scales_[row] = scales_[last];
+        rows_[ids_[row]] = row;
+    }
+    ids_[last]  = -1;
+    seqs_[last] = 0;
+
+    return true;
+}
+
+void FlatGallery::GetRow (size_t i, float* out)
+{
+    const char* src = matrix_ + i * stride_ * elem_;
+
+    switch (cfg_.storage_) {
+    case GalleryStorage::GALLERY_STORAGE_FP16:
+        DecodeF16 ((const uint16_t*) src, out, dims_);
+        break;
+    case GalleryStorage::GALLERY_STORAGE_INT8:
+        DecodeI8 ((const int8_t*) src, scales_[i], out, dims_);
+        break;
+    default:
+        memcpy (out, src, dims_ * sizeof (float));
+        break;
+    }
+}
+
+size_t FlatGallery::Size (void)
+{
+    return count_;
+}
+
+size_t FlatGallery::MemoryBytes (void)
+{
+    return allocated_ * stride_ * elem_ + capacity_ * (sizeof (int64_t) +
+        sizeof (float) + sizeof (uint64_t)) + scales_.size () * sizeof (float) +
+        age_.size () * sizeof (age_[0]);
+}
+
+bool FlatGallery::SaveSnapshot (const std::string& path)
+{
+    GallerySnapshotHeader header;
+    std::vector<int64_t>  ids;
+    std::vector<float>    scales;
+    std::vector<char>     rows;
+    std::vector<size_t>   order;
+    size_t row_bytes = stride_ * elem_;
+
+    // copy under the lock, inserts are not held up by the disk, oldest
+    // first so a loader knows the age of every row
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+
+        if (!matrix_) return false;
+
+        AgeOrder (order);
+
+        header.storage_    = cfg_.storage_;
+        header.dims_       = dims_;
+        header.stride_     = stride_;
+        header.elem_bytes_ = elem_;
+        header.capacity_   = capacity_;
+        header.count_      = count_;
+        header.oldest_     = 0;
+        header.next_id_    = next_id_;
+        ids.assign (capacity_, -1);
+        scales.assign (scales_.size (), 0.f);
+        rows.resize (count_ * row_bytes);
+        for (size_t i = 0; i < order.size (); i++) {
+            ids[i] = ids_[order[i]];
+            if (!scales.empty ()) scales[i] = scales_[order[i]];
+            memcpy (&rows[i * row_bytes], matrix_ + order[i] * row_bytes,
+                row_bytes);
+        }
+    }
+    strncpy (header.gallery_, Name (), sizeof (header.gallery_) - 1);
+
+    return WriteGallerySnapshot (path, header, ids.data (),
+        scales.empty () ? NULL : scales.data (),
+        [&rows, row_bytes](size_t i) { return (const void*) &rows[i * row_bytes]; },
+        NULL);
+}
+
+bool FlatGallery::LoadSnapshot (const std::string& path)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    GallerySnapshot snapshot;
+
+    if (!matrix_ || !snapshot.Map (path)) return false;
+
+    const GallerySnapshotHeader* h = snapshot.Header ();
+    if (strcmp (h->gallery_, Name ()) || h->dims_ != dims_ ||
+        h->storage_ != (uint32_t) cfg_.storage_ || h->stride_ != stride_ ||
+        h->elem_bytes_ != elem_ || (elem_ == sizeof (int8_t) && !h->scales_offset_)) {
+        TS_WARN_MSG_V ("Snapshot %s (%s %s %u dims) does not fit gallery "
+            "%s(%s) of %ld dims", path.c_str (), h->gallery_,
+            GalleryStorageName ((GalleryStorage) h->storage_), h->dims_,
+            Name (), GalleryStorageName (cfg_.storage_), dims_);
+        return false;
+    }
+
+    const int64_t* ids    = snapshot.Ids ();
+    const float*   scales = snapshot.Scales ();
+    size_t row_bytes = stride_ * elem_;
+
+    if (h->capacity_ == capacity_) {
+        // adopt the mapping, untouched rows stay on disk
+        FeatureFree (matrix_);
+        matrix_    = snapshot.Matrix ();
+        allocated_ = capacity_;
+        count_     = h->count_;
+        ids_.assign (ids, ids + capacity_);
+        if (scales) scales_.assign (scales, scales + capacity_);
+        next_id_ = std::max (next_id_, h->next_id_);
+        mapping_ = snapshot.Detach (mapping_bytes_);
+    } else {
+        // another max-elem-num, keep the newest rows in insertion order
+        size_t n    = h->count_;
+        size_t skip = n > capacity_ ? n - capacity_ : 0;
+        size_t head = n == h->capacity_ ? h->oldest_ : 0;
+
+        count_ = 0;
+        if (!Grow (n - skip)) return false;
+
+        for (size_t i = skip; i < n; i++) {
+            size_t src = (head + i) % n;
+            size_t dst = i - skip;
+            memcpy (matrix_ + dst * row_bytes, snapshot.Matrix () + src * row_bytes,
+                row_bytes);
+            ids_[dst] = ids[src];
+            if (scales) scales_[dst] = scales[src];
+        }
+        count_   = n - skip;
+        next_id_ = std::max (next_id_, h->next_id_);
+    }
+
+    rows_.clear ();
+    for (size_t i = 0; i < count_; i++) {
+        rows_[ids_[i]] = i;
+        Tracked (ids_[i]);
+    }
+    // written oldest first, older snapshots of a full ring from oldest_
+    ResetAge (h->capacity_ == capacity_ && count_ == capacity_ ?
+        h->oldest_ % capacity_ : 0);
+
+    // the exact shadow is fp32, it only exists while recall is sampled
+    if (exact_) {
+        std::vector<float> v (dims_);
+        for (size_t i = 0; i < count_; i++) {
+            GetRow (i, v.data ());
+            exact_->Add (ids_[i], v.data ());
+        }
+    }
+
+    TS_INFO_MSG_V ("gallery %s loaded %ld entries from %s, next id %ld",
+        Name (), count_, path.c_str (), next_id_);
+    return true;
+}
@@ -0,0 +1,94 @@
+/*
+ * @Description: Exact brute-force ReID gallery over one aligned feature matrix.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-18 11:02:46
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-18 11:02:46
+ */
+
+#ifndef __TS_FLAT_GALLERY_H__
+#define __TS_FLAT_GALLERY_H__
+
+#include <deque>
+#include <unordered_map>
+
+#include "GalleryInterface.h"
+
+// rows scored per pass of a batched search, fp16 / int8 rows are widened
+#define FLAT_BATCH_ROWS 256
+// rows allocated up front, the matrix doubles from there up to capacity
+#define FLAT_INITIAL_ROWS 1024
+
+/*
+ * Row i of matrix_ holds the unit-length feature of ids_[i] in the element
+ * type of cfg_.storage_, rows are stride_ elements apart so each one starts
+ * on an aligned boundary. A removed row is filled with the last one, so
+ * the row order is not the insertion order, age_ keeps that. Once the
+ * gallery holds max_elem_num_ entries the row of the oldest entry is
+ * overwritten. The matrix grows as entries arrive, so a gallery whose
+ * capacity is an upper bound only costs the rows it holds, e.g. a shard
+ * of ShardedGallery. A snapshot is written oldest row first, and one of the same
+ * capacity becomes the matrix itself through a private mapping, rows are
+ * paged in on the first search and new rows are copied-on-write.
+ */
+class FlatGallery : public GalleryInterface
+{
+public:
+    FlatGallery (void) {}
+    ~FlatGallery (void);
+
+    bool   Initialize   (const GalleryConfig& config);
+    void   Deinitialize (void);
+    size_t Search (const float* feature, size_t k, GalleryMatch* matches);
+    void   SearchBatch (const float* const* features, size_t n, size_t k,
+                        GalleryMatch* matches, size_t* found);
+    void   SearchBatchIds (const float* const* features, size_t n,
+                           const int64_t* ids, size_t nids, size_t k,
+                           GalleryMatch* matches, size_t* found);
+    bool   Add    (int64_t id, const float* feature);
+    bool   Remove (int64_t id);
+    size_t Size        (void);
+    size_t MemoryBytes (void);
+    const char* Name   (void) { return "flat"; }
+    bool   SaveSnapshot (const std::string& path);
+    bool   LoadSnapshot (const std::string& path);
+
+    // decoded access for galleries that build on top of an exact store
+    void         GetRow (size_t i, float* out);
+    int64_t      RowId  (size_t i) { return ids_[i]; }
+
+private:
+    // the row of the oldest entry of a gallery that is not empty
+    size_t  OldestRow (void);
+    // room for rows rows, at least doubling, false if that fails
+    bool    Grow      (size_t rows);
+    // the rows in insertion order, into order
+    void    AgeOrder  (std::vector<size_t>& order);
+    // age_ as rows [0, count_) in ring order from head
+    void    ResetAge  (size_t head);
+
+private:
+    char*                matrix_   { NULL };
+    size_t               dims_     { 0    };
+    size_t               stride_   { 0    };
+    size_t               elem_     { 0    };  // bytes per element
+    size_t               capacity_ { 0    };
+    size_t               allocated_ { 0   };  // rows in matrix_
+    size_t               count_    { 0    };
+    uint64_t             seq_      { 0    };  // of the last Add
+    std::vector<uint64_t> seqs_    {      };  // row -> seq of its Add
+    // (seq, id) in insertion order, entries whose row has another seq
+    // since were removed and are dropped when they reach the front
+    std::deque<std::pair<uint64_t, int64_t> > age_ { };
+    std::vector<int64_t> ids_      {      };
+    std::vector<float>   scales_   {      };  // int8 only
+    std::vector<float>   scores_   {      };
+    std::vector<float>   batch_    {      };  // widened rows of a batch pass
+    std::vector<int64_t> batch_ids_ {     };  // ids of gathered batch_ rows
+    std::unordered_map<int64_t, size_t> rows_ { };  // id -> row
+    char*                mapping_  { NULL };  // snapshot backing matrix_
+    size_t               mapping_bytes_ { 0 };
+};
+
+#endif //__TS_FLAT_GALLERY_H__
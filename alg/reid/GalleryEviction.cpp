@@ -0,0 +1,178 @@
+/*
+ * @Description: Implement of the ReID gallery eviction bookkeeping.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-25 13:55:40
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-25 13:55:40
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include "GalleryEviction.h"
+
+#define LIST_PROBATION 0
+#define LIST_PROTECTED 1
+
+GalleryEviction::GalleryEviction (EvictionPolicy policy, int ttl_sec,
+    int min_hits)
+    : policy_ (policy), ttl_ms_ ((int64_t) std::max (ttl_sec, 0) * 1000),
+      min_hits_ (std::max (min_hits, 0)), nodes_ (2)
+{
+    for (uint32_t l = 0; l < 2; l++) {
+        nodes_[l].prev_ = nodes_[l].next_ = l;
+        nodes_[l].list_ = l;
+    }
+}
+
+int64_t GalleryEviction::Now (void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+void GalleryEviction::Link (uint32_t n, uint8_t list)
+{
+    Node& head = nodes_[list];
+
+    nodes_[n].list_ = list;
+    nodes_[n].prev_ = list;
+    nodes_[n].next_ = head.next_;
+    nodes_[head.next_].prev_ = n;
+    head.next_ = n;
+}
+
+void GalleryEviction::Unlink (uint32_t n)
+{
+    // the expiry cursor moves on to the next older entry
+    if (cursor_[nodes_[n].list_] == n) cursor_[nodes_[n].list_] = nodes_[n].prev_;
+    nodes_[nodes_[n].prev_].next_ = nodes_[n].next_;
+    nodes_[nodes_[n].next_].prev_ = nodes_[n].prev_;
+}
+
+void GalleryEviction::Release (uint32_t n)
+{
+    Unlink (n);
+    index_.erase (nodes_[n].id_);
+    nodes_[n].id_ = -1;
+    free_.push_back (n);
+}
+
+void GalleryEviction::Insert (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    uint32_t n;
+
+    if (index_.count (id)) return;
+
+    if (!free_.empty ()) {
+        n = free_.back ();
+        free_.pop_back ();
+    } else {
+        n = nodes_.size ();
+        nodes_.push_back (Node ());
+    }
+
+    nodes_[n].id_        = id;
+    nodes_[n].last_seen_ = Now ();
+    nodes_[n].hits_      = 0;
+    Link (n, min_hits_ == 0 ? LIST_PROTECTED : LIST_PROBATION);
+    index_[id] = n;
+}
+
+void GalleryEviction::Touch (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    auto it = index_.find (id);
+    if (it == index_.end ()) return;
+
+    Node& node = nodes_[it->second];
+    node.last_seen_ = Now ();
+    node.hits_ ++;
+
+    // with min_hits_ == 0 everything lives on the protected list
+    uint8_t list = node.list_;
+    if (list == LIST_PROBATION && node.hits_ >= min_hits_) list = LIST_PROTECTED;
+
+    if (policy_ == EvictionPolicy::EVICTION_LRU || list != node.list_) {
+        Unlink (it->second);
+        Link (it->second, list);
+    }
+}
+
+void GalleryEviction::Erase (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    auto it = index_.find (id);
+    if (it != index_.end ()) Release (it->second);
+}
+
+int64_t GalleryEviction::Victim (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    for (uint32_t l = LIST_PROBATION; l <= LIST_PROTECTED; l++) {
+        if (Tail (l) != l) return nodes_[Tail (l)].id_;
+    }
+
+    return -1;
+}
+
+size_t GalleryEviction::Expired (int64_t* out, size_t max)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    size_t  n = 0;
+
+    if (ttl_ms_ == 0) return 0;
+
+    int64_t deadline = Now () - ttl_ms_;
+    for (uint32_t l = LIST_PROBATION; l <= LIST_PROTECTED; l++) {
+        if (policy_ != EvictionPolicy::EVICTION_FIFO) {
+            while (n < max && Tail (l) != l &&
+                nodes_[Tail (l)].last_seen_ < deadline) {
+                out[n++] = nodes_[Tail (l)].id_;
+                Release (Tail (l));
+            }
+            continue;
+        }
+
+        // a FIFO list is not ordered by last seen, look at up to max
+        // entries from the cursor on, the ones seen within the ttl stay
+        // where they are
+        uint32_t t = cursor_[l] != l ? cursor_[l] : Tail (l);
+        for (size_t seen = 0; n < max && seen < max && t != l; seen++) {
+            uint32_t older = nodes_[t].prev_;
+            if (nodes_[t].last_seen_ < deadline) {
+                out[n++] = nodes_[t].id_;
+                Release (t);
+            }
+            t = older;
+        }
+        cursor_[l] = t;
+    }
+
+    return n;
+}
+
+size_t GalleryEviction::Size (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return index_.size ();
+}
+
+EvictionPolicy StringToEvictionPolicy (std::string& policy)
+{
+    std::transform(policy.begin(), policy.end(), policy.begin(),
+        [](unsigned char ch){ return tolower(ch); }
+    );
+
+    if (0 == policy.compare("lru")) {
+        return EvictionPolicy::EVICTION_LRU;
+    } else {
+        return EvictionPolicy::EVICTION_FIFO;
+    }
+}
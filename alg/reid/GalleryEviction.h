@@ -0,0 +1,83 @@
+/*
+ * @Description: TTL / LRU / min-hit eviction bookkeeping of a ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-25 13:55:40
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-25 13:55:40
+ */
+
+#ifndef __TS_GALLERY_EVICTION_H__
+#define __TS_GALLERY_EVICTION_H__
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+typedef enum _EvictionPolicy {
+    EVICTION_FIFO,      // drop in insertion order, matches don't count
+    EVICTION_LRU        // drop the entry matched least recently
+} EvictionPolicy;
+
+/*
+ * Two intrusive lists over a node pool, a segmented LRU: new entries start
+ * on the probation list and move to the protected one once matched
+ * min_hits times, capacity victims come from the probation tail first.
+ * TTL expiry looks at both tails only, so every operation is O(1). A FIFO
+ * list is not ordered by last seen, expiry walks it from a cursor that
+ * resumes where the last call stopped and skips entries seen recently
+ * without moving them, so the insertion order capacity victims follow
+ * stays intact.
+ * The class locks itself, matches may touch entries from reader threads.
+ */
+class GalleryEviction
+{
+public:
+    GalleryEviction (EvictionPolicy policy, int ttl_sec, int min_hits);
+
+    void    Insert  (int64_t id);
+    void    Touch   (int64_t id);
+    void    Erase   (int64_t id);
+
+    // the entry to drop to make room, -1 if none is tracked
+    int64_t Victim  (void);
+
+    // moves up to max entries unseen for ttl_sec into out
+    size_t  Expired (int64_t* out, size_t max);
+
+    size_t  Size    (void);
+
+private:
+    typedef struct _Node {
+        int64_t  id_        { -1 };
+        int64_t  last_seen_ { 0  };  // ms, steady clock
+        uint32_t hits_      { 0  };
+        uint32_t prev_      { 0  };
+        uint32_t next_      { 0  };
+        uint8_t  list_      { 0  };
+    } Node;
+
+    // node 0 and 1 are the sentinels of the probation and protected list
+    void     Link    (uint32_t n, uint8_t list);
+    void     Unlink  (uint32_t n);
+    void     Release (uint32_t n);
+    uint32_t Tail    (uint8_t list) { return nodes_[list].prev_; }
+    int64_t  Now     (void);
+
+private:
+    EvictionPolicy                        policy_   ;
+    int64_t                               ttl_ms_   ;
+    uint32_t                              min_hits_ ;
+    std::mutex                            mutex_    ;
+    std::vector<Node>                     nodes_    ;
+    std::vector<uint32_t>                 free_     ;
+    // where FIFO expiry resumes per list, the list sentinel means the tail
+    uint32_t                              cursor_[2] { 0, 1 };
+    std::unordered_map<int64_t, uint32_t> index_    ;
+};
+
+EvictionPolicy StringToEvictionPolicy (std::string& policy);
+
+#endif //__TS_GALLERY_EVICTION_H__
@@ -0,0 +1,866 @@
+/*
+ * @Description: Implement of the shared ReID gallery logic and factory.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-18 10:40:17
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-18 10:40:17
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <unordered_set>
+
+#include "Common.h"
+#include "GalleryInterface.h"
+#include "GalleryJournal.h"
+#include "FlatGallery.h"
+#include "IvfPqGallery.h"
+#include "HnswGallery.h"
+#include "RemoteGallery.h"
+#include "SegmentedGallery.h"
+#include "ShardedGallery.h"
+#include "ReRanker.h"
+
+// sighting times of the camera topology, ms on the steady clock
+static int64_t SteadyNowMs (void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+GalleryInterface::~GalleryInterface (void)
+{
+    delete exact_;
+    delete eviction_;
+}
+
+void GalleryInterface::SetDistanceThresh (float low, float high)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    cfg_.low_dist_  = low;
+    cfg_.high_dist_ = high;
+}
+
+void GalleryInterface::SetRecallShadow (GalleryInterface* exact)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    delete exact_;
+    exact_ = exact;
+}
+
+void GalleryInterface::SetJournal (GalleryJournal* journal)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    journal_ = journal;
+}
+
+bool GalleryInterface::ReplayAdd (int64_t id, int64_t camera_id,
+    const float* feature, size_t dims)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (id < next_id_ || dims != (size_t) cfg_.dims_) return false;
+
+    // the id was handed out even if the entry does not fit any more
+    bool added = InsertEntry (id, feature, camera_id);
+    next_id_ = id + 1;
+
+    return added;
+}
+
+bool GalleryInterface::ReplayRemove (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (!Remove (id)) return false;
+    if (exact_) exact_->Remove (id);
+    if (eviction_) eviction_->Erase (id);
+    if (topology_) topology_->Erase (id);
+    if (temporal_) temporal_->Erase (id);
+    if (reranker_) reranker_->Erase (id);
+
+    return true;
+}
+
+bool GalleryInterface::ReplayUpdate (int64_t id, int64_t camera_id,
+    const float* feature, size_t dims)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (dims != (size_t) cfg_.dims_) return false;
+
+    return UpdateLocked (id, camera_id, feature);
+}
+
+bool GalleryInterface::UpdateEntry (int64_t id, int64_t camera_id,
+    const float* feature)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (!UpdateLocked (id, camera_id, feature)) return false;
+    if (journal_) journal_->AppendUpdate (id, camera_id, feature, cfg_.dims_);
+
+    return true;
+}
+
+bool GalleryInterface::UpdateLocked (int64_t id, int64_t camera_id,
+    const float* feature)
+{
+    // the entry keeps its place in the eviction order
+    if (Remove (id)) {
+        if (exact_) exact_->Remove (id);
+        if (!Add (id, feature)) {
+            if (eviction_) eviction_->Erase (id);
+            if (topology_) topology_->Erase (id);
+            if (temporal_) temporal_->Erase (id);
+            return false;
+        }
+        if (exact_) exact_->Add (id, feature);
+    } else if (!InsertEntry (id, feature, camera_id)) {
+        return false;
+    }
+
+    next_id_ = std::max (next_id_, id + 1);
+    return true;
+}
+
+void GalleryInterface::SetEviction (GalleryEviction* eviction)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    delete eviction_;
+    eviction_ = eviction;
+}
+
+void GalleryInterface::SetTopology (std::shared_ptr<CameraTopology> topology)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    topology_ = topology;
+}
+
+void GalleryInterface::SetTemporalIndex (
+    std::shared_ptr<TemporalIndex> temporal)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    temporal_ = temporal;
+}
+
+void GalleryInterface::SetReRanker (std::shared_ptr<ReRanker> reranker)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    reranker_ = reranker;
+}
+
+void GalleryInterface::Touch (int64_t id, int64_t camera_id)
+{
+    if (eviction_) eviction_->Touch (id);
+    if (topology_) topology_->Sighted (id, camera_id, SteadyNowMs ());
+    if (temporal_) temporal_->Seen (id, SteadyNowMs ());
+}
+
+void GalleryInterface::Expire (size_t budget)
+{
+    if (!eviction_) return;
+
+    std::lock_guard<std::mutex> lock (mutex_);
+    ExpireLocked (budget);
+}
+
+int64_t GalleryInterface::Evict (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    int64_t victim = eviction_ ? eviction_->Victim () : -1;
+    if (victim >= 0) EvictEntry (victim);
+
+    return victim;
+}
+
+bool GalleryInterface::InsertEntry (int64_t id, const float* feature,
+    int64_t camera_id)
+{
+    if (eviction_) {
+        while (eviction_->Size () >= (size_t) cfg_.max_elem_num_) {
+            int64_t victim = eviction_->Victim ();
+            if (victim < 0) break;
+            EvictEntry (victim);
+        }
+    }
+
+    if (!Add (id, feature)) return false;
+    if (exact_) exact_->Add (id, feature);
+    if (eviction_) eviction_->Insert (id);
+    if (topology_) topology_->Sighted (id, camera_id, SteadyNowMs ());
+    if (temporal_) temporal_->Seen (id, SteadyNowMs ());
+
+    return true;
+}
+
+void GalleryInterface::EvictEntry (int64_t id)
+{
+    Remove (id);
+    if (exact_) exact_->Remove (id);
+    if (eviction_) eviction_->Erase (id);
+    if (topology_) topology_->Erase (id);
+    if (temporal_) temporal_->Erase (id);
+    if (reranker_) reranker_->Erase (id);
+    if (journal_) journal_->AppendRemove (id);
+    stats_.evicted_ ++;
+}
+
+void GalleryInterface::ExpireLocked (size_t budget)
+{
+    int64_t ids[16];
+
+    while (budget) {
+        size_t n = eviction_->Expired (ids, std::min<size_t> (budget, 16));
+        for (size_t i = 0; i < n; i++) EvictEntry (ids[i]);
+        if (n < std::min<size_t> (budget, 16)) break;
+        budget -= n;
+    }
+}
+
+void GalleryInterface::Tracked (int64_t id)
+{
+    if (eviction_) eviction_->Insert (id);
+    // a snapshot does not keep cameras, restored entries match anywhere
+    if (topology_) topology_->Sighted (id, TOPOLOGY_ANY_CAMERA, 0);
+    if (temporal_) temporal_->Seen (id, 0);
+}
+
+void GalleryInterface::FilteredSearch (GalleryInterface* g,
+    const float* const* features, const int64_t* camera_ids, size_t n,
+    GalleryMatch* matches, size_t* found, GalleryStats& stats,
+    SearchWindow window, size_t k)
+{
+    static thread_local std::vector<size_t>       order;
+    static thread_local std::vector<const float*> group;
+    static thread_local std::vector<GalleryMatch> hits;
+    static thread_local std::vector<size_t>       counts;
+    static thread_local std::vector<int64_t>      candidates;
+    static thread_local std::vector<int64_t>      recent;
+    static thread_local std::vector<size_t>       retry;
+    static thread_local std::vector<const float*> older;
+    static thread_local std::vector<GalleryMatch> older_hits;
+    static thread_local std::vector<size_t>       older_counts;
+
+    bool windowed = temporal_ && window != SearchWindow::WINDOW_ALL;
+
+    if (!topology_ && !windowed) {
+        g->SearchBatch (features, n, k, matches, found);
+        return;
+    }
+
+    // the detections of one camera share their candidates
+    int64_t now = SteadyNowMs ();
+    order.resize (n);
+    std::iota (order.begin (), order.end (), 0);
+    if (topology_) {
+        std::stable_sort (order.begin (), order.end (),
+            [camera_ids] (size_t a, size_t b) {
+                return camera_ids[a] < camera_ids[b];
+            });
+    }
+
+    for (size_t i = 0, e; i < n; i = e) {
+        int64_t camera = camera_ids[order[i]];
+
+        group.clear ();
+        for (e = i; e < n && (!topology_ || camera_ids[order[e]] == camera);
+            e++) {
+            group.push_back (features[order[e]]);
+        }
+
+        bool limited = topology_ &&
+            topology_->Candidates (camera, now, candidates);
+        if (limited) {
+            stats.filtered_   += group.size ();
+            stats.candidates_ += group.size () * candidates.size ();
+        }
+
+        auto search = [g, limited, k] (const float* const* f, size_t m,
+            GalleryMatch* h, size_t* c) {
+            if (limited) {
+                g->SearchBatchIds (f, m, candidates.data (),
+                    candidates.size (), k, h, c);
+            } else {
+                g->SearchBatch (f, m, k, h, c);
+            }
+        };
+
+        hits.assign (group.size () * k, GalleryMatch ());
+        counts.assign (group.size (), 0);
+        if (!windowed) {
+            search (group.data (), group.size (), hits.data (), counts.data ());
+        } else {
+            // most people come back within minutes, only those who did not
+            // are searched for among the older segments
+            if (limited) {
+                recent = candidates;
+                temporal_->KeepRecent (now, recent);
+            } else {
+                temporal_->Recent (now, recent);
+            }
+            g->SearchBatchIds (group.data (), group.size (), recent.data (),
+                recent.size (), k, hits.data (), counts.data ());
+
+            retry.clear ();
+            older.clear ();
+            for (size_t x = 0; window == SearchWindow::WINDOW_RECENT_FIRST &&
+                x < group.size (); x++) {
+                if (counts[x] && hits[x * k].distance_ < cfg_.low_dist_) {
+                    stats.recent_ ++;
+                } else {
+                    retry.push_back (x);
+                    older.push_back (group[x]);
+                }
+            }
+
+            // the recent entries are scored again, which is cheaper than
+            // gathering every older one
+            if (!retry.empty ()) {
+                stats.fallbacks_ += retry.size ();
+                older_hits.assign (older.size () * k, GalleryMatch ());
+                older_counts.assign (older.size (), 0);
+                search (older.data (), older.size (), older_hits.data (),
+                    older_counts.data ());
+                for (size_t y = 0; y < retry.size (); y++) {
+                    if (older_counts[y]) {
+                        std::copy (&older_hits[y * k], &older_hits[y * k] + k,
+                            &hits[retry[y] * k]);
+                        counts[retry[y]] = older_counts[y];
+                    }
+                }
+            }
+        }
+
+        for (size_t x = 0; x < group.size (); x++) {
+            std::copy (&hits[x * k], &hits[x * k] + k,
+                matches + order[i + x] * k);
+            found[order[i + x]] = counts[x];
+        }
+    }
+}
+
+bool GalleryInterface::ReRank (const float* feature, int64_t camera_id,
+    GalleryMatch& best, int64_t& budget_ns, GalleryStats& stats)
+{
+    static thread_local std::vector<GalleryMatch> top;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now ();
+    GalleryStats unused;
+    size_t k = reranker_->K (), found = 0;
+
+    if (budget_ns <= 0) {
+        stats.rerank_skips_ ++;
+        return false;
+    }
+
+    top.assign (k, GalleryMatch ());
+    FilteredSearch (this, &feature, &camera_id, 1, top.data (), &found,
+        unused, SearchWindow::WINDOW_ALL, k);
+    int r = reranker_->Rank (top.data (), found);
+
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now () - start).count ();
+    budget_ns -= ns;
+    stats.rerank_ns_ += ns;
+    stats.reranked_ ++;
+
+    if (r < 0 || top[r].distance_ >= cfg_.high_dist_) return false;
+
+    best = top[r];
+    stats.promoted_ ++;
+    return true;
+}
+
+void GalleryInterface::ReRankIndex (int64_t id, const float* feature,
+    int64_t& budget_ns, GalleryStats& stats)
+{
+    static thread_local std::vector<GalleryMatch> top;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now ();
+    size_t k = reranker_->K () + 1, found = 0;
+
+    // an entry left out only learns its neighbours as they arrive
+    if (budget_ns <= 0) {
+        stats.rerank_skips_ ++;
+        return;
+    }
+
+    // neighbours in feature space, not limited to one camera's candidates
+    top.assign (k, GalleryMatch ());
+    SearchBatch (&feature, 1, k, top.data (), &found);
+    reranker_->Index (id, top.data (), found);
+
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now () - start).count ();
+    budget_ns -= ns;
+    stats.rerank_ns_ += ns;
+}
+
+bool GalleryInterface::SaveSnapshot (const std::string& path)
+{
+    TS_WARN_MSG_V ("gallery %s does not support snapshots, %s not written",
+        Name (), path.c_str ());
+    return false;
+}
+
+bool GalleryInterface::LoadSnapshot (const std::string& path)
+{
+    TS_WARN_MSG_V ("gallery %s does not support snapshots, %s not loaded",
+        Name (), path.c_str ());
+    return false;
+}
+
+void GalleryInterface::SearchBatch (const float* const* features, size_t n,
+    size_t k, GalleryMatch* matches, size_t* found)
+{
+    for (size_t i = 0; i < n; i++) {
+        found[i] = Search (features[i], k, matches + i * k);
+    }
+}
+
+void GalleryInterface::SearchBatchIds (const float* const* features, size_t n,
+    const int64_t* ids, size_t nids, size_t k, GalleryMatch* matches,
+    size_t* found)
+{
+    static thread_local std::vector<GalleryMatch> wide;
+    static thread_local std::vector<size_t>       counts;
+    std::unordered_set<int64_t> allowed (ids, ids + nids);
+    size_t kk = k * GALLERY_FILTER_OVERSAMPLE;
+
+    if (!nids) {
+        std::fill (found, found + n, 0);
+        return;
+    }
+
+    // a candidate beyond the oversampled neighbours is missed
+    wide.assign (n * kk, GalleryMatch ());
+    counts.assign (n, 0);
+    SearchBatch (features, n, kk, wide.data (), counts.data ());
+
+    for (size_t i = 0; i < n; i++) {
+        found[i] = 0;
+        for (size_t j = 0; j < counts[i] && found[i] < k; j++) {
+            if (allowed.count (wide[i * kk + j].id_)) {
+                matches[i * k + found[i]++] = wide[i * kk + j];
+            }
+        }
+    }
+}
+
+void GalleryInterface::InsertAndSearch (std::vector<GalleryQuery>& queries)
+{
+    // galleries without concurrent readers are serialized for the whole frame
+    std::unique_lock<std::mutex> lock (mutex_, std::defer_lock);
+    if (!ConcurrentSearch ()) lock.lock ();
+
+    static thread_local std::vector<float>        normed;
+    static thread_local std::vector<const float*> rows;
+    static thread_local std::vector<int64_t>      cameras;
+    static thread_local std::vector<GalleryMatch> nearest;
+    static thread_local std::vector<size_t>       counts;
+    static thread_local std::vector<size_t>       fresh;
+    static thread_local std::vector<size_t>       missed;
+    static thread_local std::vector<const float*> retry;
+    static thread_local std::vector<int64_t>      retry_cameras;
+    static thread_local std::vector<GalleryMatch> retry_nearest;
+    static thread_local std::vector<size_t>       retry_counts;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now ();
+    GalleryStats local;
+    size_t dims = cfg_.dims_;
+    float  low  = cfg_.low_dist_;
+    float  high = cfg_.high_dist_;
+    // re-ranking never holds the frame longer than this
+    int64_t budget = (int64_t) cfg_.rerank_budget_us_ * 1000;
+
+    normed.resize (queries.size () * dims);
+    rows.clear ();
+    cameras.clear ();
+    fresh.clear ();
+    local.frames_ ++;
+
+    // a bounded share of expired entries per frame keeps eviction O(1)
+    if (eviction_) {
+        std::unique_lock<std::mutex> writer (mutex_, std::defer_lock);
+        if (!lock.owns_lock ()) writer.lock ();
+        ExpireLocked (queries.size () + GALLERY_EXPIRE_BUDGET);
+    }
+
+    for (size_t i = 0; i < queries.size (); i++) {
+        if (!queries[i].feature_) continue;
+
+        float* f = &normed[i * dims];
+        memcpy (f, queries[i].feature_, dims * sizeof (float));
+        L2Normalize (f, dims);
+        rows.push_back (f);
+        cameras.push_back (queries[i].camera_id_);
+    }
+
+    // every detection of the frame is scored against the gallery in one pass
+    nearest.assign (rows.size (), GalleryMatch ());
+    counts.assign (rows.size (), 0);
+    FilteredSearch (this, rows.data (), cameras.data (), rows.size (), nearest.data (),
+        counts.data (), local);
+
+    // another reader may have enrolled the same person meanwhile, the misses
+    // are searched again in one batch and enrolled under the writer lock
+    std::unique_lock<std::mutex> writer (mutex_, std::defer_lock);
+    if (!lock.owns_lock ()) {
+        missed.clear ();
+        for (size_t j = 0; j < rows.size (); j++) {
+            if (counts[j] == 0 || nearest[j].distance_ >= high) {
+                missed.push_back (j);
+            }
+        }
+
+        if (!missed.empty ()) {
+            size_t m = missed.size ();
+            GalleryStats again;
+
+            retry.resize (m);
+            retry_cameras.resize (m);
+            retry_nearest.assign (m, GalleryMatch ());
+            retry_counts.assign (m, 0);
+            for (size_t x = 0; x < m; x++) {
+                retry[x] = rows[missed[x]];
+                retry_cameras[x] = cameras[missed[x]];
+            }
+
+            writer.lock ();
+            FilteredSearch (this, retry.data (), retry_cameras.data (), m,
+                retry_nearest.data (), retry_counts.data (), again);
+            for (size_t x = 0; x < m; x++) {
+                nearest[missed[x]] = retry_nearest[x];
+                counts[missed[x]]  = retry_counts[x];
+            }
+        }
+    }
+
+    for (size_t i = 0, j = 0; i < queries.size (); i++) {
+        GalleryQuery& q = queries[i];
+        const float*  f = &normed[i * dims];
+
+        if (!q.feature_) continue;
+
+        GalleryMatch best  = nearest[j];
+        size_t       found = counts[j++];
+
+        // identities enrolled earlier in this frame missed the batch
+        for (auto&& e : fresh) {
+            if (topology_ && !topology_->Reachable (queries[e].camera_id_,
+                q.camera_id_, 0)) continue;
+            float d = 1.f - DotProduct (f, &normed[e * dims], dims);
+            if (d < best.distance_) {
+                best.id_       = queries[e].object_id_;
+                best.distance_ = d;
+                found = 1;
+            }
+        }
+
+        local.queries_ ++;
+
+        if (exact_ && cfg_.recall_every_ > 0 &&
+            (recall_tick_ ++) % cfg_.recall_every_ == 0) {
+            std::unique_lock<std::mutex> shadow (mutex_, std::defer_lock);
+            if (!lock.owns_lock () && !writer.owns_lock ()) shadow.lock ();
+
+            // a new identity has no right answer to miss
+            GalleryMatch truth;
+            if (exact_->Search (f, 1, &truth) && truth.distance_ < high) {
+                local.recall_checks_ ++;
+                if (found && truth.id_ == best.id_) local.recall_hits_ ++;
+            }
+        }
+
+        if (found == 0 || best.distance_ >= high) {
+            q.distance_ = best.distance_;
+            // an id the gallery does not hold would never be matched again
+            if (!InsertEntry (next_id_, f, q.camera_id_)) {
+                q.object_id_ = -1;
+                local.refused_ ++;
+                continue;
+            }
+            q.object_id_ = next_id_++;
+            if (journal_) {
+                journal_->Append (q.object_id_, q.camera_id_, f, dims);
+            }
+            fresh.push_back (i);
+            local.inserted_ ++;
+            continue;
+        }
+
+        bool promoted = best.distance_ >= low && reranker_ &&
+            ReRank (f, q.camera_id_, best, budget, local);
+        q.object_id_ = best.id_;
+        q.distance_  = best.distance_;
+        if (best.distance_ < low || promoted) {
+            local.matched_ ++;
+            Touch (best.id_, q.camera_id_);
+        } else {
+            local.ambiguous_ ++;
+        }
+    }
+
+    if (reranker_) {
+        for (auto&& e : fresh) {
+            ReRankIndex (queries[e].object_id_, &normed[e * dims], budget,
+                local);
+        }
+    }
+
+    local.search_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now () - start).count ();
+
+    if (!lock.owns_lock () && !writer.owns_lock ()) lock.lock ();
+    stats_.frames_        += local.frames_;
+    stats_.queries_       += local.queries_;
+    stats_.matched_       += local.matched_;
+    stats_.ambiguous_     += local.ambiguous_;
+    stats_.inserted_      += local.inserted_;
+    stats_.refused_       += local.refused_;
+    stats_.search_ns_     += local.search_ns_;
+    stats_.recall_checks_ += local.recall_checks_;
+    stats_.recall_hits_   += local.recall_hits_;
+    stats_.filtered_      += local.filtered_;
+    stats_.candidates_    += local.candidates_;
+    stats_.recent_        += local.recent_;
+    stats_.fallbacks_     += local.fallbacks_;
+    stats_.reranked_      += local.reranked_;
+    stats_.promoted_      += local.promoted_;
+    stats_.rerank_skips_  += local.rerank_skips_;
+    stats_.rerank_ns_     += local.rerank_ns_;
+}
+
+GalleryStats GalleryInterface::GetStats (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return stats_;
+}
+
+int64_t GalleryInterface::NextId (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return next_id_;
+}
+
+void GalleryInterface::PrintStats (void)
+{
+    GalleryStats s = GetStats ();
+
+    TS_INFO_MSG_V ("gallery %s(%s,%s): size:%ld, memory:%ld bytes", Name (),
+        GalleryStorageName (cfg_.storage_), KernelIsaName (GetKernelIsa ()),
+        Size (), MemoryBytes ());
+    TS_INFO_MSG_V ("\tframes:%lu, queries:%lu, matched:%lu, ambiguous:%lu, "
+        "inserted:%lu, evicted:%lu", s.frames_, s.queries_, s.matched_,
+        s.ambiguous_, s.inserted_, s.evicted_);
+    if (s.refused_) {
+        TS_WARN_MSG_V ("\trefused:%lu new identities, the gallery is full",
+            s.refused_);
+    }
+    TS_INFO_MSG_V ("\tavg us/query:%.3f", s.queries_ ?
+        s.search_ns_ / 1000.0 / s.queries_ : 0.0);
+    if (s.filtered_) {
+        TS_INFO_MSG_V ("\ttopology filtered:%lu, avg candidates:%.1f",
+            s.filtered_, (double) s.candidates_ / s.filtered_);
+    }
+    if (s.recent_ || s.fallbacks_) {
+        TS_INFO_MSG_V ("\trecent window matched:%lu, older searched:%lu",
+            s.recent_, s.fallbacks_);
+    }
+    if (s.reranked_ || s.rerank_skips_) {
+        TS_INFO_MSG_V ("\treranked:%lu, promoted:%lu, over budget:%lu, "
+            "rerank ms:%.3f", s.reranked_, s.promoted_, s.rerank_skips_,
+            s.rerank_ns_ / 1000000.0);
+    }
+    if (s.recall_checks_) {
+        TS_INFO_MSG_V ("\trecall@1 vs exact:%.4f (%lu samples)",
+            (double) s.recall_hits_ / s.recall_checks_, s.recall_checks_);
+    }
+}
+
+size_t SelectNearest (const float* scores, const int64_t* ids, size_t n,
+    size_t k, GalleryMatch* out)
+{
+    return MergeNearest (scores, ids, n, k, out, 0);
+}
+
+size_t MergeNearest (const float* scores, const int64_t* ids, size_t n,
+    size_t k, GalleryMatch* out, size_t found)
+{
+    if (k == 0) return 0;
+
+    // insertion into a sorted window of k, k is tiny on the hot path
+    for (size_t i = 0; i < n; i++) {
+        float d = 1.f - scores[i];
+        if (found == k && d >= out[k - 1].distance_) continue;
+
+        size_t j = found < k ? found++ : k - 1;
+        while (j > 0 && out[j - 1].distance_ > d) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j].id_       = ids[i];
+        out[j].distance_ = d;
+    }
+
+    return found;
+}
+
+GalleryMode StringToGalleryMode (std::string& mode)
+{
+    std::transform(mode.begin(), mode.end(), mode.begin(),
+        [](unsigned char ch){ return tolower(ch); }
+    );
+
+    if (0 == mode.compare("flat")) {
+        return GalleryMode::GALLERY_FLAT;
+    } else if (0 == mode.compare("ivfpq")) {
+        return GalleryMode::GALLERY_IVFPQ;
+    } else if (0 == mode.compare("hnsw")) {
+        return GalleryMode::GALLERY_HNSW;
+    } else if (0 == mode.compare("segmented")) {
+        return GalleryMode::GALLERY_SEGMENTED;
+    } else if (0 == mode.compare("remote")) {
+        return GalleryMode::GALLERY_REMOTE;
+    } else {
+        return GalleryMode::GALLERY_VENDOR;
+    }
+}
+
+GalleryStorage StringToGalleryStorage (std::string& storage)
+{
+    std::transform(storage.begin(), storage.end(), storage.begin(),
+        [](unsigned char ch){ return tolower(ch); }
+    );
+
+    if (0 == storage.compare("fp16")) {
+        return GalleryStorage::GALLERY_STORAGE_FP16;
+    } else if (0 == storage.compare("int8")) {
+        return GalleryStorage::GALLERY_STORAGE_INT8;
+    } else {
+        return GalleryStorage::GALLERY_STORAGE_FP32;
+    }
+}
+
+const char* GalleryStorageName (GalleryStorage storage)
+{
+    switch (storage) {
+    case GalleryStorage::GALLERY_STORAGE_FP16: return "fp16";
+    case GalleryStorage::GALLERY_STORAGE_INT8: return "int8";
+    default:                                   return "fp32";
+    }
+}
+
+GalleryInterface* CreateGallery (const GalleryConfig& config)
+{
+    GalleryInterface* g = NULL;
+
+    if (0 == config.isa_.compare("scalar")) {
+        SetKernelIsa (KernelIsa::KERNEL_ISA_SCALAR);
+    } else if (0 == config.isa_.compare("avx2")) {
+        SetKernelIsa (KernelIsa::KERNEL_ISA_AVX2);
+    } else {
+        SetKernelIsa (KernelIsa::KERNEL_ISA_AVX512);
+    }
+
+    // the vendor gallery lives in TSObjectReIDDB, outside of this factory
+    GalleryMode mode = config.mode_;
+    if (mode == GalleryMode::GALLERY_VENDOR) {
+        if (config.shards_ > 1) {
+            TS_ERR_MSG_V ("The vendor gallery can not be sharded, pick an "
+                "in-process gallery mode or set shards to 1");
+        }
+        return NULL;
+    }
+
+    // the shards are created by ShardedGallery with the configured mode,
+    // the nodes of a remote gallery may be sharded themselves
+    if (mode != GalleryMode::GALLERY_REMOTE && config.shards_ > 1) {
+        g = new ShardedGallery ();
+    } else {
+        switch (mode) {
+        case GalleryMode::GALLERY_FLAT:
+            g = new FlatGallery ();
+            break;
+        case GalleryMode::GALLERY_IVFPQ:
+            g = new IvfPqGallery ();
+            break;
+        case GalleryMode::GALLERY_HNSW:
+            g = new HnswGallery ();
+            break;
+        case GalleryMode::GALLERY_SEGMENTED:
+            g = new SegmentedGallery ();
+            break;
+        case GalleryMode::GALLERY_REMOTE:
+            g = new RemoteGallery ();
+            break;
+        default:
+            return NULL;
+        }
+    }
+
+    if (!g->Initialize (config)) {
+        TS_ERR_MSG_V ("Failed to init the gallery %s", g->Name ());
+        delete g;
+        return NULL;
+    }
+
+    // eviction, indexes and recall are up to the nodes' own configuration
+    if (mode == GalleryMode::GALLERY_REMOTE) return g;
+
+    // the shards keep their own bookkeeping, see ShardedGallery
+    // the indexes must hear of every entry that leaves, even FIFO ones, and
+    // hnsw only makes room for a new node by evicting the policy's victim
+    if (config.shards_ <= 1 && (config.ttl_sec_ > 0 || config.min_hits_ > 0 ||
+        config.eviction_ != EvictionPolicy::EVICTION_FIFO ||
+        !config.topology_.empty () || config.recent_sec_ > 0 ||
+        mode == GalleryMode::GALLERY_HNSW)) {
+        g->SetEviction (new GalleryEviction (config.eviction_, config.ttl_sec_,
+            config.min_hits_));
+    }
+
+    if (!config.topology_.empty ()) {
+        g->SetTopology (std::make_shared<CameraTopology> (config.topology_));
+    }
+
+    if (config.recent_sec_ > 0) {
+        g->SetTemporalIndex (std::make_shared<TemporalIndex> (
+            config.segment_sec_, config.recent_sec_));
+    }
+
+    if (config.rerank_k_ > 0) {
+        g->SetReRanker (std::make_shared<ReRanker> (config.rerank_k_,
+            config.rerank_lambda_));
+    }
+
+    if (config.recall_every_ > 0 && (config.shards_ > 1 ||
+        config.mode_ != GalleryMode::GALLERY_FLAT ||
+        config.storage_ != GalleryStorage::GALLERY_STORAGE_FP32)) {
+        GalleryConfig ec = config;
+        ec.storage_ = GalleryStorage::GALLERY_STORAGE_FP32;
+
+        GalleryInterface* exact = new FlatGallery ();
+        if (exact->Initialize (ec)) {
+            g->SetRecallShadow (exact);
+        } else {
+            TS_WARN_MSG_V ("Recall sampling disabled, no room for exact shadow");
+            delete exact;
+        }
+    }
+
+    return g;
+}
@@ -0,0 +1,326 @@
+/*
+ * @Description: Common interface of the in-process ReID identity gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-18 10:40:17
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-18 10:40:17
+ */
+
+#ifndef __TS_GALLERY_INTERFACE_H__
+#define __TS_GALLERY_INTERFACE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CameraTopology.h"
+#include "FeatureKernels.h"
+#include "GalleryEviction.h"
+#include "TemporalIndex.h"
+
+// expired entries dropped per frame on top of one per query
+#define GALLERY_EXPIRE_BUDGET 32
+// approximate galleries fetch this many times k to filter by candidates
+#define GALLERY_FILTER_OVERSAMPLE 16
+
+class GalleryJournal;
+class ReRanker;
+
+typedef enum _GalleryMode {
+    GALLERY_VENDOR,     // ts::TSObjectReIDDB from the sdk
+    GALLERY_FLAT,       // exact brute-force search, FlatGallery
+    GALLERY_IVFPQ,      // inverted file + product quantization, IvfPqGallery
+    GALLERY_HNSW,       // navigable small-world graph, HnswGallery
+    GALLERY_SEGMENTED,  // append-only segments, lock-free reads, SegmentedGallery
+    GALLERY_REMOTE      // shards on GalleryServer nodes, RemoteGallery
+} GalleryMode;
+
+typedef enum _GalleryStorage {
+    GALLERY_STORAGE_FP32,
+    GALLERY_STORAGE_FP16,   // 2 bytes per dimension
+    GALLERY_STORAGE_INT8    // 1 byte per dimension plus a per-entry scale
+} GalleryStorage;
+
+typedef struct _GalleryConfig {
+    GalleryMode mode_         { GALLERY_VENDOR };
+    int         dims_         { 512            };
+    int         max_elem_num_ { 10000          };
+    float       low_dist_     { 0.135          };
+    float       high_dist_    { 0.16           };
+    std::string isa_          { "auto"         };
+    // element type of the flat gallery rows
+    GalleryStorage storage_   { GALLERY_STORAGE_FP32 };
+    /*-------------------------------ivfpq--------------------------------*/
+    int         nlist_        { 256            };
+    int         nprobe_       { 16             };
+    int         pq_m_         { 64             };  // code bytes per entry
+    int         train_size_   { 20000          };
+    /*--------------------------------hnsw--------------------------------*/
+    int         hnsw_m_          { 16          };
+    int         ef_construction_ { 200         };
+    int         ef_search_       { 64          };
+    /*-------------------------------recall-------------------------------*/
+    // every n-th query is repeated on an exact shadow gallery, 0 disables
+    int         recall_every_ { 0              };
+    /*------------------------------eviction------------------------------*/
+    // fifo without ttl or min-hits keeps each gallery's own overwrite order
+    EvictionPolicy eviction_  { EvictionPolicy::EVICTION_FIFO };
+    int         ttl_sec_      { 0              };  // unseen this long, dropped
+    int         min_hits_     { 0              };  // matches to be protected
+    /*-----------------------------persistence----------------------------*/
+    // snapshot file saved at algFina and mapped at algInit, empty disables
+    std::string snapshot_     { ""             };
+    // group commit window of the wal next to the snapshot, 0 disables it
+    int         wal_flush_ms_   { 0            };
+    int         checkpoint_sec_ { 300          };
+    int         checkpoint_mb_  { 64           };  // wal size forcing one
+    /*-------------------------------shards-------------------------------*/
+    // > 1 splits the gallery by camera, each shard of the mode above
+    int         shards_         { 1            };
+    int         fanout_threads_ { 0            };  // 0: one per shard, up to cores
+    // camera id -> shard (or node), other cameras use camera_id % shards_
+    std::map<int64_t, int> camera_shards_ {    };
+    /*-------------------------------tracks-------------------------------*/
+    // one gallery entry per trace, the mean of its detections, TrackAggregator
+    bool        track_aggregate_ { false       };
+    int         track_refresh_   { 10          };  // frames between updates
+    int         track_ttl_sec_   { 10          };  // unseen this long, closed
+    /*------------------------------topology------------------------------*/
+    // source camera -> cameras a person leaving it may reach, empty disables
+    std::map<int64_t, std::vector<CameraLink> > topology_ { };
+    /*------------------------------temporal------------------------------*/
+    int         recent_sec_      { 0           };  // searched first, 0 off
+    int         segment_sec_     { 60          };  // last-seen bucket length
+    /*-------------------------------rerank-------------------------------*/
+    // neighbours per entry re-ranking ambiguous matches, 0 disables, ReRanker
+    int         rerank_k_         { 0          };
+    float       rerank_lambda_    { 0.3        };  // weight of the distance
+    int         rerank_budget_us_ { 2000       };  // per frame
+    /*-------------------------------nodes--------------------------------*/
+    // GalleryServer nodes of the remote mode, unix:<path> or <host>:<port>
+    std::vector<std::string> nodes_ {          };
+    int         node_timeout_ms_  { 1000       };  // per send or receive
+    int         node_retry_ms_    { 1000       };  // a failed node rests
+} GalleryConfig;
+
+/*
+ * One detection of a frame. feature_ is borrowed from the caller and does not
+ * need to be normalized, object_id_ and distance_ are filled by the gallery.
+ */
+typedef struct _GalleryQuery {
+    const float* feature_    { NULL };
+    int64_t      camera_id_  { 0    };
+    int64_t      trace_id_   { 0    };
+    float        confidence_ { 0.f  };
+    int64_t      object_id_  { -1   };
+    float        distance_   { 2.f  };
+} GalleryQuery;
+
+typedef struct _GalleryMatch {
+    int64_t id_       { -1  };
+    float   distance_ { 2.f };  // cosine distance, 1 - <a, b>
+} GalleryMatch;
+
+typedef struct _GalleryStats {
+    uint64_t frames_    { 0 };
+    uint64_t queries_   { 0 };
+    uint64_t matched_   { 0 };  // distance < low_dist_
+    uint64_t ambiguous_ { 0 };  // low_dist_ <= distance < high_dist_
+    uint64_t inserted_  { 0 };  // new identities
+    uint64_t refused_   { 0 };  // new identities the gallery could not store
+    uint64_t search_ns_ { 0 };
+    uint64_t recall_checks_ { 0 };  // sampled queries exact search matched
+    uint64_t recall_hits_   { 0 };  // top-1 id agreed with exact search
+    uint64_t evicted_       { 0 };  // dropped by ttl or to make room
+    uint64_t filtered_      { 0 };  // queries limited by the camera topology
+    uint64_t candidates_    { 0 };  // entries those were allowed to match
+    uint64_t recent_        { 0 };  // matched within the recent window
+    uint64_t fallbacks_     { 0 };  // searched the older segments too
+    uint64_t reranked_      { 0 };  // ambiguous matches re-ranked
+    uint64_t promoted_      { 0 };  // of those settled as a match
+    uint64_t rerank_skips_  { 0 };  // left out over the frame budget
+    uint64_t rerank_ns_     { 0 };  // spent re-ranking and indexing
+} GalleryStats;
+
+class GalleryInterface
+{
+public:
+    virtual ~GalleryInterface (void);
+
+    virtual bool   Initialize   (const GalleryConfig& config) = 0;
+    virtual void   Deinitialize (void) = 0;
+
+    // k nearest entries of a unit-length feature, ascending by distance
+    virtual size_t Search (const float* feature, size_t k,
+                           GalleryMatch* matches) = 0;
+    /*
+     * Search for n features at once, matches of query i at matches + i * k
+     * and their count in found[i]. The default runs Search per query,
+     * galleries with a batched kernel score them in one pass.
+     */
+    virtual void   SearchBatch (const float* const* features, size_t n,
+                                size_t k, GalleryMatch* matches,
+                                size_t* found);
+    /*
+     * SearchBatch among the entries in ids only, ids not stored are skipped.
+     * The default filters an oversampled SearchBatch, exact galleries score
+     * just the candidates.
+     */
+    virtual void   SearchBatchIds (const float* const* features, size_t n,
+                                   const int64_t* ids, size_t nids, size_t k,
+                                   GalleryMatch* matches, size_t* found);
+    // stores a unit-length feature under id
+    virtual bool   Add    (int64_t id, const float* feature) = 0;
+    // drops the entry of id, false if it is not stored
+    virtual bool   Remove (int64_t id) = 0;
+    virtual size_t Size        (void) = 0;
+    virtual size_t MemoryBytes (void) = 0;
+    virtual const char* Name   (void) = 0;
+    /*
+     * true when Search may run from several threads while one thread is
+     * inside Add, such galleries are only locked around inserts.
+     */
+    virtual bool   ConcurrentSearch (void) { return false; }
+
+    /*
+     * Persists the entries and the id counter to a GallerySnapshot file and
+     * restores them at startup, galleries without snapshot support warn and
+     * start empty. Load runs right after Initialize, before any query.
+     */
+    virtual bool   SaveSnapshot (const std::string& path);
+    virtual bool   LoadSnapshot (const std::string& path);
+
+    // every new identity is appended to journal, NULL stops logging
+    virtual void SetJournal (GalleryJournal* journal);
+
+    // re-applies a logged insert, ids below the next id are already present
+    virtual bool ReplayAdd (int64_t id, int64_t camera_id,
+                            const float* feature, size_t dims);
+    virtual bool ReplayRemove (int64_t id);
+    virtual bool ReplayUpdate (int64_t id, int64_t camera_id,
+                               const float* feature, size_t dims);
+
+    /*
+     * Replaces the feature stored under id with a unit-length one, an entry
+     * evicted meanwhile is added back. false if the gallery can not replace
+     * entries. Logged to the journal like an insert.
+     */
+    virtual bool UpdateEntry (int64_t id, int64_t camera_id,
+                              const float* feature);
+
+    // takes ownership of the eviction bookkeeping, see GalleryEviction
+    void SetEviction (GalleryEviction* eviction);
+    // shared with the shards of a gallery, see CameraTopology
+    virtual void SetTopology (std::shared_ptr<CameraTopology> topology);
+    // shared with the shards of a gallery, see TemporalIndex
+    virtual void SetTemporalIndex (std::shared_ptr<TemporalIndex> temporal);
+    // shared with the shards of a gallery, see ReRanker
+    virtual void SetReRanker (std::shared_ptr<ReRanker> reranker);
+    // id was matched below low_dist_ on camera_id
+    void Touch  (int64_t id, int64_t camera_id);
+    // drops up to budget entries past their ttl
+    void Expire (size_t budget);
+    // drops the entry the eviction policy picks to make room, returns its
+    // id, -1 if no entry is tracked
+    int64_t Evict (void);
+
+    void SetDistanceThresh (float low, float high);
+
+    // takes ownership of an exact gallery used to sample recall
+    void SetRecallShadow   (GalleryInterface* exact);
+
+    /*
+     * Same contract as TSObjectReIDDB::insertandSearchID: a query closer than
+     * low_dist_ takes the id of its nearest entry, one between low_dist_ and
+     * high_dist_ takes that id without touching the gallery, anything else
+     * becomes a new identity. All queries are searched with one SearchBatch,
+     * so detections of several frames may be passed together.
+     */
+    virtual void InsertAndSearch (std::vector<GalleryQuery>& queries);
+
+    virtual GalleryStats GetStats (void);
+    int64_t      NextId    (void);
+    void         PrintStats (void);
+
+protected:
+    /*
+     * The writer side of every insert and eviction, mutex_ held: room is
+     * made by the eviction policy first, the shadow and the bookkeeping
+     * follow the gallery, evictions are logged. False if the gallery did
+     * not take the entry, nothing but the evictions happened then.
+     */
+    bool InsertEntry  (int64_t id, const float* feature, int64_t camera_id);
+    void EvictEntry   (int64_t id);
+    void ExpireLocked (size_t budget);
+    // UpdateEntry with mutex_ held
+    virtual bool UpdateLocked (int64_t id, int64_t camera_id,
+                               const float* feature);
+    // entries restored from a snapshot join the eviction order
+    void Tracked      (int64_t id);
+    // the entries FilteredSearch scores when there is a temporal index
+    typedef enum _SearchWindow {
+        WINDOW_RECENT_FIRST,    // the recent window, the rest on a miss
+        WINDOW_RECENT,          // the recent window only
+        WINDOW_ALL              // every entry at once
+    } SearchWindow;
+
+    /*
+     * SearchBatch of g for the k nearest entries, the features of each
+     * camera limited to the candidates the topology allows it, if any.
+     * With a temporal index and WINDOW_RECENT_FIRST the recent window is
+     * searched first, the rest only for the features it leaves without a
+     * match below low_dist_.
+     */
+    void FilteredSearch (GalleryInterface* g, const float* const* features,
+                         const int64_t* camera_ids, size_t n,
+                         GalleryMatch* matches, size_t* found,
+                         GalleryStats& stats,
+                         SearchWindow window = WINDOW_RECENT_FIRST,
+                         size_t k = 1);
+    /*
+     * Re-ranks the k nearest of an ambiguous match, true with best set to
+     * the k-reciprocal winner when that is below high_dist_. Both spend
+     * the frame's budget_ns and do nothing once it is gone.
+     */
+    bool ReRank      (const float* feature, int64_t camera_id,
+                      GalleryMatch& best, int64_t& budget_ns,
+                      GalleryStats& stats);
+    // a new entry joins the neighbour lists
+    void ReRankIndex (int64_t id, const float* feature, int64_t& budget_ns,
+                      GalleryStats& stats);
+
+protected:
+    GalleryConfig      cfg_                 ;
+    std::mutex         mutex_               ;
+    GalleryStats       stats_      {       };
+    int64_t            next_id_    { 1     };
+    GalleryInterface*  exact_      { NULL  };
+    GalleryJournal*    journal_    { NULL  };
+    GalleryEviction*   eviction_   { NULL  };
+    std::shared_ptr<CameraTopology> topology_ { };
+    std::shared_ptr<TemporalIndex>  temporal_ { };
+    std::shared_ptr<ReRanker>       reranker_ { };
+    std::atomic<uint64_t> recall_tick_ { 0 };
+};
+
+/*
+ * Picks the k largest of n dot-product scores and writes them to out as
+ * ascending cosine distances, returns the number written.
+ */
+size_t SelectNearest (const float* scores, const int64_t* ids, size_t n,
+                      size_t k, GalleryMatch* out);
+// the same, merged into the found entries already sorted in out
+size_t MergeNearest  (const float* scores, const int64_t* ids, size_t n,
+                      size_t k, GalleryMatch* out, size_t found);
+
+GalleryMode       StringToGalleryMode    (std::string& mode);
+GalleryStorage    StringToGalleryStorage (std::string& storage);
+const char*       GalleryStorageName     (GalleryStorage storage);
+GalleryInterface* CreateGallery       (const GalleryConfig& config);
+
+#endif //__TS_GALLERY_INTERFACE_H__
@@ -0,0 +1,418 @@
+/*
+ * @Description: Implement of the ReID gallery write-ahead log.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-23 14:20:51
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-23 14:20:51
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+#include "Common.h"
+#include "GalleryInterface.h"
+#include "GalleryJournal.h"
+
+// wake the writer before the flush window ends once this much is pending
+#define GALLERY_JOURNAL_EARLY_FLUSH (4 << 20)
+// records failed flushes may hold back before they are dropped
+#define GALLERY_JOURNAL_MAX_HELD    (256 << 20)
+
+static uint32_t Crc32 (uint32_t crc, const void* data, size_t bytes)
+{
+    static uint32_t table[256];
+    static std::once_flag once;
+    std::call_once (once, [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+
+    const uint8_t* p = (const uint8_t*) data;
+    crc = ~crc;
+    while (bytes--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// crc of a record, everything after the crc_ field plus the feature
+static uint32_t RecordCrc (const JournalRecord& r, const float* feature)
+{
+    const char* tail = (const char*) &r.type_;
+    uint32_t crc = Crc32 (0, tail, (const char*) (&r + 1) - tail);
+
+    return r.dims_ ? Crc32 (crc, feature, r.dims_ * sizeof (float)) : crc;
+}
+
+GalleryJournal::~GalleryJournal (void)
+{
+    Stop ();
+}
+
+std::string GalleryJournal::SegmentPath (uint64_t seq)
+{
+    return snapshot_ + ".wal." + std::to_string (seq);
+}
+
+std::vector<uint64_t> GalleryJournal::ListSegments (void)
+{
+    std::vector<uint64_t> segments;
+    std::vector<char> dir (snapshot_.begin (), snapshot_.end ());
+    std::vector<char> base (snapshot_.begin (), snapshot_.end ());
+    dir.push_back ('\0');
+    base.push_back ('\0');
+
+    std::string prefix = std::string (basename (base.data ())) + ".wal.";
+    DIR* d = opendir (dirname (dir.data ()));
+    if (!d) return segments;
+
+    struct dirent* e;
+    while ((e = readdir (d))) {
+        if (strncmp (e->d_name, prefix.c_str (), prefix.size ())) continue;
+        char* end;
+        uint64_t seq = strtoull (e->d_name + prefix.size (), &end, 10);
+        if (*end == '\0' && seq > 0) segments.push_back (seq);
+    }
+    closedir (d);
+
+    std::sort (segments.begin (), segments.end ());
+    return segments;
+}
+
+size_t GalleryJournal::Replay (const std::string& path)
+{
+    std::vector<char> data;
+    char buf[65536];
+    size_t replayed = 0, pos = 0;
+    ssize_t n;
+
+    int fd = open (path.c_str (), O_RDONLY);
+    if (fd < 0) return 0;
+    while ((n = read (fd, buf, sizeof (buf))) > 0)
+        data.insert (data.end (), buf, buf + n);
+    close (fd);
+
+    std::vector<float> feature;
+    while (pos + sizeof (JournalRecord) <= data.size ()) {
+        JournalRecord r;
+        memcpy (&r, &data[pos], sizeof (r));
+        size_t bytes = sizeof (r) + (size_t) r.dims_ * sizeof (float);
+        if (r.magic_ != GALLERY_JOURNAL_MAGIC ||
+            r.type_ < JOURNAL_RECORD_ADD || r.type_ > JOURNAL_RECORD_UPDATE ||
+            pos + bytes > data.size ()) break;
+
+        feature.resize (r.dims_);
+        if (r.dims_) {
+            memcpy (feature.data (), &data[pos + sizeof (r)],
+                r.dims_ * sizeof (float));
+        }
+        if (r.crc_ != RecordCrc (r, feature.data ())) break;
+
+        if (r.type_ == JOURNAL_RECORD_REMOVE) {
+            gallery_->ReplayRemove (r.id_);
+        } else if (r.type_ == JOURNAL_RECORD_UPDATE) {
+            gallery_->ReplayUpdate (r.id_, r.camera_id_, feature.data (),
+                r.dims_);
+        } else if (gallery_->ReplayAdd (r.id_, r.camera_id_, feature.data (),
+            r.dims_)) {
+            replayed++;
+        }
+        pos += bytes;
+    }
+
+    // a torn tail is the last group commit that never reached the disk
+    if (pos != data.size ()) {
+        TS_WARN_MSG_V ("Dropped %ld trailing bytes of %s", data.size () - pos,
+            path.c_str ());
+    }
+
+    return replayed;
+}
+
+bool GalleryJournal::OpenSegment (uint64_t seq)
+{
+    if (fd_ >= 0) close (fd_);
+
+    fd_ = open (SegmentPath (seq).c_str (), O_WRONLY | O_CREAT | O_APPEND,
+        0644);
+    if (fd_ < 0) {
+        TS_ERR_MSG_V ("Failed to open %s: %s", SegmentPath (seq).c_str (),
+            strerror (errno));
+        return false;
+    }
+
+    seq_  = seq;
+    torn_ = false;
+    return true;
+}
+
+bool GalleryJournal::Start (GalleryInterface* gallery,
+    const std::string& snapshot, int flush_ms, int checkpoint_sec,
+    uint64_t checkpoint_bytes)
+{
+    if (!gallery || snapshot.empty () || flush_ms <= 0) return false;
+
+    gallery_          = gallery;
+    snapshot_         = snapshot;
+    flush_ms_         = flush_ms;
+    checkpoint_sec_   = checkpoint_sec;
+    checkpoint_bytes_ = checkpoint_bytes;
+
+    // replayed segments stay until the next checkpoint covers them
+    std::vector<uint64_t> segments = ListSegments ();
+    size_t replayed = 0;
+    for (auto&& seq : segments) {
+        replayed += Replay (SegmentPath (seq));
+    }
+    if (!segments.empty ()) {
+        TS_INFO_MSG_V ("Replayed %ld gallery inserts from %ld wal segments",
+            replayed, segments.size ());
+    }
+
+    if (!OpenSegment (segments.empty () ? 1 : segments.back () + 1)) {
+        // the gallery runs on without a wal, a snapshot saved later would
+        // have the replayed segments applied on top of it once more
+        if (segments.empty ()) return false;
+        if (!gallery_->SaveSnapshot (snapshot_)) {
+            TS_ERR_MSG_V ("Kept %ld replayed wal segments of %s, neither a "
+                "new segment nor the snapshot is writable", segments.size (),
+                snapshot_.c_str ());
+            return false;
+        }
+        for (auto&& seq : segments) unlink (SegmentPath (seq).c_str ());
+        TS_WARN_MSG_V ("Checkpointed %ld replayed wal segments of %s",
+            segments.size (), snapshot_.c_str ());
+        return false;
+    }
+
+    stop_   = false;
+    thread_ = std::thread (&GalleryJournal::Run, this);
+    return true;
+}
+
+void GalleryJournal::Stop (void)
+{
+    if (!thread_.joinable ()) return;
+
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        stop_ = true;
+    }
+    cond_.notify_one ();
+    thread_.join ();
+
+    close (fd_);
+    fd_ = -1;
+
+    // the writer drained the buffer, a final snapshot covers every segment
+    // and whatever the last flush could not write
+    if (gallery_->SaveSnapshot (snapshot_)) {
+        for (auto&& seq : ListSegments ()) {
+            unlink (SegmentPath (seq).c_str ());
+        }
+    } else if (!writing_.empty ()) {
+        uint64_t n = CountRecords (writing_);
+        TS_ERR_MSG_V ("Dropped %lu gallery wal records, neither the wal nor "
+            "the snapshot is writable", n);
+        dropped_ += n;
+    }
+    writing_.clear ();
+
+    TS_INFO_MSG_V ("gallery wal: %lu records in %lu group commits, %lu failed "
+        "flushes, %lu records dropped", records_, syncs_, failures_, dropped_);
+}
+
+void GalleryJournal::AppendRecord (const JournalRecord& r,
+    const float* feature)
+{
+    size_t bytes = r.dims_ * sizeof (float);
+    bool   wake;
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        size_t pos = pending_.size ();
+        pending_.resize (pos + sizeof (r) + bytes);
+        memcpy (&pending_[pos], &r, sizeof (r));
+        if (feature && bytes) {
+            memcpy (&pending_[pos + sizeof (r)], feature, bytes);
+        }
+        wake = pending_.size () >= GALLERY_JOURNAL_EARLY_FLUSH;
+    }
+
+    if (wake) cond_.notify_one ();
+}
+
+void GalleryJournal::Append (int64_t id, int64_t camera_id,
+    const float* feature, size_t dims)
+{
+    JournalRecord r;
+    r.type_      = JOURNAL_RECORD_ADD;
+    r.dims_      = dims;
+    r.id_        = id;
+    r.camera_id_ = camera_id;
+    r.crc_       = RecordCrc (r, feature);
+
+    AppendRecord (r, feature);
+}
+
+void GalleryJournal::AppendUpdate (int64_t id, int64_t camera_id,
+    const float* feature, size_t dims)
+{
+    JournalRecord r;
+    r.type_      = JOURNAL_RECORD_UPDATE;
+    r.dims_      = dims;
+    r.id_        = id;
+    r.camera_id_ = camera_id;
+    r.crc_       = RecordCrc (r, feature);
+
+    AppendRecord (r, feature);
+}
+
+void GalleryJournal::AppendRemove (int64_t id)
+{
+    JournalRecord r;
+    r.type_ = JOURNAL_RECORD_REMOVE;
+    r.id_   = id;
+    r.crc_  = RecordCrc (r, NULL);
+
+    AppendRecord (r, NULL);
+}
+
+uint64_t GalleryJournal::CountRecords (const std::vector<char>& buffer)
+{
+    uint64_t n = 0;
+
+    for (size_t pos = 0; pos + sizeof (JournalRecord) <= buffer.size (); n++) {
+        const JournalRecord* r = (const JournalRecord*) &buffer[pos];
+        pos += sizeof (JournalRecord) + r->dims_ * sizeof (float);
+    }
+
+    return n;
+}
+
+bool GalleryJournal::Flush (void)
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        // what a failed flush held back goes first
+        if (writing_.empty ()) {
+            writing_.swap (pending_);
+        } else {
+            writing_.insert (writing_.end (), pending_.begin (),
+                pending_.end ());
+            pending_.clear ();
+        }
+    }
+
+    if (writing_.empty ()) return fd_ >= 0;
+
+    // records after a torn one would never be replayed
+    if (torn_) OpenSegment (seq_ + 1);
+
+    off_t       start = fd_ >= 0 ? lseek (fd_, 0, SEEK_END) : -1;
+    const char* p     = writing_.data ();
+    size_t      left  = writing_.size ();
+    while (fd_ >= 0 && left) {
+        ssize_t n = write (fd_, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // once per run of failures, the flush is retried every window
+            if (!failing_) {
+                TS_ERR_MSG_V ("Failed to write gallery wal: %s",
+                    strerror (errno));
+            }
+            break;
+        }
+        p    += n;
+        left -= n;
+    }
+
+    if (fd_ >= 0 && !left && !fdatasync (fd_)) {
+        if (failing_) {
+            TS_INFO_MSG_V ("gallery wal written again, %lu failed flushes so "
+                "far", failures_);
+            failing_ = false;
+        }
+        records_       += CountRecords (writing_);
+        segment_bytes_ += writing_.size ();
+        syncs_ ++;
+        writing_.clear ();
+        return true;
+    }
+
+    // none of it counts as written, the next flush writes it all again
+    failures_ ++;
+    failing_ = true;
+    if (fd_ >= 0 && (start < 0 || ftruncate (fd_, start))) torn_ = true;
+
+    if (writing_.size () > GALLERY_JOURNAL_MAX_HELD) {
+        uint64_t n = CountRecords (writing_);
+        TS_ERR_MSG_V ("Dropped %lu gallery wal records, the wal is not "
+            "writable", n);
+        dropped_ += n;
+        writing_.clear ();
+    }
+
+    return false;
+}
+
+bool GalleryJournal::Checkpoint (void)
+{
+    uint64_t covered = seq_;
+
+    // everything up to here is in the gallery, the snapshot will contain it
+    Flush ();
+    if (!OpenSegment (seq_ + 1)) return false;
+
+    if (!gallery_->SaveSnapshot (snapshot_)) return false;
+
+    // records a failed flush held back are in the snapshot too, the ones
+    // appended since are still pending
+    writing_.clear ();
+    for (auto&& seq : ListSegments ()) {
+        if (seq <= covered) unlink (SegmentPath (seq).c_str ());
+    }
+    segment_bytes_ = 0;
+
+    return true;
+}
+
+void GalleryJournal::Run (void)
+{
+    auto last = std::chrono::steady_clock::now ();
+    bool stop = false;
+
+    while (!stop) {
+        {
+            std::unique_lock<std::mutex> lock (mutex_);
+            cond_.wait_for (lock, std::chrono::milliseconds (flush_ms_),
+                [this] { return stop_ ||
+                    pending_.size () >= GALLERY_JOURNAL_EARLY_FLUSH; });
+            stop = stop_;
+        }
+
+        // a snapshot is the other way to keep what could not be written
+        bool failed = !Flush ();
+
+        auto now = std::chrono::steady_clock::now ();
+        bool due = (failed && now - last >= std::chrono::seconds (1)) ||
+            (checkpoint_bytes_ && segment_bytes_ >= checkpoint_bytes_) ||
+            (checkpoint_sec_ && segment_bytes_ &&
+             now - last >= std::chrono::seconds (checkpoint_sec_));
+        if (due && !stop) {
+            if (!Checkpoint ()) {
+                TS_WARN_MSG_V ("gallery checkpoint failed, keeping the wal");
+            }
+            last = now;
+        }
+    }
+}
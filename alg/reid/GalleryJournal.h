@@ -0,0 +1,127 @@
+/*
+ * @Description: Write-ahead log and background checkpoints of a ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-23 14:20:51
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-23 14:20:51
+ */
+
+#ifndef __TS_GALLERY_JOURNAL_H__
+#define __TS_GALLERY_JOURNAL_H__
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define GALLERY_JOURNAL_MAGIC 0x4c415752  // "RWAL"
+
+class GalleryInterface;
+
+typedef enum _JournalRecordType {
+    JOURNAL_RECORD_ADD    = 1,
+    JOURNAL_RECORD_REMOVE = 2,  // eviction, no feature
+    JOURNAL_RECORD_UPDATE = 3   // a new feature for an existing id
+} JournalRecordType;
+
+// followed by dims_ floats, crc_ covers everything after itself
+typedef struct _JournalRecord {
+    uint32_t magic_ { GALLERY_JOURNAL_MAGIC };
+    uint32_t crc_   { 0 };
+    uint32_t type_  { 0 };
+    uint32_t dims_  { 0 };
+    int64_t  id_    { 0 };
+    int64_t  camera_id_ { 0 };  // routes the insert back to its shard
+} JournalRecord;
+
+/*
+ * Gallery inserts are appended to an in-memory buffer under the gallery lock,
+ * a background thread writes the buffer to <snapshot>.wal.<seq> and syncs it
+ * every flush_ms (group commit), so at most one flush window of identities
+ * is lost on a crash and the insert path never waits for the disk.
+ *
+ * A flush that fails cuts the segment back to where it started and keeps
+ * its records for the next flush, on a new segment if the cut failed too.
+ * It also forces a checkpoint, a snapshot holds those records as well.
+ * Past GALLERY_JOURNAL_MAX_HELD bytes held back they are dropped and
+ * counted.
+ *
+ * A checkpoint first moves the log to a new segment, then saves a snapshot
+ * and drops the segments before it. Ids are handed out in increasing order,
+ * so on replay a record below the snapshot's next id is already contained
+ * in the snapshot and skipped. Updates and removals are replayed as they
+ * are, applying them twice leaves the same entry.
+ */
+class GalleryJournal
+{
+public:
+    GalleryJournal (void) {}
+    ~GalleryJournal (void);
+
+    /*
+     * Replays the segments left next to snapshot into gallery, which has
+     * already loaded the snapshot, then opens a new segment and starts the
+     * writer. checkpoint_sec / checkpoint_bytes of 0 disable that trigger.
+     * If no segment can be opened the replayed ones are checkpointed into
+     * the snapshot and removed, they stay only if that fails as well.
+     */
+    bool Start (GalleryInterface* gallery, const std::string& snapshot,
+                int flush_ms, int checkpoint_sec, uint64_t checkpoint_bytes);
+
+    /*
+     * Joins the writer after it synced everything appended so far, then
+     * saves a final snapshot and removes the segments. No insert may run
+     * concurrently.
+     */
+    void Stop  (void);
+
+    // called with the gallery lock held, only copies into the buffer
+    void Append (int64_t id, int64_t camera_id, const float* feature,
+                 size_t dims);
+    void AppendRemove (int64_t id);
+    void AppendUpdate (int64_t id, int64_t camera_id, const float* feature,
+                       size_t dims);
+
+private:
+    // snapshot plus dropping the covered segments, on the writer thread
+    bool   Checkpoint  (void);
+    void   Run         (void);
+    void   AppendRecord (const JournalRecord& r, const float* feature);
+    // writes and syncs the pending records, false keeps them in writing_
+    bool   Flush       (void);
+    // records in a buffer of them
+    static uint64_t CountRecords (const std::vector<char>& buffer);
+    bool   OpenSegment (uint64_t seq);
+    size_t Replay      (const std::string& path);
+    std::vector<uint64_t> ListSegments (void);
+    std::string SegmentPath (uint64_t seq);
+
+private:
+    GalleryInterface*       gallery_          { NULL  };
+    std::string             snapshot_         {       };
+    int                     flush_ms_         { 50    };
+    int                     checkpoint_sec_   { 0     };
+    uint64_t                checkpoint_bytes_ { 0     };
+    //--------------------------------------------------
+    std::mutex              mutex_                    ;  // guards pending_
+    std::condition_variable cond_                     ;
+    std::vector<char>       pending_          {       };
+    bool                    stop_             { false };
+    //--------------------------------------------------
+    std::thread             thread_                   ;
+    std::vector<char>       writing_          {       };  // unsynced
+    int                     fd_               { -1    };
+    bool                    torn_             { false };  // fd_ ends mid-record
+    bool                    failing_          { false };  // the last flush failed
+    uint64_t                seq_              { 0     };
+    uint64_t                segment_bytes_    { 0     };  // since the checkpoint
+    uint64_t                records_          { 0     };
+    uint64_t                syncs_            { 0     };
+    uint64_t                failures_         { 0     };  // flushes that failed
+    uint64_t                dropped_          { 0     };  // records never written
+};
+
+#endif //__TS_GALLERY_JOURNAL_H__
@@ -0,0 +1,248 @@
+/*
+ * @Description: Implement of the gallery node server.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "GalleryServer.h"
+
+GalleryServer::~GalleryServer (void)
+{
+    Stop ();
+}
+
+bool GalleryServer::Start (GalleryInterface* gallery, size_t dims,
+    const std::string& address)
+{
+    if (running_) return false;
+
+    if ((listen_ = WireListen (address)) < 0) return false;
+
+    gallery_  = gallery;
+    dims_     = dims;
+    address_  = address;
+    running_  = true;
+    acceptor_ = std::thread (&GalleryServer::Accept, this);
+
+    TS_INFO_MSG_V ("gallery %s served on %s", gallery_->Name (),
+        address_.c_str ());
+    return true;
+}
+
+void GalleryServer::Stop (void)
+{
+    if (!running_.exchange (false)) return;
+
+    // wakes the accept and every blocked receive
+    shutdown (listen_, SHUT_RDWR);
+    acceptor_.join ();
+    close (listen_);
+    listen_ = -1;
+
+    {
+        std::lock_guard<std::mutex> lock (conns_mutex_);
+        for (auto&& fd : conns_) shutdown (fd, SHUT_RDWR);
+    }
+    for (auto&& t : threads_) t.join ();
+    threads_.clear ();
+    done_.clear ();
+
+    if (!address_.compare (0, 5, "unix:")) unlink (address_.c_str () + 5);
+}
+
+void GalleryServer::Accept (void)
+{
+    while (running_) {
+        int fd = accept (listen_, NULL, NULL);
+        if (fd < 0) {
+            if (running_ && errno != EINTR) {
+                TS_WARN_MSG_V ("gallery server accept failed(%s)",
+                    strerror (errno));
+            }
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock (conns_mutex_);
+        if (!running_) {
+            close (fd);
+            break;
+        }
+        Reap ();
+        conns_.push_back (fd);
+        threads_.push_back (std::thread (&GalleryServer::Serve, this, fd));
+    }
+}
+
+void GalleryServer::Reap (void)
+{
+    // a thread in done_ only has the unlock of conns_mutex_ left to run
+    for (auto&& id : done_) {
+        auto it = std::find_if (threads_.begin (), threads_.end (),
+            [&id] (const std::thread& t) { return t.get_id () == id; });
+        if (it == threads_.end ()) continue;
+        it->join ();
+        threads_.erase (it);
+    }
+    done_.clear ();
+}
+
+void GalleryServer::Serve (int fd)
+{
+    WireHeader        request, reply;
+    std::vector<char> body, out;
+
+    // requests pipelined by the client queue up in the socket buffer
+    while (running_ && WireReceive (fd, request, body)) {
+        reply = WireHeader ();
+        reply.type_ = request.type_;
+        reply.seq_  = request.seq_;
+        out.clear ();
+
+        Handle (request, body, reply, out);
+
+        struct iovec part = { out.data (), out.size () };
+        if (!WireSend (fd, reply, &part, out.empty () ? 0 : 1)) break;
+    }
+
+    // gone from conns_ before the number can be reused
+    std::lock_guard<std::mutex> lock (conns_mutex_);
+    conns_.erase (std::find (conns_.begin (), conns_.end (), fd));
+    close (fd);
+    // joined by the next accept, the handle and stack are not kept to Stop
+    done_.push_back (std::this_thread::get_id ());
+}
+
+void GalleryServer::Handle (const WireHeader& request,
+    const std::vector<char>& body, WireHeader& reply, std::vector<char>& out)
+{
+    static thread_local std::vector<const float*> rows;
+    static thread_local std::vector<GalleryMatch> matches;
+    static thread_local std::vector<size_t>       found;
+    static thread_local std::vector<GalleryQuery> queries;
+    const char* p   = body.data ();
+    size_t      len = body.size ();
+
+    std::unique_lock<std::mutex> lock (mutex_, std::defer_lock);
+    if (!gallery_->ConcurrentSearch ()) lock.lock ();
+
+    reply.status_ = WIRE_BAD;
+
+    switch (request.type_) {
+    case WIRE_SEARCH: {
+        WireSearch s;
+        if (len < sizeof (s)) return;
+        memcpy (&s, p, sizeof (s));
+        if (s.dims_ != dims_ || s.k_ == 0 || s.k_ > GALLERY_WIRE_MAX_K ||
+            len != sizeof (s) + (size_t) s.n_ * s.dims_ * sizeof (float)) {
+            return;
+        }
+
+        // k and n come from the peer, sized in size_t and bounded first
+        size_t n     = s.n_;
+        size_t k     = s.k_;
+        size_t reply_bytes = n * (sizeof (uint32_t) + k * sizeof (WireMatch));
+        if (reply_bytes > GALLERY_WIRE_MAX_BODY) return;
+
+        const float* f = (const float*) (p + sizeof (s));
+        rows.resize (n);
+        for (size_t i = 0; i < n; i++) rows[i] = f + i * dims_;
+        matches.assign (n * k, GalleryMatch ());
+        found.assign (n, 0);
+        gallery_->SearchBatch (rows.data (), n, k, matches.data (),
+            found.data ());
+
+        out.resize (reply_bytes);
+        uint32_t*  counts = (uint32_t*) out.data ();
+        WireMatch* m      = (WireMatch*) (counts + n);
+        for (size_t i = 0; i < n; i++) counts[i] = found[i];
+        for (size_t i = 0; i < matches.size (); i++) {
+            m[i] = WireMatch ();
+            m[i].id_       = matches[i].id_;
+            m[i].distance_ = matches[i].distance_;
+        }
+        break;
+    }
+    case WIRE_INSERT: {
+        WireInsert s;
+        if (len < sizeof (s)) return;
+        memcpy (&s, p, sizeof (s));
+        if (s.dims_ != dims_ || len != sizeof (s) + (size_t) s.n_ *
+            (sizeof (int64_t) + s.dims_ * sizeof (float))) {
+            return;
+        }
+
+        const int64_t* cameras = (const int64_t*) (p + sizeof (s));
+        const float*   f       = (const float*) (cameras + s.n_);
+        queries.assign (s.n_, GalleryQuery ());
+        for (size_t i = 0; i < s.n_; i++) {
+            queries[i].feature_   = f + i * dims_;
+            queries[i].camera_id_ = cameras[i];
+        }
+        gallery_->InsertAndSearch (queries);
+
+        out.resize (s.n_ * sizeof (WireMatch));
+        WireMatch* m = (WireMatch*) out.data ();
+        for (size_t i = 0; i < s.n_; i++) {
+            m[i] = WireMatch ();
+            m[i].id_       = queries[i].object_id_;
+            m[i].distance_ = queries[i].distance_;
+        }
+        break;
+    }
+    case WIRE_TOUCH: {
+        uint32_t n;
+        if (len < 2 * sizeof (uint32_t)) return;
+        memcpy (&n, p, sizeof (n));
+        if (len != 2 * sizeof (uint32_t) + n * sizeof (WireTouch)) return;
+
+        const WireTouch* t = (const WireTouch*) (p + 2 * sizeof (uint32_t));
+        for (size_t i = 0; i < n; i++) {
+            gallery_->Touch (t[i].id_, t[i].camera_id_);
+        }
+        break;
+    }
+    case WIRE_UPDATE:
+    case WIRE_REMOVE: {
+        WireEntry e;
+        if (len < sizeof (e)) return;
+        memcpy (&e, p, sizeof (e));
+
+        if (request.type_ == WIRE_REMOVE) {
+            if (len != sizeof (e)) return;
+            reply.status_ = gallery_->ReplayRemove (e.id_) ? WIRE_OK :
+                WIRE_NOT_FOUND;
+            return;
+        }
+
+        if (e.dims_ != dims_ || len != sizeof (e) + dims_ * sizeof (float)) {
+            return;
+        }
+        reply.status_ = gallery_->UpdateEntry (e.id_, e.camera_id_,
+            (const float*) (p + sizeof (e))) ? WIRE_OK : WIRE_FAILED;
+        return;
+    }
+    case WIRE_INFO: {
+        WireInfo info;
+        info.dims_    = dims_;
+        info.size_    = gallery_->Size ();
+        info.memory_  = gallery_->MemoryBytes ();
+        info.next_id_ = gallery_->NextId ();
+        out.assign ((const char*) &info, (const char*) &info + sizeof (info));
+        break;
+    }
+    default:
+        return;
+    }
+
+    reply.status_ = WIRE_OK;
+}
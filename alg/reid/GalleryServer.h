@@ -0,0 +1,65 @@
+/*
+ * @Description: Serves one gallery shard to RemoteGallery clients.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#ifndef __TS_GALLERY_SERVER_H__
+#define __TS_GALLERY_SERVER_H__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GalleryInterface.h"
+#include "GalleryWire.h"
+
+/*
+ * Answers the GalleryWire requests of any number of connections, one
+ * thread each, in the order they arrive on a connection. The gallery is
+ * searched without a lock when it supports concurrent readers, otherwise
+ * every request of every connection is serialized on mutex_. The gallery
+ * keeps its own snapshot, wal, eviction and sighting indexes, the server
+ * only translates requests.
+ */
+class GalleryServer
+{
+public:
+    GalleryServer (void) {}
+    ~GalleryServer (void);
+
+    // serves gallery of dims, owned by the caller, on address (WireListen)
+    bool Start (GalleryInterface* gallery, size_t dims,
+                const std::string& address);
+    // closes the listener and every connection, joins their threads
+    void Stop  (void);
+
+private:
+    void Accept (void);
+    // joins the threads of the closed connections, under conns_mutex_
+    void Reap   (void);
+    void Serve  (int fd);
+    // fills the response of one request, its status in reply.status_
+    void Handle (const WireHeader& request, const std::vector<char>& body,
+                 WireHeader& reply, std::vector<char>& out);
+
+private:
+    GalleryInterface*        gallery_  { NULL  };
+    size_t                   dims_     { 0     };
+    std::string              address_  {       };
+    int                      listen_   { -1    };
+    std::atomic<bool>        running_  { false };
+    std::mutex               mutex_    ;   // the gallery, if not concurrent
+    std::mutex               conns_mutex_ ;
+    std::vector<int>         conns_    {       };
+    std::vector<std::thread> threads_  {       };
+    std::vector<std::thread::id> done_ {       };  // served, not joined yet
+    std::thread              acceptor_ ;
+};
+
+#endif //__TS_GALLERY_SERVER_H__
@@ -0,0 +1,215 @@
+/*
+ * @Description: Implement of the ReID gallery snapshot file.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-22 10:15:36
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-22 10:15:36
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Common.h"
+#include "GallerySnapshot.h"
+
+static uint64_t AlignUp (uint64_t n)
+{
+    return (n + GALLERY_SNAPSHOT_ALIGN - 1) / GALLERY_SNAPSHOT_ALIGN *
+        GALLERY_SNAPSHOT_ALIGN;
+}
+
+static bool WriteAt (int fd, uint64_t offset, const void* data, size_t bytes)
+{
+    const char* p = (const char*) data;
+
+    while (bytes) {
+        ssize_t n = pwrite (fd, p, bytes, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p      += n;
+        offset += n;
+        bytes  -= n;
+    }
+
+    return true;
+}
+
+// a rename is only durable once the directory entry is synced
+static void SyncDirectory (const std::string& path)
+{
+    std::vector<char> buf (path.begin (), path.end ());
+    buf.push_back ('\0');
+
+    int fd = open (dirname (buf.data ()), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    fsync (fd);
+    close (fd);
+}
+
+bool WriteGallerySnapshot (const std::string& path,
+    GallerySnapshotHeader& header, const int64_t* ids, const float* scales,
+    std::function<const void* (size_t)> row, const void* extra)
+{
+    uint64_t row_bytes = (uint64_t) header.stride_ * header.elem_bytes_;
+
+    memcpy (header.magic_, GALLERY_SNAPSHOT_MAGIC, sizeof (header.magic_));
+    header.version_       = GALLERY_SNAPSHOT_VERSION;
+    header.ids_offset_    = AlignUp (sizeof (GallerySnapshotHeader));
+    header.scales_offset_ = scales ? AlignUp (header.ids_offset_ +
+        header.capacity_ * sizeof (int64_t)) : 0;
+    header.matrix_offset_ = AlignUp ((scales ? header.scales_offset_ +
+        header.capacity_ * sizeof (float) : header.ids_offset_ +
+        header.capacity_ * sizeof (int64_t)));
+    header.file_bytes_    = header.matrix_offset_ + header.capacity_ * row_bytes;
+    header.extra_offset_  = 0;
+    if (extra && header.extra_bytes_) {
+        header.extra_offset_ = AlignUp (header.file_bytes_);
+        header.file_bytes_   = header.extra_offset_ + header.extra_bytes_;
+    } else {
+        header.extra_bytes_  = 0;
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        TS_ERR_MSG_V ("Failed to create %s: %s", tmp.c_str (), strerror (errno));
+        return false;
+    }
+
+    // rows past count_ and the gaps between sections stay holes
+    bool ok = ftruncate (fd, header.file_bytes_) == 0 &&
+        WriteAt (fd, 0, &header, sizeof (header)) &&
+        WriteAt (fd, header.ids_offset_, ids, header.capacity_ * sizeof (int64_t)) &&
+        (!scales || WriteAt (fd, header.scales_offset_, scales,
+            header.capacity_ * sizeof (float)));
+
+    for (uint64_t i = 0; ok && i < header.count_; i++) {
+        ok = WriteAt (fd, header.matrix_offset_ + i * row_bytes, row (i),
+            row_bytes);
+    }
+
+    if (ok && header.extra_bytes_) {
+        ok = WriteAt (fd, header.extra_offset_, extra, header.extra_bytes_);
+    }
+
+    ok = ok && fsync (fd) == 0;
+    ok = (close (fd) == 0) && ok;
+    if (!ok || rename (tmp.c_str (), path.c_str ()) != 0) {
+        TS_ERR_MSG_V ("Failed to write gallery snapshot %s: %s", path.c_str (),
+            strerror (errno));
+        unlink (tmp.c_str ());
+        return false;
+    }
+
+    SyncDirectory (path);
+    return true;
+}
+
+GallerySnapshot::~GallerySnapshot (void)
+{
+    Unmap ();
+}
+
+bool GallerySnapshot::Map (const std::string& path)
+{
+    struct stat st;
+
+    Unmap ();
+
+    int fd = open (path.c_str (), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            TS_WARN_MSG_V ("Failed to open gallery snapshot %s: %s",
+                path.c_str (), strerror (errno));
+        }
+        return false;
+    }
+
+    if (fstat (fd, &st) != 0 ||
+        (size_t) st.st_size < sizeof (GallerySnapshotHeader)) {
+        TS_WARN_MSG_V ("Gallery snapshot %s is truncated", path.c_str ());
+        close (fd);
+        return false;
+    }
+
+    void* base = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fd, 0);
+    close (fd);
+    if (base == MAP_FAILED) {
+        TS_WARN_MSG_V ("Failed to map gallery snapshot %s: %s", path.c_str (),
+            strerror (errno));
+        return false;
+    }
+
+    base_  = (char*) base;
+    bytes_ = st.st_size;
+
+    const GallerySnapshotHeader* h = Header ();
+    uint64_t row_bytes = (uint64_t) h->stride_ * h->elem_bytes_;
+    uint64_t fsize     = bytes_;
+    bool ok = !memcmp (h->magic_, GALLERY_SNAPSHOT_MAGIC, sizeof (h->magic_)) &&
+        h->version_ == GALLERY_SNAPSHOT_VERSION &&
+        h->file_bytes_ == fsize && h->count_ <= h->capacity_ &&
+        h->oldest_ <= h->count_ && h->stride_ >= h->dims_ &&
+        h->gallery_[sizeof (h->gallery_) - 1] == '\0' &&
+        h->ids_offset_ % GALLERY_SNAPSHOT_ALIGN == 0 &&
+        h->matrix_offset_ % GALLERY_SNAPSHOT_ALIGN == 0 &&
+        h->ids_offset_ + h->capacity_ * sizeof (int64_t) <= fsize &&
+        (!h->scales_offset_ ||
+            h->scales_offset_ + h->capacity_ * sizeof (float) <= fsize) &&
+        (!row_bytes || h->capacity_ <= fsize / row_bytes) &&
+        h->matrix_offset_ + h->capacity_ * row_bytes <= fsize &&
+        (!h->extra_offset_ || h->extra_offset_ + h->extra_bytes_ <= fsize);
+
+    if (!ok) {
+        TS_WARN_MSG_V ("Gallery snapshot %s is corrupt or of another version",
+            path.c_str ());
+        Unmap ();
+        return false;
+    }
+
+    return true;
+}
+
+void GallerySnapshot::Unmap (void)
+{
+    if (base_) {
+        munmap (base_, bytes_);
+        base_  = NULL;
+        bytes_ = 0;
+    }
+}
+
+const float* GallerySnapshot::Scales (void)
+{
+    uint64_t offset = Header ()->scales_offset_;
+
+    return offset ? (const float*) (base_ + offset) : NULL;
+}
+
+const char* GallerySnapshot::Extra (void)
+{
+    uint64_t offset = Header ()->extra_offset_;
+
+    return offset ? base_ + offset : NULL;
+}
+
+char* GallerySnapshot::Detach (size_t& bytes)
+{
+    char* base = base_;
+
+    bytes  = bytes_;
+    base_  = NULL;
+    bytes_ = 0;
+    return base;
+}
@@ -0,0 +1,90 @@
+/*
+ * @Description: Versioned, page-aligned on-disk snapshot of a ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-22 10:15:36
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-22 10:15:36
+ */
+
+#ifndef __TS_GALLERY_SNAPSHOT_H__
+#define __TS_GALLERY_SNAPSHOT_H__
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+#define GALLERY_SNAPSHOT_MAGIC   "TSREIDG"
+#define GALLERY_SNAPSHOT_VERSION 1
+#define GALLERY_SNAPSHOT_ALIGN   4096
+
+/*
+ * File layout, every section starts on a GALLERY_SNAPSHOT_ALIGN boundary:
+ *
+ *   header | ids[capacity] | scales[capacity] | matrix | extra
+ *
+ * The matrix is capacity rows of stride elements, exactly the in-memory
+ * layout of FlatGallery, so it can be searched straight from the mapping.
+ * Extra holds gallery specific state (e.g. the hnsw links), its format is
+ * owned by the gallery named in the header.
+ */
+typedef struct _GallerySnapshotHeader {
+    char     magic_[8]      {   };
+    uint32_t version_       { 0 };
+    uint32_t storage_       { 0 };  // GalleryStorage of the matrix
+    uint32_t dims_          { 0 };
+    uint32_t stride_        { 0 };  // elements per row
+    uint32_t elem_bytes_    { 0 };
+    uint32_t reserved_      { 0 };
+    char     gallery_[16]   {   };  // Name () of the writer
+    uint64_t capacity_      { 0 };  // rows in the matrix section
+    uint64_t count_         { 0 };  // valid rows
+    uint64_t oldest_        { 0 };  // next row to overwrite once full
+    int64_t  next_id_       { 1 };
+    uint64_t ids_offset_    { 0 };
+    uint64_t scales_offset_ { 0 };  // 0 without per-row scales
+    uint64_t matrix_offset_ { 0 };
+    uint64_t extra_offset_  { 0 };  // 0 without extra state
+    uint64_t extra_bytes_   { 0 };
+    uint64_t file_bytes_    { 0 };
+} GallerySnapshotHeader;
+
+/*
+ * Writes path.tmp, syncs it and renames it over path, so a crash leaves
+ * either the old or the new snapshot. row (i) returns the stride_ *
+ * elem_bytes_ bytes of matrix row i, extra points to extra_bytes_ bytes.
+ * The magic, version and offsets of header are filled in here.
+ */
+bool WriteGallerySnapshot (const std::string& path,
+    GallerySnapshotHeader& header, const int64_t* ids, const float* scales,
+    std::function<const void* (size_t)> row, const void* extra);
+
+/*
+ * A validated private mapping of a snapshot. Pages are copy-on-write, a
+ * gallery may Detach () the mapping and keep writing into its matrix
+ * without touching the file.
+ */
+class GallerySnapshot
+{
+public:
+    GallerySnapshot (void) {}
+    ~GallerySnapshot (void);
+
+    bool  Map   (const std::string& path);
+    void  Unmap (void);
+
+    const GallerySnapshotHeader* Header (void) { return (GallerySnapshotHeader*) base_; }
+    const int64_t* Ids    (void) { return (const int64_t*) (base_ + Header ()->ids_offset_); }
+    const float*   Scales (void);
+    char*          Matrix (void) { return base_ + Header ()->matrix_offset_; }
+    const char*    Extra  (void);
+
+    // hands the mapping over to the caller, release it with munmap
+    char* Detach (size_t& bytes);
+
+private:
+    char*  base_  { NULL };
+    size_t bytes_ { 0    };
+};
+
+#endif //__TS_GALLERY_SNAPSHOT_H__
@@ -0,0 +1,211 @@
+/*
+ * @Description: Implement of the gallery node protocol sockets.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Common.h"
+#include "GalleryWire.h"
+
+#define WIRE_BACKLOG 64
+
+// unix:<path> fills un, <host>:<port> resolves into info
+static bool ParseUnix (const std::string& address, struct sockaddr_un& un)
+{
+    if (address.compare (0, 5, "unix:")) return false;
+
+    memset (&un, 0, sizeof (un));
+    un.sun_family = AF_UNIX;
+    strncpy (un.sun_path, address.c_str () + 5, sizeof (un.sun_path) - 1);
+    return true;
+}
+
+static struct addrinfo* Resolve (const std::string& address, bool passive)
+{
+    struct addrinfo hints, *info = NULL;
+    size_t colon = address.rfind (':');
+
+    if (colon == std::string::npos) {
+        TS_ERR_MSG_V ("Invalid gallery node address %s", address.c_str ());
+        return NULL;
+    }
+
+    std::string host = address.substr (0, colon);
+    std::string port = address.substr (colon + 1);
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = passive ? AI_PASSIVE : 0;
+
+    int r = getaddrinfo (host.empty () ? NULL : host.c_str (), port.c_str (),
+        &hints, &info);
+    if (r != 0) {
+        TS_ERR_MSG_V ("Failed to resolve %s(%s)", address.c_str (),
+            gai_strerror (r));
+        return NULL;
+    }
+
+    return info;
+}
+
+static void SetTimeout (int fd, int timeout_ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec  = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+}
+
+int WireListen (const std::string& address)
+{
+    struct sockaddr_un un;
+    int fd = -1, one = 1;
+
+    if (ParseUnix (address, un)) {
+        // a socket file left by a previous run would fail the bind
+        unlink (un.sun_path);
+        if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind (fd, (struct sockaddr*) &un, sizeof (un)) < 0) goto fail;
+    } else {
+        struct addrinfo* info = Resolve (address, true);
+        if (!info) return -1;
+        if ((fd = socket (info->ai_family, SOCK_STREAM, 0)) < 0) {
+            freeaddrinfo (info);
+            goto fail;
+        }
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+        int r = bind (fd, info->ai_addr, info->ai_addrlen);
+        freeaddrinfo (info);
+        if (r < 0) goto fail;
+    }
+
+    if (listen (fd, WIRE_BACKLOG) < 0) goto fail;
+    return fd;
+
+fail:
+    TS_ERR_MSG_V ("Failed to listen on %s(%s)", address.c_str (),
+        strerror (errno));
+    if (fd >= 0) close (fd);
+    return -1;
+}
+
+int WireConnect (const std::string& address, int timeout_ms)
+{
+    struct sockaddr_un un;
+    int fd = -1, one = 1;
+
+    if (ParseUnix (address, un)) {
+        if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect (fd, (struct sockaddr*) &un, sizeof (un)) < 0) goto fail;
+    } else {
+        struct addrinfo* info = Resolve (address, false);
+        if (!info) return -1;
+        if ((fd = socket (info->ai_family, SOCK_STREAM, 0)) < 0) {
+            freeaddrinfo (info);
+            goto fail;
+        }
+        int r = connect (fd, info->ai_addr, info->ai_addrlen);
+        freeaddrinfo (info);
+        if (r < 0) goto fail;
+        // requests are written whole, waiting to coalesce only adds latency
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    }
+
+    if (timeout_ms > 0) SetTimeout (fd, timeout_ms);
+    return fd;
+
+fail:
+    TS_WARN_MSG_V ("Failed to connect to gallery node %s(%s)",
+        address.c_str (), strerror (errno));
+    if (fd >= 0) close (fd);
+    return -1;
+}
+
+bool WireSend (int fd, WireHeader& header, const struct iovec* parts,
+    int count)
+{
+    struct iovec iov[8];
+    size_t total = sizeof (header);
+
+    if (count > 7) return false;
+
+    header.magic_  = GALLERY_WIRE_MAGIC;
+    header.length_ = 0;
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof (header);
+    for (int i = 0; i < count; i++) {
+        iov[i + 1] = parts[i];
+        header.length_ += parts[i].iov_len;
+    }
+    total += header.length_;
+
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = count + 1;
+
+    // a short write leaves the rest in the vector for the next round
+    while (total > 0) {
+        ssize_t n = sendmsg (fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        total -= n;
+        while (msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov ++;
+            msg.msg_iovlen --;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+static bool ReadFull (int fd, void* buffer, size_t bytes)
+{
+    char* p = (char*) buffer;
+
+    while (bytes > 0) {
+        ssize_t n = recv (fd, p, bytes, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p     += n;
+        bytes -= n;
+    }
+
+    return true;
+}
+
+bool WireReceive (int fd, WireHeader& header, std::vector<char>& body)
+{
+    if (!ReadFull (fd, &header, sizeof (header))) return false;
+
+    if (header.magic_ != GALLERY_WIRE_MAGIC ||
+        header.length_ > GALLERY_WIRE_MAX_BODY) {
+        TS_ERR_MSG_V ("Broken gallery node stream, magic 0x%x length %u",
+            header.magic_, header.length_);
+        return false;
+    }
+
+    body.resize (header.length_);
+    return ReadFull (fd, body.data (), header.length_);
+}
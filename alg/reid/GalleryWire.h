@@ -0,0 +1,116 @@
+/*
+ * @Description: Binary request/response protocol between gallery nodes.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#ifndef __TS_GALLERY_WIRE_H__
+#define __TS_GALLERY_WIRE_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+
+#define GALLERY_WIRE_MAGIC   0x45524957  // "WIRE"
+#define GALLERY_WIRE_VERSION 1
+// a body larger than this is a broken stream, not a request
+#define GALLERY_WIRE_MAX_BODY (256u << 20)
+// most matches a WIRE_SEARCH may ask for per query, larger k is WIRE_BAD
+#define GALLERY_WIRE_MAX_K    1024
+
+/*
+ * Every message is a WireHeader and length_ bytes of body, integers and
+ * floats in host order, the nodes of a deployment share one architecture.
+ * A connection carries any number of requests back to back, the server
+ * answers them in the order they were sent and echoes seq_, so a client
+ * may keep several in flight.
+ */
+typedef enum _WireType {
+    // WireSearch, n * dims floats -> n uint32 found, n * k WireMatch, k at
+    // most GALLERY_WIRE_MAX_K and the reply within GALLERY_WIRE_MAX_BODY
+    WIRE_SEARCH = 1,
+    // WireInsert, n int64 cameras, n * dims floats -> n WireMatch, the
+    // node's InsertAndSearch: ids matched or enrolled there
+    WIRE_INSERT = 2,
+    // uint32 n, uint32 0, n WireTouch -> nothing
+    WIRE_TOUCH  = 3,
+    // WireEntry, dims floats -> nothing, UpdateEntry: stored under id
+    WIRE_UPDATE = 4,
+    // WireEntry without a feature -> nothing, status WIRE_NOT_FOUND if absent
+    WIRE_REMOVE = 5,
+    // nothing -> WireInfo
+    WIRE_INFO   = 6
+} WireType;
+
+typedef enum _WireStatus {
+    WIRE_OK        = 0,
+    WIRE_BAD       = 1,    // malformed or of other dimensions
+    WIRE_NOT_FOUND = 2,
+    WIRE_FAILED    = 3     // the gallery refused it
+} WireStatus;
+
+typedef struct _WireHeader {
+    uint32_t magic_   { GALLERY_WIRE_MAGIC };
+    uint16_t type_    { 0 };
+    uint16_t status_  { WIRE_OK };
+    uint32_t seq_     { 0 };
+    uint32_t length_  { 0 };  // body bytes
+} WireHeader;
+
+typedef struct _WireSearch {
+    uint32_t n_    { 0 };
+    uint32_t k_    { 0 };
+    uint32_t dims_ { 0 };
+    uint32_t pad_  { 0 };
+} WireSearch;
+
+typedef struct _WireInsert {
+    uint32_t n_    { 0 };
+    uint32_t dims_ { 0 };
+} WireInsert;
+
+typedef struct _WireMatch {
+    int64_t  id_       { -1  };
+    float    distance_ { 2.f };
+    uint32_t pad_      { 0   };
+} WireMatch;
+
+typedef struct _WireTouch {
+    int64_t id_        { 0 };
+    int64_t camera_id_ { 0 };
+} WireTouch;
+
+typedef struct _WireEntry {
+    int64_t  id_        { 0 };
+    int64_t  camera_id_ { 0 };
+    uint32_t dims_      { 0 };
+    uint32_t pad_       { 0 };
+} WireEntry;
+
+typedef struct _WireInfo {
+    uint32_t version_ { GALLERY_WIRE_VERSION };
+    uint32_t dims_    { 0 };
+    uint64_t size_    { 0 };
+    uint64_t memory_  { 0 };
+    int64_t  next_id_ { 0 };
+} WireInfo;
+
+/*
+ * Addresses are "unix:<path>" for a unix domain socket or "<host>:<port>"
+ * for tcp, both return a blocking descriptor or -1. timeout_ms bounds
+ * every later send and receive, 0 waits forever.
+ */
+int  WireListen  (const std::string& address);
+int  WireConnect (const std::string& address, int timeout_ms);
+
+// header and the body parts in one write, false once the peer is gone
+bool WireSend    (int fd, WireHeader& header, const struct iovec* parts,
+                  int count);
+// the next message, its body in body
+bool WireReceive (int fd, WireHeader& header, std::vector<char>& body);
+
+#endif //__TS_GALLERY_WIRE_H__
@@ -0,0 +1,730 @@
+/*
+ * @Description: Implement of the navigable small-world graph gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-19 15:07:52
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-19 15:07:52
+ */
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <thread>
+
+#include "Common.h"
+#include "GallerySnapshot.h"
+#include "HnswGallery.h"
+
+HnswGallery::~HnswGallery (void)
+{
+    Deinitialize ();
+}
+
+bool HnswGallery::Initialize (const GalleryConfig& config)
+{
+    if (config.dims_ <= 0 || config.max_elem_num_ <= 0 ||
+        config.hnsw_m_ < 2 || config.ef_construction_ <= 0 ||
+        config.ef_search_ <= 0) {
+        TS_ERR_MSG_V ("Invalid hnsw shape dims:%d M:%d efc:%d efs:%d",
+            config.dims_, config.hnsw_m_, config.ef_construction_,
+            config.ef_search_);
+        return false;
+    }
+
+    Deinitialize ();
+
+    cfg_             = config;
+    dims_            = config.dims_;
+    stride_          = FeatureStride (dims_);
+    m_               = config.hnsw_m_;
+    m0_              = config.hnsw_m_ * 2;
+    ef_construction_ = std::max (config.ef_construction_, config.hnsw_m_);
+    ef_search_       = config.ef_search_;
+    capacity_        = config.max_elem_num_;
+    level_mult_      = 1.0 / log ((double) m_);
+    // a purged batch sits out the searches that may still walk it while
+    // the next one fills the spare slots
+    purge_at_        = std::min<size_t> (std::max<size_t> (capacity_ / 16, 1),
+        HNSW_PURGE_BATCH);
+    slots_           = capacity_ + 2 * purge_at_;
+
+    // header and level-0 links, then the feature on its own cache line
+    vector_offset_ = (sizeof (HnswNode) + m0_ * sizeof (uint32_t) +
+        TS_FEATURE_ALIGN_BYTES - 1) / TS_FEATURE_ALIGN_BYTES *
+        TS_FEATURE_ALIGN_BYTES;
+    node_bytes_    = vector_offset_ + stride_ * sizeof (float);
+
+    blocks_.assign ((slots_ + HNSW_BLOCK_NODES - 1) / HNSW_BLOCK_NODES,
+        NULL);
+
+    return true;
+}
+
+void HnswGallery::Deinitialize (void)
+{
+    // purged slots go back to free_ first, after the searches still in them
+    epochs_.Reclaim ();
+    while (epochs_.Pending ()) {
+        std::this_thread::yield ();
+        epochs_.Reclaim ();
+    }
+
+    uint32_t n = count_.load ();
+
+    for (uint32_t i = 0; i < n; i++) {
+        delete [] Node (i)->upper_;
+    }
+
+    for (auto&& b : blocks_) {
+        if (b) FeatureFree (b);
+    }
+    blocks_.clear ();
+
+    for (auto&& v : visited_pool_) delete v;
+    visited_pool_.clear ();
+
+    index_.clear ();
+    tombstones_.clear ();
+    free_.clear ();
+    count_       = 0;
+    deleted_     = 0;
+    entry_       = HNSW_NO_ENTRY;
+    upper_bytes_ = 0;
+    full_warned_ = false;
+}
+
+HnswGallery::HnswNode* HnswGallery::Node (uint32_t i)
+{
+    return (HnswNode*) (blocks_[i / HNSW_BLOCK_NODES] +
+        (size_t) (i % HNSW_BLOCK_NODES) * node_bytes_);
+}
+
+HnswGallery::HnswNode* HnswGallery::NewNode (uint32_t i, int64_t id,
+    int level)
+{
+    char*& block = blocks_[i / HNSW_BLOCK_NODES];
+    if (!block) {
+        size_t bytes = node_bytes_ * HNSW_BLOCK_NODES;
+        if (!(block = (char*) FeatureAlloc (bytes / sizeof (float)))) {
+            TS_ERR_MSG_V ("Failed to allocate %ld bytes for hnsw nodes", bytes);
+            return NULL;
+        }
+        memset (block, 0, bytes);
+    }
+
+    HnswNode* node = Node (i);
+    node->id_     = id;
+    node->level_  = level;
+    if (id >= 0) {
+        index_[id] = i;
+    } else {
+        deleted_ ++;
+    }
+    node->count0_ = 0;
+    node->upper_  = NULL;
+    if (level > 0) {
+        size_t n = level * (m_ + 1);
+        node->upper_ = new uint32_t[n] ();
+        upper_bytes_ += n * sizeof (uint32_t);
+    }
+
+    return node;
+}
+
+uint32_t* HnswGallery::Links0 (uint32_t i)
+{
+    return (uint32_t*) ((char*) Node (i) + sizeof (HnswNode));
+}
+
+const float* HnswGallery::Vector (uint32_t i)
+{
+    return (const float*) ((char*) Node (i) + vector_offset_);
+}
+
+float HnswGallery::Distance (const float* q, uint32_t i)
+{
+    return 1.f - DotProduct (q, Vector (i), dims_);
+}
+
+size_t HnswGallery::GetLinks (uint32_t i, int level, uint32_t* out)
+{
+    std::lock_guard<std::mutex> lock (Stripe (i));
+    HnswNode* node = Node (i);
+    size_t n;
+
+    if (level == 0) {
+        n = node->count0_;
+        memcpy (out, Links0 (i), n * sizeof (uint32_t));
+    } else {
+        const uint32_t* p = node->upper_ + (level - 1) * (m_ + 1);
+        n = p[0];
+        memcpy (out, p + 1, n * sizeof (uint32_t));
+    }
+
+    return n;
+}
+
+void HnswGallery::SetLinks (uint32_t i, int level, const uint32_t* links,
+    size_t n)
+{
+    std::lock_guard<std::mutex> lock (Stripe (i));
+    HnswNode* node = Node (i);
+
+    if (level == 0) {
+        memcpy (Links0 (i), links, n * sizeof (uint32_t));
+        node->count0_ = (uint32_t) n;
+    } else {
+        uint32_t* p = node->upper_ + (level - 1) * (m_ + 1);
+        memcpy (p + 1, links, n * sizeof (uint32_t));
+        p[0] = (uint32_t) n;
+    }
+}
+
+HnswGallery::Visited* HnswGallery::AcquireVisited (void)
+{
+    Visited* v = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock (visited_mutex_);
+        if (!visited_pool_.empty ()) {
+            v = visited_pool_.back ();
+            visited_pool_.pop_back ();
+        }
+    }
+
+    if (!v) v = new Visited ();
+    if (v->tags_.size () < slots_) v->tags_.assign (slots_, 0);
+
+    if (++v->epoch_ == 0) {
+        std::fill (v->tags_.begin (), v->tags_.end (), 0);
+        v->epoch_ = 1;
+    }
+
+    return v;
+}
+
+void HnswGallery::ReleaseVisited (Visited* v)
+{
+    std::lock_guard<std::mutex> lock (visited_mutex_);
+
+    visited_pool_.push_back (v);
+}
+
+uint32_t HnswGallery::GreedyClosest (const float* q, uint32_t ep, int from,
+    int to)
+{
+    std::vector<uint32_t> links (m_);
+    float cur = Distance (q, ep);
+
+    for (int level = from; level >= to; level--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            size_t n = GetLinks (ep, level, links.data ());
+            for (size_t i = 0; i < n; i++) {
+                float d = Distance (q, links[i]);
+                if (d < cur) {
+                    cur     = d;
+                    ep      = links[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    return ep;
+}
+
+void HnswGallery::SearchLayer (const float* q, uint32_t ep, size_t ef,
+    int level, std::vector<Candidate>& result)
+{
+    std::priority_queue<Candidate, std::vector<Candidate>,
+        std::greater<Candidate> > frontier;
+    std::priority_queue<Candidate> top;
+    std::vector<uint32_t> links (level == 0 ? m0_ : m_);
+    Visited* visited = AcquireVisited ();
+
+    float d = Distance (q, ep);
+    frontier.push (Candidate (d, ep));
+    top.push (Candidate (d, ep));
+    visited->tags_[ep] = visited->epoch_;
+
+    while (!frontier.empty ()) {
+        Candidate c = frontier.top ();
+        if (c.first > top.top ().first && top.size () >= ef) break;
+        frontier.pop ();
+
+        size_t n = GetLinks (c.second, level, links.data ());
+        for (size_t i = 0; i < n; i++) {
+            uint32_t nb = links[i];
+            if (visited->tags_[nb] == visited->epoch_) continue;
+            visited->tags_[nb] = visited->epoch_;
+
+            float dn = Distance (q, nb);
+            if (top.size () < ef || dn < top.top ().first) {
+                frontier.push (Candidate (dn, nb));
+                top.push (Candidate (dn, nb));
+                if (top.size () > ef) top.pop ();
+            }
+        }
+    }
+
+    ReleaseVisited (visited);
+
+    result.resize (top.size ());
+    for (size_t i = top.size (); i > 0; i--) {
+        result[i - 1] = top.top ();
+        top.pop ();
+    }
+}
+
+/*
+ * Keeps a candidate only if it is closer to the base point than to every
+ * neighbour already kept, which preserves links across clusters.
+ */
+void HnswGallery::SelectNeighbors (std::vector<Candidate>& cand, size_t m)
+{
+    std::vector<Candidate> kept;
+
+    if (cand.size () <= m) return;
+
+    for (auto&& c : cand) {
+        bool good = true;
+        for (auto&& k : kept) {
+            float d = 1.f - DotProduct (Vector (c.second), Vector (k.second),
+                dims_);
+            if (d < c.first) {
+                good = false;
+                break;
+            }
+        }
+        if (good) kept.push_back (c);
+        if (kept.size () >= m) break;
+    }
+
+    cand.swap (kept);
+}
+
+void HnswGallery::Connect (uint32_t node, uint32_t other, int level)
+{
+    std::lock_guard<std::mutex> lock (Stripe (node));
+    HnswNode* n   = Node (node);
+    size_t    max = level == 0 ? m0_ : m_;
+    uint32_t* links;
+    uint32_t* count;
+
+    if (level == 0) {
+        links = Links0 (node);
+        count = &n->count0_;
+    } else {
+        count = n->upper_ + (level - 1) * (m_ + 1);
+        links = count + 1;
+    }
+
+    if (*count < max) {
+        links[(*count)++] = other;
+        return;
+    }
+
+    // full, shrink the old links plus the new one back to max
+    std::vector<Candidate> cand;
+    const float* base = Vector (node);
+    cand.push_back (Candidate (Distance (base, other), other));
+    for (size_t i = 0; i < *count; i++) {
+        cand.push_back (Candidate (Distance (base, links[i]), links[i]));
+    }
+    std::sort (cand.begin (), cand.end ());
+    SelectNeighbors (cand, max);
+
+    for (size_t i = 0; i < cand.size (); i++) links[i] = cand[i].second;
+    *count = (uint32_t) cand.size ();
+}
+
+uint32_t HnswGallery::AcquireSlot (void)
+{
+    uint32_t cur = count_.load (std::memory_order_relaxed);
+
+    if (epochs_.Pending ()) epochs_.Reclaim ();
+    if (tombstones_.size () >= purge_at_) Purge ();
+
+    // the spare slots are all in use: searches never wait for the writer,
+    // so the last one that may still walk a purged slot returns shortly
+    if (free_.empty () && cur >= slots_) {
+        if (!tombstones_.empty ()) Purge ();
+        while (free_.empty () && epochs_.Pending ()) {
+            std::this_thread::yield ();
+            epochs_.Reclaim ();
+        }
+    }
+    if (free_.empty ()) return cur < slots_ ? cur : HNSW_NO_ENTRY;
+
+    uint32_t slot = free_.back ();
+    free_.pop_back ();
+    return slot;
+}
+
+bool HnswGallery::Add (int64_t id, const float* feature)
+{
+    if (blocks_.empty ()) return false;
+
+    if (Size () >= capacity_) {
+        if (!full_warned_) {
+            TS_WARN_MSG_V ("hnsw gallery is full (%ld), new identities are "
+                "not stored", capacity_);
+            full_warned_ = true;
+        }
+        return false;
+    }
+
+    uint32_t cur = AcquireSlot ();
+    if (cur == HNSW_NO_ENTRY) return false;
+    bool reused = cur < count_.load (std::memory_order_relaxed);
+
+    std::uniform_real_distribution<double> uniform (0.0, 1.0);
+    int level = (int) (-log (std::max (uniform (rng_), 1e-12)) * level_mult_);
+
+    HnswNode* node = NewNode (cur, id, level);
+    if (!node) return false;
+    memcpy ((char*) node + vector_offset_, feature, dims_ * sizeof (float));
+
+    uint64_t entry = entry_.load (std::memory_order_acquire);
+    uint32_t ep    = (uint32_t) entry;
+    int      top   = (int) (entry >> 32);
+    std::vector<Candidate> cand;
+    std::vector<uint32_t>  links;
+
+    if (ep != HNSW_NO_ENTRY) {
+        if (level < top) ep = GreedyClosest (feature, ep, top, level + 1);
+
+        for (int lc = std::min (level, top); lc >= 0; lc--) {
+            SearchLayer (feature, ep, ef_construction_, lc, cand);
+            ep = cand[0].second;
+            SelectNeighbors (cand, m_);
+
+            links.resize (cand.size ());
+            for (size_t i = 0; i < cand.size (); i++) {
+                links[i] = cand[i].second;
+            }
+            SetLinks (cur, lc, links.data (), links.size ());
+
+            for (auto&& nb : links) Connect (nb, cur, lc);
+        }
+    }
+
+    if (reused) {
+        deleted_ --;
+    } else {
+        count_.store (cur + 1, std::memory_order_release);
+    }
+    if ((uint32_t) entry == HNSW_NO_ENTRY || level > top) {
+        entry_.store (((uint64_t) level << 32) | cur, std::memory_order_release);
+    }
+
+    return true;
+}
+
+size_t HnswGallery::Search (const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    // no slot this search can reach is reused before it returns
+    EpochReclaimer::Guard guard (epochs_);
+    uint64_t entry = entry_.load (std::memory_order_acquire);
+    uint32_t ep    = (uint32_t) entry;
+    int      top   = (int) (entry >> 32);
+    std::vector<Candidate> result;
+
+    if (ep == HNSW_NO_ENTRY) return 0;
+
+    if (top > 0) ep = GreedyClosest (feature, ep, top, 1);
+    SearchLayer (feature, ep, std::max (ef_search_, k), 0, result);
+
+    // tombstones are walked through but never returned
+    size_t n = 0;
+    for (size_t i = 0; i < result.size () && n < k; i++) {
+        int64_t id = __atomic_load_n (&Node (result[i].second)->id_,
+            __ATOMIC_ACQUIRE);
+        if (id < 0) continue;
+        matches[n].id_       = id;
+        matches[n].distance_ = result[i].first;
+        n++;
+    }
+
+    return n;
+}
+
+bool HnswGallery::Remove (int64_t id)
+{
+    auto it = index_.find (id);
+    if (it == index_.end ()) return false;
+
+    __atomic_store_n (&Node (it->second)->id_, (int64_t) -1, __ATOMIC_RELEASE);
+    tombstones_.push_back (it->second);
+    index_.erase (it);
+    deleted_ ++;
+
+    return true;
+}
+
+uint32_t HnswGallery::Replacement (const float* base, uint32_t self,
+    uint32_t dead, int level, const uint32_t* links, size_t n)
+{
+    static thread_local std::vector<uint32_t> around;
+    uint32_t best = HNSW_NO_ENTRY;
+    float    dist = 0.f;
+
+    around.resize (m0_);
+    size_t cnt = GetLinks (dead, level, around.data ());
+    for (size_t i = 0; i < cnt; i++) {
+        uint32_t c = around[i];
+        if (c == self || Node (c)->id_ < 0 ||
+            std::find (links, links + n, c) != links + n) continue;
+
+        float d = Distance (base, c);
+        if (best == HNSW_NO_ENTRY || d < dist) {
+            best = c;
+            dist = d;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * One pass over the live nodes, O(count * M0) link reads plus M distances
+ * per link that pointed at a tombstone. Searches keep running, a node's
+ * links are swapped under its stripe like any insert does.
+ */
+void HnswGallery::Purge (void)
+{
+    std::vector<uint32_t> dead;
+    std::vector<uint32_t> links (m0_);
+    uint32_t n = count_.load (std::memory_order_relaxed);
+
+    dead.swap (tombstones_);
+
+    for (uint32_t i = 0; i < n; i++) {
+        HnswNode* node = Node (i);
+        if (node->id_ < 0) continue;
+
+        const float* base = Vector (i);
+        for (int l = 0; l <= node->level_; l++) {
+            size_t cnt = GetLinks (i, l, links.data ()), kept = 0;
+            bool   changed = false;
+
+            // links[kept, j) only repeats live links or dead ones, both of
+            // which a replacement is never taken from
+            for (size_t j = 0; j < cnt; j++) {
+                uint32_t nb = links[j];
+                if (Node (nb)->id_ >= 0) {
+                    links[kept++] = nb;
+                    continue;
+                }
+                changed = true;
+                uint32_t r = Replacement (base, i, nb, l, links.data (), cnt);
+                if (r != HNSW_NO_ENTRY) links[kept++] = r;
+            }
+
+            if (changed) SetLinks (i, l, links.data (), kept);
+        }
+    }
+
+    // the highest live node takes over from a purged entry point
+    uint64_t entry = entry_.load (std::memory_order_relaxed);
+    if ((uint32_t) entry != HNSW_NO_ENTRY && Node ((uint32_t) entry)->id_ < 0) {
+        uint32_t ep  = HNSW_NO_ENTRY;
+        int      top = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            HnswNode* node = Node (i);
+            if (node->id_ < 0 || (ep != HNSW_NO_ENTRY && node->level_ <= top)) {
+                continue;
+            }
+            ep  = i;
+            top = node->level_;
+        }
+        entry_.store (ep == HNSW_NO_ENTRY ? (uint64_t) HNSW_NO_ENTRY :
+            ((uint64_t) top << 32) | ep, std::memory_order_release);
+    }
+
+    epochs_.Retire ([this, dead] {
+        for (auto&& i : dead) {
+            HnswNode* node = Node (i);
+            if (node->upper_) {
+                upper_bytes_ -= node->level_ * (m_ + 1) * sizeof (uint32_t);
+                delete [] node->upper_;
+            }
+            node->upper_  = NULL;
+            node->level_  = 0;
+            node->count0_ = 0;
+            free_.push_back (i);
+        }
+    });
+}
+
+size_t HnswGallery::Size (void)
+{
+    return count_.load () - deleted_.load ();
+}
+
+size_t HnswGallery::MemoryBytes (void)
+{
+    size_t bytes = upper_bytes_;
+
+    for (auto&& b : blocks_) {
+        if (b) bytes += node_bytes_ * HNSW_BLOCK_NODES;
+    }
+
+    return bytes + slots_ * sizeof (uint16_t) * visited_pool_.size ();
+}
+
+/*
+ * Extra state, in uint32 words: M, M0, entry point, entry level, then per
+ * node its level, the level-0 links as count + ids and the links of every
+ * upper level the same way.
+ */
+bool HnswGallery::SaveSnapshot (const std::string& path)
+{
+    GallerySnapshotHeader header;
+    std::vector<int64_t>  ids;
+    std::vector<uint32_t> graph;
+    uint32_t n;
+
+    // links change with every insert, copy them under the lock. Vectors of
+    // linked nodes never change, they are written after releasing it.
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        uint64_t entry = entry_.load (std::memory_order_acquire);
+        n = count_.load (std::memory_order_acquire);
+
+        graph.push_back (m_);
+        graph.push_back (m0_);
+        graph.push_back ((uint32_t) entry);
+        graph.push_back ((uint32_t) (entry >> 32));
+
+        ids.resize (n);
+        std::vector<uint32_t> links (m0_);
+        for (uint32_t i = 0; i < n; i++) {
+            HnswNode* node = Node (i);
+            ids[i] = __atomic_load_n (&node->id_, __ATOMIC_ACQUIRE);
+            graph.push_back (node->level_);
+            for (int l = 0; l <= node->level_; l++) {
+                size_t cnt = GetLinks (i, l, links.data ());
+                graph.push_back (cnt);
+                graph.insert (graph.end (), links.begin (), links.begin () + cnt);
+            }
+        }
+        header.next_id_ = next_id_;
+    }
+
+    header.storage_     = GalleryStorage::GALLERY_STORAGE_FP32;
+    header.dims_        = dims_;
+    header.stride_      = stride_;
+    header.elem_bytes_  = sizeof (float);
+    header.capacity_    = n;
+    header.count_       = n;
+    header.extra_bytes_ = graph.size () * sizeof (uint32_t);
+    strncpy (header.gallery_, Name (), sizeof (header.gallery_) - 1);
+
+    return WriteGallerySnapshot (path, header, ids.data (), NULL,
+        [this](size_t i) { return (const void*) Vector (i); }, graph.data ());
+}
+
+bool HnswGallery::RestoreGraph (const uint32_t* extra, size_t words,
+    size_t count, const char* vectors, const int64_t* ids)
+{
+    size_t pos = 4;
+
+    if (words < 4 || extra[0] != m_ || extra[1] != m0_ ||
+        extra[2] >= count) return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (pos >= words) return false;
+        int level = (int) extra[pos++];
+        if (level < 0 || level > 64) return false;
+
+        HnswNode* node = NewNode (i, ids[i], level);
+        if (!node) return false;
+        // count_ covers every node built so far, a failure frees them
+        count_.store (i + 1, std::memory_order_relaxed);
+        memcpy ((char*) node + vector_offset_,
+            vectors + (size_t) i * stride_ * sizeof (float),
+            dims_ * sizeof (float));
+
+        for (int l = 0; l <= level; l++) {
+            if (pos >= words) return false;
+            size_t cnt = extra[pos++];
+            if (cnt > (l ? m_ : m0_) || pos + cnt > words) return false;
+            for (size_t j = 0; j < cnt; j++) {
+                if (extra[pos + j] >= count) return false;
+            }
+            SetLinks (i, l, extra + pos, cnt);
+            pos += cnt;
+        }
+    }
+
+    entry_.store (((uint64_t) extra[3] << 32) | extra[2],
+        std::memory_order_release);
+    return true;
+}
+
+bool HnswGallery::LoadSnapshot (const std::string& path)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    GallerySnapshot snapshot;
+
+    if (blocks_.empty () || !snapshot.Map (path)) return false;
+
+    const GallerySnapshotHeader* h = snapshot.Header ();
+    if (strcmp (h->gallery_, Name ()) || h->dims_ != dims_ ||
+        h->stride_ != stride_ || h->elem_bytes_ != sizeof (float)) {
+        TS_WARN_MSG_V ("Snapshot %s (%s %u dims) does not fit gallery %s of "
+            "%ld dims", path.c_str (), h->gallery_, h->dims_, Name (), dims_);
+        return false;
+    }
+
+    size_t n = h->count_;
+    const char* vectors = snapshot.Matrix ();
+    const int64_t* ids = snapshot.Ids ();
+    // tombstones are dropped by rebuilding, that returns their slots
+    size_t live = std::count_if (ids, ids + n,
+        [] (int64_t id) { return id >= 0; });
+    bool tombstones = live != n;
+    // past capacity the newest entries are kept, as FlatGallery does
+    size_t skip = live > capacity_ ? live - capacity_ : 0;
+    bool linked = n <= capacity_ && !tombstones &&
+        snapshot.Extra () &&
+        RestoreGraph ((const uint32_t*) snapshot.Extra (),
+            h->extra_bytes_ / sizeof (uint32_t), n, vectors, ids);
+
+    if (!linked) {
+        if (count_.load ()) {
+            TS_WARN_MSG_V ("hnsw links in %s do not fit M=%ld, rebuilding",
+                path.c_str (), m_);
+            GalleryConfig config = cfg_;
+            Initialize (config);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (ids[i] < 0) continue;
+            if (skip) {
+                skip--;
+                continue;
+            }
+            Add (ids[i], (const float*) (vectors +
+                i * stride_ * sizeof (float)));
+        }
+    }
+
+    next_id_ = std::max (next_id_, h->next_id_);
+    n = count_.load ();
+    for (uint32_t i = 0; i < n; i++) {
+        if (Node (i)->id_ < 0) continue;
+        if (exact_) exact_->Add (Node (i)->id_, Vector (i));
+        Tracked (Node (i)->id_);
+    }
+
+    TS_INFO_MSG_V ("gallery %s %s %ld entries from %s, next id %ld", Name (),
+        linked ? "restored" : "rebuilt", Size (), path.c_str (), next_id_);
+    return true;
+}
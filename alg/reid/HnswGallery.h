@@ -0,0 +1,145 @@
+/*
+ * @Description: Hierarchical navigable small-world graph ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-19 15:07:52
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-19 15:07:52
+ */
+
+#ifndef __TS_HNSW_GALLERY_H__
+#define __TS_HNSW_GALLERY_H__
+
+#include <random>
+#include <unordered_map>
+
+#include "EpochReclaimer.h"
+#include "GalleryInterface.h"
+
+#define HNSW_LOCK_STRIPES 4096
+#define HNSW_BLOCK_NODES  4096
+// tombstones unlinked by one purge, at most
+#define HNSW_PURGE_BATCH  256
+// the entry point of a graph without live nodes
+#define HNSW_NO_ENTRY     0xffffffffu
+
+/*
+ * Nodes are inserted one at a time by the writer (the caller holds mutex_),
+ * searches run without the gallery lock. A node's link lists are guarded by
+ * one of HNSW_LOCK_STRIPES mutexes, and everything else about a node is
+ * written before the first link to it is published, so a reader that found
+ * a node through a link always sees it complete. Nodes live in fixed blocks
+ * that are never moved. A node is never overwritten in place, once
+ * max_elem_num_ live nodes are linked the gallery's eviction policy (always
+ * attached by CreateGallery, fifo by default) removes one before the next
+ * insert; without a policy Add refuses the new node.
+ * Removal tombstones a node (its id turns -1), it keeps routing searches
+ * until a batch of tombstones is purged: every live link to one is replaced
+ * by the nearest live neighbour of the node it pointed at, and the slots
+ * are reused once no search that started before can still walk them
+ * (EpochReclaimer). A few spare slots beyond max_elem_num_ keep inserts
+ * going while a purged batch waits for those searches.
+ * Snapshots hold the vectors as a fp32 matrix and the links as extra state,
+ * a graph saved with another M is rebuilt from the vectors on load.
+ */
+class HnswGallery : public GalleryInterface
+{
+public:
+    HnswGallery (void) {}
+    ~HnswGallery (void);
+
+    bool   Initialize   (const GalleryConfig& config);
+    void   Deinitialize (void);
+    size_t Search (const float* feature, size_t k, GalleryMatch* matches);
+    bool   Add    (int64_t id, const float* feature);
+    bool   Remove (int64_t id);
+    size_t Size        (void);
+    size_t MemoryBytes (void);
+    const char* Name   (void) { return "hnsw"; }
+    bool   ConcurrentSearch (void) { return true; }
+    bool   SaveSnapshot (const std::string& path);
+    bool   LoadSnapshot (const std::string& path);
+
+private:
+    typedef struct _HnswNode {
+        int64_t   id_     ;
+        int32_t   level_  ;
+        uint32_t  count0_ ;     // links at level 0, guarded by the stripe
+        uint32_t* upper_  ;     // level l > 0 at (l - 1) * (M + 1), [0]=count
+    } HnswNode;
+
+    typedef std::pair<float, uint32_t> Candidate;
+
+    HnswNode*    Node     (uint32_t i);
+    HnswNode*    NewNode  (uint32_t i, int64_t id, int level);
+    uint32_t*    Links0   (uint32_t i);
+    const float* Vector   (uint32_t i);
+    std::mutex&  Stripe   (uint32_t i) { return stripes_[i % HNSW_LOCK_STRIPES]; }
+    float        Distance (const float* q, uint32_t i);
+
+    // copies the neighbours of i at level into out, returns their count
+    size_t GetLinks (uint32_t i, int level, uint32_t* out);
+    void   SetLinks (uint32_t i, int level, const uint32_t* links, size_t n);
+
+    uint32_t GreedyClosest (const float* q, uint32_t ep, int from, int to);
+    void     SearchLayer   (const float* q, uint32_t ep, size_t ef, int level,
+                            std::vector<Candidate>& result);
+    void     SelectNeighbors (std::vector<Candidate>& cand, size_t m);
+    void     Connect       (uint32_t node, uint32_t other, int level);
+
+    // a slot for a new node, HNSW_NO_ENTRY if none is free yet
+    uint32_t AcquireSlot   (void);
+    // unlinks the tombstones and retires their slots
+    void     Purge         (void);
+    // the live neighbour of dead closest to base, not self nor in links
+    uint32_t Replacement   (const float* base, uint32_t self, uint32_t dead,
+                            int level, const uint32_t* links, size_t n);
+
+    // rebuilds the nodes and links written by SaveSnapshot, false if corrupt
+    bool     RestoreGraph  (const uint32_t* extra, size_t words, size_t count,
+                            const char* vectors, const int64_t* ids);
+
+    // one epoch-tagged visited table per concurrent search
+    typedef struct _Visited {
+        std::vector<uint16_t> tags_  {   };
+        uint16_t              epoch_ { 0 };
+    } Visited;
+    Visited* AcquireVisited (void);
+    void     ReleaseVisited (Visited* v);
+
+private:
+    size_t                dims_            { 0    },
+                          stride_          { 0    },
+                          m_               { 0    },
+                          m0_              { 0    },
+                          ef_construction_ { 0    },
+                          ef_search_       { 0    },
+                          capacity_        { 0    },
+                          slots_           { 0    },
+                          purge_at_        { 0    },
+                          node_bytes_      { 0    },
+                          vector_offset_   { 0    };
+    double                level_mult_      { 0    };
+    //--------------------------------------------------
+    std::vector<char*>    blocks_          {      };
+    std::atomic<uint32_t> count_           { 0    };
+    // entry point in the low 32 bits, its level in the high 32 bits
+    std::atomic<uint64_t> entry_           { HNSW_NO_ENTRY };
+    std::mutex            stripes_[HNSW_LOCK_STRIPES];
+    std::mt19937          rng_             { 100  };
+    size_t                upper_bytes_     { 0    };
+    bool                  full_warned_     { false};
+    // live ids to nodes, the slots without a live node (tombstoned, purged
+    // or free), the tombstones not purged yet and the reusable slots, all
+    // owned by the writer
+    std::unordered_map<int64_t, uint32_t> index_ { };
+    std::atomic<uint32_t> deleted_         { 0    };
+    std::vector<uint32_t> tombstones_      {      };
+    std::vector<uint32_t> free_            {      };
+    EpochReclaimer        epochs_                 ;
+    //--------------------------------------------------
+    std::mutex            visited_mutex_          ;
+    std::vector<Visited*> visited_pool_    {      };
+};
+
+#endif //__TS_HNSW_GALLERY_H__
@@ -0,0 +1,607 @@
+/*
+ * @Description: Implement of the inverted file + product quantization gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-19 09:21:38
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-19 09:21:38
+ */
+
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include "Common.h"
+#include "IvfPqGallery.h"
+
+#define IVFPQ_KSUB        256
+#define IVFPQ_ITERS       10
+// lloyd iterations converge long before this many points per centroid
+#define IVFPQ_MAX_PER_CENTROID 64
+// cell terms of every cell are kept up to this size, 64 MB (the default
+// 256 lists of 64 x 256 codewords take 16 MB)
+#define IVFPQ_PRECOMPUTE_BYTES (64 << 20)
+// warm-up entries moved per Add, Search or Remove once the model is in,
+// with the trainer's codes or encoded on the spot
+#define IVFPQ_INSTALL_BATCH    512
+#define IVFPQ_MIGRATE_BATCH    32
+
+/*
+ * Plain lloyd k-means on n rows of x (row stride sx), writes k centroids of
+ * d floats to c (row stride sc). Assignment uses |c|^2 - 2<x, c>.
+ */
+static void kmeans (const float* x, size_t n, size_t d, size_t sx,
+    size_t k, float* c, size_t sc, std::mt19937& rng)
+{
+    std::vector<float>  norm (k), score (k), sum (k * d);
+    std::vector<size_t> cnt (k);
+    std::vector<size_t> order (n);
+
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    std::shuffle (order.begin (), order.end (), rng);
+    for (size_t j = 0; j < k; j++) {
+        memcpy (c + j * sc, x + order[j % n] * sx, d * sizeof (float));
+    }
+
+    for (int it = 0; it < IVFPQ_ITERS; it++) {
+        for (size_t j = 0; j < k; j++) {
+            norm[j] = DotProduct (c + j * sc, c + j * sc, d);
+        }
+
+        std::fill (sum.begin (), sum.end (), 0.f);
+        std::fill (cnt.begin (), cnt.end (), 0);
+
+        for (size_t i = 0; i < n; i++) {
+            const float* xi = x + i * sx;
+            size_t best = 0;
+            float  best_d = FLT_MAX;
+
+            DotProductRows (xi, c, k, d, sc, score.data ());
+            for (size_t j = 0; j < k; j++) {
+                float dist = norm[j] - 2.f * score[j];
+                if (dist < best_d) {
+                    best_d = dist;
+                    best   = j;
+                }
+            }
+
+            cnt[best] ++;
+            float* s = sum.data () + best * d;
+            for (size_t t = 0; t < d; t++) s[t] += xi[t];
+        }
+
+        for (size_t j = 0; j < k; j++) {
+            float* cj = c + j * sc;
+            if (cnt[j] == 0) {
+                // re-seed an empty cell from a random point
+                memcpy (cj, x + (rng () % n) * sx, d * sizeof (float));
+                continue;
+            }
+            float inv = 1.f / cnt[j];
+            for (size_t t = 0; t < d; t++) cj[t] = sum[j * d + t] * inv;
+        }
+    }
+}
+
+IvfPqGallery::~IvfPqGallery (void)
+{
+    Deinitialize ();
+}
+
+bool IvfPqGallery::Initialize (const GalleryConfig& config)
+{
+    size_t train_min = std::max (config.nlist_, IVFPQ_KSUB);
+
+    if (config.dims_ <= 0 || config.max_elem_num_ <= 0 ||
+        config.nlist_ <= 0 || config.pq_m_ <= 0 ||
+        config.dims_ % config.pq_m_ != 0) {
+        TS_ERR_MSG_V ("Invalid ivfpq shape dims:%d nlist:%d pq-m:%d",
+            config.dims_, config.nlist_, config.pq_m_);
+        return false;
+    }
+
+    if ((size_t) config.train_size_ < train_min) {
+        TS_ERR_MSG_V ("ivfpq train-size %d is below %ld", config.train_size_,
+            train_min);
+        return false;
+    }
+
+    Deinitialize ();
+
+    cfg_      = config;
+    dims_     = config.dims_;
+    stride_   = FeatureStride (dims_);
+    nlist_    = config.nlist_;
+    nprobe_   = std::min (std::max (config.nprobe_, 1), config.nlist_);
+    m_        = config.pq_m_;
+    dsub_     = dims_ / m_;
+    capacity_ = config.max_elem_num_;
+
+    // the exact store keeps serving while the model trains in background
+    GalleryConfig wc = config;
+    wc.storage_      = GalleryStorage::GALLERY_STORAGE_FP32;
+    wc.max_elem_num_ = std::min (config.max_elem_num_, config.train_size_ * 2);
+    if (!warmup_.Initialize (wc)) return false;
+    warmup_capacity_ = wc.max_elem_num_;
+
+    samples_.reserve ((size_t) config.train_size_ * dims_);
+    sample_ids_.reserve (config.train_size_);
+    lists_.resize (nlist_);
+    coarse_dist_.resize (nlist_);
+    residual_.resize (dims_);
+    row_.resize (dims_);
+    code_.resize (m_);
+    code_score_.resize (IVFPQ_KSUB);
+    query_term_.resize (m_ * IVFPQ_KSUB);
+    cell_term_.resize (m_ * IVFPQ_KSUB);
+    lut_.resize (m_ * IVFPQ_KSUB);
+
+    return true;
+}
+
+void IvfPqGallery::Deinitialize (void)
+{
+    if (trainer_.joinable ()) trainer_.join ();
+
+    warmup_.Deinitialize ();
+    samples_.clear ();
+    samples_.shrink_to_fit ();
+    sample_ids_.clear ();
+    stale_.clear ();
+    model_ready_ = false;
+    migrating_   = false;
+    installed_   = 0;
+    pending_.reset ();
+    model_.reset ();
+
+    lists_.clear ();
+    slot_id_.clear ();
+    slot_list_.clear ();
+    slot_pos_.clear ();
+    free_slots_.clear ();
+    id_slot_.clear ();
+    slot_seq_.clear ();
+    age_.clear ();
+    count_           = 0;
+    seq_             = 0;
+    warmup_capacity_ = 0;
+    warmup_full_     = false;
+}
+
+void IvfPqGallery::Train (std::shared_ptr<IvfModel> model,
+    std::vector<float> samples, std::vector<int64_t> ids,
+    std::atomic<bool>* ready)
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now ();
+    std::mt19937 rng (0x5eed);
+    size_t dims    = model->dims_;
+    size_t stride  = model->stride_;
+    size_t nlist   = model->nlist_;
+    size_t m       = model->m_;
+    size_t dsub    = model->dsub_;
+    size_t ncode   = m * IVFPQ_KSUB;
+    size_t n       = ids.size ();
+    size_t ncoarse = std::min (n, nlist * IVFPQ_MAX_PER_CENTROID);
+    size_t nsub    = std::min (n, (size_t) IVFPQ_KSUB * IVFPQ_MAX_PER_CENTROID);
+
+    model->coarse_.assign (nlist * stride, 0.f);
+    model->coarse_norm_.resize (nlist);
+    model->codebook_.resize (ncode * dsub);
+
+    kmeans (samples.data (), ncoarse, dims, dims, nlist,
+        model->coarse_.data (), stride, rng);
+    for (size_t l = 0; l < nlist; l++) {
+        const float* c = model->coarse_.data () + l * stride;
+        model->coarse_norm_[l] = DotProduct (c, c, dims);
+    }
+
+    // the cell of every sample, the codebooks learn the residuals of a part
+    std::vector<float>    score (std::max<size_t> (nlist, IVFPQ_KSUB));
+    std::vector<uint32_t> cell (n);
+    for (size_t i = 0; i < n; i++) {
+        cell[i] = (uint32_t) AssignList (*model, samples.data () + i * dims,
+            score.data ());
+    }
+
+    std::vector<float> sub (nsub * dsub);
+    for (size_t j = 0; j < m; j++) {
+        for (size_t i = 0; i < nsub; i++) {
+            const float* x = samples.data () + i * dims + j * dsub;
+            const float* c = model->coarse_.data () + cell[i] * stride + j * dsub;
+            for (size_t t = 0; t < dsub; t++) sub[i * dsub + t] = x[t] - c[t];
+        }
+        kmeans (sub.data (), nsub, dsub, dsub, IVFPQ_KSUB,
+            model->codebook_.data () + j * IVFPQ_KSUB * dsub, dsub, rng);
+    }
+
+    model->code_norm_.resize (ncode);
+    for (size_t i = 0; i < ncode; i++) {
+        const float* y = model->codebook_.data () + i * dsub;
+        model->code_norm_[i] = DotProduct (y, y, dsub);
+    }
+
+    if (nlist * ncode * sizeof (float) <= IVFPQ_PRECOMPUTE_BYTES) {
+        model->cell_term_.resize (nlist * ncode);
+        for (size_t l = 0; l < nlist; l++) {
+            CellTerm (*model, l, model->cell_term_.data () + l * ncode);
+        }
+    }
+
+    // the sample is encoded here, installing the model only copies codes
+    std::vector<float> residual (dims);
+    model->sample_codes_.resize (n * m);
+    for (size_t i = 0; i < n; i++) {
+        Encode (*model, samples.data () + i * dims, cell[i],
+            model->sample_codes_.data () + i * m, residual.data (),
+            score.data ());
+    }
+    model->sample_lists_.swap (cell);
+    model->sample_ids_.swap (ids);
+
+    TS_INFO_MSG_V ("ivfpq trained nlist:%ld m:%ld on %ld samples in %ld ms",
+        nlist, m, n, (long) std::chrono::duration_cast<
+        std::chrono::milliseconds>(std::chrono::steady_clock::now () -
+        start).count ());
+
+    ready->store (true, std::memory_order_release);
+}
+
+bool IvfPqGallery::InstallModel (void)
+{
+    if (!model_ready_.load (std::memory_order_acquire)) return false;
+
+    trainer_.join ();
+    model_ = pending_;
+    pending_.reset ();
+    model_ready_ = false;
+    migrating_   = true;
+    installed_   = 0;
+
+    return true;
+}
+
+void IvfPqGallery::Migrate (void)
+{
+    InstallModel ();
+
+    if (!migrating_) return;
+
+    IvfModel& model = *model_;
+    size_t    n = 0;
+
+    // sampled entries still in the warm-up store as they were sampled move
+    // over with the trainer's codes, a bounded batch per call keeps every
+    // frame short
+    for (; installed_ < model.sample_ids_.size () &&
+        n < IVFPQ_INSTALL_BATCH; installed_++, n++) {
+        int64_t id = model.sample_ids_[installed_];
+        if (stale_.count (id) || !warmup_.Remove (id)) continue;
+        AddCode (id, model.sample_lists_[installed_],
+            &model.sample_codes_[installed_ * m_]);
+    }
+
+    // then the others, encoded here
+    for (n = n ? IVFPQ_MIGRATE_BATCH : 0;
+        n < IVFPQ_MIGRATE_BATCH && warmup_.Size (); n++) {
+        size_t  i  = warmup_.Size () - 1;
+        int64_t id = warmup_.RowId (i);
+        warmup_.GetRow (i, row_.data ());
+        warmup_.Remove (id);
+        AddEncoded (id, row_.data ());
+    }
+
+    if (warmup_.Size ()) return;
+
+    warmup_.Deinitialize ();
+    std::vector<int64_t> ().swap (model.sample_ids_);
+    std::vector<uint32_t> ().swap (model.sample_lists_);
+    std::vector<uint8_t> ().swap (model.sample_codes_);
+    stale_.clear ();
+    migrating_ = false;
+}
+
+size_t IvfPqGallery::AssignList (const IvfModel& model, const float* feature,
+    float* scores)
+{
+    size_t best = 0;
+    float  best_d = FLT_MAX;
+
+    DotProductRows (feature, model.coarse_.data (), model.nlist_, model.dims_,
+        model.stride_, scores);
+    for (size_t l = 0; l < model.nlist_; l++) {
+        float dist = model.coarse_norm_[l] - 2.f * scores[l];
+        if (dist < best_d) {
+            best_d = dist;
+            best   = l;
+        }
+    }
+
+    return best;
+}
+
+void IvfPqGallery::Encode (const IvfModel& model, const float* feature,
+    size_t list, uint8_t* code, float* residual, float* scores)
+{
+    const float* c    = model.coarse_.data () + list * model.stride_;
+    size_t       dsub = model.dsub_;
+
+    for (size_t t = 0; t < model.dims_; t++) residual[t] = feature[t] - c[t];
+
+    // nearest codeword by |y|^2 - 2<r, y>
+    for (size_t j = 0; j < model.m_; j++) {
+        const float* cb   = model.codebook_.data () + j * IVFPQ_KSUB * dsub;
+        const float* norm = model.code_norm_.data () + j * IVFPQ_KSUB;
+        size_t best = 0;
+        float  best_d = FLT_MAX;
+
+        DotProductRows (residual + j * dsub, cb, IVFPQ_KSUB, dsub, dsub,
+            scores);
+        for (size_t k = 0; k < IVFPQ_KSUB; k++) {
+            float dist = norm[k] - 2.f * scores[k];
+            if (dist < best_d) {
+                best_d = dist;
+                best   = k;
+            }
+        }
+
+        code[j] = (uint8_t) best;
+    }
+}
+
+void IvfPqGallery::CellTerm (const IvfModel& model, size_t list, float* out)
+{
+    const float* c     = model.coarse_.data () + list * model.stride_;
+    size_t       dsub  = model.dsub_;
+    size_t       ncode = model.m_ * IVFPQ_KSUB;
+
+    for (size_t j = 0; j < model.m_; j++) {
+        DotProductRows (c + j * dsub, model.codebook_.data () +
+            j * IVFPQ_KSUB * dsub, IVFPQ_KSUB, dsub, dsub,
+            out + j * IVFPQ_KSUB);
+    }
+    for (size_t i = 0; i < ncode; i++) {
+        out[i] = 2.f * out[i] + model.code_norm_[i];
+    }
+}
+
+void IvfPqGallery::RemoveSlot (uint32_t slot)
+{
+    IvfList& l = lists_[slot_list_[slot]];
+    uint32_t pos  = slot_pos_[slot];
+    uint32_t last = (uint32_t) l.slots_.size () - 1;
+
+    // swap with the tail of the list so removal stays O(m)
+    if (pos != last) {
+        uint32_t moved = l.slots_[last];
+        l.slots_[pos] = moved;
+        memcpy (l.codes_.data () + pos * m_, l.codes_.data () + last * m_, m_);
+        slot_pos_[moved] = pos;
+    }
+
+    l.slots_.pop_back ();
+    l.codes_.resize (l.slots_.size () * m_);
+}
+
+void IvfPqGallery::AddEncoded (int64_t id, const float* feature)
+{
+    size_t list = AssignList (*model_, feature, coarse_dist_.data ());
+
+    Encode (*model_, feature, list, code_.data (), residual_.data (),
+        code_score_.data ());
+    AddCode (id, list, code_.data ());
+}
+
+void IvfPqGallery::AddCode (int64_t id, size_t list, const uint8_t* code)
+{
+    uint32_t slot;
+
+    if (!free_slots_.empty ()) {
+        slot = free_slots_.back ();
+        free_slots_.pop_back ();
+    } else if (count_ < capacity_) {
+        slot = (uint32_t) count_++;
+        slot_id_.push_back (id);
+        slot_list_.push_back (0);
+        slot_pos_.push_back (0);
+        slot_seq_.push_back (0);
+    } else {
+        while (slot_id_[age_.front ().second] < 0 ||
+            slot_seq_[age_.front ().second] != age_.front ().first) {
+            age_.pop_front ();
+        }
+        slot = age_.front ().second;
+        age_.pop_front ();
+        RemoveSlot (slot);
+        id_slot_.erase (slot_id_[slot]);
+    }
+
+    IvfList& l = lists_[list];
+
+    slot_id_[slot]   = id;
+    slot_list_[slot] = (uint32_t) list;
+    slot_pos_[slot]  = (uint32_t) l.slots_.size ();
+    l.slots_.push_back (slot);
+    l.codes_.insert (l.codes_.end (), code, code + m_);
+    id_slot_[id] = slot;
+
+    slot_seq_[slot] = ++seq_;
+    age_.push_back (std::make_pair (seq_, slot));
+    // freed slots leave entries behind, never more than the slots themselves
+    if (age_.size () > 2 * capacity_) {
+        std::deque<std::pair<uint64_t, uint32_t> > live;
+        for (auto&& a : age_) {
+            if (slot_id_[a.second] >= 0 && slot_seq_[a.second] == a.first) {
+                live.push_back (a);
+            }
+        }
+        age_.swap (live);
+    }
+}
+
+bool IvfPqGallery::Remove (int64_t id)
+{
+    Migrate ();
+
+    // the trainer may have encoded the entry as it was sampled
+    auto it = id_slot_.find (id);
+    if (it == id_slot_.end ()) {
+        if (!warmup_.Remove (id)) return false;
+        stale_.insert (id);
+        return true;
+    }
+
+    RemoveSlot (it->second);
+    slot_id_[it->second] = -1;
+    free_slots_.push_back (it->second);
+    id_slot_.erase (it);
+
+    return true;
+}
+
+bool IvfPqGallery::Add (int64_t id, const float* feature)
+{
+    Migrate ();
+
+    if (model_) {
+        AddEncoded (id, feature);
+        return true;
+    }
+
+    // past its capacity the warm-up store overwrites its oldest entry
+    if (warmup_.Size () >= warmup_capacity_ && !warmup_full_) {
+        TS_WARN_MSG_V ("ivfpq warm-up store is full (%ld) while the model "
+            "trains, its oldest identities are overwritten", warmup_capacity_);
+        warmup_full_ = true;
+    }
+
+    if (!warmup_.Add (id, feature)) return false;
+
+    if (!trainer_.joinable () &&
+        samples_.size () < (size_t) cfg_.train_size_ * dims_) {
+        samples_.insert (samples_.end (), feature, feature + dims_);
+        sample_ids_.push_back (id);
+        if (samples_.size () == (size_t) cfg_.train_size_ * dims_) {
+            pending_ = std::make_shared<IvfModel> ();
+            pending_->dims_   = dims_;
+            pending_->stride_ = stride_;
+            pending_->nlist_  = nlist_;
+            pending_->m_      = m_;
+            pending_->dsub_   = dsub_;
+            trainer_ = std::thread (Train, pending_, std::move (samples_),
+                std::move (sample_ids_), &model_ready_);
+        }
+    }
+
+    return true;
+}
+
+size_t IvfPqGallery::Search (const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    Migrate ();
+
+    if (!model_) return warmup_.Search (feature, k, matches);
+
+    cand_score_.clear ();
+    cand_id_.clear ();
+
+    // entries not migrated yet are scored exactly
+    if (warmup_.Size ()) {
+        warm_hits_.resize (k);
+        size_t n = warmup_.Search (feature, k, warm_hits_.data ());
+        for (size_t i = 0; i < n; i++) {
+            cand_score_.push_back (1.f - warm_hits_[i].distance_);
+            cand_id_.push_back (warm_hits_[i].id_);
+        }
+    }
+
+    if (count_ > free_slots_.size ()) {
+        Probe (feature);
+    }
+
+    return SelectNearest (cand_score_.data (), cand_id_.data (),
+        cand_score_.size (), k, matches);
+}
+
+void IvfPqGallery::Probe (const float* feature)
+{
+    size_t ncode = m_ * IVFPQ_KSUB;
+    float  qnorm = DotProduct (feature, feature, dims_);
+
+    // nprobe nearest cells by |q - c|^2 - |q|^2
+    DotProductRows (feature, model_->coarse_.data (), nlist_, dims_, stride_,
+        coarse_dist_.data ());
+    probe_.resize (nlist_);
+    for (size_t l = 0; l < nlist_; l++) {
+        coarse_dist_[l] = model_->coarse_norm_[l] - 2.f * coarse_dist_[l];
+        probe_[l] = (uint32_t) l;
+    }
+    std::partial_sort (probe_.begin (), probe_.begin () + nprobe_,
+        probe_.end (), [this] (uint32_t a, uint32_t b) {
+            return coarse_dist_[a] < coarse_dist_[b];
+        });
+
+    // -2<q, y> of every codeword, shared by all probed cells
+    for (size_t j = 0; j < m_; j++) {
+        DotProductRows (feature + j * dsub_, model_->codebook_.data () +
+            j * IVFPQ_KSUB * dsub_, IVFPQ_KSUB, dsub_, dsub_,
+            query_term_.data () + j * IVFPQ_KSUB);
+    }
+    for (size_t i = 0; i < ncode; i++) query_term_[i] *= -2.f;
+
+    for (size_t p = 0; p < nprobe_; p++) {
+        const IvfList& l = lists_[probe_[p]];
+        if (l.slots_.empty ()) continue;
+
+        // |r - y|^2 = |q - c|^2 - 2<q, y> + 2<c, y> + |y|^2 per sub-vector,
+        // the first term is added once per code
+        const float* cell = model_->cell_term_.data () + probe_[p] * ncode;
+        if (model_->cell_term_.empty ()) {
+            CellTerm (*model_, probe_[p], cell_term_.data ());
+            cell = cell_term_.data ();
+        }
+        for (size_t i = 0; i < ncode; i++) lut_[i] = query_term_[i] + cell[i];
+        float base = qnorm + coarse_dist_[probe_[p]];
+
+        for (size_t i = 0; i < l.slots_.size (); i++) {
+            const uint8_t* code = l.codes_.data () + i * m_;
+            float dist = base;
+            for (size_t j = 0; j < m_; j++) {
+                dist += lut_[j * IVFPQ_KSUB + code[j]];
+            }
+            // unit vectors: 1 - <a, b> == |a - b|^2 / 2
+            cand_score_.push_back (1.f - 0.5f * dist);
+            cand_id_.push_back (slot_id_[l.slots_[i]]);
+        }
+    }
+}
+
+size_t IvfPqGallery::Size (void)
+{
+    return (model_ ? count_ - free_slots_.size () : 0) + warmup_.Size ();
+}
+
+size_t IvfPqGallery::MemoryBytes (void)
+{
+    size_t bytes = warmup_.MemoryBytes () + samples_.capacity () * sizeof (float);
+
+    if (model_) {
+        bytes += (model_->coarse_.size () + model_->coarse_norm_.size () +
+            model_->codebook_.size () + model_->code_norm_.size () +
+            model_->cell_term_.size ()) * sizeof (float);
+    }
+
+    for (auto&& l : lists_) {
+        bytes += l.slots_.capacity () * sizeof (uint32_t) + l.codes_.capacity ();
+    }
+
+    bytes += slot_id_.capacity () * sizeof (int64_t) +
+        (slot_list_.capacity () + slot_pos_.capacity ()) * sizeof (uint32_t) +
+        slot_seq_.capacity () * sizeof (uint64_t) + age_.size () *
+        sizeof (age_[0]);
+
+    return bytes;
+}
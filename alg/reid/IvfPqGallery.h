@@ -0,0 +1,149 @@
+/*
+ * @Description: Inverted file + product quantization ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-19 09:21:38
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-19 09:21:38
+ */
+
+#ifndef __TS_IVFPQ_GALLERY_H__
+#define __TS_IVFPQ_GALLERY_H__
+
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "FlatGallery.h"
+
+/*
+ * Until train_size_ features have been seen every entry lives in an exact
+ * warm-up FlatGallery. The sample is then clustered on a background thread
+ * into nlist_ coarse cells and pq_m_ x 256 residual codebooks, and the same
+ * thread encodes the sample. Once the model is ready every call copies
+ * IVFPQ_INSTALL_BATCH of those codes into the inverted lists, then encodes
+ * IVFPQ_MIGRATE_BATCH of the entries that joined the warm-up store
+ * meanwhile, anything still in the warm-up store is searched exactly.
+ * Each entry then costs pq_m_ bytes of code plus 40 bytes of bookkeeping.
+ *
+ * The distance table of a probed cell c is |q - c|^2 plus, per codeword y,
+ * -2<q, y> computed once per query and 2<c, y> + |y|^2 which only depends
+ * on the cell, precomputed for every cell by the trainer while that fits
+ * IVFPQ_PRECOMPUTE_BYTES and scored per probe otherwise.
+ */
+class IvfPqGallery : public GalleryInterface
+{
+public:
+    IvfPqGallery (void) {}
+    ~IvfPqGallery (void);
+
+    bool   Initialize   (const GalleryConfig& config);
+    void   Deinitialize (void);
+    size_t Search (const float* feature, size_t k, GalleryMatch* matches);
+    bool   Add    (int64_t id, const float* feature);
+    bool   Remove (int64_t id);
+    size_t Size        (void);
+    size_t MemoryBytes (void);
+    const char* Name   (void) { return "ivfpq"; }
+
+    bool   Trained     (void) { return model_ != nullptr; }
+
+private:
+    typedef struct _IvfModel {
+        size_t             dims_         { 0 },
+                           stride_       { 0 },
+                           nlist_        { 0 },
+                           m_            { 0 },
+                           dsub_         { 0 };
+        std::vector<float> coarse_       {  };  // nlist x stride
+        std::vector<float> coarse_norm_  {  };  // |c|^2
+        std::vector<float> codebook_     {  };  // m x 256 x dsub
+        std::vector<float> code_norm_    {  };  // m x 256, |y|^2
+        std::vector<float> cell_term_    {  };  // nlist x m x 256, or empty
+        // the sample encoded by the trainer, consumed by Migrate
+        std::vector<int64_t>  sample_ids_   {  };
+        std::vector<uint32_t> sample_lists_ {  };
+        std::vector<uint8_t>  sample_codes_ {  };
+    } IvfModel;
+
+    typedef struct _IvfList {
+        std::vector<uint32_t> slots_ {  };
+        std::vector<uint8_t>  codes_ {  };  // m bytes per slot
+    } IvfList;
+
+    static void Train (std::shared_ptr<IvfModel> model,
+        std::vector<float> samples, std::vector<int64_t> ids,
+        std::atomic<bool>* ready);
+    // cell of feature, scores is nlist floats of scratch
+    static size_t AssignList (const IvfModel& model, const float* feature,
+        float* scores);
+    // residual and scores are dims and 256 floats of scratch
+    static void   Encode     (const IvfModel& model, const float* feature,
+        size_t list, uint8_t* code, float* residual, float* scores);
+    // 2<c, y> + |y|^2 of cell list and every codeword, m x 256 floats
+    static void   CellTerm   (const IvfModel& model, size_t list, float* out);
+
+    bool   InstallModel   (void);
+    // installs a ready model, then moves a batch of warm-up entries over
+    void   Migrate        (void);
+    void   AddEncoded     (int64_t id, const float* feature);
+    void   AddCode        (int64_t id, size_t list, const uint8_t* code);
+    // scores the codes of the nprobe_ nearest cells into the candidates
+    void   Probe          (const float* feature);
+    void   RemoveSlot     (uint32_t slot);
+
+private:
+    FlatGallery               warmup_                ;
+    std::vector<float>        samples_      {        };
+    std::vector<int64_t>      sample_ids_   {        };
+    // warm-up ids removed or replaced, their sample code is out of date
+    std::unordered_set<int64_t> stale_      {        };
+    std::thread               trainer_               ;
+    std::atomic<bool>         model_ready_  { false  };
+    std::shared_ptr<IvfModel> pending_      {        };
+    std::shared_ptr<IvfModel> model_        {        };
+    // warm-up entries are left, the sample codes up to installed_ are done
+    bool                      migrating_    { false  };
+    size_t                    installed_    { 0      };
+    //-----------------------------------------------
+    size_t                    dims_         { 0      },
+                              stride_       { 0      },
+                              nlist_        { 0      },
+                              nprobe_       { 0      },
+                              m_            { 0      },
+                              dsub_         { 0      };
+    //-----------------------------------------------
+    std::vector<IvfList>      lists_        {        };
+    std::vector<int64_t>      slot_id_      {        };
+    std::vector<uint32_t>     slot_list_    {        },
+                              slot_pos_     {        };
+    size_t                    capacity_     { 0      },
+                              count_        { 0      },
+                              warmup_capacity_ { 0   };
+    bool                      warmup_full_  { false  };  // warned of it
+    // removed slots are reused before the oldest one is overwritten, a
+    // slot is the oldest if (seq, slot) is the first entry of age_ whose
+    // seq it still has, entries of freed slots are dropped on the way
+    std::vector<uint32_t>     free_slots_   {        };
+    std::vector<uint64_t>     slot_seq_     {        };
+    std::deque<std::pair<uint64_t, uint32_t> > age_ { };
+    uint64_t                  seq_          { 0      };
+    std::unordered_map<int64_t, uint32_t> id_slot_ { };
+    //-----------------------------------------------
+    std::vector<float>        coarse_dist_  {        },
+                              residual_     {        },
+                              code_score_   {        },
+                              query_term_   {        },
+                              cell_term_    {        },
+                              lut_          {        },
+                              row_          {        },
+                              cand_score_   {        };
+    std::vector<GalleryMatch> warm_hits_    {        };
+    std::vector<uint8_t>      code_         {        };
+    std::vector<int64_t>      cand_id_      {        };
+    std::vector<uint32_t>     probe_        {        };
+};
+
+#endif //__TS_IVFPQ_GALLERY_H__
@@ -0,0 +1,97 @@
+/*
+ * @Description: Implement of the bounded k-reciprocal re-ranking.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-30 14:05:51
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-30 14:05:51
+ */
+
+#include <float.h>
+#include <algorithm>
+
+#include "ReRanker.h"
+
+ReRanker::ReRanker (int k, float lambda)
+    : k_ (std::max (k, 1)), lambda_ (std::min (std::max (lambda, 0.f), 1.f))
+{
+}
+
+void ReRanker::Offer (Neighbors& list, int64_t id, float distance)
+{
+    if (list.size () == k_ && distance >= list.back ().second) return;
+
+    auto at = std::upper_bound (list.begin (), list.end (), distance,
+        [] (float d, const std::pair<int64_t, float>& n) {
+            return d < n.second;
+        });
+    list.insert (at, std::make_pair (id, distance));
+    if (list.size () > k_) list.pop_back ();
+}
+
+void ReRanker::Index (int64_t id, const GalleryMatch* neighbors, size_t n)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    Neighbors& own = lists_[id];
+
+    own.clear ();
+    for (size_t i = 0; i < n; i++) {
+        if (neighbors[i].id_ < 0 || neighbors[i].id_ == id) continue;
+        Offer (own, neighbors[i].id_, neighbors[i].distance_);
+        // the newcomer may be nearer than what its neighbours knew
+        Offer (lists_[neighbors[i].id_], id, neighbors[i].distance_);
+    }
+}
+
+void ReRanker::Erase (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    lists_.erase (id);
+}
+
+int ReRanker::Rank (const GalleryMatch* candidates, size_t n)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    std::vector<int64_t> reciprocal;
+    int   best = -1;
+    float best_dist = FLT_MAX;
+
+    n = std::min (n, k_);
+
+    // the query would enter the list of a reciprocal candidate
+    for (size_t i = 0; i < n; i++) {
+        auto it = lists_.find (candidates[i].id_);
+        if (it == lists_.end () || it->second.size () < k_ ||
+            candidates[i].distance_ < it->second.back ().second) {
+            reciprocal.push_back (candidates[i].id_);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        int64_t id = candidates[i].id_;
+        if (std::find (reciprocal.begin (), reciprocal.end (), id) ==
+            reciprocal.end ()) continue;
+
+        // the candidate's set is its list and itself
+        auto   it    = lists_.find (id);
+        size_t size  = 1 + (it != lists_.end () ? it->second.size () : 0);
+        size_t inter = 1;
+        if (it != lists_.end ()) {
+            for (auto&& r : reciprocal) {
+                for (auto&& nb : it->second) inter += nb.first == r;
+            }
+        }
+
+        float jaccard = 1.f - (float) inter /
+            (float) (reciprocal.size () + size - inter);
+        float blended = (1.f - lambda_) * jaccard +
+            lambda_ * candidates[i].distance_;
+        if (blended < best_dist) {
+            best_dist = blended;
+            best = (int) i;
+        }
+    }
+
+    return best;
+}
@@ -0,0 +1,61 @@
+/*
+ * @Description: Bounded k-reciprocal re-ranking of ambiguous ReID matches.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-30 14:05:51
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-30 14:05:51
+ */
+
+#ifndef __TS_RERANKER_H__
+#define __TS_RERANKER_H__
+
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "GalleryInterface.h"
+
+/*
+ * The k nearest entries of every gallery entry, kept when it is enrolled
+ * and as closer entries arrive after it. A candidate of a query is
+ * k-reciprocal when the query would make the candidate's own list. The
+ * candidates are re-scored by the jaccard distance between the query's
+ * reciprocal set and each candidate's list, blended with the original
+ * distance by lambda as in Zhong et al. 2017, without the query expansion,
+ * so one ranking is O(k^2). Removed ids stay in older lists until pushed
+ * out, entries restored from a snapshot start with an empty list. The
+ * class locks itself.
+ */
+class ReRanker
+{
+public:
+    ReRanker (int k, float lambda);
+
+    size_t K (void) { return k_; }
+
+    // neighbours of a new entry, nearest first, it joins their lists too
+    void Index (int64_t id, const GalleryMatch* neighbors, size_t n);
+    void Erase (int64_t id);
+
+    /*
+     * The best k-reciprocal candidate of the n nearest of a query by the
+     * blended distance, -1 when none of them is reciprocal.
+     */
+    int  Rank  (const GalleryMatch* candidates, size_t n);
+
+private:
+    // entries nearest first, at most k_
+    typedef std::vector<std::pair<int64_t, float> > Neighbors;
+
+    void Offer (Neighbors& list, int64_t id, float distance);
+
+private:
+    size_t                                 k_      ;
+    float                                  lambda_ ;
+    std::mutex                             mutex_  ;
+    std::unordered_map<int64_t, Neighbors> lists_  ;
+};
+
+#endif //__TS_RERANKER_H__
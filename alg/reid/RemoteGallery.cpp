@@ -0,0 +1,539 @@
+/*
+ * @Description: Implement of the ReID gallery client of GalleryServer nodes.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+#include "Common.h"
+#include "FeatureKernels.h"
+#include "RemoteGallery.h"
+
+static int64_t NowMs (void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+RemoteGallery::~RemoteGallery (void)
+{
+    Deinitialize ();
+}
+
+bool RemoteGallery::Initialize (const GalleryConfig& config)
+{
+    if (config.dims_ <= 0 || config.nodes_.empty ()) {
+        TS_ERR_MSG_V ("Invalid remote gallery shape (%ld nodes, %d dims)",
+            config.nodes_.size (), config.dims_);
+        return false;
+    }
+
+    Deinitialize ();
+
+    cfg_ = config;
+
+    for (auto&& address : config.nodes_) {
+        Node* node = new Node ();
+        node->address_ = address;
+        nodes_.push_back (node);
+    }
+
+    for (auto&& c : config.camera_shards_) {
+        if (c.second < 0 || c.second >= (int) nodes_.size ()) {
+            TS_WARN_MSG_V ("Camera %ld mapped to missing node %d, using "
+                "the default", c.first, c.second);
+            continue;
+        }
+        camera_map_[c.first] = c.second;
+    }
+
+    // a node of other dimensions would answer every request with WIRE_BAD
+    std::vector<char> body;
+    for (size_t n = 0; n < nodes_.size (); n++) {
+        if (Call (n, WIRE_INFO, NULL, 0, body) != WIRE_OK ||
+            body.size () != sizeof (WireInfo)) {
+            TS_WARN_MSG_V ("gallery node %s is not up yet",
+                nodes_[n]->address_.c_str ());
+            continue;
+        }
+
+        WireInfo info;
+        memcpy (&info, body.data (), sizeof (info));
+        if (info.version_ != GALLERY_WIRE_VERSION ||
+            info.dims_ != (uint32_t) cfg_.dims_) {
+            TS_ERR_MSG_V ("gallery node %s speaks version %u with %u dims, "
+                "expected %d with %d", nodes_[n]->address_.c_str (),
+                info.version_, info.dims_, GALLERY_WIRE_VERSION, cfg_.dims_);
+            Deinitialize ();
+            return false;
+        }
+        TS_INFO_MSG_V ("gallery node %s holds %lu entries",
+            nodes_[n]->address_.c_str (), info.size_);
+    }
+
+    TS_INFO_MSG_V ("gallery remote over %ld nodes", nodes_.size ());
+    return true;
+}
+
+void RemoteGallery::Deinitialize (void)
+{
+    for (auto&& node : nodes_) {
+        for (auto&& fd : node->idle_) close (fd);
+        delete node;
+    }
+
+    nodes_.clear ();
+    camera_map_.clear ();
+}
+
+int RemoteGallery::Checkout (size_t n)
+{
+    Node* node = nodes_[n];
+
+    {
+        std::lock_guard<std::mutex> lock (node->mutex_);
+        if (!node->idle_.empty ()) {
+            int fd = node->idle_.back ();
+            node->idle_.pop_back ();
+            return fd;
+        }
+        if (NowMs () < node->retry_ms_) return -1;
+    }
+
+    int fd = WireConnect (node->address_, cfg_.node_timeout_ms_);
+    if (fd < 0) {
+        std::lock_guard<std::mutex> lock (node->mutex_);
+        node->retry_ms_ = NowMs () + cfg_.node_retry_ms_;
+    }
+
+    return fd;
+}
+
+void RemoteGallery::Checkin (size_t n, int fd, bool ok)
+{
+    Node* node = nodes_[n];
+    std::lock_guard<std::mutex> lock (node->mutex_);
+
+    if (ok) {
+        node->idle_.push_back (fd);
+        return;
+    }
+
+    // a restarted node broke every pooled connection, not just this one
+    close (fd);
+    for (auto&& idle : node->idle_) close (idle);
+    node->idle_.clear ();
+}
+
+bool RemoteGallery::Request (int fd, WireType type, uint32_t seq,
+    const struct iovec* parts, int count)
+{
+    WireHeader header;
+
+    header.type_ = type;
+    header.seq_  = seq;
+    return WireSend (fd, header, parts, count);
+}
+
+int RemoteGallery::Reply (int fd, WireType type, uint32_t seq,
+    std::vector<char>& body)
+{
+    WireHeader header;
+
+    if (!WireReceive (fd, header, body)) return -1;
+
+    // an answer out of order means the stream is not what it should be
+    if (header.type_ != type || header.seq_ != seq) {
+        TS_ERR_MSG_V ("gallery node answered %u/%u to request %u/%u",
+            header.type_, header.seq_, type, seq);
+        return -1;
+    }
+
+    return header.status_;
+}
+
+int RemoteGallery::Call (size_t n, WireType type, const struct iovec* parts,
+    int count, std::vector<char>& body)
+{
+    uint32_t seq = seq_++;
+    int      fd  = Checkout (n);
+
+    if (fd < 0) return -1;
+
+    int status = Request (fd, type, seq, parts, count) ?
+        Reply (fd, type, seq, body) : -1;
+    Checkin (n, fd, status >= 0);
+
+    return status;
+}
+
+size_t RemoteGallery::HomeOf (int64_t camera_id)
+{
+    auto it = camera_map_.find (camera_id);
+    if (it != camera_map_.end ()) return it->second;
+
+    int64_t n = (int64_t) nodes_.size ();
+    return (size_t) (((camera_id % n) + n) % n);
+}
+
+int64_t RemoteGallery::GlobalId (size_t node, int64_t id)
+{
+    return id < 0 ? -1 : id * (int64_t) nodes_.size () + node;
+}
+
+bool RemoteGallery::LocalId (int64_t id, size_t& node, int64_t& local)
+{
+    int64_t n = (int64_t) nodes_.size ();
+
+    // local ids start at 1
+    if (id < n) return false;
+
+    node  = id % n;
+    local = id / n;
+    return true;
+}
+
+void RemoteGallery::Merge (size_t node, const std::vector<char>& body,
+    size_t n, size_t k, size_t wk, GalleryMatch* matches, size_t* found)
+{
+    if (body.size () != n * (sizeof (uint32_t) + wk * sizeof (WireMatch))) {
+        TS_WARN_MSG_V ("gallery node %s answered a search with %ld bytes",
+            nodes_[node]->address_.c_str (), body.size ());
+        return;
+    }
+
+    const uint32_t*  counts = (const uint32_t*) body.data ();
+    const WireMatch* in     = (const WireMatch*) (counts + n);
+
+    // both lists are sorted, the worse half of the merge is dropped
+    for (size_t i = 0; i < n; i++) {
+        GalleryMatch* out = matches + i * k;
+        size_t&       f   = found[i];
+
+        for (size_t j = 0; j < std::min<size_t> (counts[i], wk); j++) {
+            const WireMatch& w = in[i * wk + j];
+            if (f == k && w.distance_ >= out[k - 1].distance_) break;
+
+            size_t p = f < k ? f++ : k - 1;
+            for (; p > 0 && out[p - 1].distance_ > w.distance_; p--) {
+                out[p] = out[p - 1];
+            }
+            out[p].id_       = GlobalId (node, w.id_);
+            out[p].distance_ = w.distance_;
+        }
+    }
+}
+
+size_t RemoteGallery::Search (const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    size_t found = 0;
+
+    SearchBatch (&feature, 1, k, matches, &found);
+    return found;
+}
+
+void RemoteGallery::SearchBatch (const float* const* features, size_t n,
+    size_t k, GalleryMatch* matches, size_t* found)
+{
+    static thread_local std::vector<float> packed;
+    static thread_local std::vector<int>   fds;
+    static thread_local std::vector<char>  body;
+    size_t   dims = cfg_.dims_;
+    uint32_t seq  = seq_++;
+
+    std::fill (found, found + n, 0);
+    if (!n || !k) return;
+
+    packed.resize (n * dims);
+    for (size_t i = 0; i < n; i++) {
+        memcpy (&packed[i * dims], features[i], dims * sizeof (float));
+    }
+
+    WireSearch search;
+    search.n_    = n;
+    // nodes refuse more, nothing past that is a candidate anyway
+    search.k_    = std::min<size_t> (k, GALLERY_WIRE_MAX_K);
+    search.dims_ = dims;
+    struct iovec parts[2] = {
+        { &search,        sizeof (search)                 },
+        { packed.data (), packed.size () * sizeof (float) }
+    };
+
+    // every node works on the frame while the first answer is read
+    fds.assign (nodes_.size (), -1);
+    for (size_t s = 0; s < nodes_.size (); s++) {
+        if ((fds[s] = Checkout (s)) < 0) continue;
+        if (!Request (fds[s], WIRE_SEARCH, seq, parts, 2)) {
+            Checkin (s, fds[s], false);
+            fds[s] = -1;
+        }
+    }
+
+    for (size_t s = 0; s < nodes_.size (); s++) {
+        if (fds[s] < 0) continue;
+        int status = Reply (fds[s], WIRE_SEARCH, seq, body);
+        if (status == WIRE_OK) Merge (s, body, n, k, search.k_, matches,
+            found);
+        Checkin (s, fds[s], status >= 0);
+    }
+}
+
+void RemoteGallery::InsertAndSearch (std::vector<GalleryQuery>& queries)
+{
+    static thread_local std::vector<float>        normed;
+    static thread_local std::vector<const float*> rows;
+    static thread_local std::vector<size_t>       index;
+    static thread_local std::vector<GalleryMatch> nearest;
+    static thread_local std::vector<size_t>       counts;
+    static thread_local std::vector<std::vector<WireTouch> > touches;
+    static thread_local std::vector<std::vector<size_t> >    inserts;
+    static thread_local std::vector<int64_t>      cameras;
+    static thread_local std::vector<float>        packed;
+    static thread_local std::vector<int>          fds;
+    static thread_local std::vector<char>         body;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now ();
+    GalleryStats local;
+    size_t   dims  = cfg_.dims_;
+    size_t   nodes = nodes_.size ();
+    float    low   = cfg_.low_dist_;
+    float    high  = cfg_.high_dist_;
+    uint32_t seq   = seq_++;
+
+    normed.resize (queries.size () * dims);
+    rows.clear ();
+    index.clear ();
+    touches.resize (nodes);
+    inserts.resize (nodes);
+    for (size_t n = 0; n < nodes; n++) {
+        touches[n].clear ();
+        inserts[n].clear ();
+    }
+    local.frames_ ++;
+
+    for (size_t i = 0; i < queries.size (); i++) {
+        if (!queries[i].feature_) continue;
+
+        float* f = &normed[i * dims];
+        memcpy (f, queries[i].feature_, dims * sizeof (float));
+        L2Normalize (f, dims);
+        rows.push_back (f);
+        index.push_back (i);
+    }
+
+    nearest.assign (rows.size (), GalleryMatch ());
+    counts.assign (rows.size (), 0);
+    SearchBatch (rows.data (), rows.size (), 1, nearest.data (),
+        counts.data ());
+
+    for (size_t j = 0; j < rows.size (); j++) {
+        GalleryQuery& q = queries[index[j]];
+        size_t  node;
+        int64_t id;
+
+        local.queries_ ++;
+        if (counts[j] == 0 || nearest[j].distance_ >= high) {
+            inserts[HomeOf (q.camera_id_)].push_back (j);
+            continue;
+        }
+
+        q.object_id_ = nearest[j].id_;
+        q.distance_  = nearest[j].distance_;
+        if (q.distance_ >= low) {
+            local.ambiguous_ ++;
+        } else if (LocalId (q.object_id_, node, id)) {
+            WireTouch t;
+            t.id_        = id;
+            t.camera_id_ = q.camera_id_;
+            touches[node].push_back (t);
+            local.matched_ ++;
+        }
+    }
+
+    // a node that is down hands its inserts to the next one up
+    fds.assign (nodes, -1);
+    for (size_t n = 0; n < nodes; n++) {
+        if (!touches[n].empty () || !inserts[n].empty ()) {
+            fds[n] = Checkout (n);
+        }
+    }
+    for (size_t n = 0; n < nodes; n++) {
+        if (fds[n] >= 0 || inserts[n].empty ()) continue;
+        size_t t = 1;
+        for (; t < nodes; t++) {
+            size_t o = (n + t) % nodes;
+            if (fds[o] < 0 && touches[o].empty () && inserts[o].empty ()) {
+                fds[o] = Checkout (o);
+            }
+            if (fds[o] < 0) continue;
+            inserts[o].insert (inserts[o].end (), inserts[n].begin (),
+                inserts[n].end ());
+            break;
+        }
+        if (t == nodes) {
+            TS_ERR_MSG_V ("No gallery node took %ld new identities of %s",
+                inserts[n].size (), nodes_[n]->address_.c_str ());
+        }
+        inserts[n].clear ();
+    }
+
+    // touches and inserts of a node go out back to back on one connection
+    for (size_t n = 0; n < nodes; n++) {
+        if (fds[n] < 0) continue;
+        bool ok = true;
+
+        if (!touches[n].empty ()) {
+            uint32_t head[2] = { (uint32_t) touches[n].size (), 0 };
+            struct iovec parts[2] = {
+                { head,               sizeof (head)                        },
+                { touches[n].data (), touches[n].size () * sizeof (WireTouch) }
+            };
+            ok = Request (fds[n], WIRE_TOUCH, seq, parts, 2);
+        }
+
+        if (ok && !inserts[n].empty ()) {
+            WireInsert insert;
+            insert.n_    = inserts[n].size ();
+            insert.dims_ = dims;
+            cameras.resize (insert.n_);
+            packed.resize (insert.n_ * dims);
+            for (size_t x = 0; x < insert.n_; x++) {
+                size_t j = inserts[n][x];
+                cameras[x] = queries[index[j]].camera_id_;
+                memcpy (&packed[x * dims], rows[j], dims * sizeof (float));
+            }
+            struct iovec parts[3] = {
+                { &insert,         sizeof (insert)                     },
+                { cameras.data (), cameras.size () * sizeof (int64_t)  },
+                { packed.data (),  packed.size () * sizeof (float)     }
+            };
+            ok = Request (fds[n], WIRE_INSERT, seq, parts, 3);
+        }
+
+        if (!ok) {
+            Checkin (n, fds[n], false);
+            fds[n] = -1;
+        }
+    }
+
+    for (size_t n = 0; n < nodes; n++) {
+        if (fds[n] < 0) continue;
+        int status = WIRE_OK;
+
+        if (!touches[n].empty ()) {
+            status = Reply (fds[n], WIRE_TOUCH, seq, body);
+        }
+
+        if (status >= 0 && !inserts[n].empty ()) {
+            status = Reply (fds[n], WIRE_INSERT, seq, body);
+            if (status == WIRE_OK &&
+                body.size () == inserts[n].size () * sizeof (WireMatch)) {
+                const WireMatch* m = (const WireMatch*) body.data ();
+                for (size_t x = 0; x < inserts[n].size (); x++) {
+                    GalleryQuery& q = queries[index[inserts[n][x]]];
+                    q.object_id_ = GlobalId (n, m[x].id_);
+                    q.distance_  = m[x].distance_;
+                    // another client may have enrolled the person meanwhile
+                    if (q.object_id_ < 0) {
+                        local.refused_ ++;
+                    } else if (q.distance_ < low) {
+                        local.matched_ ++;
+                    } else if (q.distance_ < high) {
+                        local.ambiguous_ ++;
+                    } else {
+                        local.inserted_ ++;
+                    }
+                }
+            } else {
+                TS_ERR_MSG_V ("gallery node %s failed %ld inserts",
+                    nodes_[n]->address_.c_str (), inserts[n].size ());
+            }
+        }
+
+        Checkin (n, fds[n], status >= 0);
+    }
+
+    local.search_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now () - start).count ();
+
+    std::lock_guard<std::mutex> lock (mutex_);
+    stats_.frames_    += local.frames_;
+    stats_.queries_   += local.queries_;
+    stats_.matched_   += local.matched_;
+    stats_.ambiguous_ += local.ambiguous_;
+    stats_.inserted_  += local.inserted_;
+    stats_.refused_   += local.refused_;
+    stats_.search_ns_ += local.search_ns_;
+}
+
+bool RemoteGallery::UpdateEntry (int64_t id, int64_t camera_id,
+    const float* feature)
+{
+    std::vector<char> body;
+    size_t node;
+    WireEntry entry;
+
+    if (!LocalId (id, node, entry.id_)) return false;
+
+    entry.camera_id_ = camera_id;
+    entry.dims_      = cfg_.dims_;
+    struct iovec parts[2] = {
+        { &entry,          sizeof (entry)              },
+        { (void*) feature, cfg_.dims_ * sizeof (float) }
+    };
+
+    return Call (node, WIRE_UPDATE, parts, 2, body) == WIRE_OK;
+}
+
+bool RemoteGallery::Add (int64_t id, const float* feature)
+{
+    return UpdateEntry (id, 0, feature);
+}
+
+bool RemoteGallery::Remove (int64_t id)
+{
+    std::vector<char> body;
+    size_t node;
+    WireEntry entry;
+
+    if (!LocalId (id, node, entry.id_)) return false;
+
+    struct iovec part = { &entry, sizeof (entry) };
+    return Call (node, WIRE_REMOVE, &part, 1, body) == WIRE_OK;
+}
+
+WireInfo RemoteGallery::Info (void)
+{
+    std::vector<char> body;
+    WireInfo total;
+
+    total.dims_ = cfg_.dims_;
+    for (size_t n = 0; n < nodes_.size (); n++) {
+        WireInfo info;
+        if (Call (n, WIRE_INFO, NULL, 0, body) != WIRE_OK ||
+            body.size () != sizeof (info)) continue;
+        memcpy (&info, body.data (), sizeof (info));
+        total.size_   += info.size_;
+        total.memory_ += info.memory_;
+    }
+
+    return total;
+}
+
+size_t RemoteGallery::Size (void)
+{
+    return Info ().size_;
+}
+
+size_t RemoteGallery::MemoryBytes (void)
+{
+    return Info ().memory_;
+}
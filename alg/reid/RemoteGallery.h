@@ -0,0 +1,97 @@
+/*
+ * @Description: ReID gallery sharded across GalleryServer processes.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#ifndef __TS_REMOTE_GALLERY_H__
+#define __TS_REMOTE_GALLERY_H__
+
+#include <map>
+
+#include "GalleryInterface.h"
+#include "GalleryWire.h"
+
+/*
+ * A client of the gallery nodes in nodes_, each a GalleryServer holding a
+ * part of the identities. Every detection of a frame is searched on all
+ * nodes, the requests sent to all of them before any answer is read, and
+ * the top-k merged. Matches are touched on the node that holds them, new
+ * identities are enrolled by the InsertAndSearch of the camera's home node
+ * (camera_shards_, else camera_id % nodes), which searches once more and
+ * enrolls only what is still missing. A node's touches and inserts of a
+ * frame are pipelined on one connection.
+ *
+ * Node i hands out local ids, the client sees local * nodes + i, so the
+ * ids of all nodes stay apart and every id leads back to its node.
+ * Connections are pooled per node and checked out by one caller at a
+ * time. A node that can not be reached is left out of searches and
+ * retried after node_retry_ms_, its inserts go to the next node up.
+ *
+ * Like ShardedGallery, a person first seen by two home nodes at the same
+ * instant may be enrolled on both. Eviction, snapshots, the wal, topology,
+ * recent window and re-ranking belong to the nodes' own configuration.
+ */
+class RemoteGallery : public GalleryInterface
+{
+public:
+    RemoteGallery (void) {}
+    ~RemoteGallery (void);
+
+    bool   Initialize   (const GalleryConfig& config);
+    void   Deinitialize (void);
+    size_t Search (const float* feature, size_t k, GalleryMatch* matches);
+    void   SearchBatch (const float* const* features, size_t n, size_t k,
+                        GalleryMatch* matches, size_t* found);
+    bool   Add    (int64_t id, const float* feature);
+    bool   Remove (int64_t id);
+    size_t Size        (void);
+    size_t MemoryBytes (void);
+    const char* Name   (void) { return "remote"; }
+    bool   ConcurrentSearch (void) { return true; }
+
+    void   InsertAndSearch (std::vector<GalleryQuery>& queries);
+    bool   UpdateEntry  (int64_t id, int64_t camera_id, const float* feature);
+
+private:
+    typedef struct _Node {
+        std::string      address_  {   };
+        std::mutex       mutex_        ;
+        std::vector<int> idle_     {   };  // pooled connections
+        int64_t          retry_ms_ { 0 };  // down until then
+    } Node;
+
+    // a connection of node n for the caller alone, -1 if it is down
+    int    Checkout (size_t n);
+    // back to the pool, or closed when the exchange failed
+    void   Checkin  (size_t n, int fd, bool ok);
+    bool   Request  (int fd, WireType type, uint32_t seq,
+                     const struct iovec* parts, int count);
+    // the WireStatus of the answer to seq, -1 on a broken connection
+    int    Reply    (int fd, WireType type, uint32_t seq,
+                     std::vector<char>& body);
+    // one request to node n and its answer, the WireStatus or -1
+    int    Call     (size_t n, WireType type, const struct iovec* parts,
+                     int count, std::vector<char>& body);
+    // a node's answers to a fanned out WIRE_SEARCH of wk per query merged
+    // into matches of k per query
+    void   Merge    (size_t node, const std::vector<char>& body, size_t n,
+                     size_t k, size_t wk, GalleryMatch* matches,
+                     size_t* found);
+    // WireInfo of every node that answers, summed
+    WireInfo Info   (void);
+    size_t HomeOf   (int64_t camera_id);
+    int64_t GlobalId (size_t node, int64_t id);
+    // false for ids no node handed out
+    bool   LocalId  (int64_t id, size_t& node, int64_t& local);
+
+private:
+    std::vector<Node*>         nodes_      {   };
+    std::map<int64_t, size_t>  camera_map_ {   };
+    std::atomic<uint32_t>      seq_        { 0 };
+};
+
+#endif //__TS_REMOTE_GALLERY_H__
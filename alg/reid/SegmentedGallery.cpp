@@ -0,0 +1,290 @@
+/*
+ * @Description: Implement of the segmented ReID gallery with lock-free reads.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-01 10:21:44
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-01 10:21:44
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "SegmentedGallery.h"
+
+SegmentedGallery::~SegmentedGallery (void)
+{
+    Deinitialize ();
+}
+
+bool SegmentedGallery::Initialize (const GalleryConfig& config)
+{
+    if (config.dims_ <= 0 || config.max_elem_num_ <= 0) {
+        TS_ERR_MSG_V ("Invalid gallery shape (%d x %d)", config.max_elem_num_,
+            config.dims_);
+        return false;
+    }
+
+    Deinitialize ();
+
+    cfg_      = config;
+    dims_     = config.dims_;
+    stride_   = FeatureStride (dims_);
+    capacity_ = config.max_elem_num_;
+    // a dropped oldest segment costs scanning up to a segment of dead rows
+    segment_rows_ = std::min<size_t> (SEGMENT_ROWS, std::max<size_t> (
+        SEGMENT_BATCH_ROWS, (capacity_ / 8 + SEGMENT_BATCH_ROWS - 1) /
+        SEGMENT_BATCH_ROWS * SEGMENT_BATCH_ROWS));
+
+    if (cfg_.storage_ != GalleryStorage::GALLERY_STORAGE_FP32) {
+        TS_WARN_MSG_V ("gallery %s keeps %s features as fp32", Name (),
+            GalleryStorageName (cfg_.storage_));
+        cfg_.storage_ = GalleryStorage::GALLERY_STORAGE_FP32;
+    }
+
+    current_.store (new Generation ());
+    return true;
+}
+
+void SegmentedGallery::Deinitialize (void)
+{
+    // no search runs any more, what was retired goes first
+    epochs_.Reclaim ();
+
+    Generation* g = current_.exchange (NULL);
+    if (g) {
+        for (auto&& s : *g) FreeSegment (s);
+        delete g;
+    }
+
+    slots_.clear ();
+    live_     = 0;
+    dead_     = 0;
+    capacity_ = 0;
+}
+
+SegmentedGallery::Segment* SegmentedGallery::NewSegment (void)
+{
+    Segment* s = new Segment ();
+
+    s->rows_ = FeatureAlloc (segment_rows_ * stride_);
+    s->ids_  = new int64_t[segment_rows_];
+    if (!s->rows_) {
+        TS_ERR_MSG_V ("Failed to allocate a segment of %d rows",
+            (int) segment_rows_);
+        FreeSegment (s);
+        return NULL;
+    }
+
+    // padding columns must stay zero, the kernels may read them
+    memset (s->rows_, 0, segment_rows_ * stride_ * sizeof (float));
+    return s;
+}
+
+void SegmentedGallery::FreeSegment (Segment* segment)
+{
+    if (segment->rows_) FeatureFree (segment->rows_);
+    delete[] segment->ids_;
+    delete segment;
+}
+
+void SegmentedGallery::Publish (Generation* next,
+    const std::vector<Segment*>& dropped)
+{
+    Generation* old = current_.exchange (next);
+
+    epochs_.Retire ([old, dropped] {
+        for (auto&& s : dropped) FreeSegment (s);
+        delete old;
+    });
+}
+
+size_t SegmentedGallery::Search (const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    size_t found = 0;
+
+    SearchBatch (&feature, 1, k, matches, &found);
+    return found;
+}
+
+void SegmentedGallery::SearchBatch (const float* const* features, size_t n,
+    size_t k, GalleryMatch* matches, size_t* found)
+{
+    static thread_local std::vector<float>    scores;
+    static thread_local std::vector<float>    alive;
+    static thread_local std::vector<int64_t>  ids;
+    static thread_local std::vector<uint32_t> rows;
+    size_t block = SEGMENT_BATCH_ROWS;
+
+    std::fill (found, found + n, 0);
+    scores.resize (n * block);
+    alive.resize (block);
+    ids.resize (block);
+    rows.resize (block);
+
+    EpochReclaimer::Guard guard (epochs_);
+    Generation* g = current_.load ();
+    if (!g) return;
+
+    for (auto&& s : *g) {
+        uint32_t count = s->count_.load (std::memory_order_acquire);
+
+        for (uint32_t r0 = 0; r0 < count; r0 += block) {
+            size_t nr = std::min<size_t> (block, count - r0), m = 0;
+
+            DotProductBatch (features, n, s->rows_ + r0 * stride_, nr, dims_,
+                stride_, scores.data (), block);
+
+            // removed rows are only skipped, their scores are harmless
+            for (size_t r = 0; r < nr; r++) {
+                int64_t id = __atomic_load_n (&s->ids_[r0 + r],
+                    __ATOMIC_ACQUIRE);
+                if (id < 0) continue;
+                ids[m]    = id;
+                rows[m++] = r;
+            }
+
+            for (size_t i = 0; i < n; i++) {
+                const float* sc = &scores[i * block];
+                if (m < nr) {
+                    for (size_t j = 0; j < m; j++) alive[j] = sc[rows[j]];
+                    sc = alive.data ();
+                }
+                found[i] = MergeNearest (sc, ids.data (), m, k,
+                    matches + i * k, found[i]);
+            }
+        }
+    }
+}
+
+bool SegmentedGallery::Add (int64_t id, const float* feature)
+{
+    Generation* g = current_.load ();
+
+    if (!g) return false;
+
+    if (slots_.count (id)) Remove (id);
+    if (live_ >= capacity_) DropOldest ();
+
+    g = current_.load ();
+    Segment* s = g->empty () ? NULL : g->back ();
+    if (!s || s->count_.load (std::memory_order_relaxed) == segment_rows_) {
+        if (!(s = NewSegment ())) return false;
+        Generation* next = new Generation (*g);
+        next->push_back (s);
+        Publish (next, std::vector<Segment*> ());
+    }
+
+    // the row is complete before the count lets searches read it
+    uint32_t r = s->count_.load (std::memory_order_relaxed);
+    memcpy (s->rows_ + r * stride_, feature, dims_ * sizeof (float));
+    __atomic_store_n (&s->ids_[r], id, __ATOMIC_RELAXED);
+    s->count_.store (r + 1, std::memory_order_release);
+
+    slots_[id] = std::make_pair (s, r);
+    live_ ++;
+
+    return true;
+}
+
+bool SegmentedGallery::Remove (int64_t id)
+{
+    auto it = slots_.find (id);
+    if (it == slots_.end ()) return false;
+
+    Segment* s = it->second.first;
+    __atomic_store_n (&s->ids_[it->second.second], (int64_t) -1,
+        __ATOMIC_RELEASE);
+    slots_.erase (it);
+    live_ --;
+    s->dead_ ++;
+    dead_ ++;
+
+    if (s->dead_ == segment_rows_) {
+        // a full segment without a live row leaves at once
+        Generation* g = current_.load ();
+        Generation* next = new Generation ();
+        for (auto&& o : *g) if (o != s) next->push_back (o);
+        Publish (next, std::vector<Segment*> (1, s));
+        dead_ -= segment_rows_;
+    } else if (dead_ > segment_rows_ && dead_ * 2 > live_) {
+        Compact ();
+    }
+
+    return true;
+}
+
+void SegmentedGallery::DropOldest (void)
+{
+    Generation* g = current_.load ();
+
+    for (auto&& s : *g) {
+        uint32_t count = s->count_.load (std::memory_order_relaxed);
+        for (; s->front_ < count; s->front_++) {
+            int64_t id = s->ids_[s->front_];
+            if (id < 0) continue;
+            Remove (id);
+            return;
+        }
+    }
+}
+
+void SegmentedGallery::Compact (void)
+{
+    Generation* g    = current_.load ();
+    Generation* next = new Generation ();
+    Segment*    out  = NULL;
+    uint32_t    c    = segment_rows_;
+    std::vector<int64_t> moved;
+
+    // searches keep the old generation until they are done with it
+    for (auto&& s : *g) {
+        uint32_t count = s->count_.load (std::memory_order_relaxed);
+        for (uint32_t r = 0; r < count; r++) {
+            int64_t id = s->ids_[r];
+            if (id < 0) continue;
+
+            if (c == segment_rows_) {
+                if (!(out = NewSegment ())) {
+                    // keep serving the old generation, compact next time
+                    for (auto&& o : *next) FreeSegment (o);
+                    delete next;
+                    return;
+                }
+                next->push_back (out);
+                c = 0;
+            }
+
+            memcpy (out->rows_ + c * stride_, s->rows_ + r * stride_,
+                dims_ * sizeof (float));
+            out->ids_[c] = id;
+            out->count_.store (++c, std::memory_order_relaxed);
+            moved.push_back (id);
+        }
+    }
+
+    // the rows are packed, the i-th live row landed at i
+    for (size_t i = 0; i < moved.size (); i++) {
+        slots_[moved[i]] = std::make_pair ((*next)[i / segment_rows_],
+            (uint32_t) (i % segment_rows_));
+    }
+
+    Publish (next, *g);
+    dead_ = 0;
+}
+
+size_t SegmentedGallery::Size (void)
+{
+    return live_;
+}
+
+size_t SegmentedGallery::MemoryBytes (void)
+{
+    EpochReclaimer::Guard guard (epochs_);
+    Generation* g = current_.load ();
+
+    return g ? g->size () * segment_rows_ *
+        (stride_ * sizeof (float) + sizeof (int64_t)) : 0;
+}
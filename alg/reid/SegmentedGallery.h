@@ -0,0 +1,87 @@
+/*
+ * @Description: Exact ReID gallery over append-only segments with lock-free reads.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-01 10:21:44
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-01 10:21:44
+ */
+
+#ifndef __TS_SEGMENTED_GALLERY_H__
+#define __TS_SEGMENTED_GALLERY_H__
+
+#include <unordered_map>
+
+#include "EpochReclaimer.h"
+#include "GalleryInterface.h"
+
+// rows of a segment at most, an eighth of the capacity
+#define SEGMENT_ROWS       4096
+// rows scored per pass of a batched search
+#define SEGMENT_BATCH_ROWS 256
+
+/*
+ * The exact search of FlatGallery over fp32 rows kept in append-only
+ * segments. Searches take no lock: they pin an epoch, load the published
+ * generation (the list of segments) and score the rows each segment had
+ * published, while the writer (the caller holds mutex_) appends, removes
+ * and compacts. A row is written before the count that covers it is
+ * released and never written again, a removed row only turns its id to -1.
+ * Segments left without a live row, and a whole generation once removed
+ * rows reach half the live ones, are unlinked by publishing a new
+ * generation and freed when no search can still see them, EpochReclaimer.
+ * Once max_elem_num_ entries are stored the oldest one is dropped.
+ * Other storages are kept as fp32, snapshots are not supported.
+ */
+class SegmentedGallery : public GalleryInterface
+{
+public:
+    SegmentedGallery (void) {}
+    ~SegmentedGallery (void);
+
+    bool   Initialize   (const GalleryConfig& config);
+    void   Deinitialize (void);
+    size_t Search (const float* feature, size_t k, GalleryMatch* matches);
+    void   SearchBatch (const float* const* features, size_t n, size_t k,
+                        GalleryMatch* matches, size_t* found);
+    bool   Add    (int64_t id, const float* feature);
+    bool   Remove (int64_t id);
+    size_t Size        (void);
+    size_t MemoryBytes (void);
+    const char* Name   (void) { return "segmented"; }
+    bool   ConcurrentSearch (void) { return true; }
+
+private:
+    typedef struct _Segment {
+        float*                rows_  { NULL };
+        int64_t*              ids_   { NULL };  // -1 once removed
+        std::atomic<uint32_t> count_ { 0    };  // rows published
+        uint32_t              dead_  { 0    };  // writer only
+        uint32_t              front_ { 0    };  // writer only, oldest live
+    } Segment;
+
+    // the segments a search sees, never changed once published
+    typedef std::vector<Segment*> Generation;
+
+    Segment* NewSegment  (void);
+    static void FreeSegment (Segment* segment);
+    // swaps in next, old and the dropped segments are retired
+    void     Publish     (Generation* next,
+                          const std::vector<Segment*>& dropped);
+    void     DropOldest  (void);
+    void     Compact     (void);
+
+private:
+    size_t                   dims_         { 0    };
+    size_t                   stride_       { 0    };
+    size_t                   capacity_     { 0    };
+    size_t                   segment_rows_ { 0    };
+    std::atomic<size_t>      live_         { 0    };
+    std::atomic<Generation*> current_      { NULL };
+    EpochReclaimer           epochs_       ;
+    // id -> segment and row, the removed row count, both writer only
+    std::unordered_map<int64_t, std::pair<Segment*, uint32_t> > slots_ { };
+    size_t                   dead_         { 0    };
+};
+
+#endif //__TS_SEGMENTED_GALLERY_H__
@@ -0,0 +1,630 @@
+/*
+ * @Description: Implement of the camera-sharded ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-24 10:26:03
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-24 10:26:03
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "Common.h"
+#include "GalleryJournal.h"
+#include "ShardedGallery.h"
+
+ShardedGallery::~ShardedGallery (void)
+{
+    Deinitialize ();
+}
+
+bool ShardedGallery::Initialize (const GalleryConfig& config)
+{
+    if (config.shards_ < 2 || config.dims_ <= 0 || config.max_elem_num_ <= 0) {
+        TS_ERR_MSG_V ("Invalid sharded gallery shape (%d shards, %d x %d)",
+            config.shards_, config.max_elem_num_, config.dims_);
+        return false;
+    }
+
+    Deinitialize ();
+
+    cfg_ = config;
+
+    // any shard may end up with every entry, its rows are allocated as
+    // they arrive, recall is sampled on the merged result
+    GalleryConfig inner = config;
+    inner.shards_       = 1;
+    inner.recall_every_ = 0;
+
+    for (int i = 0; i < config.shards_; i++) {
+        Shard* shard = new Shard ();
+        if (!(shard->gallery_ = CreateGallery (inner))) {
+            TS_ERR_MSG_V ("Failed to create gallery shard %d", i);
+            delete shard;
+            Deinitialize ();
+            return false;
+        }
+        // Trim asks the shard for its victim, so even FIFO ones are tracked
+        shard->gallery_->SetEviction (new GalleryEviction (config.eviction_,
+            config.ttl_sec_, config.min_hits_));
+        shards_.push_back (shard);
+    }
+
+    for (auto&& c : config.camera_shards_) {
+        if (c.second < 0 || c.second >= config.shards_) {
+            TS_WARN_MSG_V ("Camera %ld mapped to missing shard %d, using "
+                "the default", c.first, c.second);
+            continue;
+        }
+        camera_map_[c.first] = c.second;
+    }
+
+    // cameras outside the map still land on id % shards
+    for (int i = 0; !camera_map_.empty () && i < config.shards_; i++) {
+        bool used = false;
+        for (auto&& c : camera_map_) used = used || c.second == (size_t) i;
+        if (!used) {
+            TS_WARN_MSG_V ("No camera mapped to gallery shard %d", i);
+        }
+    }
+
+    // the submitting thread searches too, one worker less than shards
+    size_t workers = config.fanout_threads_ > 0 ? config.fanout_threads_ :
+        std::min<size_t> (config.shards_, std::thread::hardware_concurrency ());
+    pool_ = new ThreadPool (workers > 1 ? workers - 1 : 0);
+
+    TS_INFO_MSG_V ("gallery sharded into %d %s shards sharing %d entries, "
+        "%ld fan-out workers", config.shards_, shards_[0]->gallery_->Name (),
+        config.max_elem_num_, pool_->Workers ());
+    return true;
+}
+
+void ShardedGallery::Deinitialize (void)
+{
+    delete pool_;
+    pool_ = NULL;
+
+    for (auto&& s : shards_) {
+        s->gallery_->Deinitialize ();
+        delete s->gallery_;
+        delete s;
+    }
+    shards_.clear ();
+    camera_map_.clear ();
+}
+
+size_t ShardedGallery::ShardOf (int64_t camera_id)
+{
+    auto it = camera_map_.find (camera_id);
+    if (it != camera_map_.end ()) return it->second;
+
+    int64_t n = shards_.size ();
+    return (size_t) (((camera_id % n) + n) % n);
+}
+
+size_t ShardedGallery::SearchShard (size_t s, const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    Shard* shard = shards_[s];
+
+    if (shard->gallery_->ConcurrentSearch ()) {
+        return shard->gallery_->Search (feature, k, matches);
+    }
+
+    std::lock_guard<std::mutex> lock (shard->mutex_);
+    return shard->gallery_->Search (feature, k, matches);
+}
+
+void ShardedGallery::SearchShardBatch (size_t s, const float* const* features,
+    const int64_t* camera_ids, size_t n, GalleryMatch* matches, size_t* found,
+    GalleryStats& stats, SearchWindow window)
+{
+    Shard* shard = shards_[s];
+
+    if (!n) return;
+
+    if (shard->gallery_->ConcurrentSearch ()) {
+        FilteredSearch (shard->gallery_, features, camera_ids, n, matches,
+            found, stats, window);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock (shard->mutex_);
+    FilteredSearch (shard->gallery_, features, camera_ids, n, matches, found,
+        stats, window);
+}
+
+std::string ShardedGallery::ShardPath (const std::string& path, size_t s)
+{
+    return path + ".shard" + std::to_string (s);
+}
+
+void ShardedGallery::Trim (void)
+{
+    while (Size () > (size_t) cfg_.max_elem_num_) {
+        size_t s = 0;
+        for (size_t i = 1; i < shards_.size (); i++) {
+            if (shards_[i]->gallery_->Size () > shards_[s]->gallery_->Size ()) {
+                s = i;
+            }
+        }
+
+        int64_t victim;
+        {
+            std::lock_guard<std::mutex> writer (shards_[s]->mutex_);
+            victim = shards_[s]->gallery_->Evict ();
+        }
+        if (victim < 0) break;
+
+        std::lock_guard<std::mutex> lock (mutex_);
+        if (exact_) exact_->Remove (victim);
+    }
+}
+
+void ShardedGallery::InsertAndSearch (std::vector<GalleryQuery>& queries)
+{
+    static thread_local std::vector<float>        normed;
+    static thread_local std::vector<GalleryMatch> best;
+    static thread_local std::vector<GalleryMatch> remote;
+    static thread_local std::vector<size_t>       home;
+    static thread_local std::vector<size_t>       owner;
+    static thread_local std::vector<size_t>       misses;
+    static thread_local std::vector<const float*> rows;
+    static thread_local std::vector<int64_t>      cameras;
+    static thread_local std::vector<size_t>       order;
+    static thread_local std::vector<GalleryMatch> hits;
+    static thread_local std::vector<size_t>       found;
+    static thread_local std::vector<size_t>       fresh;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now ();
+    GalleryStats local;
+    size_t dims = cfg_.dims_, n = queries.size (), ns = shards_.size ();
+    float  low  = cfg_.low_dist_;
+    float  high = cfg_.high_dist_;
+    int64_t budget = (int64_t) cfg_.rerank_budget_us_ * 1000;
+
+    normed.resize (n * dims);
+    best.assign (n, GalleryMatch ());
+    home.resize (n);
+    owner.resize (n);
+    misses.clear ();
+    fresh.clear ();
+    local.frames_ ++;
+
+    // entries past their ttl leave before the frame is searched
+    for (auto&& shard : shards_) {
+        std::lock_guard<std::mutex> writer (shard->mutex_);
+        shard->gallery_->Expire (n + GALLERY_EXPIRE_BUDGET);
+    }
+
+    // local first, most people are seen again by the cameras that saw them
+    for (size_t i = 0; i < n; i++) {
+        if (!queries[i].feature_) continue;
+
+        float* f = &normed[i * dims];
+        memcpy (f, queries[i].feature_, dims * sizeof (float));
+        L2Normalize (f, dims);
+
+        local.queries_ ++;
+        home[i] = owner[i] = ShardOf (queries[i].camera_id_);
+    }
+
+    // the detections of each shard's cameras are searched there as a batch
+    for (size_t s = 0; s < ns; s++) {
+        rows.clear ();
+        cameras.clear ();
+        order.clear ();
+        for (size_t i = 0; i < n; i++) {
+            if (!queries[i].feature_ || home[i] != s) continue;
+            rows.push_back (&normed[i * dims]);
+            cameras.push_back (queries[i].camera_id_);
+            order.push_back (i);
+        }
+
+        hits.assign (rows.size (), GalleryMatch ());
+        found.assign (rows.size (), 0);
+        SearchShardBatch (s, rows.data (), cameras.data (), rows.size (),
+            hits.data (), found.data (), local, temporal_ ?
+            SearchWindow::WINDOW_RECENT : SearchWindow::WINDOW_RECENT_FIRST);
+        for (size_t x = 0; x < order.size (); x++) {
+            best[order[x]] = hits[x];
+        }
+    }
+
+    // with a temporal index the recent windows of all shards go before any
+    // older segment, the second round searches every entry of every shard
+    for (int round = 0; round < (temporal_ ? 2 : 1); round++) {
+        SearchWindow window = !temporal_ ? SearchWindow::WINDOW_RECENT_FIRST :
+            round == 0 ? SearchWindow::WINDOW_RECENT : SearchWindow::WINDOW_ALL;
+
+        misses.clear ();
+        for (size_t i = 0; i < n; i++) {
+            if (!queries[i].feature_) continue;
+            if (best[i].id_ < 0 || best[i].distance_ >= low) {
+                misses.push_back (i);
+            }
+        }
+
+        if (temporal_ && (round == 1 || misses.empty ())) {
+            local.recent_    += local.queries_ - misses.size ();
+            local.fallbacks_ += misses.size ();
+        }
+        if (misses.empty ()) break;
+
+        // one task per shard covers every miss of the frame as a batch, the
+        // workers see their own thread_local buffers, so they get these by
+        // reference and only keep their scratch thread_local
+        size_t nm = misses.size ();
+        std::vector<float>&        fs = normed;
+        std::vector<GalleryMatch>& rs = remote;
+        std::vector<size_t>&       hs = home;
+        std::vector<size_t>&       ms = misses;
+        remote.assign (ns * nm, GalleryMatch ());
+        pool_->ParallelFor (ns, [&, nm, dims, round, window] (size_t s) {
+            static thread_local std::vector<const float*> task_rows;
+            static thread_local std::vector<int64_t>      task_cameras;
+            static thread_local std::vector<size_t>       task_at;
+            static thread_local std::vector<GalleryMatch> task_hits;
+            static thread_local std::vector<size_t>       task_found;
+
+            // a miss was counted against the indexes in its home shard
+            GalleryStats task_stats;
+
+            task_rows.clear ();
+            task_cameras.clear ();
+            task_at.clear ();
+            for (size_t m = 0; m < nm; m++) {
+                // the local pass already searched the home shard
+                if (round == 0 && hs[ms[m]] == s) continue;
+                task_rows.push_back (&fs[ms[m] * dims]);
+                task_cameras.push_back (queries[ms[m]].camera_id_);
+                task_at.push_back (m);
+            }
+
+            task_hits.assign (task_rows.size (), GalleryMatch ());
+            task_found.assign (task_rows.size (), 0);
+            SearchShardBatch (s, task_rows.data (), task_cameras.data (),
+                task_rows.size (), task_hits.data (), task_found.data (),
+                task_stats, window);
+            for (size_t x = 0; x < task_at.size (); x++) {
+                rs[s * nm + task_at[x]] = task_hits[x];
+            }
+        });
+
+        for (size_t m = 0; m < nm; m++) {
+            for (size_t s = 0; s < ns; s++) {
+                if (remote[s * nm + m].distance_ < best[misses[m]].distance_) {
+                    best[misses[m]]  = remote[s * nm + m];
+                    owner[misses[m]] = s;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        GalleryQuery& q = queries[i];
+        const float*  f = &normed[i * dims];
+
+        if (!q.feature_) continue;
+
+        if (exact_ && cfg_.recall_every_ > 0 &&
+            (recall_tick_ ++) % cfg_.recall_every_ == 0) {
+            std::lock_guard<std::mutex> lock (mutex_);
+            // a new identity has no right answer to miss
+            GalleryMatch truth;
+            if (exact_->Search (f, 1, &truth) && truth.distance_ < high) {
+                local.recall_checks_ ++;
+                if (best[i].id_ >= 0 && truth.id_ == best[i].id_) {
+                    local.recall_hits_ ++;
+                }
+            }
+        }
+
+        if (best[i].id_ < 0 || best[i].distance_ >= high) {
+            Shard* shard = shards_[home[i]];
+            std::lock_guard<std::mutex> writer (shard->mutex_);
+
+            // an earlier detection of this frame or another frame of the
+            // camera group may have enrolled the same person meanwhile
+            GalleryMatch again;
+            GalleryStats unused;
+            size_t       hit = 0;
+            FilteredSearch (shard->gallery_, &f, &q.camera_id_, 1, &again,
+                &hit, unused);
+            if (!hit || again.distance_ >= high) {
+                int64_t id;
+                {
+                    std::lock_guard<std::mutex> lock (mutex_);
+                    id = next_id_++;
+                }
+                q.distance_ = best[i].distance_;
+                // ids of a shard grow under its lock, as its snapshot expects,
+                // one the shard refused is skipped and never handed out
+                if (!shard->gallery_->ReplayAdd (id, q.camera_id_, f, dims)) {
+                    q.object_id_ = -1;
+                    local.refused_ ++;
+                    continue;
+                }
+                q.object_id_ = id;
+                if (exact_) {
+                    std::lock_guard<std::mutex> lock (mutex_);
+                    exact_->Add (id, f);
+                }
+                if (journal_) journal_->Append (q.object_id_, q.camera_id_, f, dims);
+                fresh.push_back (i);
+                local.inserted_ ++;
+                continue;
+            }
+            best[i]  = again;
+            owner[i] = home[i];
+        }
+
+        bool promoted = best[i].distance_ >= low && reranker_ &&
+            ReRank (f, q.camera_id_, best[i], budget, local);
+        q.object_id_ = best[i].id_;
+        q.distance_  = best[i].distance_;
+        if (best[i].distance_ < low) {
+            local.matched_ ++;
+            shards_[owner[i]]->gallery_->Touch (best[i].id_, q.camera_id_);
+        } else if (promoted) {
+            local.matched_ ++;
+            // the winner may live in any shard, the others ignore the id
+            for (auto&& s : shards_) s->gallery_->Touch (best[i].id_,
+                q.camera_id_);
+        } else {
+            local.ambiguous_ ++;
+        }
+    }
+
+    // the shard locks are released, the neighbours span every shard
+    if (reranker_) {
+        for (auto&& e : fresh) {
+            ReRankIndex (queries[e].object_id_, &normed[e * dims], budget,
+                local);
+        }
+    }
+
+    if (!fresh.empty ()) Trim ();
+
+    local.search_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now () - start).count ();
+
+    std::lock_guard<std::mutex> lock (mutex_);
+    stats_.frames_        += local.frames_;
+    stats_.queries_       += local.queries_;
+    stats_.matched_       += local.matched_;
+    stats_.ambiguous_     += local.ambiguous_;
+    stats_.inserted_      += local.inserted_;
+    stats_.refused_       += local.refused_;
+    stats_.search_ns_     += local.search_ns_;
+    stats_.recall_checks_ += local.recall_checks_;
+    stats_.recall_hits_   += local.recall_hits_;
+    stats_.filtered_      += local.filtered_;
+    stats_.candidates_    += local.candidates_;
+    stats_.recent_        += local.recent_;
+    stats_.fallbacks_     += local.fallbacks_;
+    stats_.reranked_      += local.reranked_;
+    stats_.promoted_      += local.promoted_;
+    stats_.rerank_skips_  += local.rerank_skips_;
+    stats_.rerank_ns_     += local.rerank_ns_;
+}
+
+size_t ShardedGallery::Search (const float* feature, size_t k,
+    GalleryMatch* matches)
+{
+    size_t ns = shards_.size ();
+    std::vector<GalleryMatch> all (ns * k);
+    std::vector<size_t>       found (ns, 0);
+
+    pool_->ParallelFor (ns, [&] (size_t s) {
+        found[s] = SearchShard (s, feature, k, &all[s * k]);
+    });
+
+    size_t n = 0;
+    for (size_t s = 0; s < ns; s++) {
+        for (size_t j = 0; j < found[s]; j++) all[n++] = all[s * k + j];
+    }
+    std::sort (all.begin (), all.begin () + n,
+        [] (const GalleryMatch& a, const GalleryMatch& b) {
+            return a.distance_ < b.distance_;
+        });
+
+    n = std::min (n, k);
+    std::copy (all.begin (), all.begin () + n, matches);
+    return n;
+}
+
+bool ShardedGallery::Add (int64_t id, const float* feature)
+{
+    // without a camera the id picks the shard
+    return ReplayAdd (id, id, feature, cfg_.dims_);
+}
+
+bool ShardedGallery::ReplayAdd (int64_t id, int64_t camera_id,
+    const float* feature, size_t dims)
+{
+    Shard* shard = shards_[ShardOf (camera_id)];
+
+    {
+        std::lock_guard<std::mutex> writer (shard->mutex_);
+
+        // each shard skips what its own snapshot already holds
+        if (!shard->gallery_->ReplayAdd (id, camera_id, feature, dims)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock (mutex_);
+        next_id_ = std::max (next_id_, id + 1);
+        if (exact_) exact_->Add (id, feature);
+    }
+
+    Trim ();
+    return true;
+}
+
+bool ShardedGallery::Remove (int64_t id)
+{
+    // the id does not tell the shard, every shard ignores ids it lacks
+    return ReplayRemove (id);
+}
+
+void ShardedGallery::SetJournal (GalleryJournal* journal)
+{
+    GalleryInterface::SetJournal (journal);
+
+    // the shards only log what they evict, inserts are logged here
+    for (auto&& s : shards_) {
+        std::lock_guard<std::mutex> writer (s->mutex_);
+        s->gallery_->SetJournal (journal);
+    }
+}
+
+void ShardedGallery::SetTopology (std::shared_ptr<CameraTopology> topology)
+{
+    GalleryInterface::SetTopology (topology);
+
+    // the shards were created with their own, sightings cross shards
+    for (auto&& s : shards_) {
+        std::lock_guard<std::mutex> writer (s->mutex_);
+        s->gallery_->SetTopology (topology);
+    }
+}
+
+void ShardedGallery::SetTemporalIndex (
+    std::shared_ptr<TemporalIndex> temporal)
+{
+    GalleryInterface::SetTemporalIndex (temporal);
+
+    for (auto&& s : shards_) {
+        std::lock_guard<std::mutex> writer (s->mutex_);
+        s->gallery_->SetTemporalIndex (temporal);
+    }
+}
+
+void ShardedGallery::SetReRanker (std::shared_ptr<ReRanker> reranker)
+{
+    GalleryInterface::SetReRanker (reranker);
+
+    // the shards only drop what they evict, ranking happens here
+    for (auto&& s : shards_) {
+        std::lock_guard<std::mutex> writer (s->mutex_);
+        s->gallery_->SetReRanker (reranker);
+    }
+}
+
+bool ShardedGallery::ReplayRemove (int64_t id)
+{
+    bool removed = false;
+
+    for (auto&& s : shards_) {
+        std::lock_guard<std::mutex> writer (s->mutex_);
+        removed = s->gallery_->ReplayRemove (id) || removed;
+    }
+
+    if (removed) {
+        std::lock_guard<std::mutex> lock (mutex_);
+        if (exact_) exact_->Remove (id);
+    }
+
+    return removed;
+}
+
+bool ShardedGallery::ReplayUpdate (int64_t id, int64_t camera_id,
+    const float* feature, size_t dims)
+{
+    Shard* shard = shards_[ShardOf (camera_id)];
+
+    {
+        std::lock_guard<std::mutex> writer (shard->mutex_);
+
+        if (!shard->gallery_->ReplayUpdate (id, camera_id, feature, dims)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock (mutex_);
+        next_id_ = std::max (next_id_, id + 1);
+    }
+
+    // an entry evicted meanwhile came back
+    Trim ();
+    return true;
+}
+
+bool ShardedGallery::UpdateEntry (int64_t id, int64_t camera_id,
+    const float* feature)
+{
+    // the camera that enrolled an id updates it, so it is in the home shard
+    Shard* shard = shards_[ShardOf (camera_id)];
+
+    {
+        std::lock_guard<std::mutex> writer (shard->mutex_);
+        if (!shard->gallery_->UpdateEntry (id, camera_id, feature)) {
+            return false;
+        }
+    }
+
+    Trim ();
+    return true;
+}
+
+GalleryStats ShardedGallery::GetStats (void)
+{
+    GalleryStats stats = GalleryInterface::GetStats ();
+
+    for (auto&& s : shards_) {
+        stats.evicted_ += s->gallery_->GetStats ().evicted_;
+    }
+
+    return stats;
+}
+
+size_t ShardedGallery::Size (void)
+{
+    size_t n = 0;
+
+    for (auto&& s : shards_) n += s->gallery_->Size ();
+
+    return n;
+}
+
+size_t ShardedGallery::MemoryBytes (void)
+{
+    size_t bytes = 0;
+
+    for (auto&& s : shards_) bytes += s->gallery_->MemoryBytes ();
+
+    return bytes;
+}
+
+bool ShardedGallery::SaveSnapshot (const std::string& path)
+{
+    bool ok = true;
+
+    for (size_t s = 0; s < shards_.size (); s++) {
+        ok = shards_[s]->gallery_->SaveSnapshot (ShardPath (path, s)) && ok;
+    }
+
+    return ok;
+}
+
+bool ShardedGallery::LoadSnapshot (const std::string& path)
+{
+    bool any = false;
+
+    for (size_t s = 0; s < shards_.size (); s++) {
+        Shard* shard = shards_[s];
+        std::lock_guard<std::mutex> writer (shard->mutex_);
+
+        if (!shard->gallery_->LoadSnapshot (ShardPath (path, s))) continue;
+        any = true;
+
+        std::lock_guard<std::mutex> lock (mutex_);
+        next_id_ = std::max (next_id_, shard->gallery_->NextId ());
+    }
+
+    // every shard may hold the whole capacity, together they may not
+    if (any) Trim ();
+    return any;
+}
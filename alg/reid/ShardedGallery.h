@@ -0,0 +1,98 @@
+/*
+ * @Description: ReID gallery sharded by camera with a parallel fan-out search.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-24 10:26:03
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-24 10:26:03
+ */
+
+#ifndef __TS_SHARDED_GALLERY_H__
+#define __TS_SHARDED_GALLERY_H__
+
+#include <map>
+
+#include "GalleryInterface.h"
+#include "ThreadPool.h"
+
+/*
+ * One inner gallery of the configured mode per camera group. A detection is
+ * first searched in the shard of its camera, only when that finds no match
+ * below low_dist_ are the other shards searched in parallel, one pool task
+ * per shard for all such detections of the frame, and the results merged.
+ * Both passes hand each shard its detections as one SearchBatch.
+ * New identities go to the local shard.
+ *
+ * Every shard has its own lock, frames of different camera groups only
+ * meet on the shared id counter. A person first seen by two groups at the
+ * same instant may be enrolled once in each of them.
+ *
+ * The shards share one capacity of max_elem_num_ entries, however the
+ * cameras are spread over them: every shard may hold all of it and tracks
+ * its entries for eviction, whenever an insert takes the total past the
+ * capacity the largest shard drops its victim. The shards allocate their
+ * rows as entries arrive, so a skewed camera mix costs neither entries nor
+ * memory beyond about max_elem_num_ rows. The shards log their evictions
+ * to the shared journal.
+ *
+ * The shards share one camera topology, temporal index and re-ranker. A
+ * shard filters by the candidates of every shard and skips the ids it does
+ * not hold, ambiguous matches are re-ranked across all shards.
+ */
+class ShardedGallery : public GalleryInterface
+{
+public:
+    ShardedGallery (void) {}
+    ~ShardedGallery (void);
+
+    bool   Initialize   (const GalleryConfig& config);
+    void   Deinitialize (void);
+    size_t Search (const float* feature, size_t k, GalleryMatch* matches);
+    bool   Add    (int64_t id, const float* feature);
+    bool   Remove (int64_t id);
+    size_t Size        (void);
+    size_t MemoryBytes (void);
+    const char* Name   (void) { return "sharded"; }
+    bool   ConcurrentSearch (void) { return true; }
+
+    void   InsertAndSearch (std::vector<GalleryQuery>& queries);
+    void   SetJournal   (GalleryJournal* journal);
+    void   SetTopology  (std::shared_ptr<CameraTopology> topology);
+    void   SetTemporalIndex (std::shared_ptr<TemporalIndex> temporal);
+    void   SetReRanker  (std::shared_ptr<ReRanker> reranker);
+    bool   ReplayAdd    (int64_t id, int64_t camera_id, const float* feature,
+                         size_t dims);
+    bool   ReplayRemove (int64_t id);
+    bool   ReplayUpdate (int64_t id, int64_t camera_id, const float* feature,
+                         size_t dims);
+    bool   UpdateEntry  (int64_t id, int64_t camera_id, const float* feature);
+    GalleryStats GetStats (void);
+    bool   SaveSnapshot (const std::string& path);
+    bool   LoadSnapshot (const std::string& path);
+
+private:
+    typedef struct _Shard {
+        GalleryInterface* gallery_ { NULL };
+        std::mutex        mutex_          ;  // writers, and readers if needed
+    } Shard;
+
+    size_t ShardOf     (int64_t camera_id);
+    // nearest entry of one shard, locked unless the shard searches concurrently
+    size_t SearchShard (size_t s, const float* feature, size_t k,
+                        GalleryMatch* matches);
+    void   SearchShardBatch (size_t s, const float* const* features,
+                             const int64_t* camera_ids, size_t n,
+                             GalleryMatch* matches, size_t* found,
+                             GalleryStats& stats, SearchWindow window);
+    std::string ShardPath (const std::string& path, size_t s);
+    // evicts from the largest shards until the total fits the capacity,
+    // no shard lock held
+    void   Trim (void);
+
+private:
+    std::vector<Shard*>        shards_     {      };
+    std::map<int64_t, size_t>  camera_map_ {      };
+    ThreadPool*                pool_       { NULL };
+};
+
+#endif //__TS_SHARDED_GALLERY_H__
@@ -0,0 +1,87 @@
+/*
+ * @Description: Implement of the last-seen time segments of the gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-29 09:12:36
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-29 09:12:36
+ */
+
+#include <algorithm>
+
+#include "TemporalIndex.h"
+
+TemporalIndex::TemporalIndex (int segment_sec, int recent_sec)
+    : segment_ms_ ((int64_t) std::max (segment_sec, 1) * 1000),
+      recent_ms_  ((int64_t) std::max (recent_sec, 0) * 1000)
+{
+}
+
+int64_t TemporalIndex::FirstRecent (int64_t now)
+{
+    return std::max<int64_t> (now - recent_ms_, 0) / segment_ms_;
+}
+
+void TemporalIndex::Seen (int64_t id, int64_t now)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    int64_t segment = std::max<int64_t> (now, 0) / segment_ms_;
+
+    auto it = index_.find (id);
+    if (it != index_.end ()) {
+        if (it->second.segment_ == segment) return;
+
+        // the last id of the old segment takes the freed place
+        std::vector<int64_t>& old = segments_[it->second.segment_];
+        old[it->second.pos_] = old.back ();
+        index_[old.back ()].pos_ = it->second.pos_;
+        old.pop_back ();
+        if (old.empty ()) segments_.erase (it->second.segment_);
+    }
+
+    std::vector<int64_t>& ids = segments_[segment];
+    index_[id] = Slot { segment, ids.size () };
+    ids.push_back (id);
+}
+
+void TemporalIndex::Erase (int64_t id)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    auto it = index_.find (id);
+    if (it == index_.end ()) return;
+
+    Slot slot = it->second;
+    index_.erase (it);
+
+    std::vector<int64_t>& ids = segments_[slot.segment_];
+    if (ids.back () != id) {
+        ids[slot.pos_] = ids.back ();
+        index_[ids.back ()].pos_ = slot.pos_;
+    }
+    ids.pop_back ();
+    if (ids.empty ()) segments_.erase (slot.segment_);
+}
+
+void TemporalIndex::Recent (int64_t now, std::vector<int64_t>& out)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    out.clear ();
+    for (auto it = segments_.lower_bound (FirstRecent (now));
+        it != segments_.end (); it++) {
+        out.insert (out.end (), it->second.begin (), it->second.end ());
+    }
+}
+
+void TemporalIndex::KeepRecent (int64_t now, std::vector<int64_t>& ids)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    int64_t first = FirstRecent (now);
+
+    ids.erase (std::remove_if (ids.begin (), ids.end (),
+        [this, first] (int64_t id) {
+            auto it = index_.find (id);
+            return it == index_.end () || it->second.segment_ < first;
+        }), ids.end ());
+}
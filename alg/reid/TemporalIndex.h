@@ -0,0 +1,59 @@
+/*
+ * @Description: Last-seen time segments of the ReID gallery entries.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-29 09:12:36
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-29 09:12:36
+ */
+
+#ifndef __TS_TEMPORAL_INDEX_H__
+#define __TS_TEMPORAL_INDEX_H__
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Entries bucketed into segments of segment_sec by the time they were last
+ * inserted or matched. The recent window is every segment that overlaps
+ * the last recent_sec, so its size follows the traffic of the site and not
+ * the age of the gallery. Moving an entry to the current segment and
+ * dropping it are O(1), collecting the window touches recent entries only.
+ * Entries restored from a snapshot start in the oldest segment. The class
+ * locks itself.
+ */
+class TemporalIndex
+{
+public:
+    TemporalIndex (int segment_sec, int recent_sec);
+
+    // id was inserted or matched at now (ms)
+    void Seen   (int64_t id, int64_t now);
+    void Erase  (int64_t id);
+
+    // writes the ids of the recent window to out
+    void Recent     (int64_t now, std::vector<int64_t>& out);
+    // drops the ids outside the recent window from ids
+    void KeepRecent (int64_t now, std::vector<int64_t>& ids);
+
+private:
+    typedef struct _Slot {
+        int64_t segment_ ;
+        size_t  pos_     ;
+    } Slot;
+
+    int64_t FirstRecent (int64_t now);
+
+private:
+    int64_t                                     segment_ms_ ;
+    int64_t                                     recent_ms_  ;
+    std::mutex                                  mutex_      ;
+    // segment number -> its ids, the segments in time order
+    std::map<int64_t, std::vector<int64_t> >    segments_   ;
+    std::unordered_map<int64_t, Slot>           index_      ;
+};
+
+#endif //__TS_TEMPORAL_INDEX_H__
@@ -0,0 +1,86 @@
+/*
+ * @Description: Implement of the fixed-size worker pool.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-24 09:42:17
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-24 09:42:17
+ */
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool (size_t workers)
+{
+    for (size_t i = 0; i < workers; i++) {
+        workers_.emplace_back (&ThreadPool::Run, this);
+    }
+}
+
+ThreadPool::~ThreadPool (void)
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all ();
+
+    for (auto&& t : workers_) t.join ();
+}
+
+void ThreadPool::Drain (Batch* batch)
+{
+    size_t i;
+
+    while ((i = batch->next_.fetch_add (1)) < batch->n_) {
+        (*batch->fn_) (i);
+        if (batch->done_.fetch_add (1) + 1 == batch->n_) {
+            std::lock_guard<std::mutex> lock (batch->mutex_);
+            batch->cond_.notify_all ();
+        }
+    }
+}
+
+void ThreadPool::ParallelFor (size_t n, const std::function<void (size_t)>& fn)
+{
+    if (n == 0) return;
+    if (n == 1 || workers_.empty ()) {
+        for (size_t i = 0; i < n; i++) fn (i);
+        return;
+    }
+
+    std::shared_ptr<Batch> batch = std::make_shared<Batch> ();
+    batch->fn_ = &fn;
+    batch->n_  = n;
+
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        queue_.push_back (batch);
+    }
+    cond_.notify_all ();
+
+    Drain (batch.get ());
+
+    std::unique_lock<std::mutex> lock (batch->mutex_);
+    batch->cond_.wait (lock, [&batch] { return batch->done_ == batch->n_; });
+}
+
+void ThreadPool::Run (void)
+{
+    for (;;) {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> lock (mutex_);
+            cond_.wait (lock, [this] { return stop_ || !queue_.empty (); });
+            if (stop_) return;
+
+            // fully claimed batches leave the queue, their owner waits on them
+            batch = queue_.front ();
+            if (batch->next_ >= batch->n_) {
+                queue_.pop_front ();
+                continue;
+            }
+        }
+
+        Drain (batch.get ());
+    }
+}
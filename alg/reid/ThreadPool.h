@@ -0,0 +1,60 @@
+/*
+ * @Description: Fixed-size worker pool running parallel-for batches.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-24 09:42:17
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-24 09:42:17
+ */
+
+#ifndef __TS_THREAD_POOL_H__
+#define __TS_THREAD_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Several threads may submit batches at the same time, every batch is
+ * worked on by the idle workers and by its submitter, which returns once
+ * all of its items are done.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool (size_t workers);
+    ~ThreadPool (void);
+
+    // runs fn (i) for every i in [0, n), returns when all have finished
+    void ParallelFor (size_t n, const std::function<void (size_t)>& fn);
+
+    size_t Workers (void) { return workers_.size (); }
+
+private:
+    typedef struct _Batch {
+        const std::function<void (size_t)>* fn_ { NULL };
+        size_t                  n_    { 0 };
+        std::atomic<size_t>     next_ { 0 };
+        std::atomic<size_t>     done_ { 0 };
+        std::mutex              mutex_    ;
+        std::condition_variable cond_     ;
+    } Batch;
+
+    // claims and runs items of batch until none are left
+    static void Drain (Batch* batch);
+    void Run (void);
+
+private:
+    std::mutex                          mutex_            ;
+    std::condition_variable             cond_             ;
+    std::deque<std::shared_ptr<Batch> > queue_   {       };
+    bool                                stop_    { false };
+    std::vector<std::thread>            workers_ {       };
+};
+
+#endif //__TS_THREAD_POOL_H__
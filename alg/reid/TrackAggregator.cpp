@@ -0,0 +1,180 @@
+/*
+ * @Description: Implement of the per-trace feature aggregation.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-26 10:18:22
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-26 10:18:22
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "Common.h"
+#include "TrackAggregator.h"
+
+TrackAggregator::TrackAggregator (GalleryInterface* gallery,
+    const GalleryConfig& config)
+    : gallery_ (gallery), cfg_ (config)
+{
+}
+
+int64_t TrackAggregator::Now (void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+void TrackAggregator::Fold (Track& t, const float* feature, float quality,
+    float* centroid)
+{
+    size_t dims = cfg_.dims_;
+    float  w    = std::max (quality, TRACK_MIN_QUALITY);
+
+    if (t.sum_.empty ()) t.sum_.assign (dims, 0.f);
+
+    // past the window the mean decays instead of growing without bound
+    if (t.weight_ + w > TRACK_WINDOW_WEIGHT) {
+        float scale = std::max (TRACK_WINDOW_WEIGHT - w, 0.f) / t.weight_;
+        for (auto&& x : t.sum_) x *= scale;
+        t.weight_ *= scale;
+    }
+
+    for (size_t i = 0; i < dims; i++) t.sum_[i] += w * feature[i];
+    t.weight_ += w;
+
+    memcpy (centroid, t.sum_.data (), dims * sizeof (float));
+    L2Normalize (centroid, dims);
+}
+
+void TrackAggregator::Sweep (int64_t now)
+{
+    if (now - last_sweep_ < 1000) return;
+    last_sweep_ = now;
+
+    // a track being searched right now must outlive the sweep
+    int64_t deadline = now -
+        (int64_t) std::max (cfg_.track_ttl_sec_, 1) * 1000;
+    for (auto it = tracks_.begin (); it != tracks_.end ();) {
+        if (it->second.last_seen_ < deadline) {
+            it = tracks_.erase (it);
+            stats_.closed_ ++;
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TrackAggregator::InsertAndSearch (std::vector<GalleryQuery>& queries)
+{
+    static thread_local std::vector<float>        normed;
+    static thread_local std::vector<float>        centroids;
+    static thread_local std::vector<GalleryQuery> fresh;
+    static thread_local std::vector<std::pair<size_t, size_t> > fresh_at;
+    static thread_local std::vector<size_t>       refresh;
+    size_t  dims = cfg_.dims_;
+    int64_t now  = Now ();
+
+    normed.resize (dims);
+    centroids.resize (queries.size () * dims);
+    fresh.clear ();
+    fresh_at.clear ();
+    refresh.clear ();
+
+    uint64_t call;
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+
+        call = ++calls_;
+        for (size_t i = 0; i < queries.size (); i++) {
+            GalleryQuery& q = queries[i];
+            float*        c = &centroids[i * dims];
+
+            if (!q.feature_) continue;
+
+            memcpy (normed.data (), q.feature_, dims * sizeof (float));
+            L2Normalize (normed.data (), dims);
+
+            Track& t = tracks_[TrackKey (q.camera_id_, q.trace_id_)];
+            Fold (t, normed.data (), q.confidence_, c);
+            t.last_seen_ = now;
+            stats_.detections_ ++;
+
+            if (t.object_id_ < 0) {
+                // a track another call is still searching is searched again,
+                // its query lives in that call's thread_local batch
+                if (t.call_ != call) {
+                    GalleryQuery g = q;
+                    g.feature_ = c;
+                    t.call_  = call;
+                    t.fresh_ = fresh.size ();
+                    fresh.push_back (g);
+                }
+                // another detection of the track in this batch follows it
+                fresh_at.push_back (std::make_pair (i, t.fresh_));
+                continue;
+            }
+
+            q.object_id_ = t.object_id_;
+            q.distance_  = 1.f - DotProduct (normed.data (), c, dims);
+            if (t.owner_ && ++t.pending_ >= cfg_.track_refresh_) {
+                t.pending_ = 0;
+                refresh.push_back (i);
+            }
+        }
+
+        Sweep (now);
+    }
+
+    // new tracks only, with the mean of what they have seen so far
+    if (!fresh.empty ()) gallery_->InsertAndSearch (fresh);
+
+    size_t refreshed = 0;
+    for (auto&& i : refresh) {
+        if (gallery_->UpdateEntry (queries[i].object_id_, queries[i].camera_id_,
+            &centroids[i * dims])) {
+            refreshed++;
+            continue;
+        }
+
+        // the gallery can not replace entries, stop trying for this track
+        std::lock_guard<std::mutex> lock (mutex_);
+        auto it = tracks_.find (TrackKey (queries[i].camera_id_,
+            queries[i].trace_id_));
+        if (it != tracks_.end ()) it->second.owner_ = false;
+    }
+
+    std::lock_guard<std::mutex> lock (mutex_);
+    stats_.searched_  += fresh.size ();
+    stats_.refreshed_ += refreshed;
+
+    for (auto&& at : fresh_at) {
+        GalleryQuery& q = queries[at.first];
+        q.object_id_ = fresh[at.second].object_id_;
+        q.distance_  = fresh[at.second].distance_;
+
+        auto it = tracks_.find (TrackKey (q.camera_id_, q.trace_id_));
+        if (it == tracks_.end () || it->second.object_id_ >= 0) continue;
+        it->second.object_id_ = q.object_id_;
+        if (it->second.call_ == call) it->second.call_ = 0;
+        // a new identity is the track's own, its mean may replace it
+        it->second.owner_ = q.distance_ >= cfg_.high_dist_;
+    }
+}
+
+size_t TrackAggregator::Size (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return tracks_.size ();
+}
+
+void TrackAggregator::PrintStats (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    TS_INFO_MSG_V ("tracks: open:%ld, detections:%lu, searched:%lu, "
+        "refreshed:%lu, closed:%lu", tracks_.size (), stats_.detections_,
+        stats_.searched_, stats_.refreshed_, stats_.closed_);
+}
@@ -0,0 +1,86 @@
+/*
+ * @Description: Per-trace feature aggregation in front of the ReID gallery.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-26 10:18:22
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-26 10:18:22
+ */
+
+#ifndef __TS_TRACK_AGGREGATOR_H__
+#define __TS_TRACK_AGGREGATOR_H__
+
+#include <unordered_map>
+
+#include "GalleryInterface.h"
+
+// weight after which the running mean starts forgetting older detections
+#define TRACK_WINDOW_WEIGHT 32.f
+// lowest quality a detection is weighted with
+#define TRACK_MIN_QUALITY   0.05f
+
+typedef struct _TrackStats {
+    uint64_t detections_ { 0 };
+    uint64_t searched_   { 0 };  // tracks resolved against the gallery
+    uint64_t refreshed_  { 0 };  // centroid updates written to the gallery
+    uint64_t closed_     { 0 };
+} TrackStats;
+
+/*
+ * Detections are folded into a running mean per (camera, trace id), each
+ * weighted by its confidence. A track is searched in the gallery once, on
+ * its first detection, and keeps the id it got. A track that
+ * enrolled a new identity owns that entry and replaces it with its current
+ * mean every track_refresh_ frames, so the gallery grows with the number of
+ * tracks and every detection after the first costs no search.
+ */
+class TrackAggregator
+{
+public:
+    TrackAggregator (GalleryInterface* gallery, const GalleryConfig& config);
+
+    // same contract as GalleryInterface::InsertAndSearch
+    void   InsertAndSearch (std::vector<GalleryQuery>& queries);
+
+    size_t Size       (void);
+    void   PrintStats (void);
+
+private:
+    typedef struct _Track {
+        std::vector<float> sum_       {       };
+        float              weight_    { 0.f   };
+        int64_t            object_id_ { -1    };
+        bool               owner_     { false };  // enrolled object_id_
+        int                pending_   { 0     };  // frames since the update
+        uint64_t           call_      { 0     };  // call searching it, or 0
+        size_t             fresh_     { 0     };  // its query in that call
+        int64_t            last_seen_ { 0     };  // ms, steady clock
+    } Track;
+
+    typedef std::pair<int64_t, int64_t> TrackKey;
+
+    struct TrackKeyHash {
+        size_t operator() (const TrackKey& k) const {
+            return std::hash<int64_t> () (k.first * 0x9e3779b97f4a7c15ULL ^
+                k.second);
+        }
+    };
+
+    // folds a unit-length feature into t, writes the new mean to centroid
+    void    Fold  (Track& t, const float* feature, float quality,
+                   float* centroid);
+    // drops the tracks unseen for track_ttl_sec_, at most once a second
+    void    Sweep (int64_t now);
+    int64_t Now   (void);
+
+private:
+    GalleryInterface*  gallery_ ;
+    GalleryConfig      cfg_     ;
+    std::mutex         mutex_   ;
+    TrackStats         stats_      {   };
+    int64_t            last_sweep_ { 0 };
+    uint64_t           calls_      { 0 };
+    std::unordered_map<TrackKey, Track, TrackKeyHash> tracks_;
+};
+
+#endif //__TS_TRACK_AGGREGATOR_H__
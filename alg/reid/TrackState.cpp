@@ -0,0 +1,253 @@
+/*
+ * @Description: Implement of the osd track-state store.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-13 10:05:47
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-13 10:05:47
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "Common.h"
+#include "TrackState.h"
+
+static const int64_t kEmpty     = INT64_MIN;
+static const int64_t kTombstone = INT64_MIN + 1;
+
+static uint64_t Mix (uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x  = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x  = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void TrackColor (int64_t id, uint8_t& r, uint8_t& g, uint8_t& b)
+{
+    // a hue from the id, saturated and bright enough to read on video
+    uint64_t h  = Mix ((uint64_t) id);
+    int      hi = (int) (h % 6);
+    int      f  = (int) ((h >> 8) & 0xff);
+    uint8_t  v  = 255;
+    uint8_t  p  = 48;
+    uint8_t  q  = (uint8_t) (v - (v - p) * f / 255);
+    uint8_t  t  = (uint8_t) (p + (v - p) * f / 255);
+
+    switch (hi) {
+    case 0:  r = v; g = t; b = p; break;
+    case 1:  r = q; g = v; b = p; break;
+    case 2:  r = p; g = v; b = t; break;
+    case 3:  r = p; g = q; b = v; break;
+    case 4:  r = t; g = p; b = v; break;
+    default: r = v; g = p; b = q; break;
+    }
+}
+
+TrackStateStore::TrackStateStore (size_t capacity, int ttl_sec)
+    : capacity_ (std::max<size_t> (capacity, 1)),
+      ttl_ms_   ((int64_t) std::max (ttl_sec, 1) * 1000)
+{
+    size_t n = 16;
+    while (n < capacity_ * 2) n <<= 1;
+
+    mask_  = n - 1;
+    slots_.reset (new Slot[n]);
+    for (size_t i = 0; i < n; i++) {
+        slots_[i].key_.store (kEmpty, std::memory_order_relaxed);
+        slots_[i].last_seen_.store (0, std::memory_order_relaxed);
+    }
+}
+
+int64_t TrackStateStore::Now (void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+size_t TrackStateStore::Home (int64_t id) const
+{
+    return (size_t) Mix ((uint64_t) id) & mask_;
+}
+
+int64_t TrackStateStore::Find (int64_t id) const
+{
+    size_t i = Home (id);
+
+    for (size_t n = 0; n <= mask_; n++, i = (i + 1) & mask_) {
+        int64_t key = slots_[i].key_.load (std::memory_order_acquire);
+        if (key == id)     return (int64_t) i;
+        if (key == kEmpty) return -1;
+    }
+
+    return -1;
+}
+
+void TrackStateStore::Touch (int64_t id, int64_t now)
+{
+    if (id == kEmpty || id == kTombstone) return;
+
+    int64_t i = Find (id);
+    if (i >= 0) {
+        slots_[i].last_seen_.store (now, std::memory_order_relaxed);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock (mutex_);
+    Insert (id, now);
+}
+
+int64_t TrackStateStore::LastSeen (int64_t id) const
+{
+    int64_t i = Find (id);
+
+    return i < 0 ? -1 : slots_[i].last_seen_.load (std::memory_order_relaxed);
+}
+
+void TrackStateStore::Insert (int64_t id, int64_t now)
+{
+    // another frame may have added it since the lock-free probe
+    int64_t found = Find (id);
+    if (found >= 0) {
+        slots_[found].last_seen_.store (now, std::memory_order_relaxed);
+        return;
+    }
+
+    if (size_.load (std::memory_order_relaxed) >= capacity_) Drop ();
+    if (tombstones_ > (mask_ + 1) / 4) Rebuild ();
+
+    size_t i = Home (id);
+    for (;; i = (i + 1) & mask_) {
+        int64_t key = slots_[i].key_.load (std::memory_order_relaxed);
+        if (key == kEmpty || key == kTombstone) {
+            if (key == kTombstone) tombstones_ --;
+            break;
+        }
+    }
+
+    slots_[i].last_seen_.store (now, std::memory_order_relaxed);
+    slots_[i].key_.store (id, std::memory_order_release);
+    size_.fetch_add (1, std::memory_order_relaxed);
+    stats_.inserted_ ++;
+
+    heap_.emplace_back (now, id);
+    std::push_heap (heap_.begin (), heap_.end (), std::greater<Seen> ());
+    // entries of expired ids pile up when nothing is dropped
+    if (heap_.size () > capacity_ * 2) Reheap ();
+}
+
+void TrackStateStore::Drop (void)
+{
+    int64_t oldest = -1;
+
+    while (!heap_.empty ()) {
+        Seen top = heap_.front ();
+        std::pop_heap (heap_.begin (), heap_.end (), std::greater<Seen> ());
+        heap_.pop_back ();
+
+        int64_t i = Find (top.second);
+        if (i < 0) continue;  // expired or dropped already
+
+        // touched since it was pushed, back in with when it was seen
+        int64_t t = slots_[i].last_seen_.load (std::memory_order_relaxed);
+        if (t > top.first) {
+            heap_.emplace_back (t, top.second);
+            std::push_heap (heap_.begin (), heap_.end (), std::greater<Seen> ());
+            continue;
+        }
+
+        oldest = i;
+        break;
+    }
+
+    if (oldest < 0) return;
+
+    slots_[oldest].key_.store (kTombstone, std::memory_order_release);
+    size_.fetch_sub (1, std::memory_order_relaxed);
+    tombstones_ ++;
+    stats_.dropped_ ++;
+}
+
+void TrackStateStore::Reheap (void)
+{
+    heap_.clear ();
+    for (size_t i = 0; i <= mask_; i++) {
+        int64_t key = slots_[i].key_.load (std::memory_order_relaxed);
+        if (key == kEmpty || key == kTombstone) continue;
+
+        heap_.emplace_back (
+            slots_[i].last_seen_.load (std::memory_order_relaxed), key);
+    }
+    std::make_heap (heap_.begin (), heap_.end (), std::greater<Seen> ());
+}
+
+void TrackStateStore::Rebuild (void)
+{
+    std::vector<std::pair<int64_t, int64_t> > live;
+    live.reserve (size_.load (std::memory_order_relaxed));
+
+    for (size_t i = 0; i <= mask_; i++) {
+        int64_t key = slots_[i].key_.load (std::memory_order_relaxed);
+        if (key != kEmpty && key != kTombstone) {
+            live.emplace_back (key,
+                slots_[i].last_seen_.load (std::memory_order_relaxed));
+        }
+        slots_[i].key_.store (kEmpty, std::memory_order_release);
+    }
+
+    for (auto&& l : live) {
+        size_t i = Home (l.first);
+        while (slots_[i].key_.load (std::memory_order_relaxed) != kEmpty) {
+            i = (i + 1) & mask_;
+        }
+        slots_[i].last_seen_.store (l.second, std::memory_order_relaxed);
+        slots_[i].key_.store (l.first, std::memory_order_release);
+    }
+
+    tombstones_ = 0;
+    stats_.rebuilt_ ++;
+}
+
+void TrackStateStore::Sweep (int64_t now)
+{
+    int64_t last = last_sweep_.load (std::memory_order_relaxed);
+    if (now - last < TRACK_STATE_SWEEP_MS) return;
+
+    // one of the frames due to sweep does it, the others carry on
+    if (!last_sweep_.compare_exchange_strong (last, now)) return;
+    std::unique_lock<std::mutex> lock (mutex_, std::try_to_lock);
+    if (!lock.owns_lock ()) return;
+
+    int64_t deadline = now - ttl_ms_;
+    for (size_t i = 0; i <= mask_; i++) {
+        int64_t key = slots_[i].key_.load (std::memory_order_relaxed);
+        if (key == kEmpty || key == kTombstone) continue;
+        if (slots_[i].last_seen_.load (std::memory_order_relaxed) >= deadline) {
+            continue;
+        }
+
+        slots_[i].key_.store (kTombstone, std::memory_order_release);
+        size_.fetch_sub (1, std::memory_order_relaxed);
+        tombstones_ ++;
+        stats_.expired_ ++;
+    }
+
+    if (tombstones_ > (mask_ + 1) / 4) Rebuild ();
+}
+
+size_t TrackStateStore::Size (void) const
+{
+    return size_.load (std::memory_order_relaxed);
+}
+
+void TrackStateStore::PrintStats (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    TS_INFO_MSG_V ("track state: size:%zu/%zu, inserted:%lu, expired:%lu, "
+        "dropped:%lu, rebuilt:%lu", Size (), capacity_, stats_.inserted_,
+        stats_.expired_, stats_.dropped_, stats_.rebuilt_);
+}
@@ -0,0 +1,98 @@
+/*
+ * @Description: Bounded per-identity state of the osd, with lock-free lookups.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-13 10:05:47
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-13 10:05:47
+ */
+
+#ifndef __TS_TRACK_STATE_H__
+#define __TS_TRACK_STATE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// ms between two sweeps of the identities past their ttl
+#define TRACK_STATE_SWEEP_MS 1000
+
+typedef struct _TrackStateStats {
+    uint64_t inserted_ { 0 };
+    uint64_t expired_  { 0 };  // unseen for ttl
+    uint64_t dropped_  { 0 };  // least recently seen, the store was full
+    uint64_t rebuilt_  { 0 };  // times the tombstones were cleaned up
+} TrackStateStats;
+
+// the osd color of id, the same for an id on every run
+void TrackColor (int64_t id, uint8_t& r, uint8_t& g, uint8_t& b);
+
+/*
+ * The identities drawn by the osd and when they were last seen, at most
+ * capacity of them, forgotten ttl_sec after their last detection.
+ *
+ * Open addressing with linear probing over twice capacity slots, a slot is
+ * an atomic key and last-seen time. Touching a known id is a probe and a
+ * store without any lock. New ids, sweeps and cleaning up the tombstones
+ * they leave take mutex_ and re-probe, so a lookup racing them at worst
+ * misses and retries under the lock, or refreshes the slot's next owner.
+ *
+ * A full store drops the least recently seen id off a min-heap of (last
+ * seen, id) kept under mutex_. Lock-free touches don't reach the heap, so
+ * an entry older than its slot is pushed again with the slot's time when
+ * it surfaces, and entries of ids already gone are discarded then; every
+ * touch costs at most one such push, O(log n) amortized per drop.
+ */
+class TrackStateStore
+{
+public:
+    TrackStateStore (size_t capacity, int ttl_sec);
+
+    // id seen at now (ms, steady clock), added if new
+    void    Touch    (int64_t id, int64_t now);
+    // when id was seen last, -1 if it is not in the store
+    int64_t LastSeen (int64_t id) const;
+    // forgets the ids unseen for ttl, at most every TRACK_STATE_SWEEP_MS
+    void    Sweep    (int64_t now);
+
+    size_t  Size       (void) const;
+    void    PrintStats (void);
+
+    static int64_t Now (void);
+
+private:
+    typedef struct _Slot {
+        std::atomic<int64_t> key_       ;
+        std::atomic<int64_t> last_seen_ ;
+    } Slot;
+    // (last seen, id)
+    typedef std::pair<int64_t, int64_t> Seen;
+
+    size_t  Home   (int64_t id) const;
+    // the slot of id, or -1
+    int64_t Find   (int64_t id) const;
+    void    Insert (int64_t id, int64_t now);
+    // drops the least recently seen id
+    void    Drop   (void);
+    // the heap over the live ids only
+    void    Reheap (void);
+    // reinserts the live ids into a table without tombstones
+    void    Rebuild (void);
+
+private:
+    size_t                   capacity_   ;
+    int64_t                  ttl_ms_     ;
+    size_t                   mask_       ;
+    std::unique_ptr<Slot[]>  slots_      ;
+    std::atomic<size_t>      size_       { 0 };
+    size_t                   tombstones_ { 0 };
+    std::atomic<int64_t>     last_sweep_ { 0 };
+    std::vector<Seen>        heap_       ;  // min-heap, may be stale
+    std::mutex               mutex_      ;
+    TrackStateStats          stats_      {   };
+};
+
+#endif //__TS_TRACK_STATE_H__
@@ -0,0 +1,110 @@
+/*
+ * @Description: Implement of the osd trajectory store.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-14 15:32:08
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-14 15:32:08
+ */
+
+#include <algorithm>
+
+#include "Trajectory.h"
+
+TrajectoryStore::TrajectoryStore (size_t capacity, int points, int lost_ms)
+    : capacity_ (std::max<size_t> (capacity, 1)),
+      points_   ((uint32_t) std::max (points, 1)),
+      lost_ms_  (std::max (lost_ms, 1))
+{
+    xs_.assign        (capacity_ * points_, 0);
+    ys_.assign        (capacity_ * points_, 0);
+    head_.assign      (capacity_, 0);
+    count_.assign     (capacity_, 0);
+    last_seen_.assign (capacity_, 0);
+    keys_.resize      (capacity_);
+
+    free_.reserve (capacity_);
+    for (size_t i = capacity_; i > 0; i--) free_.push_back ((uint32_t) i - 1);
+    slots_.reserve (capacity_);
+}
+
+void TrajectoryStore::Append (int64_t camera_id, int64_t object_id, int x,
+    int y, int64_t now, uint8_t r, uint8_t g, uint8_t b,
+    std::vector<TsOsdObject>& osd)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    TrailKey key (camera_id, object_id);
+    uint32_t slot;
+
+    auto it = slots_.find (key);
+    if (it != slots_.end ()) {
+        slot = it->second;
+    } else {
+        if (free_.empty ()) {
+            stats_.refused_ ++;
+            return;
+        }
+        slot = free_.back ();
+        free_.pop_back ();
+        slots_.emplace (key, slot);
+        keys_[slot]  = key;
+        head_[slot]  = 0;
+        count_[slot] = 0;
+        stats_.opened_ ++;
+    }
+
+    size_t   base = (size_t) slot * points_;
+    uint32_t head = head_[slot];
+
+    xs_[base + head] = x;
+    ys_[base + head] = y;
+    head_[slot]      = head + 1 == points_ ? 0 : head + 1;
+    count_[slot]     = std::min (count_[slot] + 1, points_);
+    last_seen_[slot] = now;
+
+    uint32_t n = count_[slot];
+    uint32_t i = (head_[slot] + points_ - n) % points_;
+    for (; n > 0; n--, i = i + 1 == points_ ? 0 : i + 1) {
+        osd.push_back (TsOsdObject (
+            xs_[base + i] - TRAJECTORY_POINT / 2,
+            ys_[base + i] - TRAJECTORY_POINT / 2,
+            TRAJECTORY_POINT, TRAJECTORY_POINT, r, g, b, 0, ""));
+    }
+}
+
+void TrajectoryStore::Sweep (int64_t now)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (now - last_sweep_ < TRAJECTORY_SWEEP_MS) return;
+    last_sweep_ = now;
+
+    for (auto it = slots_.begin (); it != slots_.end ();) {
+        uint32_t slot = it->second;
+        if (now - last_seen_[slot] < lost_ms_) {
+            ++it;
+            continue;
+        }
+
+        count_[slot] = 0;
+        free_.push_back (slot);
+        it = slots_.erase (it);
+        stats_.lost_ ++;
+    }
+}
+
+size_t TrajectoryStore::Size (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    return slots_.size ();
+}
+
+void TrajectoryStore::PrintStats (void)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    TS_INFO_MSG_V ("trajectory: trails:%zu/%zu, points:%u, opened:%lu, "
+        "lost:%lu, refused:%lu", slots_.size (), capacity_, points_,
+        stats_.opened_, stats_.lost_, stats_.refused_);
+}
@@ -0,0 +1,85 @@
+/*
+ * @Description: Bounded trails of the identities drawn by the osd.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-14 15:32:08
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-14 15:32:08
+ */
+
+#ifndef __TS_TRAJECTORY_H__
+#define __TS_TRAJECTORY_H__
+
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "Common.h"
+
+// ms between two sweeps of the lost trails
+#define TRAJECTORY_SWEEP_MS 250
+// side of the square a trail point is drawn as
+#define TRAJECTORY_POINT    6
+
+typedef struct _TrajectoryStats {
+    uint64_t opened_  { 0 };
+    uint64_t lost_    { 0 };  // unseen for lost_ms
+    uint64_t refused_ { 0 };  // new trails while all capacity was in use
+} TrajectoryStats;
+
+/*
+ * The last foot points of every (camera, object id) on screen, for
+ * the osd to draw the way it came. Trails live in capacity fixed slots, a
+ * ring of points each, the x and y of all slots in two flat arrays, so a
+ * detection costs one write and at most points osd objects however long
+ * the person stays in view. A trail unseen for lost_ms is freed, a new one
+ * while every slot is taken is not drawn.
+ */
+class TrajectoryStore
+{
+public:
+    TrajectoryStore (size_t capacity, int points, int lost_ms);
+
+    /*
+     * Appends the foot point (x, y) of the object seen at now (ms, steady
+     * clock) to its trail, then the trail, oldest point first, to osd.
+     */
+    void   Append (int64_t camera_id, int64_t object_id, int x, int y,
+                   int64_t now, uint8_t r, uint8_t g, uint8_t b,
+                   std::vector<TsOsdObject>& osd);
+    // frees the trails lost at now, at most every TRAJECTORY_SWEEP_MS
+    void   Sweep  (int64_t now);
+
+    size_t Size       (void);
+    void   PrintStats (void);
+
+private:
+    typedef std::pair<int64_t, int64_t> TrailKey;
+
+    struct TrailKeyHash {
+        size_t operator() (const TrailKey& k) const {
+            return std::hash<int64_t> () (k.first * 0x9e3779b97f4a7c15ULL ^
+                k.second);
+        }
+    };
+
+private:
+    size_t                capacity_   ;
+    uint32_t              points_     ;
+    int64_t               lost_ms_    ;
+    std::mutex            mutex_      ;
+    TrajectoryStats       stats_      {   };
+    int64_t               last_sweep_ { 0 };
+    // slot * points_ + i, i in [head - count, head) modulo points_
+    std::vector<int32_t>  xs_         ;
+    std::vector<int32_t>  ys_         ;
+    std::vector<uint32_t> head_       ;
+    std::vector<uint32_t> count_      ;
+    std::vector<int64_t>  last_seen_  ;
+    std::vector<TrailKey> keys_       ;
+    std::vector<uint32_t> free_       ;
+    std::unordered_map<TrailKey, uint32_t, TrailKeyHash> slots_;
+};
+
+#endif //__TS_TRAJECTORY_H__
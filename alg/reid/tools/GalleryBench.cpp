@@ -0,0 +1,352 @@
+/*
+ * @Description: Throughput, latency, memory and recall of every gallery mode.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-06 10:05:19
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-06 10:05:19
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include <gflags/gflags.h>
+
+#include "Common.h"
+#include "GalleryInterface.h"
+#include "IvfPqGallery.h"
+#include "SyntheticFeatures.h"
+
+DEFINE_string(features,   "",     "raw fp32 feature dump, synthetic features if empty.");
+DEFINE_int32 (dims,       512,    "feature dimensions.");
+DEFINE_int32 (identities, 10000,  "gallery entries (identities when synthetic).");
+DEFINE_int32 (queries,    5000,   "synthetic queries.");
+DEFINE_double(noise,      0.5,    "synthetic query noise norm.");
+DEFINE_int32 (clusters,   100,    "synthetic identity clusters, 0 for none.");
+DEFINE_double(spread,     0.9,    "synthetic identity noise norm around a cluster.");
+DEFINE_int32 (seed,       100,    "synthetic feature seed.");
+DEFINE_string(modes,      "flat,ivfpq,hnsw,segmented,sharded",
+                                  "comma separated gallery modes.");
+DEFINE_string(storage,    "fp32", "element type of flat and sharded rows.");
+DEFINE_int32 (shards,     4,      "shards of the sharded mode.");
+DEFINE_int32 (k,          10,     "neighbours per search, recall@k.");
+DEFINE_int32 (batch,      8,      "detections per frame of the frame workload.");
+DEFINE_int32 (threads,    1,      "threads feeding frames.");
+DEFINE_double(low,        0.135,  "low distance threshold.");
+DEFINE_double(high,       0.16,   "high distance threshold.");
+DEFINE_string(isa,        "auto", "kernel isa: scalar, avx2, avx512 or auto.");
+DEFINE_string(format,     "csv",  "csv or json.");
+DEFINE_string(output,     "",     "report file, stdout if empty.");
+
+/*
+ * One row of the report. insert adds every identity, search looks up every
+ * query for k neighbours, frame feeds the queries through InsertAndSearch
+ * in frames of --batch into an empty gallery.
+ */
+typedef struct _BenchResult {
+    std::string mode_      {     };
+    std::string workload_  {     };
+    size_t      entries_   { 0   };
+    size_t      ops_       { 0   };  // entries, queries
+    double      qps_       { 0.0 };
+    double      p50_us_    { 0.0 };
+    double      p99_us_    { 0.0 };  // per operation, per frame for frames
+    double      memory_mb_ { 0.0 };
+    double      recall_    { -1  };  // search: recall@k against exact
+    double      purity_    { -1  };  // frame: queries given their label's id
+} BenchResult;
+
+static double Percentile (std::vector<double>& samples, double p)
+{
+    if (samples.empty ()) return 0.0;
+
+    size_t n = std::min (samples.size () - 1, (size_t) (p * samples.size ()));
+    std::nth_element (samples.begin (), samples.begin () + n, samples.end ());
+    return samples[n];
+}
+
+static double ElapsedUs (std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro> (
+        std::chrono::steady_clock::now () - start).count ();
+}
+
+static GalleryConfig BenchConfig (const std::string& mode, size_t dims)
+{
+    GalleryConfig config;
+    std::string   m = mode;
+
+    config.mode_         = StringToGalleryMode (m);
+    config.dims_         = dims;
+    config.max_elem_num_ = std::max (FLAGS_identities, FLAGS_queries);
+    config.low_dist_     = FLAGS_low;
+    config.high_dist_    = FLAGS_high;
+    config.isa_          = FLAGS_isa;
+    // ivfpq trains on what the benchmark inserts
+    config.train_size_   = std::min (config.train_size_, FLAGS_identities);
+
+    if (mode == "flat" || mode == "sharded") {
+        config.storage_ = StringToGalleryStorage (FLAGS_storage);
+    }
+    if (mode == "sharded") {
+        config.mode_   = GalleryMode::GALLERY_FLAT;
+        config.shards_ = FLAGS_shards;
+    }
+
+    return config;
+}
+
+// unit-length row i of features
+static const float* Row (const std::vector<float>& features, size_t i,
+    size_t dims, std::vector<float>& v)
+{
+    v.assign (features.begin () + i * dims, features.begin () + (i + 1) * dims);
+    L2Normalize (v.data (), dims);
+    return v.data ();
+}
+
+// ivfpq serves from its exact warm-up store until the model is installed
+static void WaitTrained (GalleryInterface* gallery, const float* probe)
+{
+    IvfPqGallery* ivf = dynamic_cast<IvfPqGallery*> (gallery);
+    GalleryMatch  m;
+
+    while (ivf && !ivf->Trained ()) {
+        std::this_thread::sleep_for (std::chrono::milliseconds (10));
+        ivf->Search (probe, 1, &m);
+    }
+}
+
+static bool RunStaticWorkloads (const FeatureSet& set, const std::string& mode,
+    const std::vector<GalleryMatch>& exact, std::vector<BenchResult>& out)
+{
+    size_t dims = set.dims_, k = FLAGS_k, ng = set.GallerySize ();
+    GalleryInterface* gallery = CreateGallery (BenchConfig (mode, dims));
+    std::vector<float>  v;
+    std::vector<double> lat;
+
+    if (!gallery) return false;
+
+    BenchResult insert;
+    insert.mode_     = mode;
+    insert.workload_ = "insert";
+    insert.ops_      = ng;
+    lat.resize (ng);
+    auto start = std::chrono::steady_clock::now ();
+    for (size_t i = 0; i < ng; i++) {
+        auto t = std::chrono::steady_clock::now ();
+        gallery->Add (i, Row (set.gallery_, i, dims, v));
+        lat[i] = ElapsedUs (t);
+    }
+    insert.qps_       = ng / (ElapsedUs (start) / 1e6);
+    insert.p50_us_    = Percentile (lat, 0.50);
+    insert.p99_us_    = Percentile (lat, 0.99);
+    WaitTrained (gallery, v.data ());
+    insert.entries_   = gallery->Size ();
+    insert.memory_mb_ = gallery->MemoryBytes () / 1048576.0;
+    out.push_back (insert);
+
+    BenchResult search = insert;
+    size_t nq = set.QuerySize (), hits = 0;
+    std::vector<GalleryMatch> m (k);
+    search.workload_ = "search";
+    search.ops_      = nq;
+    lat.resize (nq);
+    start = std::chrono::steady_clock::now ();
+    for (size_t i = 0; i < nq; i++) {
+        const float* q = Row (set.queries_, i, dims, v);
+        auto t = std::chrono::steady_clock::now ();
+        size_t found = gallery->Search (q, k, m.data ());
+        lat[i] = ElapsedUs (t);
+
+        for (size_t x = 0; x < k; x++) {
+            for (size_t y = 0; y < found; y++) {
+                if (exact[i * k + x].id_ >= 0 &&
+                    exact[i * k + x].id_ == m[y].id_) { hits++; break; }
+            }
+        }
+    }
+    search.qps_    = nq / (ElapsedUs (start) / 1e6);
+    search.p50_us_ = Percentile (lat, 0.50);
+    search.p99_us_ = Percentile (lat, 0.99);
+    search.recall_ = nq ? (double) hits / (nq * k) : 0.0;
+    out.push_back (search);
+
+    gallery->Deinitialize ();
+    delete gallery;
+    return true;
+}
+
+static bool RunFrames (const FeatureSet& set, const std::string& mode,
+    std::vector<BenchResult>& out)
+{
+    size_t dims = set.dims_, nq = set.QuerySize (), batch = FLAGS_batch;
+    size_t threads = std::max (FLAGS_threads, 1);
+    GalleryInterface* gallery = CreateGallery (BenchConfig (mode, dims));
+    std::vector<int64_t> ids (nq, -1);
+    std::vector<std::vector<double> > lat (threads);
+
+    if (!gallery || !batch) {
+        delete gallery;
+        return false;
+    }
+
+    // thread t feeds frames t, t + threads, ... as camera t
+    auto start = std::chrono::steady_clock::now ();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.push_back (std::thread ([&, t] {
+            std::vector<GalleryQuery> frame;
+            for (size_t f = t * batch; f < nq; f += threads * batch) {
+                size_t n = std::min (batch, nq - f);
+                frame.assign (n, GalleryQuery ());
+                for (size_t j = 0; j < n; j++) {
+                    frame[j].feature_   = &set.queries_[(f + j) * dims];
+                    frame[j].camera_id_ = t;
+                }
+                auto s = std::chrono::steady_clock::now ();
+                gallery->InsertAndSearch (frame);
+                lat[t].push_back (ElapsedUs (s));
+                for (size_t j = 0; j < n; j++) ids[f + j] = frame[j].object_id_;
+            }
+        }));
+    }
+    for (auto&& w : workers) w.join ();
+
+    BenchResult frames;
+    frames.mode_      = mode;
+    frames.workload_  = "frame";
+    frames.ops_       = nq;
+    frames.qps_       = nq / (ElapsedUs (start) / 1e6);
+    frames.entries_   = gallery->Size ();
+    frames.memory_mb_ = gallery->MemoryBytes () / 1048576.0;
+
+    std::vector<double> all;
+    for (auto&& l : lat) all.insert (all.end (), l.begin (), l.end ());
+    frames.p50_us_ = Percentile (all, 0.50);
+    frames.p99_us_ = Percentile (all, 0.99);
+
+    // the share of queries carrying the id most of their label got
+    std::map<int64_t, std::map<int64_t, size_t> > labels;
+    size_t labelled = 0, agreed = 0;
+    for (size_t i = 0; i < nq; i++) {
+        if (set.query_label_[i] < 0) continue;
+        labels[set.query_label_[i]][ids[i]] ++;
+        labelled ++;
+    }
+    for (auto&& l : labels) {
+        size_t top = 0;
+        for (auto&& c : l.second) top = std::max (top, c.second);
+        agreed += top;
+    }
+    if (labelled) frames.purity_ = (double) agreed / labelled;
+    out.push_back (frames);
+
+    gallery->Deinitialize ();
+    delete gallery;
+    return true;
+}
+
+static void Report (const std::vector<BenchResult>& results, FILE* fp)
+{
+    bool json = FLAGS_format == "json";
+
+    if (json) {
+        fprintf (fp, "[\n");
+    } else {
+        fprintf (fp, "mode,storage,workload,dims,entries,ops,qps,p50_us,"
+            "p99_us,memory_mb,recall_at_%d,purity\n", FLAGS_k);
+    }
+
+    for (size_t i = 0; i < results.size (); i++) {
+        const BenchResult& r = results[i];
+        if (json) {
+            fprintf (fp, "  {\"mode\":\"%s\", \"storage\":\"%s\", "
+                "\"workload\":\"%s\", \"dims\":%d, \"entries\":%zu, "
+                "\"ops\":%zu, \"qps\":%.1f, \"p50_us\":%.2f, "
+                "\"p99_us\":%.2f, \"memory_mb\":%.3f",
+                r.mode_.c_str (), FLAGS_storage.c_str (), r.workload_.c_str (),
+                FLAGS_dims, r.entries_, r.ops_, r.qps_, r.p50_us_, r.p99_us_,
+                r.memory_mb_);
+            if (r.recall_ >= 0) fprintf (fp, ", \"recall_at_k\":%.4f", r.recall_);
+            if (r.purity_ >= 0) fprintf (fp, ", \"purity\":%.4f", r.purity_);
+            fprintf (fp, "}%s\n", i + 1 < results.size () ? "," : "");
+        } else {
+            fprintf (fp, "%s,%s,%s,%d,%zu,%zu,%.1f,%.2f,%.2f,%.3f,",
+                r.mode_.c_str (), FLAGS_storage.c_str (), r.workload_.c_str (),
+                FLAGS_dims, r.entries_, r.ops_, r.qps_, r.p50_us_, r.p99_us_,
+                r.memory_mb_);
+            if (r.recall_ >= 0) fprintf (fp, "%.4f", r.recall_);
+            fprintf (fp, ",");
+            if (r.purity_ >= 0) fprintf (fp, "%.4f", r.purity_);
+            fprintf (fp, "\n");
+        }
+    }
+
+    if (json) fprintf (fp, "]\n");
+}
+
+int main (int argc, char* argv[])
+{
+    gflags::SetUsageMessage ("gallery-bench [--modes flat,hnsw] [--identities 10000] "
+        "[--format json --output bench.json]");
+    gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+    FeatureSet set;
+    if (!FLAGS_features.empty ()) {
+        if (!LoadFeatures (set, FLAGS_features, FLAGS_dims, FLAGS_identities)) {
+            TS_ERR_MSG_V ("Failed to load %d-d features beyond the first %d "
+                "from %s", FLAGS_dims, FLAGS_identities, FLAGS_features.c_str ());
+            return -1;
+        }
+    } else {
+        SynthesizeClusters (set, FLAGS_dims, FLAGS_identities, FLAGS_queries,
+            FLAGS_noise, FLAGS_clusters, FLAGS_spread, FLAGS_seed);
+    }
+
+    TS_INFO_MSG_V ("Benchmarking %zu identities, %zu queries, %zu dims, k=%d",
+        set.GallerySize (), set.QuerySize (), set.dims_, FLAGS_k);
+
+    // the exact neighbours recall is measured against
+    size_t dims = set.dims_, k = FLAGS_k;
+    std::vector<GalleryMatch> exact (set.QuerySize () * k);
+    {
+        GalleryConfig config = BenchConfig ("flat", dims);
+        config.storage_ = GalleryStorage::GALLERY_STORAGE_FP32;
+        GalleryInterface* truth = CreateGallery (config);
+        if (!truth) return -1;
+
+        std::vector<float> v;
+        for (size_t i = 0; i < set.GallerySize (); i++) {
+            truth->Add (i, Row (set.gallery_, i, dims, v));
+        }
+        for (size_t i = 0; i < set.QuerySize (); i++) {
+            truth->Search (Row (set.queries_, i, dims, v), k, &exact[i * k]);
+        }
+        delete truth;
+    }
+
+    std::vector<BenchResult> results;
+    std::stringstream ss (FLAGS_modes);
+    std::string mode;
+    while (std::getline (ss, mode, ',')) {
+        if (!RunStaticWorkloads (set, mode, exact, results) ||
+            !RunFrames (set, mode, results)) {
+            TS_ERR_MSG_V ("Failed to benchmark the %s gallery", mode.c_str ());
+        }
+    }
+
+    FILE* fp = FLAGS_output.empty () ? stdout : fopen (FLAGS_output.c_str (), "w");
+    if (!fp) {
+        TS_ERR_MSG_V ("Failed to open %s", FLAGS_output.c_str ());
+        return -1;
+    }
+    Report (results, fp);
+    if (fp != stdout) fclose (fp);
+
+    gflags::ShutDownCommandLineFlags ();
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * @Description: Accuracy and memory of quantized gallery storage against fp32.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-20 09:48:02
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-20 09:48:02
+ */
+
+#include <math.h>
+#include <chrono>
+#include <sstream>
+
+#include <gflags/gflags.h>
+
+#include "Common.h"
+#include "GalleryInterface.h"
+#include "SyntheticFeatures.h"
+
+DEFINE_string(features,   "",     "raw fp32 feature dump, synthetic features if empty.");
+DEFINE_int32 (dims,       512,    "feature dimensions.");
+DEFINE_int32 (gallery,    10000,  "gallery entries (identities when synthetic).");
+DEFINE_int32 (queries,    2000,   "synthetic queries.");
+DEFINE_double(noise,      0.5,    "synthetic query noise norm.");
+DEFINE_int32 (k,          10,     "neighbours compared per query.");
+DEFINE_double(low,        0.135,  "low distance threshold.");
+DEFINE_double(high,       0.16,   "high distance threshold.");
+DEFINE_string(storages,   "fp16,int8", "comma separated storages compared to fp32.");
+DEFINE_string(isa,        "auto", "kernel isa: scalar, avx2, avx512 or auto.");
+
+typedef struct _EvalRun {
+    std::string               name_        ;
+    size_t                    memory_      { 0   };
+    double                    us_per_query_{ 0.0 };
+    std::vector<GalleryMatch> matches_     {     };  // queries x k
+} EvalRun;
+
+// 0 match, 1 ambiguous, 2 new identity
+static int Decision (float distance)
+{
+    if (distance < FLAGS_low)  return 0;
+    if (distance < FLAGS_high) return 1;
+    return 2;
+}
+
+static bool RunStorage (const FeatureSet& set, GalleryStorage storage,
+    EvalRun& run)
+{
+    GalleryConfig config;
+    config.mode_         = GalleryMode::GALLERY_FLAT;
+    config.storage_      = storage;
+    config.dims_         = set.dims_;
+    config.max_elem_num_ = set.GallerySize ();
+    config.low_dist_     = FLAGS_low;
+    config.high_dist_    = FLAGS_high;
+    config.isa_          = FLAGS_isa;
+
+    GalleryInterface* gallery = CreateGallery (config);
+    if (!gallery) return false;
+
+    size_t dims = set.dims_, k = FLAGS_k;
+    std::vector<float> v (dims);
+    for (size_t i = 0; i < set.GallerySize (); i++) {
+        v.assign (set.gallery_.begin () + i * dims,
+                  set.gallery_.begin () + (i + 1) * dims);
+        L2Normalize (v.data (), dims);
+        gallery->Add (i, v.data ());
+    }
+
+    size_t nq = set.QuerySize ();
+    run.name_ = GalleryStorageName (storage);
+    run.memory_ = gallery->MemoryBytes ();
+    run.matches_.assign (nq * k, GalleryMatch ());
+
+    auto start = std::chrono::steady_clock::now ();
+    for (size_t i = 0; i < nq; i++) {
+        v.assign (set.queries_.begin () + i * dims,
+                  set.queries_.begin () + (i + 1) * dims);
+        L2Normalize (v.data (), dims);
+        gallery->Search (v.data (), k, &run.matches_[i * k]);
+    }
+    auto elapsed = std::chrono::steady_clock::now () - start;
+    run.us_per_query_ = nq ? std::chrono::duration<double, std::micro>
+        (elapsed).count () / nq : 0.0;
+
+    gallery->Deinitialize ();
+    delete gallery;
+    return true;
+}
+
+static void Report (const FeatureSet& set, const EvalRun& ref,
+    const EvalRun& run)
+{
+    size_t nq = set.QuerySize (), k = FLAGS_k;
+    size_t top1 = 0, overlap = 0, flips = 0, labelled = 0, correct = 0;
+    double err_sum = 0.0, err_max = 0.0;
+
+    for (size_t i = 0; i < nq; i++) {
+        const GalleryMatch* a = &ref.matches_[i * k];
+        const GalleryMatch* b = &run.matches_[i * k];
+
+        if (a[0].id_ == b[0].id_) top1++;
+        for (size_t x = 0; x < k; x++)
+            for (size_t y = 0; y < k; y++)
+                if (a[x].id_ >= 0 && a[x].id_ == b[y].id_) { overlap++; break; }
+
+        double err = fabs (a[0].distance_ - b[0].distance_);
+        err_sum += err;
+        if (err > err_max) err_max = err;
+
+        if (Decision (a[0].distance_) != Decision (b[0].distance_)) flips++;
+        if (set.query_label_[i] >= 0) {
+            labelled++;
+            if (b[0].id_ == set.query_label_[i]) correct++;
+        }
+    }
+
+    printf ("%-6s %10.2f %8.3f %8.4f %8.4f %10.6f %10.6f %7zu",
+        run.name_.c_str (), run.memory_ / 1048576.0, run.us_per_query_,
+        nq ? (double)top1 / nq : 0.0,
+        nq ? (double)overlap / (nq * k) : 0.0,
+        nq ? err_sum / nq : 0.0, err_max, flips);
+    if (labelled) printf (" %8.4f", (double)correct / labelled);
+    printf ("\n");
+}
+
+int main (int argc, char* argv[])
+{
+    gflags::SetUsageMessage ("gallery-eval [--features dump.f32] [--storages fp16,int8]");
+    gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+    FeatureSet set;
+    if (!FLAGS_features.empty ()) {
+        if (!LoadFeatures (set, FLAGS_features, FLAGS_dims, FLAGS_gallery)) {
+            TS_ERR_MSG_V ("Failed to load %d-d features beyond the first %d "
+                "from %s", FLAGS_dims, FLAGS_gallery, FLAGS_features.c_str ());
+            return -1;
+        }
+    } else {
+        SynthesizeFeatures (set, FLAGS_dims, FLAGS_gallery, FLAGS_queries,
+            FLAGS_noise, 100);
+    }
+
+    TS_INFO_MSG_V ("Evaluating %zu gallery entries, %zu queries, %zu dims, k=%d",
+        set.GallerySize (), set.QuerySize (), set.dims_, FLAGS_k);
+
+    EvalRun ref;
+    if (!RunStorage (set, GalleryStorage::GALLERY_STORAGE_FP32, ref)) {
+        TS_ERR_MSG_V ("Failed to build the fp32 reference gallery");
+        return -1;
+    }
+
+    printf ("%-6s %10s %8s %8s %8s %10s %10s %7s %8s\n", "store",
+        "memory(MB)", "us/query", "top1", "recall@k", "mean|dd|", "max|dd|",
+        "flips", "correct");
+    Report (set, ref, ref);
+
+    std::stringstream ss (FLAGS_storages);
+    std::string name;
+    while (std::getline (ss, name, ',')) {
+        GalleryStorage storage = StringToGalleryStorage (name);
+        if (storage == GalleryStorage::GALLERY_STORAGE_FP32) continue;
+
+        EvalRun run;
+        if (!RunStorage (set, storage, run)) {
+            TS_ERR_MSG_V ("Failed to build the %s gallery", name.c_str ());
+            continue;
+        }
+        Report (set, ref, run);
+    }
+
+    gflags::ShutDownCommandLineFlags ();
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * @Description: One node of a multi-process gallery, serving a gallery shard.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-03 15:12:37
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-03 15:12:37
+ */
+
+#include <signal.h>
+#include <pthread.h>
+
+#include <gflags/gflags.h>
+
+#include "Common.h"
+#include "GalleryInterface.h"
+#include "GalleryJournal.h"
+#include "GalleryServer.h"
+
+DEFINE_string(listen,       "unix:/tmp/reid-gallery-0.sock",
+                                    "unix:<path> or <host>:<port> to serve on.");
+DEFINE_string(mode,         "flat", "gallery mode of this node.");
+DEFINE_string(storage,      "fp32", "element type of flat rows.");
+DEFINE_string(isa,          "auto", "kernel isa: scalar, avx2, avx512 or auto.");
+DEFINE_int32 (dims,         512,    "feature dimensions, as the clients'.");
+DEFINE_int32 (max_elem_num, 10000,  "entries held by this node.");
+DEFINE_double(low,          0.135,  "low distance threshold.");
+DEFINE_double(high,         0.16,   "high distance threshold.");
+DEFINE_int32 (shards,       1,      "camera shards inside this node.");
+DEFINE_string(snapshot,     "",     "snapshot loaded at start and saved at exit.");
+DEFINE_int32 (wal_flush_ms, 0,      "wal group commit window, 0 disables.");
+DEFINE_int32 (checkpoint_sec, 300,  "seconds between wal checkpoints.");
+DEFINE_string(eviction,     "fifo", "eviction policy: fifo or lru.");
+DEFINE_int32 (ttl_sec,      0,      "entries unseen this long are dropped.");
+
+int main (int argc, char* argv[])
+{
+    gflags::SetUsageMessage ("gallery-node --listen unix:/tmp/g0.sock "
+        "[--mode flat] [--dims 512] [--snapshot g0.snap]");
+    gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+    // the serving threads inherit the mask, only sigwait sees the signals
+    sigset_t signals;
+    sigemptyset (&signals);
+    sigaddset (&signals, SIGINT);
+    sigaddset (&signals, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &signals, NULL);
+
+    GalleryConfig config;
+    config.mode_         = StringToGalleryMode (FLAGS_mode);
+    config.storage_      = StringToGalleryStorage (FLAGS_storage);
+    config.isa_          = FLAGS_isa;
+    config.dims_         = FLAGS_dims;
+    config.max_elem_num_ = FLAGS_max_elem_num;
+    config.low_dist_     = FLAGS_low;
+    config.high_dist_    = FLAGS_high;
+    config.shards_       = FLAGS_shards;
+    config.snapshot_     = FLAGS_snapshot;
+    config.eviction_     = StringToEvictionPolicy (FLAGS_eviction);
+    config.ttl_sec_      = FLAGS_ttl_sec;
+
+    if (config.mode_ == GalleryMode::GALLERY_REMOTE ||
+        config.mode_ == GalleryMode::GALLERY_VENDOR) {
+        TS_ERR_MSG_V ("A gallery node serves an in-process gallery, not %s",
+            FLAGS_mode.c_str ());
+        return -1;
+    }
+
+    GalleryInterface* gallery = CreateGallery (config);
+    if (!gallery) return -1;
+
+    GalleryJournal* journal = NULL;
+    if (!config.snapshot_.empty ()) {
+        gallery->LoadSnapshot (config.snapshot_);
+        if (FLAGS_wal_flush_ms > 0) {
+            journal = new GalleryJournal ();
+            if (journal->Start (gallery, config.snapshot_, FLAGS_wal_flush_ms,
+                FLAGS_checkpoint_sec, 64ull << 20)) {
+                gallery->SetJournal (journal);
+            } else {
+                delete journal;
+                journal = NULL;
+            }
+        }
+    }
+
+    GalleryServer server;
+    if (!server.Start (gallery, config.dims_, FLAGS_listen)) {
+        delete journal;
+        delete gallery;
+        return -1;
+    }
+
+    int signal = 0;
+    sigwait (&signals, &signal);
+    TS_INFO_MSG_V ("gallery node stopping on signal %d", signal);
+
+    server.Stop ();
+    gallery->PrintStats ();
+    if (journal) {
+        gallery->SetJournal (NULL);
+        journal->Stop ();
+        delete journal;
+    } else if (!config.snapshot_.empty ()) {
+        gallery->SaveSnapshot (config.snapshot_);
+    }
+
+    delete gallery;
+    gflags::ShutDownCommandLineFlags ();
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * @Description: Checks of the gallery engine and the result record, run by ctest.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-20 10:12:06
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-20 10:12:06
+ */
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "Common.h"
+#include "FeatureKernels.h"
+#include "GalleryEviction.h"
+#include "GalleryInterface.h"
+#include "GalleryJournal.h"
+
+DEFINE_string(dir,  "/tmp", "where the snapshots and wal segments are written.");
+DEFINE_int32 (dims, 64,     "feature dimensions.");
+
+// logs the failed condition, the check goes on to report every failure
+#define CHECK(cond) do {                                                  \
+    if (!(cond)) {                                                        \
+        TS_ERR_MSG_V ("%s:%d: %s failed", __FILE__, __LINE__, #cond);     \
+        ok = false;                                                       \
+    }                                                                     \
+} while (0)
+
+// n unit-length features, random directions are far apart in any dims
+static std::vector<float> Features (size_t n, unsigned seed)
+{
+    std::mt19937 rng (seed);
+    std::normal_distribution<float> gauss (0.0f, 1.0f);
+    std::vector<float> f (n * FLAGS_dims);
+
+    for (auto&& v : f) v = gauss (rng);
+    for (size_t i = 0; i < n; i++) L2Normalize (&f[i * FLAGS_dims], FLAGS_dims);
+    return f;
+}
+
+static GalleryConfig Config (int max_elem_num)
+{
+    GalleryConfig config;
+    config.mode_         = GalleryMode::GALLERY_FLAT;
+    config.dims_         = FLAGS_dims;
+    config.max_elem_num_ = max_elem_num;
+    return config;
+}
+
+// every feature becomes a new identity, ids are handed out from 1
+static void Insert (GalleryInterface* gallery, const std::vector<float>& f)
+{
+    std::vector<GalleryQuery> queries (f.size () / FLAGS_dims);
+
+    for (size_t i = 0; i < queries.size (); i++) {
+        queries[i].feature_ = &f[i * FLAGS_dims];
+    }
+    gallery->InsertAndSearch (queries);
+}
+
+// the id stored for feature i of f, -1 if it is not close to any entry
+static int64_t Lookup (GalleryInterface* gallery, const std::vector<float>& f,
+    size_t i)
+{
+    GalleryMatch match;
+
+    if (!gallery->Search (&f[i * FLAGS_dims], 1, &match)) return -1;
+    return match.distance_ < 1e-3f ? match.id_ : -1;
+}
+
+static std::string Path (const char* name)
+{
+    return FLAGS_dir + "/gallery-test-" + std::to_string (getpid ()) + "-" + name;
+}
+
+// removes a snapshot and whatever wal segments it left
+static void RemoveSnapshot (const std::string& path)
+{
+    unlink (path.c_str ());
+    unlink ((path + ".tmp").c_str ());
+    for (int seq = 0; seq < 16; seq++) {
+        unlink ((path + ".wal." + std::to_string (seq)).c_str ());
+    }
+}
+
+static bool TestEvictionOrder (void)
+{
+    bool ok = true;
+
+    // fifo drops in insertion order, touches do not matter
+    GalleryEviction fifo (EvictionPolicy::EVICTION_FIFO, 0, 0);
+    for (int64_t id = 1; id <= 3; id++) fifo.Insert (id);
+    fifo.Touch (1);
+    CHECK (fifo.Victim () == 1);
+    fifo.Erase (1);
+    CHECK (fifo.Victim () == 2);
+
+    // lru drops the least recently touched
+    GalleryEviction lru (EvictionPolicy::EVICTION_LRU, 0, 0);
+    for (int64_t id = 1; id <= 3; id++) lru.Insert (id);
+    lru.Touch (1);
+    lru.Touch (2);
+    CHECK (lru.Victim () == 3);
+    lru.Erase (3);
+    CHECK (lru.Victim () == 1);
+
+    // a full gallery overwrites its oldest identities
+    GalleryInterface* gallery = CreateGallery (Config (4));
+    CHECK (gallery != NULL);
+    if (!gallery) return false;
+
+    std::vector<float> f = Features (6, 1);
+    Insert (gallery, f);
+    CHECK (gallery->Size () == 4);
+    CHECK (Lookup (gallery, f, 0) == -1);
+    CHECK (Lookup (gallery, f, 1) == -1);
+    for (size_t i = 2; i < 6; i++) CHECK (Lookup (gallery, f, i) == (int64_t) i + 1);
+
+    gallery->Deinitialize ();
+    delete gallery;
+    return ok;
+}
+
+static bool TestSnapshotRoundTrip (void)
+{
+    bool ok = true;
+    std::string path = Path ("round-trip.snap");
+    std::vector<float> f = Features (100, 2);
+
+    GalleryInterface* gallery = CreateGallery (Config (64));
+    if (!gallery) return false;
+    // wraps once, the snapshot keeps the newest 64
+    Insert (gallery, f);
+    CHECK (gallery->SaveSnapshot (path));
+    int64_t next_id = gallery->NextId ();
+    gallery->Deinitialize ();
+    delete gallery;
+
+    gallery = CreateGallery (Config (64));
+    if (!gallery) return false;
+    CHECK (gallery->LoadSnapshot (path));
+    CHECK (gallery->Size () == 64);
+    CHECK (gallery->NextId () == next_id);
+    for (size_t i = 0; i < 36; i++)   CHECK (Lookup (gallery, f, i) == -1);
+    for (size_t i = 36; i < 100; i++) CHECK (Lookup (gallery, f, i) == (int64_t) i + 1);
+
+    // the restored gallery still drops its oldest first
+    std::vector<float> more = Features (1, 3);
+    Insert (gallery, more);
+    CHECK (Lookup (gallery, f, 36) == -1);
+    CHECK (Lookup (gallery, more, 0) == next_id);
+
+    gallery->Deinitialize ();
+    delete gallery;
+    RemoveSnapshot (path);
+    return ok;
+}
+
+static bool TestJournalReplay (void)
+{
+    bool ok = true;
+    std::string path = Path ("journal.snap");
+    std::vector<float> f = Features (20, 4);
+
+    // the child logs the inserts and dies without a checkpoint or Stop
+    pid_t child = fork ();
+    if (child == 0) {
+        GalleryInterface* gallery = CreateGallery (Config (64));
+        GalleryJournal*   journal = new GalleryJournal ();
+        if (!gallery || !journal->Start (gallery, path, 10, 0, 0)) _exit (1);
+        gallery->SetJournal (journal);
+        Insert (gallery, f);
+        // a few group commit windows
+        std::this_thread::sleep_for (std::chrono::milliseconds (200));
+        _exit (0);
+    }
+
+    int status = -1;
+    CHECK (child > 0 && waitpid (child, &status, 0) == child);
+    CHECK (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+    GalleryInterface* gallery = CreateGallery (Config (64));
+    if (!gallery) return false;
+    // there is no snapshot yet, only the wal
+    GalleryJournal journal;
+    CHECK (journal.Start (gallery, path, 10, 0, 0));
+    gallery->SetJournal (&journal);
+    CHECK (gallery->Size () == 20);
+    CHECK (gallery->NextId () == 21);
+    for (size_t i = 0; i < 20; i++) CHECK (Lookup (gallery, f, i) == (int64_t) i + 1);
+
+    gallery->SetJournal (NULL);
+    journal.Stop ();
+    gallery->Deinitialize ();
+    delete gallery;
+    RemoveSnapshot (path);
+    return ok;
+}
+
+static bool TestResultView (void)
+{
+    bool ok = true;
+    std::vector<unsigned char> record;
+    TsResultWriter writer (record);
+
+    writer.Begin ("reid", 2, TS_RESULT_FEATURE_FP32, 4);
+    writer.Detection (0).object_id_ = 7;
+    writer.Detection (1).object_id_ = 8;
+    float feature[4] = { 1.f, 2.f, 3.f, 4.f };
+    memcpy (writer.AddFeature (1), feature, sizeof (feature));
+
+    TsResultView view (record.data (), record.size ());
+    CHECK (view.Valid ());
+    CHECK (view.Count () == 2);
+    CHECK (view.Detection (1).object_id_ == 8);
+    CHECK (view.Feature (0) == nullptr);
+    CHECK (view.Feature (1) != nullptr &&
+        !memcmp (view.Feature (1), feature, sizeof (feature)));
+
+    // cut short, within the header and within the features
+    CHECK (!TsResultView (record.data (), sizeof (TsResultHeader) - 1).Valid ());
+    CHECK (!TsResultView (record.data (), record.size () - 1).Valid ());
+    CHECK (!TsResultView (nullptr, record.size ()).Valid ());
+
+    std::vector<unsigned char> bad = record;
+    reinterpret_cast<TsResultHeader*> (bad.data ())->magic_ ^= 1;
+    CHECK (!TsResultView (bad.data (), bad.size ()).Valid ());
+
+    bad = record;
+    reinterpret_cast<TsResultHeader*> (bad.data ())->count_ = 1000;
+    CHECK (!TsResultView (bad.data (), bad.size ()).Valid ());
+
+    bad = record;
+    reinterpret_cast<TsResultHeader*> (bad.data ())->feature_count_ = 2;
+    CHECK (!TsResultView (bad.data (), bad.size ()).Valid ());
+
+    bad = record;
+    reinterpret_cast<TsResultHeader*> (bad.data ())->feature_ = 3;
+    CHECK (!TsResultView (bad.data (), bad.size ()).Valid ());
+
+    return ok;
+}
+
+static bool TestJsonWriter (void)
+{
+    bool ok = true;
+    std::string out;
+    TsJsonWriter writer (out);
+
+    writer.BeginObject ();
+    writer.String ("name", std::string ("a\"b\\c\n\x01 long enough for words"));
+    writer.Int ("min", INT64_MIN);
+    writer.Int ("zero", 0);
+    writer.Bool ("on", true);
+    writer.BeginArray ("values");
+    writer.Float (nullptr, 0.5f);
+    writer.Float (nullptr, -0.25f);
+    writer.Float (nullptr, 3.f);
+    writer.Float (nullptr, 2483.8515625f);
+    writer.Float (nullptr, 1.0f / 0.0f);
+    writer.EndArray ();
+    writer.BeginObject ("empty");
+    writer.EndObject ();
+    writer.EndObject ();
+
+    CHECK (out == "{\"name\":\"a\\\"b\\\\c\\n\\u0001 long enough for words\","
+        "\"min\":-9223372036854775808,\"zero\":0,\"on\":true,"
+        "\"values\":[0.5,-0.25,3,2483.851562,null],\"empty\":{}}");
+    if (!ok) TS_ERR_MSG_V ("wrote %s", out.c_str ());
+
+    // the record as the plugin publishes it
+    std::vector<unsigned char> record;
+    TsResultWriter result (record);
+    result.Begin ("reid", 1);
+    result.Detection (0).object_id_  = 3;
+    result.Detection (0).trace_id_   = 9;
+    result.Detection (0).confidence_ = 0.75f;
+    writer.Clear ();
+    TsResultView (record.data (), record.size ()).ToJson (writer);
+    CHECK (out == "{\"alg-name\":\"reid\",\"alg-result\":[{\"object-id\":3,"
+        "\"trace-id\":9,\"confidence\":0.75,\"x\":0,\"y\":0,\"width\":0,"
+        "\"height\":0}]}");
+    if (!ok) TS_ERR_MSG_V ("wrote %s", out.c_str ());
+
+    return ok;
+}
+
+int main (int argc, char* argv[])
+{
+    gflags::SetUsageMessage ("gallery-test [--dir /tmp]");
+    gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+    // the journal check forks, it runs before any gallery starts a thread
+    struct {
+        const char* name_;
+        bool (*run_) (void);
+    } tests[] = {
+        { "journal-replay",      TestJournalReplay     },
+        { "eviction-order",      TestEvictionOrder     },
+        { "snapshot-round-trip", TestSnapshotRoundTrip },
+        { "result-view",         TestResultView        },
+        { "json-writer",         TestJsonWriter        },
+    };
+
+    int failed = 0;
+    for (auto&& t : tests) {
+        bool ok = t.run_ ();
+        printf ("%-20s %s\n", t.name_, ok ? "ok" : "FAILED");
+        if (!ok) failed++;
+    }
+
+    gflags::ShutDownCommandLineFlags ();
+    return failed ? 1 : 0;
+}
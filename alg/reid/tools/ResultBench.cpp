@@ -0,0 +1,499 @@
+/*
+ * @Description: Cost of serializing the results of a frame into a message.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-12-09 14:20:51
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-12-09 14:20:51
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+
+#include <gflags/gflags.h>
+
+#include "Common.h"
+#include "FeatureCodec.h"
+#include "FeatureKernels.h"
+#include "SyntheticFeatures.h"
+#include "TrackState.h"
+
+DEFINE_string(detections, "1,10,100", "comma separated detections per frame.");
+DEFINE_int32 (dims,       512,        "feature dimensions.");
+DEFINE_int32 (frames,     2000,       "frames serialized per path and size.");
+DEFINE_string(encoding,   "text",     "feature-encoding of all paths.");
+DEFINE_string(paths,      "tree,stream,copy,inplace",
+                                      "comma separated paths to run.");
+DEFINE_int32 (publish,    1,          "one frame in this many reads its message.");
+DEFINE_int32 (seed,       100,        "synthetic feature seed.");
+DEFINE_string(format,     "csv",      "csv or json.");
+DEFINE_string(output,     "",         "report file, stdout if empty.");
+
+// the fields of ts::ReIDData the plugin publishes
+typedef struct _Detection {
+    int64_t            object_id_  { 0   };
+    int64_t            trace_id_   { 0   };
+    std::vector<float> feature_    {     };
+    float              confidence_ { 0.f };
+    float              x_          { 0.f };
+    float              y_          { 0.f };
+    float              width_      { 0.f };
+    float              height_     { 0.f };
+} Detection;
+
+/*
+ * One row of the report. tree is the json-glib path the plugin used to
+ * take: a JsonObject per detection, numbers through std::to_string, text
+ * features through a stringstream and the message pretty printed by
+ * TsJsonObject::Update. stream is TsJsonWriter into a per-thread buffer
+ * and the compact Update, as the plugin does now.
+ *
+ * copy and inplace are the whole listener around stream, the osd objects
+ * and the id search included, with a stand-in for the search so only the
+ * listener's own work is measured. copy is how the listener used to do it:
+ * the frame serialized with the ids before the search, then deep copied to
+ * be searched, and the colors from a map behind a mutex. inplace searches
+ * first into per-thread ids and builds the osd from the frame as it is.
+ *
+ * record is the result as a binary record with the raw features, bytes of
+ * the record, as a consumer reading it in place gets it. record-json is
+ * the same record turned into the message by Update.
+ */
+typedef struct _BenchResult {
+    std::string path_       {     };
+    size_t      detections_ { 0   };
+    double      fps_        { 0.0 };
+    double      p50_us_     { 0.0 };
+    double      p99_us_     { 0.0 };  // per frame, result and Update
+    size_t      bytes_      { 0   };  // of the message
+    double      allocs_     { 0.0 };  // heap allocations per frame
+} BenchResult;
+
+// counts every heap allocation of the process, the report's allocs
+static std::atomic<uint64_t> g_allocs { 0 };
+
+// neither is inlined, gcc would pair the malloc and free with new and delete
+__attribute__ ((noinline)) void* operator new (size_t size)
+{
+    g_allocs.fetch_add (1, std::memory_order_relaxed);
+    if (void* p = malloc (size ? size : 1)) return p;
+    throw std::bad_alloc ();
+}
+
+void* operator new[] (size_t size)
+{
+    return operator new (size);
+}
+
+__attribute__ ((noinline)) void operator delete (void* p) noexcept
+{
+    free (p);
+}
+
+void operator delete[] (void* p) noexcept
+{
+    operator delete (p);
+}
+
+static double Percentile (std::vector<double>& samples, double p)
+{
+    if (samples.empty ()) return 0.0;
+
+    size_t n = std::min (samples.size () - 1, (size_t) (p * samples.size ()));
+    std::nth_element (samples.begin (), samples.begin () + n, samples.end ());
+    return samples[n];
+}
+
+static std::string OldVector2Str (const std::vector<float>& vec)
+{
+    std::stringstream ss;
+
+    for (size_t i = 0; i < vec.size (); ++i) {
+        if (i != 0) ss << " ";
+        ss << vec[i];
+    }
+
+    return ss.str ();
+}
+
+// base64 into text, true, or appended to blob at offset, false
+static bool EncodeFeature (FeatureEncoding encoding, const Detection& d,
+    std::vector<char>& text, std::vector<unsigned char>& blob, size_t& length,
+    size_t& offset)
+{
+    size_t dims = d.feature_.size ();
+
+    if (encoding == FEATURE_ENCODING_BLOB_FP32 ||
+        encoding == FEATURE_ENCODING_BLOB_FP16) {
+        offset = blob.size ();
+        blob.resize (offset + FeatureBytes (encoding, dims));
+        FeatureToBytes (encoding, d.feature_.data (), dims,
+            blob.data () + offset);
+        return false;
+    }
+
+    text.resize (std::max (text.size (),
+        Base64Size (FeatureBytes (encoding, dims)) + 1));
+    length = FeatureToBase64 (encoding, d.feature_.data (), dims, text.data ());
+    return true;
+}
+
+static std::shared_ptr<TsJsonObject> TreeResult (
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    static thread_local std::vector<char> text;
+    std::vector<unsigned char> blob;
+    size_t length = 0, offset = 0;
+
+    JsonObject* result = json_object_new ();
+    JsonArray*  jarray = json_array_new ();
+
+    for (size_t i = 0; i < frame.size (); i++) {
+        const Detection& d = frame[i];
+        JsonObject* jobject = json_object_new ();
+
+        json_object_set_string_member (jobject, "object-id",
+            std::to_string(d.object_id_).c_str());
+        json_object_set_string_member (jobject, "trace-id",
+            std::to_string(d.trace_id_).c_str());
+        if (encoding == FEATURE_ENCODING_TEXT) {
+            json_object_set_string_member (jobject, "feature",
+                OldVector2Str(d.feature_).c_str());
+        } else if (EncodeFeature (encoding, d, text, blob, length, offset)) {
+            json_object_set_string_member (jobject, "feature", text.data ());
+        } else {
+            json_object_set_string_member (jobject, "feature-offset",
+                std::to_string(offset).c_str());
+        }
+        json_object_set_string_member (jobject, "confidence",
+            std::to_string(d.confidence_).c_str());
+        json_object_set_string_member (jobject, "x",
+            std::to_string(d.x_).c_str());
+        json_object_set_string_member (jobject, "y",
+            std::to_string(d.y_).c_str());
+        json_object_set_string_member (jobject, "width",
+            std::to_string(d.width_).c_str());
+        json_object_set_string_member (jobject, "height",
+            std::to_string(d.height_).c_str());
+        json_array_add_object_element (jarray, jobject);
+    }
+
+    json_object_set_string_member (result, "alg-name", "reid");
+    json_object_set_array_member  (result, "alg-result", jarray);
+
+    std::shared_ptr<TsJsonObject> jo = std::make_shared<TsJsonObject> (result);
+    jo->SetPretty (true);
+    jo->GetFeatureBuffer ().swap (blob);
+    return jo;
+}
+
+// what the gallery or vendor db would do, the same for both listeners
+static int64_t SearchId (const Detection& d)
+{
+    return 100000 + d.trace_id_ % 997;
+}
+
+static void StreamDetections (const std::vector<Detection>& frame,
+    const std::vector<int64_t>& ids, FeatureEncoding encoding,
+    std::vector<unsigned char>& blob, TsJsonWriter& writer)
+{
+    static thread_local std::vector<char> text;
+    size_t length = 0, offset = 0;
+
+    writer.Clear ();
+    writer.BeginObject ();
+    writer.String ("alg-name", "reid", 4);
+    writer.BeginArray ("alg-result");
+    for (size_t i = 0; i < frame.size (); i++) {
+        const Detection& d = frame[i];
+
+        writer.BeginObject ();
+        writer.Int ("object-id", ids.empty () ? d.object_id_ : ids[i]);
+        writer.Int ("trace-id",  d.trace_id_);
+        if (encoding == FEATURE_ENCODING_TEXT) {
+            text.resize (std::max (text.size (),
+                FeatureTextSize (d.feature_.size ())));
+            length = FeatureToText (d.feature_.data (), d.feature_.size (),
+                text.data ());
+            writer.String ("feature", text.data (), length);
+        } else if (EncodeFeature (encoding, d, text, blob, length, offset)) {
+            writer.String ("feature", text.data (), length);
+        } else {
+            writer.Int ("feature-offset", offset);
+        }
+        writer.Float ("confidence", d.confidence_);
+        writer.Float ("x",          d.x_);
+        writer.Float ("y",          d.y_);
+        writer.Float ("width",      d.width_);
+        writer.Float ("height",     d.height_);
+        writer.EndObject ();
+    }
+    writer.EndArray ();
+    writer.EndObject ();
+}
+
+static std::shared_ptr<TsJsonObject> StreamResult (
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    static thread_local TsJsonWriter writer;
+    std::vector<unsigned char> blob;
+
+    StreamDetections (frame, std::vector<int64_t> (), encoding, blob, writer);
+    std::shared_ptr<TsJsonObject> jo = std::make_shared<TsJsonObject> (
+        writer.GetString ());
+    jo->GetFeatureBuffer ().swap (blob);
+    return jo;
+}
+
+static std::shared_ptr<TsJsonObject> RecordResult (
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    bool fp16 = encoding == FEATURE_ENCODING_BASE64_FP16 ||
+        encoding == FEATURE_ENCODING_BLOB_FP16;
+    size_t dims = frame.empty () ? 0 : frame[0].feature_.size ();
+    std::vector<unsigned char> record;
+
+    TsResultWriter writer (record);
+    writer.Begin ("reid", frame.size (), fp16 ? TS_RESULT_FEATURE_FP16 :
+        TS_RESULT_FEATURE_FP32, dims);
+    for (size_t i = 0; i < frame.size (); i++) {
+        const Detection&   d = frame[i];
+        TsResultDetection& r = writer.Detection (i);
+        r.object_id_  = d.object_id_;
+        r.trace_id_   = d.trace_id_;
+        r.confidence_ = d.confidence_;
+        r.x_          = d.x_;
+        r.y_          = d.y_;
+        r.width_      = d.width_;
+        r.height_     = d.height_;
+        FeatureToBytes (fp16 ? FEATURE_ENCODING_BLOB_FP16 :
+            FEATURE_ENCODING_BLOB_FP32, d.feature_.data (), dims,
+            writer.AddFeature (i));
+    }
+
+    return std::make_shared<TsJsonObject> (std::move (record));
+}
+
+static std::shared_ptr<TsJsonObject> CopyListener (
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    static thread_local TsJsonWriter writer;
+    static std::map<int64_t, std::tuple<uint8_t, uint8_t, uint8_t> > colors;
+    static std::mutex mutex;
+    std::vector<unsigned char> blob;
+
+    StreamDetections (frame, std::vector<int64_t> (), encoding, blob, writer);
+    std::shared_ptr<TsJsonObject> jo = std::make_shared<TsJsonObject> (
+        writer.GetString ());
+    jo->GetFeatureBuffer ().swap (blob);
+
+    auto tmp = std::make_shared<std::vector<Detection>> ();
+    *tmp = frame;
+    for (auto&& d : *tmp) d.object_id_ = SearchId (d);
+
+    for (auto&& d : *tmp) {
+        std::string text = "person_" + std::to_string (d.object_id_);
+        std::tuple<uint8_t, uint8_t, uint8_t> color;
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            if (colors.find (d.object_id_) != colors.end ()) {
+                color = colors[d.object_id_];
+            } else {
+                color = std::make_tuple (rand () % 256, rand () % 256,
+                    rand () % 256);
+                colors[d.object_id_] = color;
+            }
+        }
+        jo->GetOsdObject ().push_back (TsOsdObject ((int)d.x_, (int)d.y_,
+            (int)d.width_, (int)d.height_, std::get<0>(color),
+            std::get<1>(color), std::get<2>(color), 0, text,
+            TsObjectType::OBJECT));
+    }
+
+    return jo;
+}
+
+static std::shared_ptr<TsJsonObject> InplaceListener (
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    static thread_local TsJsonWriter         writer;
+    static thread_local std::vector<int64_t> ids;
+    static TrackStateStore                   states (4096, 60);
+    std::vector<unsigned char> blob;
+    size_t dims = frame.empty () ? 0 : frame[0].feature_.size ();
+
+    blob.reserve (frame.size () * FeatureBytes (encoding, dims));
+
+    ids.resize (frame.size ());
+    for (size_t i = 0; i < frame.size (); i++) ids[i] = SearchId (frame[i]);
+
+    StreamDetections (frame, ids, encoding, blob, writer);
+    std::shared_ptr<TsJsonObject> jo = std::make_shared<TsJsonObject> (
+        writer.GetString ());
+    jo->GetFeatureBuffer ().swap (blob);
+
+    std::vector<TsOsdObject>& osd = jo->GetOsdObject ();
+    int64_t now = TrackStateStore::Now ();
+    osd.reserve (frame.size ());
+    for (size_t i = 0; i < frame.size (); i++) {
+        const Detection& d = frame[i];
+        uint8_t r, g, b;
+
+        states.Touch (ids[i], now);
+        TrackColor (ids[i], r, g, b);
+        osd.emplace_back ((int)d.x_, (int)d.y_, (int)d.width_,
+            (int)d.height_, r, g, b, 0, "person_" + std::to_string (ids[i]),
+            TsObjectType::OBJECT);
+    }
+    states.Sweep (now);
+
+    return jo;
+}
+
+static std::shared_ptr<TsJsonObject> RunPath (const std::string& path,
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    if (path == "tree")    return TreeResult      (frame, encoding);
+    if (path == "copy")    return CopyListener    (frame, encoding);
+    if (path == "inplace") return InplaceListener (frame, encoding);
+    if (path == "record" || path == "record-json") {
+        return RecordResult (frame, encoding);
+    }
+    return StreamResult (frame, encoding);
+}
+
+static BenchResult Run (const std::string& path,
+    const std::vector<Detection>& frame, FeatureEncoding encoding)
+{
+    BenchResult         r;
+    std::vector<double> samples;
+    uuid_t              uuid;
+
+    uuid_generate (uuid);
+    samples.reserve (FLAGS_frames);
+    // the first frame grows the per-thread buffers, it is not counted
+    RunPath (path, frame, encoding);
+
+    uint64_t allocs = g_allocs.load (std::memory_order_relaxed);
+    auto begin = std::chrono::steady_clock::now ();
+    for (int f = 0; f < FLAGS_frames; f++) {
+        auto start = std::chrono::steady_clock::now ();
+
+        std::shared_ptr<TsJsonObject> jo = RunPath (path, frame, encoding);
+        if (path == "record") {
+            r.bytes_ = jo->GetRecordData ().size ();
+        } else {
+            // the message is rendered by GetMessage, frames not read skip it
+            jo->Update (uuid, "alg", 1638000000000 + f, "reid", "", "0", "jpg");
+            if (f % std::max (FLAGS_publish, 1) == 0) {
+                r.bytes_ = jo->GetMessage ().size ();
+            }
+        }
+
+        jo.reset ();
+
+        samples.push_back (std::chrono::duration<double, std::micro> (
+            std::chrono::steady_clock::now () - start).count ());
+    }
+    double total = std::chrono::duration<double> (
+        std::chrono::steady_clock::now () - begin).count ();
+    // the samples vector was reserved up front, it adds nothing here
+    allocs = g_allocs.load (std::memory_order_relaxed) - allocs;
+
+    r.path_       = path;
+    r.detections_ = frame.size ();
+    r.fps_        = total > 0 ? FLAGS_frames / total : 0.0;
+    r.p50_us_     = Percentile (samples, 0.50);
+    r.p99_us_     = Percentile (samples, 0.99);
+    r.allocs_     = FLAGS_frames > 0 ? (double) allocs / FLAGS_frames : 0.0;
+    return r;
+}
+
+static void Report (const std::vector<BenchResult>& results, FILE* fp)
+{
+    bool json = FLAGS_format == "json";
+
+    if (json) {
+        fprintf (fp, "[\n");
+    } else {
+        fprintf (fp, "path,encoding,dims,detections,fps,p50_us,p99_us,bytes,"
+            "allocs\n");
+    }
+
+    for (size_t i = 0; i < results.size (); i++) {
+        const BenchResult& r = results[i];
+        if (json) {
+            fprintf (fp, "  {\"path\":\"%s\", \"encoding\":\"%s\", "
+                "\"dims\":%d, \"detections\":%zu, \"fps\":%.1f, "
+                "\"p50_us\":%.2f, \"p99_us\":%.2f, \"bytes\":%zu, "
+                "\"allocs\":%.1f}%s\n",
+                r.path_.c_str (), FLAGS_encoding.c_str (), FLAGS_dims,
+                r.detections_, r.fps_, r.p50_us_, r.p99_us_, r.bytes_,
+                r.allocs_, i + 1 < results.size () ? "," : "");
+        } else {
+            fprintf (fp, "%s,%s,%d,%zu,%.1f,%.2f,%.2f,%zu,%.1f\n",
+                r.path_.c_str (), FLAGS_encoding.c_str (), FLAGS_dims,
+                r.detections_, r.fps_, r.p50_us_, r.p99_us_, r.bytes_,
+                r.allocs_);
+        }
+    }
+
+    if (json) fprintf (fp, "]\n");
+}
+
+int main (int argc, char* argv[])
+{
+    gflags::SetUsageMessage ("result-bench [--detections 1,10,100] "
+        "[--encoding base64-fp16] [--paths copy,inplace,record] "
+        "[--format json --output result.json]");
+    gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+    FeatureEncoding encoding = StringToFeatureEncoding (FLAGS_encoding);
+    std::vector<BenchResult> results;
+    std::stringstream ss (FLAGS_detections);
+    std::string count;
+
+    while (std::getline (ss, count, ',')) {
+        size_t n = std::stoul (count);
+
+        FeatureSet set;
+        SynthesizeFeatures (set, FLAGS_dims, n, 0, 0.0, FLAGS_seed);
+
+        std::vector<Detection> frame (n);
+        for (size_t i = 0; i < n; i++) {
+            Detection& d = frame[i];
+            d.object_id_  = 100000 + i;
+            d.trace_id_   = 2000 + i;
+            d.feature_.assign (set.gallery_.begin () + i * FLAGS_dims,
+                set.gallery_.begin () + (i + 1) * FLAGS_dims);
+            L2Normalize (d.feature_.data (), FLAGS_dims);
+            d.confidence_ = 0.5f + 0.45f * i / std::max<size_t> (n, 1);
+            d.x_          = (float) (37 * i % 1800);
+            d.y_          = (float) (53 * i % 1000);
+            d.width_      = 64.f + i % 32;
+            d.height_     = 160.f + i % 64;
+        }
+
+        std::stringstream ps (FLAGS_paths);
+        std::string path;
+        while (std::getline (ps, path, ',')) {
+            results.push_back (Run (path, frame, encoding));
+        }
+    }
+
+    FILE* fp = FLAGS_output.empty () ? stdout : fopen (FLAGS_output.c_str (), "w");
+    if (!fp) {
+        TS_ERR_MSG_V ("Failed to open %s", FLAGS_output.c_str ());
+        return -1;
+    }
+    Report (results, fp);
+    if (fp != stdout) fclose (fp);
+
+    gflags::ShutDownCommandLineFlags ();
+    return 0;
+}
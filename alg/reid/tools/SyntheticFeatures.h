@@ -0,0 +1,144 @@
+/*
+ * @Description: Synthetic and dumped ReID feature sets for the gallery tools.
+ * @version: 1.0
+ * @Author: Ricardo Lu<shenglu1202@163.com>
+ * @Date: 2021-11-20 09:31:18
+ * @LastEditors: Ricardo Lu
+ * @LastEditTime: 2021-11-20 09:31:18
+ */
+
+#ifndef __TS_SYNTHETIC_FEATURES_H__
+#define __TS_SYNTHETIC_FEATURES_H__
+
+#include <stdio.h>
+#include <math.h>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * A gallery set and a query set of row-major fp32 features. query_label_[i]
+ * is the gallery row query i was sampled from, -1 when unknown (dumps).
+ */
+typedef struct _FeatureSet {
+    size_t               dims_         { 0  };
+    std::vector<float>   gallery_      {    };
+    std::vector<float>   queries_      {    };
+    std::vector<int64_t> query_label_  {    };
+
+    size_t GallerySize (void) const { return dims_ ? gallery_.size () / dims_ : 0; }
+    size_t QuerySize   (void) const { return dims_ ? queries_.size () / dims_ : 0; }
+} FeatureSet;
+
+/*
+ * identities unit-length centres, each query is a centre plus isotropic noise
+ * of total norm ~noise, so its cosine distance to the centre is about
+ * noise^2 / 2 (0.5 lands right on the default low/high thresholds).
+ */
+static inline void SynthesizeFeatures (FeatureSet& set, size_t dims,
+    size_t identities, size_t queries, float noise, unsigned seed)
+{
+    std::mt19937 rng (seed);
+    std::normal_distribution<float> gauss (0.0f, 1.0f);
+    std::uniform_int_distribution<size_t> pick (0, identities - 1);
+    float sigma = noise / sqrtf ((float)dims);
+
+    set.dims_ = dims;
+    set.gallery_.resize (identities * dims);
+    for (size_t i = 0; i < identities * dims; i++)
+        set.gallery_[i] = gauss (rng);
+
+    set.queries_.resize (queries * dims);
+    set.query_label_.resize (queries);
+    for (size_t i = 0; i < queries; i++) {
+        size_t id = pick (rng);
+        float norm = 0.0f;
+        const float* c = &set.gallery_[id * dims];
+        for (size_t d = 0; d < dims; d++) norm += c[d] * c[d];
+        norm = 1.0f / sqrtf (norm);
+        for (size_t d = 0; d < dims; d++)
+            set.queries_[i * dims + d] = c[d] * norm + sigma * gauss (rng);
+        set.query_label_[i] = id;
+    }
+}
+
+/*
+ * The same with identities drawn around cluster centres, people in similar
+ * clothes: an identity is a unit-length centre plus noise of norm ~spread,
+ * so identities of one cluster sit about spread^2 / 2 apart. clusters of 0
+ * gives independent identities as above.
+ */
+static inline void SynthesizeClusters (FeatureSet& set, size_t dims,
+    size_t identities, size_t queries, float noise, size_t clusters,
+    float spread, unsigned seed)
+{
+    if (!clusters) {
+        SynthesizeFeatures (set, dims, identities, queries, noise, seed);
+        return;
+    }
+
+    std::mt19937 rng (seed ^ 0x9e3779b9u);
+    std::normal_distribution<float> gauss (0.0f, 1.0f);
+    std::uniform_int_distribution<size_t> pick (0, clusters - 1);
+    std::vector<float> centres (clusters * dims);
+    float sigma = spread / sqrtf ((float)dims);
+
+    for (size_t c = 0; c < clusters; c++) {
+        float norm = 0.0f, *v = &centres[c * dims];
+        for (size_t d = 0; d < dims; d++) {
+            v[d] = gauss (rng);
+            norm += v[d] * v[d];
+        }
+        norm = 1.0f / sqrtf (norm);
+        for (size_t d = 0; d < dims; d++) v[d] *= norm;
+    }
+
+    // the queries are sampled from the clustered identities as before
+    SynthesizeFeatures (set, dims, identities, queries, noise, seed);
+    for (size_t i = 0; i < identities; i++) {
+        const float* c = &centres[pick (rng) * dims];
+        for (size_t d = 0; d < dims; d++)
+            set.gallery_[i * dims + d] = c[d] + sigma * gauss (rng);
+    }
+
+    std::mt19937 qrng (seed + 1);
+    float qsigma = noise / sqrtf ((float)dims);
+    for (size_t i = 0; i < set.QuerySize (); i++) {
+        const float* c = &set.gallery_[set.query_label_[i] * dims];
+        float norm = 0.0f;
+        for (size_t d = 0; d < dims; d++) norm += c[d] * c[d];
+        norm = 1.0f / sqrtf (norm);
+        for (size_t d = 0; d < dims; d++)
+            set.queries_[i * dims + d] = c[d] * norm + qsigma * gauss (qrng);
+    }
+}
+
+/*
+ * A raw little-endian fp32 dump of N x dims features, e.g. written from the
+ * algorithm results. The first gallery rows form the gallery, the rest are
+ * queries with unknown labels.
+ */
+static inline bool LoadFeatures (FeatureSet& set, const std::string& path,
+    size_t dims, size_t gallery)
+{
+    FILE* fp = fopen (path.c_str (), "rb");
+    if (!fp) return false;
+
+    std::vector<float> all;
+    float buf[4096];
+    size_t n;
+    while ((n = fread (buf, sizeof(float), 4096, fp)) > 0)
+        all.insert (all.end (), buf, buf + n);
+    fclose (fp);
+
+    size_t rows = all.size () / dims;
+    if (!rows || rows <= gallery) return false;
+
+    set.dims_ = dims;
+    set.gallery_.assign (all.begin (), all.begin () + gallery * dims);
+    set.queries_.assign (all.begin () + gallery * dims, all.begin () + rows * dims);
+    set.query_label_.assign (rows - gallery, -1);
+    return true;
+}
+
+#endif //__TS_SYNTHETIC_FEATURES_H__
@@ -11,8 +11,15 @@
 #define __TS_COMMON_H__
 
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <json-glib/json-glib.h>
@@ -31,6 +38,15 @@
     g_print("** WARN:  <%s:%s:%d>: " msg "\n", \
         __FILE__, __func__, __LINE__, ##__VA_ARGS__)
 
+// per-frame tracing, compiled in with -DTS_ENABLE_DEBUG
+#ifdef TS_ENABLE_DEBUG
+#define TS_DEBUG_MSG_V(msg, ...) \
+    g_print("** DEBUG: <%s:%s:%d>: " msg "\n", \
+        __FILE__, __func__, __LINE__, ##__VA_ARGS__)
+#else
+#define TS_DEBUG_MSG_V(msg, ...)
+#endif
+
 class TsGstBuffer 
 {
 public:
@@ -227,6 +243,431 @@ public:
     //-----------------------------------------------
 };
 
+/*
+ * Compact json written straight into a string, members in the order they
+ * are written. key is nullptr for the elements of an array. Reuse one
+ * writer, or the string it writes into, to keep its capacity.
+ */
+class TsJsonWriter
+{
+public:
+    TsJsonWriter (void) : out_ (&buffer_) {}
+
+    explicit TsJsonWriter (
+        std::string& out) : out_ (&out) {}
+
+    TsJsonWriter (const TsJsonWriter&) = delete;
+    TsJsonWriter& operator= (const TsJsonWriter&) = delete;
+
+    void Clear (void) {
+        out_->clear ();
+        comma_ = false;
+    }
+
+    const std::string& GetString (void) {
+        return *out_;
+    }
+
+    void BeginObject (
+        const char* key = nullptr) {
+        Key (key);
+        out_->push_back ('{');
+        comma_ = false;
+    }
+
+    void EndObject (void) {
+        out_->push_back ('}');
+        comma_ = true;
+    }
+
+    void BeginArray (
+        const char* key = nullptr) {
+        Key (key);
+        out_->push_back ('[');
+        comma_ = false;
+    }
+
+    void EndArray (void) {
+        out_->push_back (']');
+        comma_ = true;
+    }
+
+    void String (
+        const char* key,
+        const char* value,
+        size_t      length) {
+        Key (key);
+        Escape (value, length);
+        comma_ = true;
+    }
+
+    void String (
+        const char*        key,
+        const std::string& value) {
+        String (key, value.data (), value.length ());
+    }
+
+    void Int (
+        const char* key,
+        int64_t     value) {
+        char  buf[24];
+        char* end = buf + sizeof (buf);
+        char* p   = end;
+        uint64_t u = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+
+        Key (key);
+        do {
+            *--p = (char) ('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (value < 0) *--p = '-';
+        out_->append (p, end - p);
+        comma_ = true;
+    }
+
+    // six decimals as std::to_string printed, trailing zeros dropped
+    void Float (
+        const char* key,
+        float       value) {
+        char buf[32];
+
+        if (!std::isfinite (value)) {
+            Key (key);
+            out_->append ("null", 4);
+            comma_ = true;
+            return;
+        }
+        if (fabsf (value) >= 1e9f) {
+            Key (key);
+            out_->append (buf, snprintf (buf, sizeof (buf), "%.9g", value));
+            comma_ = true;
+            return;
+        }
+
+        // a float times 1e6 is exact in a double, rounding it half to
+        // even (the default mode) ties the way printf("%f") does
+        int64_t micros = (int64_t) nearbyint ((double) value * 1e6);
+        int64_t whole  = micros / 1000000;
+        int64_t frac   = micros % 1000000;
+        if (frac < 0) frac = -frac;
+
+        // -0.5 has no whole part to carry the sign
+        if (micros < 0 && whole == 0) {
+            Key (key);
+            out_->append ("-0", 2);
+            comma_ = true;
+        } else {
+            Int (key, whole);
+        }
+        if (frac) {
+            char* p = buf + 7;
+            *p = '\0';
+            for (int i = 0; i < 6; i++, frac /= 10) *--p = (char) ('0' + frac % 10);
+            size_t n = 7;
+            while (buf[n - 1] == '0') n--;
+            buf[0] = '.';
+            out_->append (buf, n);
+        }
+    }
+
+    void Bool (
+        const char* key,
+        bool        value) {
+        Key (key);
+        if (value) out_->append ("true", 4);
+        else       out_->append ("false", 5);
+        comma_ = true;
+    }
+
+    // the members of object, compact json text of an object, into this one
+    void Members (
+        const std::string& object) {
+        if (object.length () <= 2) return;
+        if (comma_) out_->push_back (',');
+        out_->append (object, 1, object.length () - 2);
+        comma_ = true;
+    }
+
+private:
+    void Key (
+        const char* key) {
+        if (comma_) out_->push_back (',');
+        if (key) {
+            Escape (key, strlen (key));
+            out_->push_back (':');
+        }
+    }
+
+    void Escape (
+        const char* s,
+        size_t      length) {
+        static const char hex[] = "0123456789abcdef";
+        const uint64_t ones = 0x0101010101010101ull;
+        const uint64_t high = 0x8080808080808080ull;
+        size_t run = 0, i = 0;
+
+        out_->push_back ('"');
+        while (i < length) {
+            // eight bytes at a time until one is a control, '"' or '\\'
+            if (i + 8 <= length) {
+                uint64_t w, q, b;
+                memcpy (&w, s + i, 8);
+                q = w ^ (ones * '"');
+                b = w ^ (ones * '\\');
+                if (!((((w - ones * 0x20) & ~w) | ((q - ones) & ~q) |
+                    ((b - ones) & ~b)) & high)) {
+                    i += 8;
+                    continue;
+                }
+            }
+
+            unsigned char c = (unsigned char) s[i++];
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+            out_->append (s + run, i - 1 - run);
+            run = i;
+            switch (c) {
+            case '"':  out_->append ("\\\"", 2); break;
+            case '\\': out_->append ("\\\\", 2); break;
+            case '\n': out_->append ("\\n", 2);  break;
+            case '\r': out_->append ("\\r", 2);  break;
+            case '\t': out_->append ("\\t", 2);  break;
+            default:
+                out_->append ("\\u00", 4);
+                out_->push_back (hex[c >> 4]);
+                out_->push_back (hex[c & 0xf]);
+                break;
+            }
+        }
+        out_->append (s + run, length - run);
+        out_->push_back ('"');
+    }
+
+private:
+    std::string* out_    { nullptr };
+    std::string  buffer_ {         };
+    bool         comma_  { false   };
+};
+
+// "TSRR" in the first four bytes of a record
+#define TS_RESULT_MAGIC      0x52525354u
+// readers take any record of the same version, newer ones only grow
+#define TS_RESULT_VERSION    1
+#define TS_RESULT_NO_FEATURE 0xffffffffu
+
+typedef enum _TsResultFeature {
+    TS_RESULT_FEATURE_NONE,
+    TS_RESULT_FEATURE_FP32,
+    TS_RESULT_FEATURE_FP16
+} TsResultFeature;
+
+/*
+ * The binary result record: this header, count_ detections of
+ * detection_size_ bytes from header_size_, then the feature block of
+ * feature_count_ features from feature_offset_. Every offset is from the
+ * start of the record and every field is in the little-endian byte order
+ * of the hosts the plugin runs on. A later version may only append fields
+ * to the header and the detections, so the sizes are read, not assumed.
+ */
+typedef struct _TsResultHeader {
+    uint32_t magic_          { TS_RESULT_MAGIC        };
+    uint16_t version_        { TS_RESULT_VERSION      };
+    uint16_t header_size_    { 0                      };
+    uint32_t count_          { 0                      };
+    uint16_t detection_size_ { 0                      };
+    uint8_t  feature_        { TS_RESULT_FEATURE_NONE };
+    uint8_t  reserved_       { 0                      };
+    uint32_t feature_dims_   { 0                      };
+    uint32_t feature_count_  { 0                      };
+    uint32_t feature_offset_ { 0                      };
+    uint32_t size_           { 0                      };  // of the record
+    char     alg_name_[16]   {                        };
+} TsResultHeader;
+
+typedef struct _TsResultDetection {
+    int64_t  object_id_      { -1                     };
+    int64_t  trace_id_       { -1                     };
+    float    confidence_     { 0.f                    };
+    float    x_              { 0.f                    },
+             y_              { 0.f                    },
+             width_          { 0.f                    },
+             height_         { 0.f                    };
+    // its feature in the feature block, TS_RESULT_NO_FEATURE without one
+    uint32_t feature_index_  { TS_RESULT_NO_FEATURE   };
+} TsResultDetection;
+
+static_assert (sizeof (TsResultHeader)    == 48, "TsResultHeader is packed");
+static_assert (sizeof (TsResultDetection) == 40, "TsResultDetection is packed");
+
+/*
+ * Writes a record into out. Begin sizes it for count detections and
+ * reserves their features, fill every Detection, AddFeature hands out the
+ * bytes of a detection's feature for the caller to write.
+ */
+class TsResultWriter
+{
+public:
+    explicit TsResultWriter (
+        std::vector<unsigned char>& out) : out_ (&out) {}
+
+    void Begin (
+        const char*     alg_name,
+        uint32_t        count,
+        TsResultFeature feature = TS_RESULT_FEATURE_NONE,
+        uint32_t        dims    = 0) {
+        TsResultHeader    header;
+        TsResultDetection detection;
+        size_t            size = sizeof (header) + count * sizeof (detection);
+
+        header.header_size_    = sizeof (header);
+        header.count_          = count;
+        header.detection_size_ = sizeof (detection);
+        header.feature_        = feature;
+        header.feature_dims_   = feature == TS_RESULT_FEATURE_NONE ? 0 : dims;
+        header.feature_offset_ = size;
+        header.size_           = size;
+        strncpy (header.alg_name_, alg_name, sizeof (header.alg_name_) - 1);
+
+        // AddFeature never moves the detections already written
+        out_->clear ();
+        out_->reserve (size + count * FeatureBytes (header));
+        out_->resize (size);
+        memcpy (out_->data (), &header, sizeof (header));
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy (out_->data () + sizeof (header) + i * sizeof (detection),
+                &detection, sizeof (detection));
+        }
+    }
+
+    TsResultDetection& Detection (
+        uint32_t index) {
+        return *reinterpret_cast<TsResultDetection*> (out_->data () +
+            sizeof (TsResultHeader) + index * sizeof (TsResultDetection));
+    }
+
+    // the FeatureBytes to write the feature of detection index into
+    unsigned char* AddFeature (
+        uint32_t index) {
+        TsResultHeader* header = Header ();
+        size_t          offset = out_->size ();
+
+        Detection (index).feature_index_ = header->feature_count_++;
+        out_->resize (offset + FeatureBytes (*header));
+        Header ()->size_ = out_->size ();
+        return out_->data () + offset;
+    }
+
+    static size_t FeatureBytes (
+        const TsResultHeader& header) {
+        return (size_t) header.feature_dims_ *
+            (header.feature_ == TS_RESULT_FEATURE_FP16 ? 2 :
+             header.feature_ == TS_RESULT_FEATURE_FP32 ? 4 : 0);
+    }
+
+private:
+    TsResultHeader* Header (void) {
+        return reinterpret_cast<TsResultHeader*> (out_->data ());
+    }
+
+private:
+    std::vector<unsigned char>* out_ { nullptr };
+};
+
+/*
+ * Reads a record where it is, nothing is copied. data must stay alive and
+ * 8 byte aligned, as a std::vector's or malloc's is. Check Valid before
+ * anything else.
+ */
+class TsResultView
+{
+public:
+    TsResultView (
+        const unsigned char* data,
+        size_t               size) : data_ (data), size_ (size) {}
+
+    bool Valid (void) const {
+        if (!data_ || size_ < sizeof (TsResultHeader)) return false;
+
+        const TsResultHeader& h = Header ();
+        if (h.magic_ != TS_RESULT_MAGIC || h.version_ != TS_RESULT_VERSION ||
+            h.header_size_ < sizeof (TsResultHeader) ||
+            h.detection_size_ < sizeof (TsResultDetection) ||
+            h.feature_ > TS_RESULT_FEATURE_FP16 || h.size_ > size_) {
+            return false;
+        }
+        return (uint64_t) h.header_size_ + (uint64_t) h.count_ *
+            h.detection_size_ <= h.feature_offset_ &&
+            (uint64_t) h.feature_offset_ + (uint64_t) h.feature_count_ *
+            TsResultWriter::FeatureBytes (h) <= h.size_;
+    }
+
+    const TsResultHeader& Header (void) const {
+        return *reinterpret_cast<const TsResultHeader*> (data_);
+    }
+
+    uint32_t Count (void) const {
+        return Header ().count_;
+    }
+
+    const TsResultDetection& Detection (
+        uint32_t index) const {
+        const TsResultHeader& h = Header ();
+        return *reinterpret_cast<const TsResultDetection*> (data_ +
+            h.header_size_ + (size_t) index * h.detection_size_);
+    }
+
+    // the raw fp32 or fp16 values of the detection's feature, or nullptr
+    const unsigned char* Feature (
+        uint32_t index) const {
+        const TsResultHeader&    h = Header ();
+        const TsResultDetection& d = Detection (index);
+        if (d.feature_index_ >= h.feature_count_) return nullptr;
+        return data_ + h.feature_offset_ +
+            (size_t) d.feature_index_ * TsResultWriter::FeatureBytes (h);
+    }
+
+    /*
+     * The record as the json the plugin publishes, features as a blob:
+     * "feature-offset" of a detection is from the record's feature block.
+     */
+    void ToJson (
+        TsJsonWriter& writer) const {
+        const TsResultHeader& h = Header ();
+        size_t bytes = TsResultWriter::FeatureBytes (h);
+
+        writer.BeginObject ();
+        writer.String ("alg-name", h.alg_name_,
+            strnlen (h.alg_name_, sizeof (h.alg_name_)));
+        if (h.feature_ == TS_RESULT_FEATURE_FP32) {
+            writer.String ("feature-encoding", "blob-fp32", 9);
+        } else if (h.feature_ == TS_RESULT_FEATURE_FP16) {
+            writer.String ("feature-encoding", "blob-fp16", 9);
+        }
+        writer.BeginArray ("alg-result");
+        for (uint32_t i = 0; i < h.count_; i++) {
+            const TsResultDetection& d = Detection (i);
+            writer.BeginObject ();
+            writer.Int ("object-id", d.object_id_);
+            writer.Int ("trace-id",  d.trace_id_);
+            if (d.feature_index_ < h.feature_count_) {
+                writer.Int ("feature-offset", d.feature_index_ * bytes);
+            }
+            writer.Float ("confidence", d.confidence_);
+            writer.Float ("x",          d.x_);
+            writer.Float ("y",          d.y_);
+            writer.Float ("width",      d.width_);
+            writer.Float ("height",     d.height_);
+            writer.EndObject ();
+        }
+        writer.EndArray ();
+        writer.EndObject ();
+    }
+
+private:
+    const unsigned char* data_ { nullptr };
+    size_t               size_ { 0       };
+};
+
 class TsJsonObject 
 {
 public:
@@ -236,6 +677,16 @@ public:
         result_ = result;
     }
 
+    // the result as compact json text of an object, see TsJsonWriter
+    explicit TsJsonObject (
+        const std::string& result) : result_text_ (result) {
+    }
+
+    // the result as a binary record, see TsResultHeader
+    explicit TsJsonObject (
+        std::vector<unsigned char>&& record) : record_ (std::move (record)) {
+    }
+
    ~TsJsonObject () {
         if (object_) {
             json_object_unref (object_);
@@ -245,6 +696,12 @@ public:
         }
     }
 
+    /*
+     * Takes the envelope of the message, the message itself is rendered
+     * by the first GetMessage and kept, so a result that is only drawn
+     * never pays for it. Only the first Update of an object counts, and
+     * camera_id only if the producer set none, see SetCameraId.
+     */
     bool Update (
         const uuid_t&      uuid,
         const std::string& data_type,
@@ -254,53 +711,45 @@ public:
         const std::string& camera_id,
         const std::string& picture_type,
         const std::string& userdata = "") {
-        if (object_) return true;
-        if (!(object_ = json_object_new ())) {
-            return false;
-        }
+        if (object_ || updated_) return true;
 
         char uuids[UUID_STR_LEN + 1];
         uuid_unparse (uuid, uuids);
         uuid_         = uuids;
-        camera_id_    = camera_id;
+        data_type_    = data_type;
+        source_       = source;
+        dest_         = dest;
+        if (camera_id_.empty ()) camera_id_ = camera_id;
         timestamp_    = timestamp;
         picture_type_ = picture_type;
         SetUserData  (userdata, 0);
 
-        json_object_set_string_member (result_, 
-            (gchar*)("camera-id"),    (gchar*)(camera_id.c_str()));
-        json_object_set_string_member (object_, 
-            (gchar*)("type"),         (gchar*)(data_type.c_str()));
-        json_object_set_int_member    (object_, 
-            (gchar*)("timestamp"),    (gint64)(timestamp));
-        json_object_set_string_member (object_, 
-            (gchar*)("uuid"),         (gchar*)(uuids));
-        json_object_set_string_member (object_,
-            (gchar*)("source"),       (gchar*)(source.c_str()));
-        json_object_set_string_member (object_, 
-            (gchar*)("destination"),  (gchar*)(dest.c_str()));
+        updated_ = true;
+        return true;
+    }
 
-        if (result_) {
-            json_object_set_object_member (object_, 
-                (gchar*)("data"), result_);
-            result_ = nullptr;
+    // a tree result rendered indented instead of on one line, see Render
+    void SetPretty (
+        bool pretty) {
+        pretty_ = pretty;
+    }
+
+    void Print (void) {
+        if (!object_ && !result_ && !updated_ && result_text_.empty ()) {
+            TS_INFO_MSG_V ("Message: record of %zu bytes", record_.size ());
+            return;
         }
 
-        JsonNode *root = json_node_new (JSON_NODE_OBJECT);
-        if (root) {
-            json_node_set_object (root, object_);
-            char* message = json_to_string (root, true);
-            json_node_free (root);
-            if (message) {
-                message_ = message;
-                g_free (message);
-            }
+        if (updated_) {
+            TS_INFO_MSG_V ("Message: \n%s", GetMessage ().c_str ());
+            return;
         }
 
-        return true;
-    }
+        if (!object_ && !result_) {
+            TS_INFO_MSG_V ("Message: \n%s", result_text_.c_str ());
+            return;
+        }
 
-    void Print (void) {
         JsonNode *root = json_node_new (JSON_NODE_OBJECT);
         if (root) {
             json_node_set_object (root, object_?object_:result_);
@@ -326,7 +775,31 @@ public:
         return picture_data_;
     }
 
+    // features published out of band, "feature-offset" in the result
+    std::vector<unsigned char>& GetFeatureBuffer (void) {
+        return feature_data_;
+    }
+
+    const std::vector<unsigned char>& GetFeatureData (void) {
+        return feature_data_;
+    }
+
+    // the binary result, empty unless the result was made as a record
+    std::vector<unsigned char>& GetRecordBuffer (void) {
+        return record_;
+    }
+
+    const std::vector<unsigned char>& GetRecordData (void) {
+        return record_;
+    }
+
+    TsResultView GetRecord (void) {
+        return TsResultView (record_.data (), record_.size ());
+    }
+
+    // "{}" until Update, rendered once by whichever sink asks first
     const std::string& GetMessage (void) {
+        if (updated_) std::call_once (rendered_, [this] { Render (); });
         return message_;
     }
 
@@ -346,6 +819,12 @@ public:
         return camera_id_;
     }
 
+    // the camera of a result made for one, kept by Update
+    void SetCameraId (
+        const std::string& camera_id) {
+        camera_id_ = camera_id;
+    }
+
     const std::string& GetUserData (
         size_t index = 0) {
         if (index > user_datas_.size () - 1) {
@@ -369,6 +848,11 @@ public:
         return result_;
     }
 
+    // a result tree, streamed text or record to publish
+    bool HasResult (void) {
+        return result_ || !result_text_.empty () || GetRecord ().Valid ();
+    }
+
     bool GetSnapPicture (void) {
         return snap_picture_;
     }
@@ -390,20 +874,100 @@ public:
         }
     }
 
+private:
+    bool Render (void) {
+        // a record is only turned into json for the message
+        if (result_text_.empty () && !result_) {
+            TsResultView view = GetRecord ();
+            if (view.Valid ()) {
+                TsJsonWriter writer (result_text_);
+                view.ToJson (writer);
+            }
+        }
+
+        // a streamed result is wrapped the same way without a tree
+        if (!result_text_.empty ()) {
+            message_.clear ();
+            message_.reserve (result_text_.length () + 256);
+
+            TsJsonWriter writer (message_);
+            writer.BeginObject ();
+            writer.String ("type",        data_type_);
+            writer.Int    ("timestamp",   timestamp_);
+            writer.String ("uuid",        uuid_);
+            writer.String ("source",      source_);
+            writer.String ("destination", dest_);
+            writer.BeginObject ("data");
+            writer.String ("camera-id",   camera_id_);
+            writer.Members (result_text_);
+            writer.EndObject ();
+            writer.EndObject ();
+            return true;
+        }
+
+        if (!(object_ = json_object_new ())) {
+            return false;
+        }
+
+        if (result_) {
+            json_object_set_string_member (result_,
+                (gchar*)("camera-id"),    (gchar*)(camera_id_.c_str()));
+        }
+        json_object_set_string_member (object_, 
+            (gchar*)("type"),         (gchar*)(data_type_.c_str()));
+        json_object_set_int_member    (object_, 
+            (gchar*)("timestamp"),    (gint64)(timestamp_));
+        json_object_set_string_member (object_, 
+            (gchar*)("uuid"),         (gchar*)(uuid_.c_str()));
+        json_object_set_string_member (object_,
+            (gchar*)("source"),       (gchar*)(source_.c_str()));
+        json_object_set_string_member (object_, 
+            (gchar*)("destination"),  (gchar*)(dest_.c_str()));
+
+        // result_ keeps its own reference and stays the GetResult of the
+        // object, with the camera-id set above from the first GetMessage
+        if (result_) {
+            json_object_set_object_member (object_, 
+                (gchar*)("data"), json_object_ref (result_));
+        }
+
+        JsonNode *root = json_node_new (JSON_NODE_OBJECT);
+        if (root) {
+            json_node_set_object (root, object_);
+            char* message = json_to_string (root, pretty_);
+            json_node_free (root);
+            if (message) {
+                message_ = message;
+                g_free (message);
+            }
+        }
+
+        return true;
+    }
+
 private:
     //---------------------------------------------------
     JsonObject*                object_       { nullptr };
     JsonObject*                result_       { nullptr };
     //---------------------------------------------------
     std::string                message_      { "{}"    };
+    std::string                result_text_  { ""      };
+    bool                       updated_      { false   };
+    std::once_flag             rendered_     {         };
+    bool                       pretty_       { false   };
     std::vector<TsOsdObject>   osd_          {         };
     std::vector<unsigned char> picture_data_ {         };
+    std::vector<unsigned char> feature_data_ {         };
+    std::vector<unsigned char> record_       {         };
     //---------------------------------------------------
     bool                       snap_picture_ { true    };
     gint64                     timestamp_    { 0       };
     std::string                uuid_         { ""      };
     std::string                camera_id_    { ""      };
     std::string                picture_type_ { ""      };
+    std::string                data_type_    { ""      };
+    std::string                source_       { ""      };
+    std::string                dest_         { ""      };
     //---------------------------------------------------
     // user_datas_[0]: splname in the config            ;
     // user_datas_[1]: algname in the config            ;